@@ -8,7 +8,7 @@ class CClientSocket
 
 public:
 
-	CClientSocket() : clnt_sock(INVALID_SOCKET), serv_addr(), serv_addr_len(sizeof(SOCKADDR_IN)), isReadOver(false) //, index(0)
+	CClientSocket() : clnt_sock(INVALID_SOCKET), serv_addr(), serv_addr_len(sizeof(SOCKADDR_IN)), isReadOver(false), index(0)
 	{
 		BUFFER_SIZE = 1024 * 1024 * 2;
 		InitSockEnv();
@@ -98,6 +98,7 @@ public:
 	void CloseSocket()
 	{
 		isReadOver = false;
+		index = 0;
 		closesocket(clnt_sock);
 	}
 
@@ -115,6 +116,18 @@ public:
 		}
 		while (true)
 		{
+			//一个连接上连着收包(推屏)时，上次多收的可能已经是整包，先解析再收
+			if (index > 0)
+			{
+				int len = index;
+				pack = CPacket((BYTE*)buf, len);
+				if (len > 0)
+				{
+					memmove(buf, buf + len, index - len);
+					index -= len;
+					return pack.nCmd;
+				}
+			}
 			int readLen = 0;	
 
 			TRACE("1------------------tick = %lld\r\n", GetTickCount64());
@@ -125,9 +138,9 @@ public:
 
 			TRACE("[threadId: %d] readLen = %d\r\n", GetThreadId(GetCurrentThread()), readLen);
 
-			if (readLen <= 0 && index <= 0)
+			if (readLen <= 0)
 			{
-				TRACE("[threadId: %d] 读取错误，数据收完了，并且缓冲区读完了 \r\n", GetThreadId(GetCurrentThread()));
+				TRACE("[threadId: %d] 读取错误，数据收完了，缓冲区里剩%d字节凑不成包 \r\n", GetThreadId(GetCurrentThread()), index);
 				return -2;
 			}
 			TRACE("[threadId: %d] index 1 = %d\r\n", GetThreadId(GetCurrentThread()) , index);
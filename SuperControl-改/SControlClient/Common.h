@@ -69,8 +69,8 @@ public:
 		nSum = *(WORD*)&bParserAddr[i];
 		//指向和校验的下一位
 		i += sizeof(nSum);
-		//和校验
-		if (nCmd == 5)
+		//和校验(屏幕帧很大，不校验)
+		if ((nCmd == 5) || (nCmd == 9))
 		{
 			len = i;
 		}
@@ -174,6 +174,24 @@ typedef struct mouse_info
 	MOUSEEVE	nEvent;
 }MOUSEINFO, PMOUSEINFO;
 
+//推屏(命令9)的控制包：控制端在推屏的连接上发给被控端
+enum MSTREAMOP
+{
+	MS_START	= 0		,	//开始推屏，带质量和额度
+	MS_CREDIT	= 1		,	//又能收nCredit帧了
+	MS_PAUSE	= 2		,	//暂停(看不见画面的时候)
+	MS_RESUME	= 3		,	//继续
+	MS_QUALITY	= 4		,	//换质量，下一帧整帧发
+	MS_KEY		= 5		,	//解码失败了，下一帧整帧发
+};
+
+typedef struct stream_ctrl
+{
+	BYTE		nOp;			//MSTREAMOP
+	BYTE		nQuality;		//0是无损，1~100是有损
+	WORD		nCredit;		//额度：还能收几帧
+}STREAMCTRL,*PSTREAMCTRL;
+
 typedef struct user_info
 {
 	CString ip;
@@ -211,6 +229,80 @@ struct ConnectIds
 	unsigned long long  id1;
 };
 
+//本机网卡地址(101登记时跟在MUserInfo后面)：同一个局域网的两端可以直接连，不用绕公网
+#define LOCAL_ADDR_MAX 4
+struct MLocalAddrs
+{
+	char				ip[LOCAL_ADDR_MAX][16];
+	unsigned short		port;			//本地UDP端口
+	short				count;
+};
+
+//心跳(103)间隔(毫秒)，服务器5秒收不到就算下线
+#define KEEP_ONLINE_INTERVAL	1000
+
+//局域网发现：组播广播自己的id和本地UDP端口(125)，对端收到就知道能直接连
+#define LAN_GROUP				"239.255.18.99"
+#define LAN_PORT				18999
+#define LAN_BEACON_INTERVAL		2000
+struct MLanBeacon
+{
+	unsigned long long  id;
+	unsigned short		port;			//本地UDP端口
+};
+
+//打洞协调信息(105)：对端地址放最前面，只认MUserInfo的旧客户端也能用
+struct MPunchInfo
+{
+	MUserInfo			peer;			//对端的公网地址
+	unsigned long long  session;		//本次打洞的序号
+	int					startDelay;		//收到后延迟多少毫秒开始探测(双方同时收到，同时开始)
+	short				probeCount;		//探测轮数
+	short				probeInterval;	//每轮间隔(毫秒)
+	short				portRange;		//端口预测范围，0表示只探测对端端口
+	short				portStep;		//端口预测步长(顺序分配型NAT的端口增量)
+	MLocalAddrs			peerLocal;		//对端的局域网地址，和公网地址同时探测，谁先通用谁
+};
+
+//第round轮第p个公网探测：目标是对端登记端口往后按步长预测的第p个端口，序号按轮连续编
+inline unsigned short PunchPort(const MPunchInfo& info, int p)
+{
+	return (unsigned short)(info.peer.port + p * info.portStep);
+}
+inline int PunchSeq(const MPunchInfo& info, int round, int p)
+{
+	return round * (info.portRange + 1) + p;
+}
+
+//打洞探测包(123)和应答包(124)
+struct MPunchProbe
+{
+	unsigned long long  session;		//打洞序号
+	unsigned long long  id;				//发送者id
+	int					seq;			//探测包序号
+	long long			sendTick;		//发送方本地时间，应答原样带回
+};
+
+//打洞结果(107)：客户端确认打通或超时后上报
+struct MPunchResult
+{
+	unsigned long long  session;
+	unsigned long long  id;
+	int					success;		//1表示收到应答，打洞成功
+	int					elapsed;		//从开始探测到收到应答的毫秒数
+	short				port;			//实际打通的对端端口
+};
+
+//集群节点信息(108重定向：换到管理自己的节点登记)
+struct MNodeInfo
+{
+	char				ip[16];
+	unsigned short		tcpPort;
+	unsigned short		udpPort;
+	unsigned short		gossipPort;		//节点之间同步成员用的UDP端口
+	unsigned long long  heartbeat;		//心跳计数，越大越新
+};
+
 
 #pragma pack(pop)
 
@@ -0,0 +1,599 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstddef>
+#include <cstdint>
+
+//屏幕内容的无损压缩(一块一块地压)：纯色块只发一个颜色；颜色少的块(文字、图标、界面)发调色板+索引；
+//其他的先做颜色变换(B-G、R-G)和逐行预测(左、上、梯度里挑残差最小的)，再交给LZ
+//LZ是LZ4那样的格式：不做熵编码，解码只有拷贝，压缩和解压都很快
+//内层循环都是按字节的简单循环，编译器能自动向量化，不依赖特定指令集；缓冲区都留在对象里反复用
+class CMLossless
+{
+public:
+	enum
+	{
+		MODE_SOLID		= 0,		//整块一个颜色
+		MODE_PALETTE	= 1,		//调色板 + 索引(1/2/4/8位)
+		MODE_FILTERED	= 2,		//颜色变换 + 逐行预测
+		PALETTE_MAX		= 64,		//颜色比这个多就不用调色板
+		FLAG_ALPHA		= 1,		//MODE_FILTERED：有不是255的alpha，按4个通道存
+	};
+private:
+	enum
+	{
+		PRED_NONE		= 0,
+		PRED_LEFT		= 1,
+		PRED_UP			= 2,
+		PRED_GRADIENT	= 3,		//左+上-左上，夹在左和上之间(LOCO-I的中值预测)
+		PRED_COUNT		= 4,
+		HASH_BITS		= 12,
+		HASH_SIZE		= 1 << HASH_BITS,
+		MIN_MATCH		= 4,
+		MAX_OFFSET		= 0xFFFF,
+		LAST_LITERALS	= 5,		//最后几个字节只当字面量，解码时不用担心越界
+		PALETTE_SLOTS	= 256,		//统计颜色用的开放寻址表，比PALETTE_MAX大好几倍
+	};
+	std::vector<uint8_t>	m_plane;		//预测后的数据/索引，LZ的输入
+	std::vector<uint8_t>	m_rows[2];		//颜色变换后的上一行和这一行
+	std::vector<uint8_t>	m_trial;		//挑预测方式时的临时行
+	std::vector<uint32_t>	m_hash;			//LZ的哈希表
+	std::vector<uint8_t>	m_raw;			//解码用
+	uint32_t				m_slots[PALETTE_SLOTS];		//颜色
+	uint8_t					m_slotIndex[PALETTE_SLOTS];	//调色板下标+1，0表示空槽
+	uint32_t				m_palette[PALETTE_MAX];
+private:
+	static uint32_t Load32(const uint8_t* p)
+	{
+		uint32_t v;
+		memcpy(&v, p, sizeof(v));
+		return v;
+	}
+	static uint64_t Load64(const uint8_t* p)
+	{
+		uint64_t v;
+		memcpy(&v, p, sizeof(v));
+		return v;
+	}
+	static void Put32(std::vector<uint8_t>& out, uint32_t v)
+	{
+		size_t pos = out.size();
+		out.resize(pos + 4);
+		memcpy(out.data() + pos, &v, 4);
+	}
+	static int Abs(int v)
+	{
+		return (v < 0) ? -v : v;
+	}
+	static uint8_t Gradient(uint8_t left, uint8_t up, uint8_t upLeft)
+	{
+		int lo = (left < up) ? left : up;
+		int hi = (left < up) ? up : left;
+		int grad = (int)left + up - upLeft;
+		return (uint8_t)((grad < lo) ? lo : ((grad > hi) ? hi : grad));
+	}
+	//一行残差：dst[i] = cur[i] - 预测值，bpp是每像素字节数
+	static void Predict(int pred, const uint8_t* cur, const uint8_t* up, uint8_t* dst, size_t bytes, int bpp)
+	{
+		size_t i = 0;
+		switch (pred)
+		{
+		case PRED_NONE:
+			memcpy(dst, cur, bytes);
+			break;
+		case PRED_LEFT:
+			for (; i < (size_t)bpp; i++)
+			{
+				dst[i] = cur[i];
+			}
+			for (; i < bytes; i++)
+			{
+				dst[i] = (uint8_t)(cur[i] - cur[i - bpp]);
+			}
+			break;
+		case PRED_UP:
+			for (; i < bytes; i++)
+			{
+				dst[i] = (uint8_t)(cur[i] - up[i]);
+			}
+			break;
+		case PRED_GRADIENT:
+			for (; i < (size_t)bpp; i++)
+			{
+				dst[i] = (uint8_t)(cur[i] - up[i]);
+			}
+			for (; i < bytes; i++)
+			{
+				dst[i] = (uint8_t)(cur[i] - Gradient(cur[i - bpp], up[i], up[i - bpp]));
+			}
+			break;
+		}
+	}
+	//Predict的逆过程，cur里放残差，原地还原
+	static void Unpredict(int pred, uint8_t* cur, const uint8_t* up, size_t bytes, int bpp)
+	{
+		size_t i = 0;
+		switch (pred)
+		{
+		case PRED_LEFT:
+			for (i = bpp; i < bytes; i++)
+			{
+				cur[i] = (uint8_t)(cur[i] + cur[i - bpp]);
+			}
+			break;
+		case PRED_UP:
+			for (; i < bytes; i++)
+			{
+				cur[i] = (uint8_t)(cur[i] + up[i]);
+			}
+			break;
+		case PRED_GRADIENT:
+			for (; i < (size_t)bpp; i++)
+			{
+				cur[i] = (uint8_t)(cur[i] + up[i]);
+			}
+			for (; i < bytes; i++)
+			{
+				cur[i] = (uint8_t)(cur[i] + Gradient(cur[i - bpp], up[i], up[i - bpp]));
+			}
+			break;
+		}
+	}
+	//残差越接近0越好压：按有符号的绝对值求和
+	static unsigned Cost(const uint8_t* data, size_t bytes)
+	{
+		unsigned sum = 0;
+		for (size_t i = 0; i < bytes; i++)
+		{
+			sum += (unsigned)Abs((int8_t)data[i]);
+		}
+		return sum;
+	}
+	//数颜色，超过PALETTE_MAX返回0
+	int CountColors(const uint8_t* src, int w, int h, ptrdiff_t stride)
+	{
+		memset(m_slotIndex, 0, sizeof(m_slotIndex));
+		int count = 0;
+		uint32_t last = 0;
+		bool hasLast = false;
+		for (int y = 0; y < h; y++)
+		{
+			const uint8_t* p = src + y * stride;
+			for (int x = 0; x < w; x++)
+			{
+				uint32_t c = Load32(p + x * 4);
+				if (hasLast && (c == last))
+				{
+					continue;
+				}
+				last = c;
+				hasLast = true;
+				uint32_t slot = (c * 2654435761u) >> 24;
+				while ((m_slotIndex[slot] != 0) && (m_slots[slot] != c))
+				{
+					slot = (slot + 1) & (PALETTE_SLOTS - 1);
+				}
+				if (m_slotIndex[slot] != 0)
+				{
+					continue;
+				}
+				if (count == PALETTE_MAX)
+				{
+					return 0;
+				}
+				m_slots[slot] = c;
+				m_palette[count++] = c;
+				m_slotIndex[slot] = (uint8_t)count;
+			}
+		}
+		return count;
+	}
+	int IndexOf(uint32_t c) const
+	{
+		uint32_t slot = (c * 2654435761u) >> 24;
+		while ((m_slotIndex[slot] == 0) || (m_slots[slot] != c))
+		{
+			slot = (slot + 1) & (PALETTE_SLOTS - 1);
+		}
+		return m_slotIndex[slot] - 1;
+	}
+	static int IndexBits(int colors)
+	{
+		return (colors <= 2) ? 1 : ((colors <= 4) ? 2 : ((colors <= 16) ? 4 : 8));
+	}
+	static void PutLength(std::vector<uint8_t>& out, size_t len)
+	{
+		while (len >= 255)
+		{
+			out.push_back(255);
+			len -= 255;
+		}
+		out.push_back((uint8_t)len);
+	}
+	static bool GetLength(const uint8_t*& p, const uint8_t* end, size_t& len)
+	{
+		uint8_t b;
+		do
+		{
+			if (p >= end)
+			{
+				return false;
+			}
+			b = *p++;
+			len += b;
+		} while (b == 255);
+		return true;
+	}
+	static void PutSequence(std::vector<uint8_t>& out, const uint8_t* lit, size_t litLen, size_t offset, size_t matchLen)
+	{
+		size_t token = out.size();
+		out.push_back(0);
+		uint8_t t = (uint8_t)(((litLen < 15) ? litLen : 15) << 4);
+		if (litLen >= 15)
+		{
+			PutLength(out, litLen - 15);
+		}
+		out.insert(out.end(), lit, lit + litLen);
+		if (matchLen > 0)
+		{
+			size_t m = matchLen - MIN_MATCH;
+			t |= (uint8_t)((m < 15) ? m : 15);
+			out.push_back((uint8_t)(offset & 0xFF));
+			out.push_back((uint8_t)(offset >> 8));
+			if (m >= 15)
+			{
+				PutLength(out, m - 15);
+			}
+		}
+		out[token] = t;
+	}
+public:
+	CMLossless() : m_hash(HASH_SIZE)
+	{
+	}
+	//块里有几种颜色，超过PALETTE_MAX返回0(界面、文字的颜色少)
+	int Colors(const uint8_t* src, int w, int h, ptrdiff_t stride)
+	{
+		return CountColors(src, w, h, stride);
+	}
+	//LZ压缩：先写原始长度(4字节)，再是一串(字面量,匹配)；追加到out
+	void Compress(const uint8_t* src, size_t size, std::vector<uint8_t>& out)
+	{
+		Put32(out, (uint32_t)size);
+		size_t anchor = 0;
+		size_t pos = 0;
+		if (size > MIN_MATCH + LAST_LITERALS)
+		{
+			std::fill(m_hash.begin(), m_hash.end(), 0);
+			size_t limit = size - MIN_MATCH - LAST_LITERALS;
+			size_t step = 1 << 6;		//连续找不到匹配时越跳越远
+			while (pos < limit)
+			{
+				uint32_t seq = Load32(src + pos);
+				uint32_t h = (seq * 2654435761u) >> (32 - HASH_BITS);
+				size_t cand = m_hash[h];
+				m_hash[h] = (uint32_t)pos;
+				if ((cand >= pos) || (pos - cand > MAX_OFFSET) || (Load32(src + cand) != seq))
+				{
+					pos += step >> 6;
+					step++;
+					continue;
+				}
+				step = 1 << 6;
+				//往后延伸，一次比8字节
+				size_t len = MIN_MATCH;
+				size_t maxLen = size - LAST_LITERALS - pos;
+				bool differ = false;
+				while (!differ && (len + 8 <= maxLen))
+				{
+					uint64_t diff = Load64(src + pos + len) ^ Load64(src + cand + len);
+					if (diff == 0)
+					{
+						len += 8;
+						continue;
+					}
+					//小端：低位字节在前，数一数前面有几个字节一样
+					while ((diff & 0xFF) == 0)
+					{
+						diff >>= 8;
+						len++;
+					}
+					differ = true;
+				}
+				while (!differ && (len < maxLen) && (src[pos + len] == src[cand + len]))
+				{
+					len++;
+				}
+				//往前延伸进字面量
+				while ((pos > anchor) && (cand > 0) && (src[pos - 1] == src[cand - 1]))
+				{
+					pos--;
+					cand--;
+					len++;
+				}
+				PutSequence(out, src + anchor, pos - anchor, pos - cand, len);
+				pos += len;
+				anchor = pos;
+				if (pos >= 2)
+				{
+					m_hash[(Load32(src + pos - 2) * 2654435761u) >> (32 - HASH_BITS)] = (uint32_t)(pos - 2);
+				}
+			}
+		}
+		PutSequence(out, src + anchor, size - anchor, 0, 0);
+	}
+	//LZ解压到dst(原始长度写在开头)，数据不对返回false
+	//expected是调用方按块大小算出来的长度，码流里写的对不上就不解(不能按码流里的长度分配内存)
+	static bool Decompress(const uint8_t* data, size_t size, std::vector<uint8_t>& dst, size_t expected)
+	{
+		if (size < 4)
+		{
+			return false;
+		}
+		uint32_t rawSize = Load32(data);
+		if (rawSize != expected)
+		{
+			return false;
+		}
+		dst.resize(rawSize);
+		const uint8_t* p = data + 4;
+		const uint8_t* end = data + size;
+		size_t pos = 0;
+		while (p < end)
+		{
+			uint8_t token = *p++;
+			size_t litLen = token >> 4;
+			if ((litLen == 15) && !GetLength(p, end, litLen))
+			{
+				return false;
+			}
+			if (((size_t)(end - p) < litLen) || (rawSize - pos < litLen))
+			{
+				return false;
+			}
+			if (litLen > 0)
+			{
+				memcpy(dst.data() + pos, p, litLen);
+			}
+			p += litLen;
+			pos += litLen;
+			if (p == end)
+			{
+				break;		//最后一段只有字面量
+			}
+			if (end - p < 2)
+			{
+				return false;
+			}
+			size_t offset = p[0] | ((size_t)p[1] << 8);
+			p += 2;
+			size_t matchLen = token & 15;
+			if ((matchLen == 15) && !GetLength(p, end, matchLen))
+			{
+				return false;
+			}
+			matchLen += MIN_MATCH;
+			if ((offset == 0) || (offset > pos) || (rawSize - pos < matchLen))
+			{
+				return false;
+			}
+			uint8_t* out = dst.data() + pos;
+			const uint8_t* from = out - offset;
+			if (offset >= matchLen)
+			{
+				memcpy(out, from, matchLen);
+			}
+			else
+			{
+				//重叠的拷贝(连续重复的一段)只能一个一个来
+				for (size_t i = 0; i < matchLen; i++)
+				{
+					out[i] = from[i];
+				}
+			}
+			pos += matchLen;
+		}
+		return pos == rawSize;
+	}
+	//压一块：src指向左上角像素，stride是行间隔；结果追加到out
+	void Encode(const uint8_t* src, int w, int h, ptrdiff_t stride, std::vector<uint8_t>& out)
+	{
+		int colors = CountColors(src, w, h, stride);
+		if (colors == 1)
+		{
+			out.push_back(MODE_SOLID);
+			Put32(out, m_palette[0]);
+			return;
+		}
+		if (colors > 0)
+		{
+			//每行按字节对齐，索引从高位往低位放
+			int bits = IndexBits(colors);
+			size_t rowBytes = ((size_t)w * bits + 7) / 8;
+			m_plane.assign(rowBytes * h, 0);
+			for (int y = 0; y < h; y++)
+			{
+				const uint8_t* p = src + y * stride;
+				uint8_t* row = m_plane.data() + y * rowBytes;
+				uint32_t last = Load32(p) + 1;
+				int index = 0;
+				for (int x = 0; x < w; x++)
+				{
+					uint32_t c = Load32(p + x * 4);
+					if (c != last)
+					{
+						last = c;
+						index = IndexOf(c);
+					}
+					size_t bit = (size_t)x * bits;
+					row[bit >> 3] |= (uint8_t)(index << (8 - bits - (bit & 7)));
+				}
+			}
+			out.push_back(MODE_PALETTE);
+			out.push_back((uint8_t)(colors - 1));
+			for (int i = 0; i < colors; i++)
+			{
+				Put32(out, m_palette[i]);
+			}
+			Compress(m_plane.data(), m_plane.size(), out);
+			return;
+		}
+		//alpha全是255时只存3个通道
+		bool alpha = false;
+		for (int y = 0; (y < h) && !alpha; y++)
+		{
+			const uint8_t* p = src + y * stride;
+			for (int x = 0; x < w; x++)
+			{
+				alpha |= (p[x * 4 + 3] != 255);
+			}
+		}
+		int bpp = alpha ? 4 : 3;
+		size_t bytes = (size_t)w * bpp;
+		m_plane.resize((1 + bytes) * h);
+		m_rows[0].assign(bytes, 0);
+		m_rows[1].resize(bytes);
+		m_trial.resize(bytes);
+		for (int y = 0; y < h; y++)
+		{
+			const uint8_t* p = src + y * stride;
+			uint8_t* cur = m_rows[y & 1].data();
+			const uint8_t* up = m_rows[(y & 1) ^ 1].data();
+			//颜色变换：B-G、G、R-G，灰色和文字的三个通道变得很像
+			for (int x = 0; x < w; x++)
+			{
+				uint8_t b = p[x * 4], g = p[x * 4 + 1], r = p[x * 4 + 2];
+				cur[x * bpp] = (uint8_t)(b - g);
+				cur[x * bpp + 1] = g;
+				cur[x * bpp + 2] = (uint8_t)(r - g);
+				if (alpha)
+				{
+					cur[x * bpp + 3] = p[x * 4 + 3];
+				}
+			}
+			//第一行没有上一行，只试左边
+			uint8_t* dst = m_plane.data() + y * (1 + bytes);
+			int best = PRED_LEFT;
+			Predict(PRED_LEFT, cur, up, dst + 1, bytes, bpp);
+			unsigned bestCost = Cost(dst + 1, bytes);
+			for (int pred = PRED_UP; (y > 0) && (pred < PRED_COUNT) && (bestCost > 0); pred++)
+			{
+				Predict(pred, cur, up, m_trial.data(), bytes, bpp);
+				unsigned cost = Cost(m_trial.data(), bytes);
+				if (cost < bestCost)
+				{
+					best = pred;
+					bestCost = cost;
+					memcpy(dst + 1, m_trial.data(), bytes);
+				}
+			}
+			dst[0] = (uint8_t)best;
+		}
+		out.push_back(MODE_FILTERED);
+		out.push_back((uint8_t)(alpha ? FLAG_ALPHA : 0));
+		Compress(m_plane.data(), m_plane.size(), out);
+	}
+	//解一块到dst(左上角像素，stride是行间隔)，数据不对返回false
+	bool Decode(const uint8_t* data, size_t size, uint8_t* dst, int w, int h, ptrdiff_t stride)
+	{
+		if (size < 1)
+		{
+			return false;
+		}
+		switch (data[0])
+		{
+		case MODE_SOLID:
+		{
+			if (size != 5)
+			{
+				return false;
+			}
+			uint32_t c = Load32(data + 1);
+			for (int y = 0; y < h; y++)
+			{
+				uint8_t* row = dst + y * stride;
+				for (int x = 0; x < w; x++)
+				{
+					memcpy(row + x * 4, &c, 4);
+				}
+			}
+			return true;
+		}
+		case MODE_PALETTE:
+		{
+			if (size < 2)
+			{
+				return false;
+			}
+			int colors = data[1] + 1;
+			if ((colors > PALETTE_MAX) || (size < 2 + (size_t)colors * 4))
+			{
+				return false;
+			}
+			int bits = IndexBits(colors);
+			size_t rowBytes = ((size_t)w * bits + 7) / 8;
+			const uint8_t* palette = data + 2;
+			if (!Decompress(data + 2 + colors * 4, size - 2 - colors * 4, m_raw, rowBytes * h))
+			{
+				return false;
+			}
+			int mask = (1 << bits) - 1;
+			for (int y = 0; y < h; y++)
+			{
+				const uint8_t* row = m_raw.data() + y * rowBytes;
+				uint8_t* out = dst + y * stride;
+				for (int x = 0; x < w; x++)
+				{
+					size_t bit = (size_t)x * bits;
+					int index = (row[bit >> 3] >> (8 - bits - (bit & 7))) & mask;
+					if (index >= colors)
+					{
+						return false;
+					}
+					memcpy(out + x * 4, palette + index * 4, 4);
+				}
+			}
+			return true;
+		}
+		case MODE_FILTERED:
+		{
+			if (size < 2)
+			{
+				return false;
+			}
+			int bpp = (data[1] & FLAG_ALPHA) ? 4 : 3;
+			size_t bytes = (size_t)w * bpp;
+			if (!Decompress(data + 2, size - 2, m_raw, (1 + bytes) * h))
+			{
+				return false;
+			}
+			m_rows[0].assign(bytes, 0);
+			const uint8_t* up = m_rows[0].data();
+			for (int y = 0; y < h; y++)
+			{
+				uint8_t* cur = m_raw.data() + y * (1 + bytes) + 1;
+				int pred = cur[-1];
+				if ((pred >= PRED_COUNT) || ((y == 0) && (pred != PRED_LEFT)))
+				{
+					return false;
+				}
+				Unpredict(pred, cur, up, bytes, bpp);
+				uint8_t* out = dst + y * stride;
+				for (int x = 0; x < w; x++)
+				{
+					uint8_t g = cur[x * bpp + 1];
+					out[x * 4] = (uint8_t)(cur[x * bpp] + g);
+					out[x * 4 + 1] = g;
+					out[x * 4 + 2] = (uint8_t)(cur[x * bpp + 2] + g);
+					out[x * 4 + 3] = (bpp == 4) ? cur[x * bpp + 3] : 255;
+				}
+				up = cur;
+			}
+			return true;
+		}
+		}
+		return false;
+	}
+};
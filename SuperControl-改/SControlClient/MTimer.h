@@ -0,0 +1,402 @@
+#pragma once
+
+#include <vector>
+#include <queue>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <condition_variable>
+#include "MThread.h"
+
+//定时器服务：近处的定时器放多层时间轮(增删O(1))，超出时间轮范围的放最小堆
+//到期的任务投递到线程池执行，替代各处只为了Sleep而占着的线程
+//周期定时器沿用CMWork的约定：回调返回0继续，返回其他值(void的lambda算-1)就停
+class CMTimer
+{
+public:
+	typedef unsigned long long TimerId;
+private:
+	enum
+	{
+		WHEEL_BITS		= 6,
+		WHEEL_SIZE		= 1 << WHEEL_BITS,		//每层64个槽
+		WHEEL_MASK		= WHEEL_SIZE - 1,
+		WHEEL_LEVELS	= 4,					//一格1毫秒，4层能放约4.6小时，更远的放堆里
+		POOL_THREADS	= 2,					//没指定线程池时用自己的
+		TRACE_INTERVAL	= 1000,					//导出线程池统计的间隔(毫秒)
+	};
+	struct MTimerEntry
+	{
+		TimerId				id;
+		long long			expire;			//到期的刻度(毫秒)
+		int					period;			//周期，0表示只执行一次
+		int					slack;			//允许推迟多少毫秒，用来和附近的定时器合并
+		CMTask				task;
+		CMThreadPool*		pool;
+		MPriority			priority;		//投递到线程池用的优先级
+		bool				firing;			//驱动线程正在往线程池投递它(持锁读写)
+		std::atomic<bool>	cancelled;
+	};
+	typedef std::shared_ptr<MTimerEntry> MEntryPtr;
+	struct MHeapItem
+	{
+		long long	expire;
+		MEntryPtr	entry;
+		bool operator<(const MHeapItem& other) const
+		{
+			return expire > other.expire;	//小顶堆
+		}
+	};
+private:
+	std::vector<MEntryPtr>				m_wheel[WHEEL_LEVELS][WHEEL_SIZE];
+	size_t								m_wheelCount;		//时间轮里的定时器数(含已取消还没扫掉的)
+	std::priority_queue<MHeapItem>		m_heap;
+	std::map<TimerId, MEntryPtr>		m_mapTimers;		//还活着的定时器，取消时用
+	long long							m_current;			//时间轮已经走到的刻度
+	TimerId								m_nextId;
+	std::chrono::steady_clock::time_point m_base;
+	std::mutex							m_mutex;
+	std::condition_variable				m_cond;
+	std::condition_variable				m_condFire;			//一批投递完了，叫醒等着的Cancel
+	std::function<long long()>			m_clock;			//测试用的时钟，空的时候用steady_clock
+	bool								m_run;
+	std::thread							m_thread;
+	CMThreadPool						m_pool;
+private:
+	static long long Range()
+	{
+		return 1LL << (WHEEL_BITS * WHEEL_LEVELS);
+	}
+	long long NowTick()
+	{
+		if (m_clock)
+		{
+			return m_clock();
+		}
+		return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_base).count();
+	}
+	//到期时间按slack向上取整：差不多同时到期的落进同一个槽，一起投递
+	static long long Coalesce(long long expire, int slack)
+	{
+		if (slack <= 1)
+		{
+			return expire;
+		}
+		return (expire + slack - 1) / slack * slack;
+	}
+	//放进时间轮或堆(调用方持锁)，minTick之前的算作minTick到期
+	void Place(const MEntryPtr& entry, long long minTick)
+	{
+		long long expire = std::max(entry->expire, minTick);
+		long long delta = expire - m_current;
+		if (delta >= Range())
+		{
+			MHeapItem item = { expire, entry };
+			m_heap.push(item);
+			return;
+		}
+		for (int level = 0; level < WHEEL_LEVELS; level++)
+		{
+			if (delta < (1LL << (WHEEL_BITS * (level + 1))))
+			{
+				m_wheel[level][(expire >> (WHEEL_BITS * level)) & WHEEL_MASK].push_back(entry);
+				m_wheelCount++;
+				return;
+			}
+		}
+	}
+	//堆里快到期的挪进时间轮(调用方持锁)
+	void Migrate()
+	{
+		while (!m_heap.empty() && (m_heap.top().expire - m_current < Range()))
+		{
+			MEntryPtr entry = m_heap.top().entry;
+			m_heap.pop();
+			Place(entry, m_current + 1);
+		}
+	}
+	//时间轮空着的时候驱动线程不走刻度，新放进来之前先追上现在(调用方持锁)
+	void CatchUp()
+	{
+		if (m_wheelCount == 0)
+		{
+			m_current = std::max(m_current, NowTick() - 1);
+			Migrate();
+		}
+	}
+	//时间轮走一格，到期的放进vecDue(调用方持锁)
+	void Advance(std::vector<MEntryPtr>& vecDue)
+	{
+		m_current++;
+		//低层转完一圈，把上一层对应槽里的定时器摊下来
+		for (int level = 1; level < WHEEL_LEVELS; level++)
+		{
+			if (((m_current >> (WHEEL_BITS * (level - 1))) & WHEEL_MASK) != 0)
+			{
+				break;
+			}
+			std::vector<MEntryPtr> vecSlot;
+			vecSlot.swap(m_wheel[level][(m_current >> (WHEEL_BITS * level)) & WHEEL_MASK]);
+			m_wheelCount -= vecSlot.size();
+			for (size_t i = 0; i < vecSlot.size(); i++)
+			{
+				Place(vecSlot.at(i), m_current);
+			}
+		}
+		Migrate();
+		std::vector<MEntryPtr>& slot = m_wheel[0][m_current & WHEEL_MASK];
+		m_wheelCount -= slot.size();
+		for (size_t i = 0; i < slot.size(); i++)
+		{
+			if (!slot.at(i)->cancelled)
+			{
+				vecDue.push_back(slot.at(i));
+			}
+		}
+		slot.clear();
+	}
+	//离下一次需要醒来还有多少毫秒，-1表示没有定时器(调用方持锁)
+	long long NextWait()
+	{
+		long long wait = -1;
+		if (m_wheelCount > 0)
+		{
+			//最多看到这一圈结束，到那时要往下摊上层的槽
+			long long left = WHEEL_SIZE - (m_current & WHEEL_MASK);
+			wait = left;
+			for (long long i = 1; i < left; i++)
+			{
+				if (!m_wheel[0][(m_current + i) & WHEEL_MASK].empty())
+				{
+					wait = i;
+					break;
+				}
+			}
+		}
+		if (!m_heap.empty())
+		{
+			long long heapWait = std::max(m_heap.top().expire - Range() + 1 - m_current, 1LL);
+			wait = (wait < 0) ? heapWait : std::min(wait, heapWait);
+		}
+		return wait;
+	}
+	void ThreadMain()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (m_run)
+		{
+			std::vector<MEntryPtr> vecDue;
+			long long now = NowTick();
+			while (m_current < now)
+			{
+				//时间轮是空的，不用一格一格地走
+				if (m_wheelCount == 0)
+				{
+					m_current = now - 1;
+					Migrate();
+				}
+				Advance(vecDue);
+			}
+			if (vecDue.size() > 0)
+			{
+				//投递在锁外做，这期间Cancel要等：投递完之前线程池的指针还在用
+				for (size_t i = 0; i < vecDue.size(); i++)
+				{
+					vecDue.at(i)->firing = true;
+				}
+				lock.unlock();
+				Fire(vecDue);
+				lock.lock();
+				for (size_t i = 0; i < vecDue.size(); i++)
+				{
+					vecDue.at(i)->firing = false;
+				}
+				m_condFire.notify_all();
+				continue;
+			}
+			long long wait = NextWait();
+			if (wait < 0)
+			{
+				m_cond.wait(lock);
+			}
+			else
+			{
+				m_cond.wait_for(lock, std::chrono::milliseconds(wait));
+			}
+		}
+	}
+	//同一个线程池、同一个优先级的到期任务合成一个任务投递，同时到期的定时器只唤醒一次线程池
+	void Fire(std::vector<MEntryPtr>& vecDue)
+	{
+		typedef std::pair<CMThreadPool*, MPriority> MBatchKey;
+		std::map<MBatchKey, std::vector<MEntryPtr> > mapBatch;
+		for (size_t i = 0; i < vecDue.size(); i++)
+		{
+			mapBatch[MBatchKey(vecDue.at(i)->pool, vecDue.at(i)->priority)].push_back(vecDue.at(i));
+		}
+		for (std::map<MBatchKey, std::vector<MEntryPtr> >::iterator it = mapBatch.begin(); it != mapBatch.end(); it++)
+		{
+			std::shared_ptr<std::vector<MEntryPtr> > batch = std::make_shared<std::vector<MEntryPtr> >();
+			batch->swap(it->second);
+			bool ret = it->first.first->DispatchTask(CMTask([this, batch]() {
+				for (size_t i = 0; i < batch->size(); i++)
+				{
+					Run(batch->at(i));
+				}
+			}), it->first.second);
+			if (!ret)
+			{
+				//线程池满了或关了：周期的等下一个周期，一次性的丢掉(不能丢的用MP_HIGH，只有线程池关了才会被拒绝)
+				printf("%s(%d):%s timer dispatch rejected count:%d\n", __FILE__, __LINE__, __FUNCTION__, (int)batch->size());
+				for (size_t i = 0; i < batch->size(); i++)
+				{
+					Finish(batch->at(i), batch->at(i)->period > 0);
+				}
+			}
+		}
+	}
+	void Run(const MEntryPtr& entry)
+	{
+		if (entry->cancelled)
+		{
+			return;
+		}
+		int ret = entry->task();
+		Finish(entry, (entry->period > 0) && (ret == 0));
+	}
+	//周期定时器排下一次(从上次到期算，不累积漂移；落后太多就从现在算)，其他的删掉
+	void Finish(const MEntryPtr& entry, bool again)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!again || entry->cancelled)
+		{
+			m_mapTimers.erase(entry->id);
+			return;
+		}
+		entry->expire = Coalesce(std::max(entry->expire + entry->period, NowTick()), entry->slack);
+		CatchUp();
+		Place(entry, m_current + 1);
+		m_cond.notify_one();
+	}
+public:
+	CMTimer()
+		: m_wheelCount(0)
+		, m_current(0)
+		, m_nextId(0)
+		, m_base(std::chrono::steady_clock::now())
+		, m_run(true)
+		, m_pool(POOL_THREADS)
+	{
+		m_pool.Invoke();
+		m_thread = std::thread(&CMTimer::ThreadMain, this);
+	}
+	~CMTimer()
+	{
+		m_mutex.lock();
+		m_run = false;
+		m_mutex.unlock();
+		m_cond.notify_all();
+		if (m_thread.joinable())
+		{
+			m_thread.join();
+		}
+		m_pool.Stop();
+	}
+	//设置了环境变量SCONTROL_TRACE(文件路径)时，定时把所有线程池的统计追加到这个文件
+	TimerId TraceFromEnv()
+	{
+		const char* path = getenv("SCONTROL_TRACE");
+		if ((path == NULL) || (*path == '\0'))
+		{
+			return 0;
+		}
+		std::string file(path);
+		return Every(TRACE_INTERVAL, CMTask([file]() {
+			CMThreadPool::DumpTrace(file.c_str());
+			return 0;
+		}));
+	}
+	//进程里共用的定时器
+	static CMTimer& Global()
+	{
+		static CMTimer timer;
+		static TimerId trace = timer.TraceFromEnv();
+		(void)trace;
+		return timer;
+	}
+	//delay毫秒后第一次执行，period大于0时之后每period毫秒执行一次
+	//pool为NULL时在定时器自己的线程池里执行，slack是允许推迟的毫秒数(越大越容易合并)
+	//priority是投递到线程池的优先级，MP_HIGH不受队列上限限制
+	TimerId Schedule(int delay, int period, CMTask&& task, CMThreadPool* pool = NULL, int slack = 0, MPriority priority = MP_NORMAL)
+	{
+		MEntryPtr entry = std::make_shared<MTimerEntry>();
+		entry->period = std::max(period, 0);
+		entry->slack = std::max(slack, 0);
+		entry->task = std::move(task);
+		entry->pool = (pool != NULL) ? pool : &m_pool;
+		entry->priority = priority;
+		entry->firing = false;
+		entry->cancelled = false;
+		std::lock_guard<std::mutex> lock(m_mutex);
+		entry->id = ++m_nextId;
+		entry->expire = Coalesce(NowTick() + std::max(delay, 0), entry->slack);
+		m_mapTimers[entry->id] = entry;
+		CatchUp();
+		Place(entry, m_current + 1);
+		m_cond.notify_one();
+		return entry->id;
+	}
+	//只执行一次
+	TimerId After(int ms, CMTask&& task, CMThreadPool* pool = NULL, int slack = 0, MPriority priority = MP_NORMAL)
+	{
+		return Schedule(ms, 0, std::move(task), pool, slack, priority);
+	}
+	//每ms毫秒执行一次，第一次在ms毫秒后
+	TimerId Every(int ms, CMTask&& task, CMThreadPool* pool = NULL, int slack = 0, MPriority priority = MP_NORMAL)
+	{
+		return Schedule(ms, std::max(ms, 1), std::move(task), pool, slack, priority);
+	}
+	//取消定时器，返回false表示已经执行完或不存在；正在执行的这一次不会被打断
+	//驱动线程正在投递它的时候等投递完再返回，返回以后定时器不会再碰它的线程池，可以析构线程池
+	bool Cancel(TimerId id)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		std::map<TimerId, MEntryPtr>::iterator find = m_mapTimers.find(id);
+		if (find == m_mapTimers.end())
+		{
+			return false;
+		}
+		MEntryPtr entry = find->second;
+		entry->cancelled = true;
+		m_mapTimers.erase(find);
+		if (std::this_thread::get_id() != m_thread.get_id())
+		{
+			m_condFire.wait(lock, [&entry]() { return !entry->firing; });
+		}
+		return true;
+	}
+	size_t Count()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_mapTimers.size();
+	}
+	//测试用：换成手动拨的时钟(毫秒刻度，不能往回拨)，要在放定时器之前设置
+	void SetClock(std::function<long long()> clock)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_clock = clock;
+		m_current = std::max(NowTick() - 1, 0LL);
+		m_cond.notify_one();
+	}
+	//拨了时钟以后叫醒驱动线程重新看时间
+	void Poke()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_cond.notify_one();
+	}
+};
@@ -6,34 +6,41 @@
 #include "MThread.h"
 #include <mutex>
 #include <atomic>
+#include <list>
+#include <chrono>
 #define WM_RE_SEND_PACK		(WM_USER + 101)
 #define WM_RE_SEND_PACK_ACK (WM_USER + 102)
 
 class CRequest : public CMFuncBase
 {
 private:
+	enum
+	{
+		BATCH_MAX		= 16,		//一次最多取走几个包
+		WAIT_INTERVAL	= 100,		//队列空时最多等多久(毫秒)再看一次m_stop
+		PENDING_MAX		= 10,		//最多积压几个包，再多就丢最旧的
+	};
 	CMQueue<CPacket>	m_quePackets;
 	CMThread			m_thread;
-	HANDLE				m_event;
 	std::mutex			m_mutex;
 	std::atomic<bool>	m_stop;
+	std::atomic<unsigned long long>	m_dropped;		//因为积压丢掉的包数
 public:
 
 	int ThreadMain()
 	{
 		while (m_stop)
 		{
-			//m_mutex.lock();
-			if (m_quePackets.size() <= 0)
+			//一次取走攒下的所有包；空的就在队列上等，有包放进来马上醒，不会像以前先看size再等事件那样漏掉唤醒
+			std::list<CPacket> lstPacks;
+			if (m_quePackets.pop_n(lstPacks, BATCH_MAX, std::chrono::steady_clock::now() + std::chrono::milliseconds(WAIT_INTERVAL)) == 0)
+			{
+				continue;
+			}
+			for (std::list<CPacket>::iterator it = lstPacks.begin(); it != lstPacks.end(); it++)
 			{
-				WaitForSingleObject(m_event, INFINITE);
+				_SendPacket(*it);
 			}
-			//TRACE(" ThreadMain -> size %d\r\n", GetTickCount64(), m_quePackets.size());
-			ResetEvent(m_event);
-			CPacket pack;
-			m_quePackets.pop_front(pack);
-			_SendPacket(pack);
-			//m_mutex.unlock();
 		}
 		return -1;
 	}
@@ -52,9 +59,9 @@ public:
 	CRequest()
 	{
 		m_thread.Work(CMWork(this,(MT_FUNC)&CRequest::ThreadMain));
-		m_thread.Start();
-		m_event = CreateEvent(NULL, TRUE, FALSE, NULL);
 		m_stop = true;
+		m_dropped = 0;
+		m_thread.Start();
 	}
 
 	~CRequest()
@@ -64,29 +71,37 @@ public:
 
 	void SendPacket(WORD nCmd, BYTE* data, DWORD len)
 	{
-		
-		TRACE(" push back ->  %d  size  %d\r\n", GetTickCount64(), m_quePackets.size());
-		m_mutex.lock();
-		if (m_quePackets.size() > 10)
+		CPacket pack(nCmd, data, len);
+		SendPacket(pack);
+	}
+
+	//鼠标键盘命令只要最新的：排着的超过PENDING_MAX个，或者队列满了放不进去，就丢最旧的，丢了多少记下来
+	void SendPacket(CPacket& packet)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		CPacket old;
+		while ((m_quePackets.size() > PENDING_MAX) && m_quePackets.pop_front(old))
 		{
-			CPacket pack;
-			m_quePackets.pop_front(pack);
+			m_dropped++;
 		}
-		m_quePackets.push_back(CPacket(nCmd,data,len));
-
-		int a = m_quePackets.size();
-		TRACE("SendPacket ->  %d  size  %d\r\n", GetTickCount64(), a);
-		static int count = 0;
-		TRACE("SendPacket ->  %d  count  %d\r\n", GetTickCount64(), ++count);
-		m_mutex.unlock();
-		SetEvent(m_event);
+		while (!m_quePackets.push_back(packet))
+		{
+			if (!m_quePackets.pop_front(old))
+			{
+				//放的一方都持着m_mutex，放不进去又取不出来只能是容量为0，只好丢新包
+				m_dropped++;
+				TRACE("SendPacket drop ->  %d  dropped  %llu\r\n", GetTickCount64(), m_dropped.load());
+				return;
+			}
+			m_dropped++;
+		}
+		TRACE("SendPacket ->  %d  size  %d  dropped  %llu\r\n", GetTickCount64(), (int)m_quePackets.size(), m_dropped.load());
 	}
 
-	void SendPacket(CPacket& packet)
+	//因为积压丢掉的包数
+	unsigned long long Dropped()
 	{
-		TRACE(" push back ->  %d  size  %d\r\n", GetTickCount64(), m_quePackets.size());
-		m_quePackets.push_back(packet);
-		SetEvent(m_event);
+		return m_dropped;
 	}
 	
 };
@@ -76,46 +76,91 @@ void CScreenWatch::ThreadEntryScreenWatch(void* arg)
 void CScreenWatch::ThreadScreenWatch()
 {
 	threadIsRunning = true;
+	//一个连接看到底：发一次命令9，之后被控端一直推帧(第一帧整帧，后面只有变了的块)
+	streamSock.InitSocket(CClientController::m_vecUserInfos.at(0).ip, CClientController::m_vecUserInfos.at(0).port);
+	streamSock.SetBufferSize(1024 * 1024 * 10);
+	SendStreamCtrl(MS_START, STREAM_CREDIT);
+	isStreaming = true;
+	if (isPaused)
+	{
+		SendStreamCtrl(MS_PAUSE);
+	}
+	ULONGLONG fpsTick = GetTickCount64();
+	int frames = 0;
 	while (threadIsRunning)
 	{
-		//告诉服务器我要屏幕截图
-		CClientSocket clientSock;
-		clientSock.InitSocket(CClientController::m_vecUserInfos.at(0).ip, CClientController::m_vecUserInfos.at(0).port);
-		clientSock.SetBufferSize(1024 * 1024 * 10);
-		CPacket pack(5);
-		clientSock.Send(pack);
-		//得到截图
-		TRACE("1=======================tick = %lld\r\n", GetTickCount64());
-		int nCmd = clientSock.DealCommand();
-		TRACE("2=======================tick = %lld\r\n", GetTickCount64());
+		int nCmd = streamSock.DealCommand();
 		if (nCmd <= 0)
 		{
-			TRACE("获取屏幕截图错误(错误码: %d 错误 : % s)\r\n", GetLastError(), GetErrInfo(GetLastError()));
-			AfxMessageBox(L"获取屏幕截图错误");
-			return;
+			//关窗口时是OnCancel关的连接，不用报错
+			if (threadIsRunning)
+			{
+				TRACE("获取屏幕截图错误(错误码: %d 错误 : % s)\r\n", GetLastError(), GetErrInfo(GetLastError()));
+				AfxMessageBox(L"获取屏幕截图错误");
+			}
+			break;
+		}
+		if (nCmd != 9)
+		{
+			continue;
+		}
+		//上一帧画完才能解这一帧：后面的帧只带变了的块，一帧都不能丢(解码失败以后到整帧之前的除外)
+		while (threadIsRunning && (WaitForSingleObject(hShown, 100) == WAIT_TIMEOUT))
+		{
+		}
+		if (!threadIsRunning)
+		{
+			break;
+		}
+		const std::string& sData = streamSock.GetPacket().sData;
+		int ret = decoder.Receive((const uint8_t*)sData.c_str(), sData.size());
+		if (ret == MTR_NEED_KEY)
+		{
+			//画面对不上了，让被控端下一帧整帧发，只要一次
+			TRACE("[threadId: %d] 屏幕数据解码失败 size = %d\r\n", GetThreadId(GetCurrentThread()), sData.size());
+			SetEvent(hShown);
+			SendStreamCtrl(MS_KEY);
 		}
-		if (showOver == true)
+		else if (ret == MTR_SKIPPED)
 		{
-			//截图数据写入pStream
-			HGLOBAL hMem = GlobalAlloc(GMEM_MOVEABLE, 0);
-			if (hMem == NULL) return;
-			IStream* pStream = NULL;
-			HRESULT ret = CreateStreamOnHGlobal(hMem, TRUE, &pStream);
-			ULONG written;
-			pStream->Write(clientSock.GetPacket().sData.c_str(), clientSock.GetPacket().sData.size(), &written);
-			//加载成图片
-			image.Load(pStream);
-			pStream->Release();
-			GlobalFree(hMem);
-			//
-			showOver = false;
-
-			TRACE("[threadId: %d] 成功读取一张照片 nCmd = %d\r\n", GetThreadId(GetCurrentThread()), nCmd);
-			
+			//MS_KEY发出去之前已经在路上的变化帧：画面是坏的，解了也不对，扔掉等整帧
+			SetEvent(hShown);
+		}
+		else
+		{
+			PostMessage(WM_SCREEN_FRAME);
+		}
+		//这一帧从连接上取走了(扔掉的也算)，还被控端一个额度，不然额度用完整帧就推不过来了
+		SendStreamCtrl(MS_CREDIT, 1);
+		frames++;
+		if (GetTickCount64() - fpsTick >= 1000)
+		{
+			TRACE("[threadId: %d] 推屏 %d 帧/秒\r\n", GetThreadId(GetCurrentThread()), frames);
+			fpsTick = GetTickCount64();
+			frames = 0;
 		}
-		clientSock.CloseSocket();
-		//Sleep(30);
-		//threadIsRunning = false;
+	}
+	isStreaming = false;
+}
+
+//推屏的控制包：画完一帧还额度、最小化暂停、换质量
+void CScreenWatch::SendStreamCtrl(BYTE op, WORD credit)
+{
+	STREAMCTRL ctrl{};
+	ctrl.nOp = op;
+	ctrl.nQuality = quality;
+	ctrl.nCredit = credit;
+	CPacket pack(9, (BYTE*)&ctrl, sizeof(ctrl));
+	std::lock_guard<std::mutex> lock(sendMutex);
+	streamSock.Send(pack);
+}
+
+void CScreenWatch::SetQuality(BYTE q)
+{
+	quality = q;
+	if (isStreaming)
+	{
+		SendStreamCtrl(MS_QUALITY);
 	}
 }
 
@@ -132,7 +177,10 @@ CPoint CScreenWatch::ClientPt2GlobalPt(CPoint& clientPt)
 CScreenWatch::CScreenWatch(CWnd* pParent /*=nullptr*/)
 	: CDialogEx(IDD_SCREEN_WATCH, pParent)
 {
-	showOver = true;
+	hShown = CreateEvent(NULL, FALSE, TRUE, NULL);
+	quality = 0;
+	isPaused = false;
+	isStreaming = false;
 	isControlMouse = false;
 	isControlKey = false;
 	imageWidth = 0;
@@ -141,6 +189,7 @@ CScreenWatch::CScreenWatch(CWnd* pParent /*=nullptr*/)
 
 CScreenWatch::~CScreenWatch()
 {
+	CloseHandle(hShown);
 }
 
 void CScreenWatch::DoDataExchange(CDataExchange* pDX)
@@ -148,12 +197,14 @@ void CScreenWatch::DoDataExchange(CDataExchange* pDX)
 	DDX_Control(pDX, IDC_PIC_SCREEN, m_picScreen);
 	CDialogEx::DoDataExchange(pDX);
 	DDX_Control(pDX, IDC_EDIT1, m_edit);
+	DDX_Control(pDX, IDC_COMBO_QUALITY, m_quality);
 }
 
 
 BEGIN_MESSAGE_MAP(CScreenWatch, CDialogEx)
 
-	ON_WM_TIMER()
+	ON_MESSAGE(WM_SCREEN_FRAME, &CScreenWatch::OnScreenFrame)
+	ON_WM_SIZE()
 	ON_COMMAND(ID_T_CMOUSE, &CScreenWatch::CmdControlMouse)
 	ON_COMMAND(ID_T_CKEY, &CScreenWatch::CmdControlKey)
 	ON_COMMAND(ID_T_LOCKM, &CScreenWatch::CmdLockMachine)
@@ -168,6 +219,7 @@ BEGIN_MESSAGE_MAP(CScreenWatch, CDialogEx)
 	ON_WM_MOUSEMOVE()
 	ON_BN_CLICKED(IDC_BUTTON1, &CScreenWatch::OnBnClickedButton1)
 	ON_WM_KEYDOWN()
+	ON_CBN_SELCHANGE(IDC_COMBO_QUALITY, &CScreenWatch::OnCbnSelchangeQuality)
 END_MESSAGE_MAP()
 
 
@@ -181,48 +233,63 @@ BOOL CScreenWatch::OnInitDialog()
 	// TODO:  在此添加额外的初始化
 
 	CreateToolBar();
+	//画质下拉框，顺序和OnCbnSelchangeQuality里的表对应
+	m_quality.AddString(L"无损");
+	m_quality.AddString(L"高");
+	m_quality.AddString(L"中");
+	m_quality.AddString(L"低");
+	m_quality.SetCurSel(0);
 	hThread = (HANDLE)_beginthread(ThreadEntryScreenWatch, 0, this);
-	SetTimer(123, 70, NULL);
 
 	return TRUE;  // return TRUE unless you set the focus to a control
 				  // 异常: OCX 属性页应返回 FALSE
 }
 
 
-void CScreenWatch::OnTimer(UINT_PTR nIDEvent)
+//解码线程解好一帧：画到控件上，再让它解下一帧
+LRESULT CScreenWatch::OnScreenFrame(WPARAM wParam, LPARAM lParam)
 {
-	// TODO: 在此添加消息处理程序代码和/或调用默认值
+	imageWidth = decoder.Width();
+	imageHeight = decoder.Height();
+	CRect picRect;
+	m_picScreen.GetWindowRect(&picRect);
+	//解码出来的是BGRA、行从上往下，直接缩放画到控件上
+	BITMAPINFO info = {};
+	info.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+	info.bmiHeader.biWidth = imageWidth;
+	info.bmiHeader.biHeight = -imageHeight;
+	info.bmiHeader.biPlanes = 1;
+	info.bmiHeader.biBitCount = 32;
+	info.bmiHeader.biCompression = BI_RGB;
+	CDC* pDC = m_picScreen.GetDC();
+	StretchDIBits(pDC->GetSafeHdc(), 0, 0, picRect.Width(), picRect.Height(), 0, 0, imageWidth, imageHeight,
+		decoder.Frame(), &info, DIB_RGB_COLORS, SRCCOPY);
+	m_picScreen.ReleaseDC(pDC);
+	SetEvent(hShown);
+	return 0;
+}
 
-	if ((nIDEvent == 123) && (showOver == false))
+//最小化时看不见画面，让被控端先别截了
+void CScreenWatch::OnSize(UINT nType, int cx, int cy)
+{
+	CDialogEx::OnSize(nType, cx, cy);
+	bool paused = (nType == SIZE_MINIMIZED);
+	if (paused != isPaused)
 	{
-		if (imageWidth == 0)
+		isPaused = paused;
+		if (isStreaming)
 		{
-			imageWidth = image.GetWidth();
+			SendStreamCtrl(paused ? MS_PAUSE : MS_RESUME);
 		}
-		if (imageHeight == 0)
-		{
-			imageHeight = image.GetHeight();
-		}
-		CRect picRect;
-		m_picScreen.GetWindowRect(&picRect);
-		CRect showPicRect(0, 0, picRect.Width(), picRect.Height());
-		image.StretchBlt(m_picScreen.GetDC()->GetSafeHdc(), showPicRect, SRCCOPY);
-		image.Save(L"D:\\Desktop\\1.png", Gdiplus::ImageFormatPNG);
-		image.Destroy();
-		showOver = true;
 	}
-
-	if (nIDEvent == 123)
-	{
-	}
-
-	CDialogEx::OnTimer(nIDEvent);
 }
 
 
 void CScreenWatch::OnCancel()
 {
 	threadIsRunning = false;
+	//关掉推屏连接，解码线程从recv里出来
+	streamSock.CloseSocket();
 	WaitForSingleObject(hThread, 500);
 	delete this;
 }
@@ -522,3 +589,16 @@ BOOL CScreenWatch::PreTranslateMessage(MSG* pMsg)
 	
 	return CDialogEx::PreTranslateMessage(pMsg);
 }
+
+
+//换画质：慢的链路选低一点，推屏中的话被控端下一帧整帧按新质量发
+void CScreenWatch::OnCbnSelchangeQuality()
+{
+	static const BYTE levels[] = { 0, 80, 60, 40 };
+	int sel = m_quality.GetCurSel();
+	if ((sel < 0) || (sel >= _countof(levels)))
+	{
+		return;
+	}
+	SetQuality(levels[sel]);
+}
@@ -1,6 +1,8 @@
 ﻿#pragma once
 #include "MToolbar.h"
 #include "Request.h"
+#include "MTileCodec.h"
+#define WM_SCREEN_FRAME		(WM_USER + 201)
 
 // CScreenWatch 对话框
 
@@ -14,8 +16,17 @@ private:
 	CImageList img;
 	bool isControlMouse;
 	bool isControlKey;
-	bool showOver;
-	CImage image;
+	enum
+	{
+		STREAM_CREDIT	= 2,		//推屏额度：一帧在画、一帧在路上
+	};
+	HANDLE	hShown;					//上一帧画完了(自动复位)，解码线程等它再解下一帧
+	BYTE	quality;				//截屏质量：0是无损，1~100是有损(慢的链路用)
+	bool	isPaused;				//最小化时让被控端暂停推屏
+	CMTileDecoder decoder;		//收到的画面，解码线程写、界面线程画(hShown交替)
+	CClientSocket streamSock;	//推屏的长连接，收帧在解码线程，控制包两边都会发
+	std::mutex sendMutex;		//streamSock的发送
+	std::atomic<bool> isStreaming;
 	int		imageWidth;
 	int		imageHeight;
 	CStatic m_picScreen;
@@ -24,6 +35,7 @@ private:
 	bool threadIsRunning;
 	static void ThreadEntryScreenWatch(void* arg);
 	void ThreadScreenWatch();
+	void SendStreamCtrl(BYTE op, WORD credit = 0);
 	CPoint ClientPt2GlobalPt(CPoint& clientPt);
 	void ShowDesktop(DWORD code);
 
@@ -42,7 +54,10 @@ protected:
 	DECLARE_MESSAGE_MAP()
 public:
 	virtual BOOL OnInitDialog();
-	afx_msg void OnTimer(UINT_PTR nIDEvent);
+	//换截屏质量(0是无损)，推屏中的话下一帧整帧按新质量发
+	void SetQuality(BYTE q);
+	afx_msg LRESULT OnScreenFrame(WPARAM wParam, LPARAM lParam);
+	afx_msg void OnSize(UINT nType, int cx, int cy);
 	virtual void OnCancel();
 	afx_msg void CmdControlMouse();
 	afx_msg void CmdControlKey();
@@ -59,5 +74,7 @@ public:
 	afx_msg void OnBnClickedButton1();
 	afx_msg void OnKeyDown(UINT nChar, UINT nRepCnt, UINT nFlags);
 	virtual BOOL PreTranslateMessage(MSG* pMsg);
+	afx_msg void OnCbnSelchangeQuality();
 	CEdit m_edit;
+	CComboBox m_quality;		//画质：无损、高、中、低
 };
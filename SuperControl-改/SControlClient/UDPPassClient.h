@@ -2,9 +2,11 @@
 #include "framework.h"
 #include "Common.h"
 #include "MThread.h"
+#include "MTimer.h"
 #include <string>
 #include <vector>
 #include <atomic>
+#include <mutex>
 #include <map>
 
 class UDPPassClient : public CMFuncBase
@@ -19,11 +21,29 @@ private:
 	CMThreadPool					m_thpool;
 	std::atomic<bool>				m_stop;
 	HWND							m_hWnd;
-	CPacket							m_udpConectPack;
+	CPacket							m_udpConectPack;		//打洞协调包(105)
+	std::mutex						m_punchMutex;			//m_udpConectPack和m_punchRecvTick：TCP线程写，打洞线程、收包线程读
+	ULONGLONG						m_punchRecvTick;		//收到打洞协调包(105)的时间
+	ULONGLONG						m_punchStartTick;		//开始探测的时间
+	std::atomic<bool>				m_punchOk;				//收到对端应答，打洞成功
+	sockaddr_in						m_punchAddr;			//实际打通的对端地址
+	std::atomic<bool>				m_redirect;				//服务器叫我换节点(108)，TCP线程重连
+	SOCKET							m_lanSock;				//局域网发现用的组播套接字
+	std::map<long long, sockaddr_in>	m_mapLanAddrs;		//组播发现的同一局域网用户的地址
+	std::mutex						m_lanMutex;
+	CMTimer::TimerId				m_keepTimer;			//心跳定时器
 private:
 	int ThreadTcpProc();
 	int ThreadUdpProc();
 	int ThreadUDPPass();
+	//处理打洞探测包(123)和应答包(124)
+	bool DealPunch(CPacket& pack, sockaddr_in& addr);
+	//换到管理自己的节点(108)
+	void Redirect(CPacket& pack);
+	//组播广播自己，顺便收同一局域网其他用户的广播
+	int ThreadLanDiscover();
+	//本机的局域网地址(登记时带给服务器)
+	MLocalAddrs GetLocalAddrs();
 	/// <summary>
 /// 初始化网络环境
 /// </summary>
@@ -46,6 +66,7 @@ private:
 	{
 		WSACleanup();
 	}
+	//发一次心跳(103)，定时器每秒调一次
 	int KeepOnline();
 	
 public:
@@ -58,6 +58,7 @@
 #define IDC_EDIT_DL_INFO                1012
 #define IDC_TXT_DL_PRO                  1013
 #define IDC_PIC_SCREEN                  1014
+#define IDC_COMBO_QUALITY               1015
 #define ID_BUTTON32771                  32771
 #define ID_T_FILEMANAGER                32771
 #define ID_BUTTON32772                  32772
@@ -91,7 +92,7 @@
 #ifndef APSTUDIO_READONLY_SYMBOLS
 #define _APS_NEXT_RESOURCE_VALUE        168
 #define _APS_NEXT_COMMAND_VALUE         32787
-#define _APS_NEXT_CONTROL_VALUE         1015
+#define _APS_NEXT_CONTROL_VALUE         1016
 #define _APS_NEXT_SYMED_VALUE           101
 #endif
 #endif
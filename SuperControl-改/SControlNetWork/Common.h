@@ -169,5 +169,94 @@ struct ConnectIds
 	unsigned long long  id1;
 };
 
+//本机网卡地址(101登记时跟在MUserInfo后面)：同一个局域网的两端可以直接连，不用绕公网
+#define LOCAL_ADDR_MAX 4
+struct MLocalAddrs
+{
+	char				ip[LOCAL_ADDR_MAX][16];
+	unsigned short		port;			//本地UDP端口
+	short				count;
+};
+
+//打洞协调信息(105)：对端地址放最前面，只认MUserInfo的旧客户端也能用
+struct MPunchInfo
+{
+	MUserInfo			peer;			//对端的公网地址
+	unsigned long long  session;		//本次打洞的序号
+	int					startDelay;		//收到后延迟多少毫秒开始探测(双方同时收到，同时开始)
+	short				probeCount;		//探测轮数
+	short				probeInterval;	//每轮间隔(毫秒)
+	short				portRange;		//端口预测范围，0表示只探测对端端口
+	short				portStep;		//端口预测步长(顺序分配型NAT的端口增量)
+	MLocalAddrs			peerLocal;		//对端的局域网地址，和公网地址同时探测，谁先通用谁
+
+	MPunchInfo(const MUserInfo& _peer) : peer(_peer)
+	{
+		session = 0;
+		startDelay = 0;
+		probeCount = 0;
+		probeInterval = 0;
+		portRange = 0;
+		portStep = 0;
+		memset(&peerLocal, 0, sizeof(peerLocal));
+	}
+};
+
+//第round轮第p个公网探测：目标是对端登记端口往后按步长预测的第p个端口，序号按轮连续编
+inline unsigned short PunchPort(const MPunchInfo& info, int p)
+{
+	return (unsigned short)(info.peer.port + p * info.portStep);
+}
+inline int PunchSeq(const MPunchInfo& info, int round, int p)
+{
+	return round * (info.portRange + 1) + p;
+}
+
+//打洞探测包(123)和应答包(124)
+struct MPunchProbe
+{
+	unsigned long long  session;		//打洞序号
+	unsigned long long  id;				//发送者id
+	int					seq;			//探测包序号
+	long long			sendTick;		//发送方本地时间，应答原样带回
+};
+
+//打洞结果(107)：客户端确认打通或超时后上报
+struct MPunchResult
+{
+	unsigned long long  session;
+	unsigned long long  id;
+	int					success;		//1表示收到应答，打洞成功
+	int					elapsed;		//从开始探测到收到应答的毫秒数
+	short				port;			//实际打通的对端端口
+};
+
+//集群节点信息(108重定向、201成员同步)
+struct MNodeInfo
+{
+	char				ip[16];
+	unsigned short		tcpPort;
+	unsigned short		udpPort;
+	unsigned short		gossipPort;		//节点之间同步成员用的UDP端口
+	unsigned long long  heartbeat;		//心跳计数，越大越新
+};
+
+//节点之间转发配对请求(202)和应答(203/204)
+struct MClusterPair
+{
+	unsigned long long  session;		//打洞序号(由收到104的节点生成)
+	ConnectIds			ids;			//id0:发起方 id1:目标
+	MUserInfo			user;			//202里是发起方信息，203里是目标信息
+	MLocalAddrs			local;			//user的局域网地址
+
+	MClusterPair() : user("", 0)
+	{
+		session = 0;
+		ids.id0 = 0;
+		ids.id1 = 0;
+		memset(&local, 0, sizeof(local));
+	}
+};
+
 #pragma pack(pop)
 
@@ -0,0 +1,395 @@
+#include "MCluster.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+static long long GetTick()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+int MCluster::ThreadGossipRecv()
+{
+	while (!m_stop)
+	{
+		char        buf[4096]{};
+		sockaddr_in addr{};
+		socklen_t   addr_len{ sizeof(addr) };
+		ssize_t ret = recvfrom(m_gossipSock, buf, sizeof(buf), 0, (sockaddr*)&addr, &addr_len);
+		if (ret <= 0)
+		{
+			continue;
+		}
+		int len = (int)ret;
+		CPacket pack((unsigned char*)buf, len);
+		if (len <= 0)
+		{
+			printf("%s(%d):%s packet parse error\n", __FILE__, __LINE__, __FUNCTION__);
+			continue;
+		}
+		if (pack.nCmd == 201)
+		{
+			bool changed = false;
+			m_mutex.lock();
+			changed = MergeMembers((MNodeInfo*)pack.sData.c_str(), pack.sData.size() / sizeof(MNodeInfo));
+			m_mutex.unlock();
+			if (changed && m_base && m_changeFunc)
+			{
+				(m_base->*m_changeFunc)();
+			}
+			continue;
+		}
+		if (m_base && m_dealFunc)
+		{
+			(m_base->*m_dealFunc)(pack, addr);
+		}
+	}
+	m_mutex.lock();
+	m_running = false;
+	m_condExit.notify_all();
+	m_mutex.unlock();
+	return -1;
+}
+
+int MCluster::GossipTick()
+{
+	if (m_stop)
+	{
+		return -1;
+	}
+	std::vector<MNodeInfo> vecNodes;
+	std::vector<sockaddr_in> vecTargets;
+	bool changed = false;
+	long long tick = GetTick();
+
+	m_mutex.lock();
+	m_self.heartbeat++;
+	//清理超时的节点
+	for (std::map<std::string, MMember>::iterator it = m_mapMembers.begin(); it != m_mapMembers.end();)
+	{
+		if (tick - it->second.last > NODE_TIMEOUT)
+		{
+			printf("node down:%s\n", it->first.c_str());
+			MMember& dead = m_mapDead[it->first];
+			dead.info = it->second.info;
+			dead.last = tick;
+			it = m_mapMembers.erase(it);
+			changed = true;
+		}
+		else
+		{
+			it++;
+		}
+	}
+	//别的节点也都超时删掉了，不会再有人传它的旧心跳
+	for (std::map<std::string, MMember>::iterator it = m_mapDead.begin(); it != m_mapDead.end();)
+	{
+		if (tick - it->second.last > NODE_TIMEOUT * 2)
+		{
+			it = m_mapDead.erase(it);
+		}
+		else
+		{
+			it++;
+		}
+	}
+	if (changed)
+	{
+		RebuildRing();
+	}
+	//成员表：自己放第一个
+	vecNodes.push_back(m_self);
+	for (std::map<std::string, MMember>::iterator it = m_mapMembers.begin(); it != m_mapMembers.end(); it++)
+	{
+		vecNodes.push_back(it->second.info);
+	}
+	//随机挑几个节点同步，还不认识任何节点时发给种子
+	if (m_mapMembers.size() > 0)
+	{
+		std::vector<MNodeInfo> vecAll(vecNodes.begin() + 1, vecNodes.end());
+		for (int i = 0; (i < GOSSIP_FANOUT) && (vecAll.size() > 0); i++)
+		{
+			size_t pos = (size_t)rand() % vecAll.size();
+			vecTargets.push_back(GossipAddr(vecAll.at(pos)));
+			vecAll.erase(vecAll.begin() + pos);
+		}
+	}
+	else
+	{
+		vecTargets = m_vecSeeds;
+	}
+	m_mutex.unlock();
+
+	if (changed && m_base && m_changeFunc)
+	{
+		(m_base->*m_changeFunc)();
+	}
+	CPacket pack(201, (unsigned char*)vecNodes.data(), (unsigned int)(vecNodes.size() * sizeof(MNodeInfo)));
+	for (size_t i = 0; i < vecTargets.size(); i++)
+	{
+		sendto(m_gossipSock, pack.Data(), pack.Size(), 0, (sockaddr*)&vecTargets.at(i), sizeof(sockaddr_in));
+	}
+	return 0;
+}
+
+bool MCluster::MergeMembers(const MNodeInfo* pNodes, size_t count)
+{
+	bool changed = false;
+	long long tick = GetTick();
+	for (size_t i = 0; i < count; i++)
+	{
+		std::string key = NodeKey(pNodes[i]);
+		if (key == m_selfKey)
+		{
+			continue;
+		}
+		//删掉的节点：只有它自己发来(排第一个)或者心跳比删的时候大，才算活过来了
+		//不然两个节点先后删掉它，又从对方的表里把它加回来，一直删不掉
+		std::map<std::string, MMember>::iterator dead = m_mapDead.find(key);
+		if (dead != m_mapDead.end())
+		{
+			if ((i != 0) && (pNodes[i].heartbeat <= dead->second.info.heartbeat))
+			{
+				continue;
+			}
+			m_mapDead.erase(dead);
+		}
+		std::map<std::string, MMember>::iterator find = m_mapMembers.find(key);
+		if (find == m_mapMembers.end())
+		{
+			MMember member;
+			member.info = pNodes[i];
+			member.last = tick;
+			m_mapMembers.insert(std::pair<std::string, MMember>(key, member));
+			printf("node up:%s\n", key.c_str());
+			changed = true;
+		}
+		//心跳变大才算活着，转手传来的旧心跳不刷新时间
+		else if (pNodes[i].heartbeat > find->second.info.heartbeat)
+		{
+			find->second.info = pNodes[i];
+			find->second.last = tick;
+		}
+	}
+	if (changed)
+	{
+		RebuildRing();
+	}
+	return changed;
+}
+
+void MCluster::RebuildRing()
+{
+	m_ring.clear();
+	std::vector<std::string> vecKeys;
+	vecKeys.push_back(m_selfKey);
+	for (std::map<std::string, MMember>::iterator it = m_mapMembers.begin(); it != m_mapMembers.end(); it++)
+	{
+		vecKeys.push_back(it->first);
+	}
+	for (size_t i = 0; i < vecKeys.size(); i++)
+	{
+		for (int v = 0; v < VIRTUAL_NODES; v++)
+		{
+			std::string vnode = vecKeys.at(i) + "#" + std::to_string(v);
+			m_ring[Hash(vnode.c_str(), vnode.size())] = vecKeys.at(i);
+		}
+	}
+}
+
+std::string MCluster::NodeKey(const MNodeInfo& node)
+{
+	char key[64]{};
+	snprintf(key, sizeof(key), "%.16s:%d", node.ip, node.tcpPort);
+	return key;
+}
+
+unsigned long long MCluster::Hash(const void* data, size_t len)
+{
+	//FNV-1a：虚拟节点名只差最后几个字符，高位区分不开(3个节点实测分到1438/204/358)，再打散一次
+	const unsigned char* p = (const unsigned char*)data;
+	unsigned long long h = 14695981039346656037ULL;
+	for (size_t i = 0; i < len; i++)
+	{
+		h ^= p[i];
+		h *= 1099511628211ULL;
+	}
+	return Mix(h);
+}
+
+unsigned long long MCluster::HashId(long long id)
+{
+	//id是时间戳，连续性很强，先打散
+	return Mix((unsigned long long)id);
+}
+
+unsigned long long MCluster::Mix(unsigned long long x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+sockaddr_in MCluster::GossipAddr(const MNodeInfo& node)
+{
+	sockaddr_in addr{};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr(node.ip);
+	addr.sin_port = htons(node.gossipPort);
+	return addr;
+}
+
+MCluster::MCluster(const std::string& ip, unsigned short tcpPort, unsigned short udpPort, unsigned short gossipPort)
+	: m_gossipSock(-1)
+	, m_base(NULL)
+	, m_dealFunc(NULL)
+	, m_changeFunc(NULL)
+	, m_gossipTimer(0)
+{
+	m_stop = true;
+	m_running = false;
+	memset(&m_self, 0, sizeof(m_self));
+	strncpy(m_self.ip, ip.c_str(), sizeof(m_self.ip) - 1);
+	m_self.tcpPort = tcpPort;
+	m_self.udpPort = udpPort;
+	m_self.gossipPort = gossipPort;
+	m_self.heartbeat = 0;
+	m_selfKey = NodeKey(m_self);
+	RebuildRing();
+}
+
+MCluster::~MCluster()
+{
+	Stop();
+}
+
+void MCluster::Stop()
+{
+	m_stop = true;
+	CMTimer::Global().Cancel(m_gossipTimer);
+	if (m_gossipSock != -1)
+	{
+		//shutdown叫醒阻塞在recvfrom上的收包线程，等它退出再关，不然fd被复用后它收的是别人的包
+		shutdown(m_gossipSock, SHUT_RDWR);
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if (!m_condExit.wait_for(lock, std::chrono::milliseconds(NODE_TIMEOUT), [this]() { return !m_running; }))
+		{
+			printf("%s(%d):%s gossip thread did not exit\n", __FILE__, __LINE__, __FUNCTION__);
+		}
+		lock.unlock();
+		close(m_gossipSock);
+		m_gossipSock = -1;
+	}
+}
+
+void MCluster::AddSeed(const std::string& ip, unsigned short gossipPort)
+{
+	sockaddr_in addr{};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr(ip.c_str());
+	addr.sin_port = htons(gossipPort);
+	m_vecSeeds.push_back(addr);
+}
+
+void MCluster::SetHandler(CMFuncBase* base, MC_FUNC dealFunc, MT_FUNC changeFunc)
+{
+	m_base = base;
+	m_dealFunc = dealFunc;
+	m_changeFunc = changeFunc;
+}
+
+int MCluster::Invoke(CMThreadPool& pool)
+{
+	if (m_self.gossipPort == 0)
+	{
+		return 0;
+	}
+	m_stop = false;
+	m_gossipSock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (m_gossipSock == -1)
+	{
+		printf("%s(%d):%s socket error gossip (%d) %s\n", __FILE__, __LINE__, __FUNCTION__, errno, strerror(errno));
+		return 0;
+	}
+	sockaddr_in addr = GossipAddr(m_self);
+	if (bind(m_gossipSock, (sockaddr*)&addr, sizeof(sockaddr_in)) == -1)
+	{
+		close(m_gossipSock);
+		m_gossipSock = -1;
+		printf("%s(%d):%s socket error gossip (%d) %s\n", __FILE__, __LINE__, __FUNCTION__, errno, strerror(errno));
+		return 0;
+	}
+	srand((unsigned int)(GetTick() ^ m_self.tcpPort));
+	m_running = true;
+	if (!pool.DispatchWork(CMWork(this, (MT_FUNC)&MCluster::ThreadGossipRecv), MP_NORMAL, MTAG_NET))
+	{
+		m_running = false;
+		printf("%s(%d):%s dispatch gossip thread error\n", __FILE__, __LINE__, __FUNCTION__);
+	}
+	m_gossipTimer = CMTimer::Global().Schedule(0, GOSSIP_INTERVAL, CMWork(this, (MT_FUNC)&MCluster::GossipTick), &pool);
+	return 0;
+}
+
+bool MCluster::IsLocal(long long id)
+{
+	m_mutex.lock();
+	std::map<unsigned long long, std::string>::iterator it = m_ring.lower_bound(HashId(id));
+	if (it == m_ring.end())
+	{
+		it = m_ring.begin();
+	}
+	bool isLocal = (it->second == m_selfKey);
+	m_mutex.unlock();
+	return isLocal;
+}
+
+MNodeInfo MCluster::Owner(long long id)
+{
+	MNodeInfo node = m_self;
+	m_mutex.lock();
+	std::map<unsigned long long, std::string>::iterator it = m_ring.lower_bound(HashId(id));
+	if (it == m_ring.end())
+	{
+		it = m_ring.begin();
+	}
+	std::map<std::string, MMember>::iterator find = m_mapMembers.find(it->second);
+	if (find != m_mapMembers.end())
+	{
+		node = find->second.info;
+	}
+	m_mutex.unlock();
+	return node;
+}
+
+bool MCluster::IsMember(const sockaddr_in& addr)
+{
+	bool member = false;
+	m_mutex.lock();
+	for (std::map<std::string, MMember>::iterator it = m_mapMembers.begin(); it != m_mapMembers.end(); it++)
+	{
+		sockaddr_in gossip = GossipAddr(it->second.info);
+		if ((gossip.sin_addr.s_addr == addr.sin_addr.s_addr) && (gossip.sin_port == addr.sin_port))
+		{
+			member = true;
+			break;
+		}
+	}
+	m_mutex.unlock();
+	return member;
+}
+
+int MCluster::SendTo(const MNodeInfo& node, CPacket& pack)
+{
+	sockaddr_in addr = GossipAddr(node);
+	return (int)sendto(m_gossipSock, pack.Data(), pack.Size(), 0, (sockaddr*)&addr, sizeof(sockaddr_in));
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <netinet/in.h>
+#include "Common.h"
+#include "MThread.h"
+#include "MTimer.h"
+
+typedef int (CMFuncBase::* MC_FUNC)(CPacket& pack, sockaddr_in& addr);
+
+//多个汇合服务器节点组成集群：一致性哈希划分用户id，节点之间用gossip同步成员
+class MCluster : public CMFuncBase
+{
+private:
+	enum
+	{
+		VIRTUAL_NODES		= 64,		//每个节点在哈希环上的虚拟节点数
+		GOSSIP_INTERVAL		= 1000,		//同步成员的间隔(毫秒)
+		GOSSIP_FANOUT		= 3,		//每次随机同步给几个节点
+		NODE_TIMEOUT		= 5000,		//多久没有心跳就认为节点下线(毫秒)
+	};
+	struct MMember
+	{
+		MNodeInfo		info;
+		long long		last;			//最后一次看到心跳变大的时间
+	};
+private:
+	MNodeInfo							m_self;
+	std::string							m_selfKey;
+	int									m_gossipSock;
+	std::map<std::string, MMember>		m_mapMembers;		//不含自己
+	std::map<std::string, MMember>		m_mapDead;			//超时删掉的节点(last是删掉的时间)，别人转手传来的旧心跳不再把它加回来
+	std::vector<sockaddr_in>			m_vecSeeds;
+	std::map<unsigned long long, std::string> m_ring;		//哈希环：哈希值->节点
+	std::mutex							m_mutex;
+	std::atomic<bool>					m_stop;
+	bool								m_running;			//收包线程还在跑，析构要等它退出
+	std::condition_variable				m_condExit;
+	CMFuncBase*							m_base;
+	MC_FUNC								m_dealFunc;			//非gossip的集群消息交给上层
+	MT_FUNC								m_changeFunc;		//成员变化(哈希环重建)后通知上层
+	CMTimer::TimerId					m_gossipTimer;
+private:
+	//接收其他节点的消息
+	int ThreadGossipRecv();
+	//定时把成员表同步给其他节点，清理超时节点(定时器回调)
+	int GossipTick();
+	//合并别人发来的成员表(第一个是发送者自己)，返回成员是否有变化
+	bool MergeMembers(const MNodeInfo* pNodes, size_t count);
+	//重建哈希环(调用方持锁)
+	void RebuildRing();
+	static std::string NodeKey(const MNodeInfo& node);
+	static unsigned long long Hash(const void* data, size_t len);
+	static unsigned long long HashId(long long id);
+	//64位整数打散(murmur3的收尾)
+	static unsigned long long Mix(unsigned long long x);
+	static sockaddr_in GossipAddr(const MNodeInfo& node);
+public:
+	MCluster(const std::string& ip, unsigned short tcpPort, unsigned short udpPort, unsigned short gossipPort);
+	~MCluster();
+	//种子节点：启动时先和它们同步成员
+	void AddSeed(const std::string& ip, unsigned short gossipPort);
+	//设置上层的回调
+	void SetHandler(CMFuncBase* base, MC_FUNC dealFunc, MT_FUNC changeFunc);
+	//开启(gossipPort为0时只有自己一个节点，不开线程)
+	int Invoke(CMThreadPool& pool);
+	//停止同步，等收包线程退出；之后不会再回调上层
+	void Stop();
+	//这个id是否归本节点管
+	bool IsLocal(long long id);
+	//这个id归哪个节点管
+	MNodeInfo Owner(long long id);
+	//addr是不是集群里某个节点的gossip地址(转发的配对消息只认成员发来的)
+	bool IsMember(const sockaddr_in& addr);
+	//给其他节点发消息
+	int SendTo(const MNodeInfo& node, CPacket& pack);
+	const MNodeInfo& Self() const { return m_self; }
+};
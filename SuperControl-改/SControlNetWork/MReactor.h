@@ -0,0 +1,656 @@
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <vector>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cerrno>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "MThread.h"
+#include "MTimer.h"
+
+//协程网络层：每个连接的处理逻辑顺着写(co_await AsyncRead/AsyncWrite...)，不用一个连接占一个线程
+//一个CMReactor在线程池里占一个线程跑epoll(边沿触发)，它上面的协程都在这个线程里执行，协程之间不用加锁
+//IO先直接调系统调用，EAGAIN了才挂到fd上等epoll；SleepFor走CMTimer
+
+class CMReactor;
+
+//协程的promise公共部分：结束时接着执行co_await它的协程，Spawn出去的自己销毁
+class CMCoPromiseBase
+{
+public:
+	std::coroutine_handle<>		m_continuation;
+	CMReactor*					m_reactor;			//Spawn出去的根协程才有
+	CMCoPromiseBase() : m_reactor(NULL) {}
+	struct MFinalAwait
+	{
+		bool await_ready() noexcept
+		{
+			return false;
+		}
+		template <typename P>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<P> handle) noexcept;
+		void await_resume() noexcept {}
+	};
+	std::suspend_always initial_suspend() noexcept
+	{
+		return std::suspend_always();
+	}
+	MFinalAwait final_suspend() noexcept
+	{
+		return MFinalAwait();
+	}
+	void unhandled_exception()
+	{
+		printf("%s(%d):%s coroutine exception\n", __FILE__, __LINE__, __FUNCTION__);
+		std::terminate();
+	}
+};
+
+template <typename T>
+class CMCoPromise : public CMCoPromiseBase
+{
+public:
+	T	m_value;
+	void return_value(T value)
+	{
+		m_value = std::move(value);
+	}
+	T Result()
+	{
+		return std::move(m_value);
+	}
+};
+
+template <>
+class CMCoPromise<void> : public CMCoPromiseBase
+{
+public:
+	void return_void() {}
+	void Result() {}
+};
+
+//协程：创建后不马上执行，被co_await或者交给CMReactor::Spawn时才开始
+template <typename T = void>
+class CMCo
+{
+public:
+	class promise_type : public CMCoPromise<T>
+	{
+	public:
+		CMCo get_return_object()
+		{
+			return CMCo(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+	};
+private:
+	std::coroutine_handle<promise_type>	m_handle;
+	explicit CMCo(std::coroutine_handle<promise_type> handle) : m_handle(handle) {}
+public:
+	CMCo() : m_handle(NULL) {}
+	CMCo(CMCo&& other) noexcept : m_handle(other.m_handle)
+	{
+		other.m_handle = NULL;
+	}
+	CMCo& operator=(CMCo&& other) noexcept
+	{
+		if (this != &other)
+		{
+			if (m_handle)
+			{
+				m_handle.destroy();
+			}
+			m_handle = other.m_handle;
+			other.m_handle = NULL;
+		}
+		return *this;
+	}
+	CMCo(const CMCo&) = delete;
+	CMCo& operator=(const CMCo&) = delete;
+	~CMCo()
+	{
+		if (m_handle)
+		{
+			m_handle.destroy();
+		}
+	}
+	//交出协程的所有权(Spawn用)
+	std::coroutine_handle<promise_type> Release()
+	{
+		std::coroutine_handle<promise_type> handle = m_handle;
+		m_handle = NULL;
+		return handle;
+	}
+	bool await_ready()
+	{
+		return !m_handle || m_handle.done();
+	}
+	//直接切到被等的协程，它结束时再切回来(对称转移，不占栈)
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller)
+	{
+		m_handle.promise().m_continuation = caller;
+		return m_handle;
+	}
+	T await_resume()
+	{
+		return m_handle.promise().Result();
+	}
+};
+
+//挂在fd上等待的一次IO：fd就绪时由反应器再试一次，还是EAGAIN就继续等
+class CMIoOp
+{
+public:
+	std::coroutine_handle<>		m_handle;
+	CMReactor*					m_reactor;
+	int							m_fd;
+	bool						m_write;			//等可写还是可读
+	ssize_t						m_result;
+	int							m_error;
+	CMIoOp(CMReactor* reactor, int fd, bool write)
+		: m_reactor(reactor), m_fd(fd), m_write(write), m_result(-1), m_error(0) {}
+	virtual ~CMIoOp() {}
+	virtual ssize_t Attempt() = 0;
+	//试一次，返回false表示还要等
+	bool Try()
+	{
+		while (true)
+		{
+			m_result = Attempt();
+			if (m_result >= 0)
+			{
+				m_error = 0;
+				return true;
+			}
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+			{
+				return false;
+			}
+			m_error = errno;
+			return true;
+		}
+	}
+	bool await_ready()
+	{
+		return Try();
+	}
+	void await_suspend(std::coroutine_handle<> handle);
+	//返回值和对应的系统调用一样，出错时errno有效
+	ssize_t await_resume()
+	{
+		errno = m_error;
+		return m_result;
+	}
+};
+
+class CMReadOp : public CMIoOp
+{
+private:
+	void*	m_buf;
+	size_t	m_len;
+public:
+	CMReadOp(CMReactor* reactor, int fd, void* buf, size_t len)
+		: CMIoOp(reactor, fd, false), m_buf(buf), m_len(len) {}
+	ssize_t Attempt()
+	{
+		return recv(m_fd, m_buf, m_len, 0);
+	}
+};
+
+//写完为止：只写了一部分也接着等可写
+class CMWriteOp : public CMIoOp
+{
+private:
+	const char*	m_buf;
+	size_t		m_len;
+	size_t		m_done;
+public:
+	CMWriteOp(CMReactor* reactor, int fd, const void* buf, size_t len)
+		: CMIoOp(reactor, fd, true), m_buf((const char*)buf), m_len(len), m_done(0) {}
+	ssize_t Attempt()
+	{
+		while (m_done < m_len)
+		{
+			ssize_t ret = send(m_fd, m_buf + m_done, m_len - m_done, MSG_NOSIGNAL);
+			if (ret < 0)
+			{
+				return -1;
+			}
+			m_done += (size_t)ret;
+		}
+		return (ssize_t)m_done;
+	}
+};
+
+class CMAcceptOp : public CMIoOp
+{
+private:
+	sockaddr_in*	m_addr;
+public:
+	CMAcceptOp(CMReactor* reactor, int fd, sockaddr_in* addr)
+		: CMIoOp(reactor, fd, false), m_addr(addr) {}
+	ssize_t Attempt()
+	{
+		sockaddr_in addr{};
+		socklen_t len = sizeof(addr);
+		int sock = accept4(m_fd, (sockaddr*)&addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if ((sock != -1) && (m_addr != NULL))
+		{
+			*m_addr = addr;
+		}
+		return sock;
+	}
+};
+
+class CMRecvFromOp : public CMIoOp
+{
+private:
+	void*			m_buf;
+	size_t			m_len;
+	sockaddr_in*	m_addr;
+public:
+	CMRecvFromOp(CMReactor* reactor, int fd, void* buf, size_t len, sockaddr_in* addr)
+		: CMIoOp(reactor, fd, false), m_buf(buf), m_len(len), m_addr(addr) {}
+	ssize_t Attempt()
+	{
+		sockaddr_in addr{};
+		socklen_t len = sizeof(addr);
+		ssize_t ret = recvfrom(m_fd, m_buf, m_len, 0, (sockaddr*)&addr, &len);
+		if ((ret >= 0) && (m_addr != NULL))
+		{
+			*m_addr = addr;
+		}
+		return ret;
+	}
+};
+
+//睡ms毫秒，到时间由定时器投递回反应器线程
+class CMSleepOp
+{
+private:
+	CMReactor*			m_reactor;
+	int					m_ms;
+	CMTimer::TimerId	m_timer;
+public:
+	CMSleepOp(CMReactor* reactor, int ms) : m_reactor(reactor), m_ms(ms), m_timer(0) {}
+	~CMSleepOp();
+	bool await_ready()
+	{
+		return m_ms <= 0;
+	}
+	void await_suspend(std::coroutine_handle<> handle);
+	void await_resume() {}
+};
+
+class CMReactor : public CMFuncBase
+{
+private:
+	enum
+	{
+		EVENT_COUNT		= 256,		//一次epoll_wait最多取多少个事件
+		STOP_TIMEOUT	= 1000,		//关闭时等线程退出的时间(毫秒)
+	};
+	struct MFdState
+	{
+		CMIoOp*		reader;
+		CMIoOp*		writer;
+		bool		attached;		//已经加进epoll
+	};
+	//睡眠定时器的回调经它投递：Stop时置空，之后到期的回调不再碰反应器(反应器可能已经析构)
+	struct MSleepGate
+	{
+		std::mutex	mutex;
+		CMReactor*	reactor;
+	};
+	int									m_epoll;
+	int									m_wakeFd;			//别的线程投递协程后写它，叫醒epoll_wait
+	std::vector<MFdState>				m_fds;				//fd为下标，只在反应器线程里访问
+	std::vector<std::coroutine_handle<> >	m_posted;		//别的线程投递过来等执行的协程
+	std::set<void*>						m_roots;			//Spawn出去还没结束的协程，关闭时销毁
+	std::set<CMTimer::TimerId>			m_sleeps;			//还没到期的睡眠定时器，关闭时取消
+	std::shared_ptr<MSleepGate>			m_gate;
+	std::mutex							m_mutex;
+	std::condition_variable				m_condExit;
+	std::atomic<bool>					m_run;
+	bool								m_looping;
+private:
+	void OpenGate()
+	{
+		m_gate = std::make_shared<MSleepGate>();
+		m_gate->reactor = this;
+	}
+	MFdState& State(int fd)
+	{
+		if ((size_t)fd >= m_fds.size())
+		{
+			MFdState empty = { NULL, NULL, false };
+			m_fds.resize(fd * 2 + 16, empty);
+		}
+		return m_fds[fd];
+	}
+	void Wake()
+	{
+		unsigned long long one = 1;
+		ssize_t ret = write(m_wakeFd, &one, sizeof(one));
+		(void)ret;
+	}
+	//执行投递过来的协程
+	void RunPosted()
+	{
+		std::vector<std::coroutine_handle<> > vecPosted;
+		m_mutex.lock();
+		vecPosted.swap(m_posted);
+		m_mutex.unlock();
+		for (size_t i = 0; i < vecPosted.size(); i++)
+		{
+			vecPosted.at(i).resume();
+		}
+	}
+	//挂着的IO不再等了：按出错返回，投递回来恢复(不在Close的调用者里直接切过去)
+	void Abort(CMIoOp*& op)
+	{
+		if (op == NULL)
+		{
+			return;
+		}
+		op->m_result = -1;
+		op->m_error = ECANCELED;
+		Post(op->m_handle);
+		op = NULL;
+	}
+	//fd就绪：挂着的IO再试一次，成了就恢复对应的协程
+	void Ready(CMIoOp*& op)
+	{
+		if ((op == NULL) || !op->Try())
+		{
+			return;
+		}
+		std::coroutine_handle<> handle = op->m_handle;
+		op = NULL;
+		handle.resume();
+	}
+	int ThreadLoop()
+	{
+		m_mutex.lock();
+		m_looping = true;
+		m_mutex.unlock();
+		epoll_event events[EVENT_COUNT];
+		while (m_run)
+		{
+			int count = epoll_wait(m_epoll, events, EVENT_COUNT, -1);
+			for (int i = 0; i < count; i++)
+			{
+				int fd = events[i].data.fd;
+				if (fd == m_wakeFd)
+				{
+					unsigned long long value = 0;
+					ssize_t ret = read(m_wakeFd, &value, sizeof(value));
+					(void)ret;
+					continue;
+				}
+				//出错和挂断时两边都叫醒，让它们从系统调用里拿到错误
+				unsigned int ev = events[i].events;
+				if (ev & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+				{
+					Ready(State(fd).reader);
+				}
+				if (ev & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+				{
+					Ready(State(fd).writer);
+				}
+			}
+			RunPosted();
+		}
+		//持锁通知：Stop等到以后反应器可能马上析构，解锁以后不能再碰m_condExit
+		m_mutex.lock();
+		m_looping = false;
+		m_condExit.notify_all();
+		m_mutex.unlock();
+		return -1;
+	}
+public:
+	CMReactor()
+	{
+		m_epoll = epoll_create1(EPOLL_CLOEXEC);
+		m_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if ((m_epoll == -1) || (m_wakeFd == -1))
+		{
+			printf("%s(%d):%s epoll error (%d) %s\n", __FILE__, __LINE__, __FUNCTION__, errno, strerror(errno));
+		}
+		epoll_event ev{};
+		ev.events = EPOLLIN;
+		ev.data.fd = m_wakeFd;
+		epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wakeFd, &ev);
+		m_run = false;
+		m_looping = false;
+		OpenGate();
+	}
+	~CMReactor()
+	{
+		Stop();
+		close(m_wakeFd);
+		close(m_epoll);
+	}
+	//在线程池里占一个线程跑事件循环
+	int Invoke(CMThreadPool& pool)
+	{
+		m_run = true;
+		if (!pool.DispatchWork(CMWork(this, (MT_FUNC)&CMReactor::ThreadLoop), MP_HIGH, MTAG_NET))
+		{
+			m_run = false;
+			return 0;
+		}
+		return 1;
+	}
+	//停掉事件循环，销毁还没结束的协程(它们的局部变量正常析构)
+	void Stop()
+	{
+		m_run = false;
+		Wake();
+		//先关睡眠定时器：正在投递的回调等它投完，之后到期的不再投递，还没到期的取消掉
+		m_gate->mutex.lock();
+		m_gate->reactor = NULL;
+		m_gate->mutex.unlock();
+		std::set<CMTimer::TimerId> sleeps;
+		m_mutex.lock();
+		sleeps.swap(m_sleeps);
+		m_mutex.unlock();
+		for (std::set<CMTimer::TimerId>::iterator it = sleeps.begin(); it != sleeps.end(); it++)
+		{
+			CMTimer::Global().Cancel(*it);
+		}
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if (!m_condExit.wait_for(lock, std::chrono::milliseconds(STOP_TIMEOUT), [this]() { return !m_looping; }))
+		{
+			printf("%s(%d):%s reactor stop timeout\n", __FILE__, __LINE__, __FUNCTION__);
+			return;
+		}
+		std::set<void*> roots;
+		roots.swap(m_roots);
+		m_posted.clear();
+		lock.unlock();
+		for (std::set<void*>::iterator it = roots.begin(); it != roots.end(); it++)
+		{
+			std::coroutine_handle<>::from_address(*it).destroy();
+		}
+		m_fds.clear();
+		//可以再Invoke
+		OpenGate();
+	}
+	//启动一个独立的协程(比如每个连接一个)，在反应器线程里开始执行，结束后自己销毁；哪个线程都可以调
+	template <typename T>
+	void Spawn(CMCo<T>&& co)
+	{
+		std::coroutine_handle<typename CMCo<T>::promise_type> handle = co.Release();
+		if (!handle)
+		{
+			return;
+		}
+		handle.promise().m_reactor = this;
+		m_mutex.lock();
+		m_roots.insert(handle.address());
+		m_mutex.unlock();
+		Post(handle);
+	}
+	//把协程交给反应器线程恢复执行；哪个线程都可以调
+	void Post(std::coroutine_handle<> handle)
+	{
+		m_mutex.lock();
+		m_posted.push_back(handle);
+		m_mutex.unlock();
+		Wake();
+	}
+	//Spawn出去的协程结束了(在反应器线程里)
+	void Forget(void* address)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_roots.erase(address);
+	}
+	//让op等fd就绪(反应器线程里调)，第一次用到fd时加进epoll，可读可写都关心
+	void Wait(CMIoOp* op)
+	{
+		MFdState& state = State(op->m_fd);
+		if (!state.attached)
+		{
+			epoll_event ev{};
+			ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+			ev.data.fd = op->m_fd;
+			if ((epoll_ctl(m_epoll, EPOLL_CTL_ADD, op->m_fd, &ev) == -1) && (errno != EEXIST))
+			{
+				//加不进去(比如fd已经关了)：按出错返回，不让协程挂死
+				op->m_result = -1;
+				op->m_error = errno;
+				Post(op->m_handle);
+				return;
+			}
+			state.attached = true;
+		}
+		if (op->m_write)
+		{
+			state.writer = op;
+		}
+		else
+		{
+			state.reader = op;
+		}
+	}
+	//关闭反应器上的fd(反应器线程里调)：必须用它关，fd号会被复用
+	//别的协程还挂在这个fd上等IO的，按ECANCELED返回，不然它们永远醒不过来
+	void Close(int fd)
+	{
+		if ((fd >= 0) && ((size_t)fd < m_fds.size()))
+		{
+			MFdState& state = m_fds[fd];
+			if (state.attached)
+			{
+				epoll_ctl(m_epoll, EPOLL_CTL_DEL, fd, NULL);
+			}
+			Abort(state.reader);
+			Abort(state.writer);
+			state.attached = false;
+		}
+		close(fd);
+	}
+	//以下都在反应器的协程里co_await，返回值同recv/send/accept/recvfrom
+	CMReadOp AsyncRead(int fd, void* buf, size_t len)
+	{
+		return CMReadOp(this, fd, buf, len);
+	}
+	//发完len个字节才返回
+	CMWriteOp AsyncWrite(int fd, const void* buf, size_t len)
+	{
+		return CMWriteOp(this, fd, buf, len);
+	}
+	//返回的新连接已经是非阻塞的
+	CMAcceptOp AsyncAccept(int fd, sockaddr_in* addr = NULL)
+	{
+		return CMAcceptOp(this, fd, addr);
+	}
+	CMRecvFromOp AsyncRecvFrom(int fd, void* buf, size_t len, sockaddr_in* addr = NULL)
+	{
+		return CMRecvFromOp(this, fd, buf, len, addr);
+	}
+	CMSleepOp SleepFor(int ms)
+	{
+		return CMSleepOp(this, ms);
+	}
+	//ms毫秒后把协程投递回来，登记下来关闭时取消(CMSleepOp用)
+	CMTimer::TimerId SleepTimer(int ms, std::coroutine_handle<> handle)
+	{
+		std::shared_ptr<MSleepGate> gate = m_gate;
+		CMTimer::TimerId id = CMTimer::Global().After(ms, CMTask([gate, handle]() {
+			std::lock_guard<std::mutex> lock(gate->mutex);
+			if (gate->reactor != NULL)
+			{
+				gate->reactor->Post(handle);
+			}
+		}));
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_sleeps.insert(id);
+		return id;
+	}
+	void CancelSleep(CMTimer::TimerId id)
+	{
+		CMTimer::Global().Cancel(id);
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_sleeps.erase(id);
+	}
+	//交给反应器的套接字要设成非阻塞
+	static bool SetNonBlock(int fd)
+	{
+		int flags = fcntl(fd, F_GETFL);
+		return (flags != -1) && (fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1);
+	}
+};
+
+template <typename P>
+inline std::coroutine_handle<> CMCoPromiseBase::MFinalAwait::await_suspend(std::coroutine_handle<P> handle) noexcept
+{
+	CMCoPromiseBase& promise = handle.promise();
+	if (promise.m_continuation)
+	{
+		return promise.m_continuation;
+	}
+	if (promise.m_reactor != NULL)
+	{
+		promise.m_reactor->Forget(handle.address());
+		handle.destroy();
+	}
+	return std::noop_coroutine();
+}
+
+inline void CMIoOp::await_suspend(std::coroutine_handle<> handle)
+{
+	m_handle = handle;
+	m_reactor->Wait(this);
+}
+
+inline CMSleepOp::~CMSleepOp()
+{
+	//睡醒了或者协程在睡的时候被销毁(反应器关闭)：注销定时器，没到期的不要再投递
+	if (m_timer != 0)
+	{
+		m_reactor->CancelSleep(m_timer);
+	}
+}
+
+inline void CMSleepOp::await_suspend(std::coroutine_handle<> handle)
+{
+	m_timer = m_reactor->SleepTimer(m_ms, handle);
+}
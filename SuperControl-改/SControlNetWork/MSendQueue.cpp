@@ -0,0 +1,229 @@
+#include "MSendQueue.h"
+#include <cstdio>
+#include <cerrno>
+#include <vector>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+int MSendQueue::ThreadSend()
+{
+	while (!m_stop)
+	{
+		//只关心有积压的连接
+		std::vector<pollfd> vecFds;
+		pollfd wakeFd{ m_wakePipe[0], POLLIN, 0 };
+		vecFds.push_back(wakeFd);
+		m_mutex.lock();
+		for (std::map<int, MOutQueue>::iterator it = m_mapQueues.begin(); it != m_mapQueues.end(); it++)
+		{
+			if (it->second.packs.size() > 0)
+			{
+				pollfd fd{ it->first, POLLOUT, 0 };
+				vecFds.push_back(fd);
+			}
+		}
+		m_mutex.unlock();
+
+		int ret = poll(vecFds.data(), vecFds.size(), POLL_TIMEOUT);
+		if (ret <= 0)
+		{
+			continue;
+		}
+		//清空唤醒管道
+		if (vecFds.at(0).revents & POLLIN)
+		{
+			char buf[64];
+			while (read(m_wakePipe[0], buf, sizeof(buf)) > 0);
+		}
+		m_mutex.lock();
+		for (size_t i = 1; i < vecFds.size(); i++)
+		{
+			if (vecFds.at(i).revents == 0)
+			{
+				continue;
+			}
+			//poll期间连接可能已经被Remove了
+			std::map<int, MOutQueue>::iterator it = m_mapQueues.find(vecFds.at(i).fd);
+			if (it == m_mapQueues.end())
+			{
+				continue;
+			}
+			if (!Flush(it->first, it->second))
+			{
+				//出错了：丢掉积压，断开后由接收线程清理
+				shutdown(it->first, SHUT_RDWR);
+				m_mapQueues.erase(it);
+			}
+		}
+		m_mutex.unlock();
+	}
+	m_mutex.lock();
+	m_running = false;
+	m_condExit.notify_all();
+	m_mutex.unlock();
+	return -1;
+}
+
+bool MSendQueue::Flush(int sock, MOutQueue& queue)
+{
+	while (queue.packs.size() > 0)
+	{
+		//把队头的若干个包合并成一次发送
+		iovec iov[BATCH_COUNT];
+		size_t count = 0;
+		for (std::deque<MOutPack>::iterator it = queue.packs.begin(); (it != queue.packs.end()) && (count < BATCH_COUNT); it++)
+		{
+			size_t skip = (count == 0) ? queue.offset : 0;
+			iov[count].iov_base = (void*)(it->data.c_str() + skip);
+			iov[count].iov_len = it->data.size() - skip;
+			count++;
+		}
+		msghdr msg{};
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+		ssize_t ret = sendmsg(sock, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (ret < 0)
+		{
+			return (errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR);
+		}
+		//发出去多少就从队头去掉多少
+		size_t sent = (size_t)ret;
+		queue.bytes -= sent;
+		while ((sent > 0) && (queue.packs.size() > 0))
+		{
+			size_t left = queue.packs.front().data.size() - queue.offset;
+			if (sent < left)
+			{
+				queue.offset += sent;
+				return true;
+			}
+			sent -= left;
+			queue.offset = 0;
+			queue.packs.pop_front();
+		}
+	}
+	return true;
+}
+
+void MSendQueue::Wake()
+{
+	char c = 0;
+	ssize_t ret = write(m_wakePipe[1], &c, 1);
+	(void)ret;
+}
+
+MSendQueue::MSendQueue()
+{
+	m_stop = true;
+	m_running = false;
+	m_wakePipe[0] = -1;
+	m_wakePipe[1] = -1;
+}
+
+MSendQueue::~MSendQueue()
+{
+	//叫醒发送线程，等它退出再关管道，不然它醒来时碰的是已经析构的成员
+	m_stop = true;
+	if (m_wakePipe[0] != -1)
+	{
+		Wake();
+	}
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if (!m_condExit.wait_for(lock, std::chrono::milliseconds(POLL_TIMEOUT * 2), [this]() { return !m_running; }))
+	{
+		printf("%s(%d):%s send thread did not exit\n", __FILE__, __LINE__, __FUNCTION__);
+	}
+	lock.unlock();
+	if (m_wakePipe[0] != -1)
+	{
+		close(m_wakePipe[0]);
+		close(m_wakePipe[1]);
+	}
+}
+
+int MSendQueue::Invoke(CMThreadPool& pool)
+{
+	if (pipe(m_wakePipe) == -1)
+	{
+		printf("%s(%d):%s pipe error (%d) %s\n", __FILE__, __LINE__, __FUNCTION__, errno, strerror(errno));
+		return 0;
+	}
+	//管道满了也不要阻塞，已经有没读的字节就足够叫醒了
+	fcntl(m_wakePipe[0], F_SETFL, fcntl(m_wakePipe[0], F_GETFL) | O_NONBLOCK);
+	fcntl(m_wakePipe[1], F_SETFL, fcntl(m_wakePipe[1], F_GETFL) | O_NONBLOCK);
+	m_stop = false;
+	m_running = true;
+	if (!pool.DispatchWork(CMWork(this, (MT_FUNC)&MSendQueue::ThreadSend), MP_NORMAL, MTAG_NET))
+	{
+		m_running = false;
+		printf("%s(%d):%s dispatch send thread error\n", __FILE__, __LINE__, __FUNCTION__);
+		return 0;
+	}
+	return 1;
+}
+
+bool MSendQueue::Post(int sock, CPacket& pack)
+{
+	MOutPack outPack;
+	outPack.cmd = pack.nCmd;
+	outPack.data.assign((char*)pack.Data(), pack.Size());
+
+	m_mutex.lock();
+	//没登记的(已经Remove，或者发送出错被删掉的)不再建队列，不然fd复用后新连接会收到旧的包
+	std::map<int, MOutQueue>::iterator find = m_mapQueues.find(sock);
+	if (find == m_mapQueues.end())
+	{
+		m_mutex.unlock();
+		return false;
+	}
+	MOutQueue& queue = find->second;
+	//积压多了，还没开始发的旧地址列表没必要再发，换成最新的
+	if ((queue.bytes > LOW_WATER) && (outPack.cmd == 102))
+	{
+		for (std::deque<MOutPack>::iterator it = queue.packs.begin(); it != queue.packs.end();)
+		{
+			bool sending = (it == queue.packs.begin()) && (queue.offset > 0);
+			if ((it->cmd == 102) && !sending)
+			{
+				queue.bytes -= it->data.size();
+				it = queue.packs.erase(it);
+			}
+			else
+			{
+				it++;
+			}
+		}
+	}
+	//还是太多：慢用户，断开
+	if (queue.bytes + outPack.data.size() > HIGH_WATER)
+	{
+		printf("slow consumer sock:%d pending:%zu, disconnect\n", sock, queue.bytes);
+		m_mapQueues.erase(find);
+		m_mutex.unlock();
+		shutdown(sock, SHUT_RDWR);
+		return false;
+	}
+	queue.bytes += outPack.data.size();
+	queue.packs.push_back(outPack);
+	m_mutex.unlock();
+	Wake();
+	return true;
+}
+
+void MSendQueue::Add(int sock)
+{
+	m_mutex.lock();
+	m_mapQueues[sock] = MOutQueue();
+	m_mutex.unlock();
+}
+
+void MSendQueue::Remove(int sock)
+{
+	m_mutex.lock();
+	m_mapQueues.erase(sock);
+	m_mutex.unlock();
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <string>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include "Common.h"
+#include "MThread.h"
+
+//TCP发送队列：每个连接一个有上限的队列，由一个发送线程统一用poll+sendmsg批量发出
+//调用方只入队不阻塞，一个慢用户不会卡住给其他人的通知
+class MSendQueue : public CMFuncBase
+{
+private:
+	enum
+	{
+		LOW_WATER		= 64 * 1024,	//积压超过这个数，新的地址列表(102)替换掉还没发的旧列表
+		HIGH_WATER		= 256 * 1024,	//积压超过这个数，认为对方太慢，断开
+		BATCH_COUNT		= 64,			//一次sendmsg最多合并几个包
+		POLL_TIMEOUT	= 1000,			//poll超时(毫秒)
+	};
+	struct MOutPack
+	{
+		unsigned short		cmd;
+		std::string			data;
+	};
+	struct MOutQueue
+	{
+		std::deque<MOutPack>	packs;
+		size_t					offset;		//队头的包已经发出去的字节数
+		size_t					bytes;		//积压的字节数
+		MOutQueue() : offset(0), bytes(0) {}
+	};
+private:
+	std::map<int, MOutQueue>	m_mapQueues;
+	std::mutex					m_mutex;
+	std::atomic<bool>			m_stop;
+	bool						m_running;			//发送线程还在跑，析构要等它退出
+	std::condition_variable		m_condExit;
+	int							m_wakePipe[2];		//入队后写一个字节，叫醒发送线程
+private:
+	int ThreadSend();
+	//尽量多地把队列里的数据发出去(调用方持锁)，返回false表示连接出错
+	bool Flush(int sock, MOutQueue& queue);
+	void Wake();
+public:
+	MSendQueue();
+	~MSendQueue();
+	int Invoke(CMThreadPool& pool);
+	//接入连接后登记，只有登记过的连接能入队
+	void Add(int sock);
+	//把包放进sock的发送队列，返回false表示没登记(已经断开)或积压太多，连接已被断开
+	bool Post(int sock, CPacket& pack);
+	//连接关闭前调用，丢掉还没发的数据；之后这个fd被新连接复用也收不到旧的包
+	void Remove(int sock);
+};
@@ -4,7 +4,23 @@
 #include <atomic>
 #include <vector>
 #include <mutex>
+#include <deque>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <new>
+#include <cstddef>
+#include <utility>
+#include <type_traits>
 #include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
 
 class CMFuncBase {};
 typedef int (CMFuncBase::* MT_FUNC)();
@@ -42,12 +58,370 @@ public:
 	}
 };
 
+//小对象优化的任务：放得下的可调用对象(lambda、CMWork)直接存在对象里，不用new
+//可调用对象返回int时沿用CMWork的约定(返回0表示还要再执行)，返回其他类型执行一次就结束
+class CMTask
+{
+private:
+	enum
+	{
+		INLINE_SIZE = 64,
+	};
+	struct Ops
+	{
+		int  (*invoke)(void* obj);
+		void (*move)(void* dst, void* src);		//只用于内部存储
+		void (*destroy)(void* obj);
+	};
+	template <typename R>
+	struct Ret
+	{
+		template <typename F>
+		static int Call(F& func)
+		{
+			func();
+			return -1;
+		}
+	};
+	template <typename F>
+	static int Invoke(void* obj)
+	{
+		F& func = *(F*)obj;
+		return Ret<decltype(func())>::Call(func);
+	}
+	template <typename F>
+	static void Move(void* dst, void* src)
+	{
+		new (dst) F(std::move(*(F*)src));
+		((F*)src)->~F();
+	}
+	template <typename F>
+	static void DestroyInline(void* obj)
+	{
+		((F*)obj)->~F();
+	}
+	template <typename F>
+	static void DestroyHeap(void* obj)
+	{
+		delete (F*)obj;
+	}
+	template <typename F>
+	static const Ops* InlineOps()
+	{
+		static const Ops ops = { &Invoke<F>, &Move<F>, &DestroyInline<F> };
+		return &ops;
+	}
+	template <typename F>
+	static const Ops* HeapOps()
+	{
+		static const Ops ops = { &Invoke<F>, NULL, &DestroyHeap<F> };
+		return &ops;
+	}
+	alignas(std::max_align_t) unsigned char m_buf[INLINE_SIZE];
+	void*		m_heap;			//放不下时才在堆上
+	const Ops*	m_ops;
+	void* Object()
+	{
+		return (m_heap != NULL) ? m_heap : (void*)m_buf;
+	}
+	void Reset()
+	{
+		if (m_ops != NULL)
+		{
+			m_ops->destroy(Object());
+		}
+		m_ops = NULL;
+		m_heap = NULL;
+	}
+	void MoveFrom(CMTask& other)
+	{
+		m_ops = other.m_ops;
+		m_heap = other.m_heap;
+		if ((m_ops != NULL) && (m_heap == NULL))
+		{
+			m_ops->move(m_buf, other.m_buf);
+		}
+		other.m_ops = NULL;
+		other.m_heap = NULL;
+	}
+	//放得下的(移动不抛异常)存在m_buf里，放不下的new；编译期选，放不下的类型不会生成放到m_buf里的代码
+	template <typename Fn, typename F>
+	void Store(F&& func, std::true_type)
+	{
+		new (m_buf) Fn(std::forward<F>(func));
+		m_ops = InlineOps<Fn>();
+	}
+	template <typename Fn, typename F>
+	void Store(F&& func, std::false_type)
+	{
+		m_heap = new Fn(std::forward<F>(func));
+		m_ops = HeapOps<Fn>();
+	}
+public:
+	CMTask() : m_heap(NULL), m_ops(NULL)
+	{
+	}
+	template <typename F, typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, CMTask>::value>::type>
+	CMTask(F&& func) : m_heap(NULL), m_ops(NULL)
+	{
+		typedef typename std::decay<F>::type Fn;
+		Store<Fn>(std::forward<F>(func), std::integral_constant<bool, (sizeof(Fn) <= INLINE_SIZE) && (alignof(Fn) <= alignof(std::max_align_t))
+			&& std::is_nothrow_move_constructible<Fn>::value>());
+	}
+	CMTask(CMTask&& other) : m_heap(NULL), m_ops(NULL)
+	{
+		MoveFrom(other);
+	}
+	CMTask& operator=(CMTask&& other)
+	{
+		if (this != &other)
+		{
+			Reset();
+			MoveFrom(other);
+		}
+		return *this;
+	}
+	CMTask(const CMTask&) = delete;
+	CMTask& operator=(const CMTask&) = delete;
+	~CMTask()
+	{
+		Reset();
+	}
+	bool IsValid() const
+	{
+		return m_ops != NULL;
+	}
+	int operator()()
+	{
+		if (m_ops == NULL)
+		{
+			return -1;
+		}
+		return m_ops->invoke(Object());
+	}
+};
+
+template <>
+struct CMTask::Ret<int>
+{
+	template <typename F>
+	static int Call(F& func)
+	{
+		return func();
+	}
+};
+
+//没有返回值的任务，future里放这个
+struct CMVoid {};
+
+template <typename T>
+class CMPromise;
+template <typename T>
+class CMFuture;
+
+//把可调用对象的结果放进promise，void结果用CMVoid代替
+template <typename R>
+struct CMResult
+{
+	typedef R type;
+	template <typename F>
+	static void Call(CMPromise<R>& promise, F& func)
+	{
+		promise.SetValue(func());
+	}
+	template <typename F, typename A>
+	static void Call(CMPromise<R>& promise, F& func, A& arg)
+	{
+		promise.SetValue(func(arg));
+	}
+};
+
+template <>
+struct CMResult<void>
+{
+	typedef CMVoid type;
+	template <typename P, typename F>
+	static void Call(P& promise, F& func)
+	{
+		func();
+		promise.SetValue(CMVoid());
+	}
+	template <typename P, typename F, typename A>
+	static void Call(P& promise, F& func, A& arg)
+	{
+		func(arg);
+		promise.SetValue(CMVoid());
+	}
+};
+
+//future/promise共享的状态
+template <typename T>
+struct CMFutureState
+{
+	std::mutex				mutex;
+	std::condition_variable	cond;
+	bool					ready;
+	bool					broken;		//promise都没了也没设置结果(任务被线程池丢掉)，永远不会有结果
+	T						value;
+	CMTask					cont;		//结果出来后接着执行(只能接一个)
+	CMFutureState() : ready(false), broken(false), value() {}
+};
+
+template <typename T>
+class CMPromise
+{
+private:
+	friend class CMFuture<T>;
+	//promise的所有拷贝共用一个，最后一个拷贝没了还没有结果就把状态标成broken
+	struct MOwner
+	{
+		std::shared_ptr<CMFutureState<T>>	state;
+		explicit MOwner(const std::shared_ptr<CMFutureState<T>>& s) : state(s)
+		{
+		}
+		~MOwner()
+		{
+			Break(state);
+		}
+	};
+	std::shared_ptr<CMFutureState<T>>	m_state;
+	std::shared_ptr<MOwner>				m_owner;
+	//挂上后续：还没结果就存起来，已经有结果就马上执行，broken了就扔掉(后续里的promise跟着broken)
+	static void Attach(const std::shared_ptr<CMFutureState<T>>& state, CMTask&& cont)
+	{
+		std::unique_lock<std::mutex> lock(state->mutex);
+		if (state->broken)
+		{
+			lock.unlock();
+			cont = CMTask();
+			return;
+		}
+		if (!state->ready)
+		{
+			state->cont = std::move(cont);
+			return;
+		}
+		lock.unlock();
+		cont();
+	}
+	//叫醒等结果的线程；挂着的后续不执行，在锁外析构
+	static void Break(const std::shared_ptr<CMFutureState<T>>& state)
+	{
+		CMTask cont;
+		{
+			std::lock_guard<std::mutex> lock(state->mutex);
+			if (state->ready || state->broken)
+			{
+				return;
+			}
+			state->broken = true;
+			cont = std::move(state->cont);
+		}
+		state->cond.notify_all();
+	}
+public:
+	CMPromise() : m_state(std::make_shared<CMFutureState<T>>())
+	{
+		m_owner = std::make_shared<MOwner>(m_state);
+	}
+	CMFuture<T> GetFuture()
+	{
+		return CMFuture<T>(m_state);
+	}
+	void SetValue(T value)
+	{
+		CMTask cont;
+		{
+			std::lock_guard<std::mutex> lock(m_state->mutex);
+			if (m_state->ready)
+			{
+				return;
+			}
+			m_state->value = std::move(value);
+			m_state->ready = true;
+			cont = std::move(m_state->cont);
+		}
+		m_state->cond.notify_all();
+		cont();
+	}
+};
+
+//future：结果出来以后用Then接着做下一步，不用阻塞线程等
+template <typename T>
+class CMFuture
+{
+private:
+	friend class CMPromise<T>;
+	std::shared_ptr<CMFutureState<T>>	m_state;
+	explicit CMFuture(const std::shared_ptr<CMFutureState<T>>& state) : m_state(state)
+	{
+	}
+public:
+	CMFuture()
+	{
+	}
+	//false表示任务没有提交成功，永远不会有结果
+	bool IsValid() const
+	{
+		return m_state != NULL;
+	}
+	//有结果了或者broken了(不用再等了)
+	bool IsReady() const
+	{
+		if (m_state == NULL)
+		{
+			return false;
+		}
+		std::lock_guard<std::mutex> lock(m_state->mutex);
+		return m_state->ready || m_state->broken;
+	}
+	//任务没执行就被丢掉了(线程池关闭)，Get拿到的是默认值
+	bool IsBroken() const
+	{
+		if (m_state == NULL)
+		{
+			return false;
+		}
+		std::lock_guard<std::mutex> lock(m_state->mutex);
+		return m_state->broken;
+	}
+	//阻塞等结果；broken了马上返回默认值，用IsBroken区分
+	T& Get()
+	{
+		std::unique_lock<std::mutex> lock(m_state->mutex);
+		m_state->cond.wait(lock, [this]() { return m_state->ready || m_state->broken; });
+		return m_state->value;
+	}
+	//结果出来后在设置结果的线程上执行func(value)，已经有结果就马上在当前线程执行
+	//这一步broken了，返回的future也broken，func不执行
+	template <typename F>
+	CMFuture<typename CMResult<decltype(std::declval<F&>()(std::declval<T&>()))>::type> Then(F func)
+	{
+		typedef decltype(func(std::declval<T&>())) R;
+		CMPromise<typename CMResult<R>::type> next;
+		CMFuture<typename CMResult<R>::type> future = next.GetFuture();
+		//后续存在状态里，不能再持有状态，不然没有结果的链谁也释放不了
+		std::weak_ptr<CMFutureState<T>> weak = m_state;
+		CMPromise<T>::Attach(m_state, CMTask([weak, next, func]() mutable {
+			std::shared_ptr<CMFutureState<T>> state = weak.lock();
+			if (state != NULL)
+			{
+				CMResult<R>::Call(next, func, state->value);
+			}
+		}));
+		return future;
+	}
+};
+
 class CMThread
 {
 private:
-	std::atomic<CMWork*> m_work;
+	CMTask				 m_work;
+	std::atomic<bool>	 m_hasWork;
 	pthread_t            m_thread;
 	bool				 m_run;
+	std::mutex			 m_mutex;
+	std::condition_variable m_cond;		//有任务了/要关闭了
 	static void* ThreadEntry(void* arg)
 	{
 		CMThread* thiz = (CMThread*)arg;
@@ -59,22 +433,26 @@ private:
 	{
 		while (m_run)
 		{
-			while (m_work == NULL)
 			{
-				usleep(10000);
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_cond.wait(lock, [this]() { return m_hasWork || !m_run; });
 			}
-			int ret = (*m_work)();
+			if (!m_hasWork)
+			{
+				break;
+			}
+			int ret = m_work();
 			if (ret != 0)
 			{
-				delete m_work;
-				m_work = NULL;
+				m_work = CMTask();
+				m_hasWork = false;
 			}
 		}
 	}
 public:
 	CMThread()
 	{
-		m_work = NULL;
+		m_hasWork = false;
 		m_thread = -1;
 		m_run = true;
 	}
@@ -85,11 +463,11 @@ public:
 	
 	void Work(const CMWork& work)
 	{
-		if (m_work != NULL)
-		{
-			delete m_work;
-		}
-		m_work = new CMWork(work);
+		m_mutex.lock();
+		m_work = CMTask(work);
+		m_hasWork = true;
+		m_mutex.unlock();
+		m_cond.notify_one();
 	}
 	bool Start()
 	{
@@ -107,7 +485,10 @@ public:
 		{
 			return true;
 		}
+		m_mutex.lock();
 		m_run = false;
+		m_mutex.unlock();
+		m_cond.notify_one();
 		void* thret;
 		int ret = pthread_join(m_thread, &thret);
 		if (ret == 0)
@@ -118,7 +499,7 @@ public:
 	}
 	bool IsFree()
 	{
-		if (m_run && (m_work == NULL))
+		if (m_run && !m_hasWork)
 		{
 			return true;
 		}
@@ -126,80 +507,842 @@ public:
 	}
 };
 
+//执行域：同一类工作的线程归到一起，可以绑到指定的CPU上，互相不抢缓存
+//线程带上名字(io-0、capture-1...)，调试器和性能分析器里能直接认出来
+enum MDomain
+{
+	MD_DEFAULT,		//不绑定
+	MD_IO,			//网络收发、IOCP分发(延迟敏感)
+	MD_CAPTURE,		//截屏
+	MD_ENCODE,		//图像编码
+	MD_BULK,		//命令处理、文件传输等大块数据
+	MD_COUNT,
+};
+
+class CMDomain
+{
+private:
+	struct MDomainInfo
+	{
+		const char*			name;
+		unsigned long long	cpuMask;		//0表示不绑定
+		int					priority;		//大于0提高优先级(只在Windows上生效，Linux要权限)
+	};
+	struct MDomainTable
+	{
+		MDomainInfo			infos[MD_COUNT];
+		bool				numaLocal;		//缓冲区在当前线程所在的NUMA节点上分配
+		std::mutex			mutex;
+		MDomainTable()
+		{
+			MDomainInfo defaults[MD_COUNT] = {
+				{ "pool", 0, 0 },
+				{ "io", 0, 1 },
+				{ "capture", 0, 0 },
+				{ "encode", 0, 0 },
+				{ "bulk", 0, 0 },
+			};
+			for (int i = 0; i < MD_COUNT; i++)
+			{
+				infos[i] = defaults[i];
+			}
+			numaLocal = false;
+			//环境变量配置，例如 SCONTROL_AFFINITY=io=0-1;capture=2;encode=3-5;bulk=6,7
+			const char* spec = getenv("SCONTROL_AFFINITY");
+			if (spec != NULL)
+			{
+				Parse(spec);
+			}
+			const char* numa = getenv("SCONTROL_NUMA");
+			numaLocal = (numa != NULL) && (atoi(numa) != 0);
+		}
+		//"域=CPU列表;域=CPU列表"，CPU列表用逗号分隔，可以写范围a-b
+		bool Parse(const char* spec)
+		{
+			bool isOk = true;
+			std::string str(spec);
+			size_t pos = 0;
+			while (pos < str.size())
+			{
+				size_t end = str.find(';', pos);
+				if (end == std::string::npos)
+				{
+					end = str.size();
+				}
+				std::string item = str.substr(pos, end - pos);
+				pos = end + 1;
+				size_t eq = item.find('=');
+				if (eq == std::string::npos)
+				{
+					continue;
+				}
+				std::string name = item.substr(0, eq);
+				int domain = -1;
+				for (int i = 0; i < MD_COUNT; i++)
+				{
+					if (name == infos[i].name)
+					{
+						domain = i;
+					}
+				}
+				if (domain < 0)
+				{
+					printf("unknown domain:%s\n", name.c_str());
+					isOk = false;
+					continue;
+				}
+				unsigned long long mask = 0;
+				const char* p = item.c_str() + eq + 1;
+				while (*p != '\0')
+				{
+					char* next = NULL;
+					long first = strtol(p, &next, 10);
+					long last = first;
+					if (next == p)
+					{
+						break;
+					}
+					if (*next == '-')
+					{
+						p = next + 1;
+						last = strtol(p, &next, 10);
+					}
+					for (long cpu = first; (cpu <= last) && (cpu < 64); cpu++)
+					{
+						if (cpu >= 0)
+						{
+							mask |= 1ULL << cpu;
+						}
+					}
+					p = (*next == ',') ? next + 1 : next;
+				}
+				infos[domain].cpuMask = mask;
+			}
+			return isOk;
+		}
+	};
+	static MDomainTable& Table()
+	{
+		static MDomainTable table;
+		return table;
+	}
+public:
+	static const char* Name(MDomain domain)
+	{
+		return Table().infos[domain].name;
+	}
+	//程序里直接配置，格式同环境变量SCONTROL_AFFINITY，要在线程池Invoke之前调用
+	static bool Configure(const char* spec)
+	{
+		MDomainTable& table = Table();
+		std::lock_guard<std::mutex> lock(table.mutex);
+		return table.Parse(spec);
+	}
+	static void SetAffinity(MDomain domain, unsigned long long cpuMask)
+	{
+		MDomainTable& table = Table();
+		std::lock_guard<std::mutex> lock(table.mutex);
+		table.infos[domain].cpuMask = cpuMask;
+	}
+	static void SetNumaLocal(bool numaLocal)
+	{
+		Table().numaLocal = numaLocal;
+	}
+	//当前线程进入执行域：改名字、绑CPU、调优先级
+	static void Enter(MDomain domain, int index)
+	{
+		MDomainTable& table = Table();
+		table.mutex.lock();
+		MDomainInfo info = table.infos[domain];
+		table.mutex.unlock();
+		char name[16]{};
+		snprintf(name, sizeof(name), "%s-%d", info.name, index);
+#ifdef _WIN32
+		//SetThreadDescription在Win10 1607以后才有，动态取
+		typedef HRESULT(WINAPI* SETDESC)(HANDLE, PCWSTR);
+		static SETDESC setDesc = (SETDESC)GetProcAddress(GetModuleHandleW(L"kernel32.dll"), "SetThreadDescription");
+		if (setDesc != NULL)
+		{
+			wchar_t wname[16]{};
+			for (int i = 0; (i < 15) && (name[i] != '\0'); i++)
+			{
+				wname[i] = (wchar_t)name[i];
+			}
+			setDesc(GetCurrentThread(), wname);
+		}
+		if (info.cpuMask != 0)
+		{
+			if (SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)info.cpuMask) == 0)
+			{
+				printf("%s(%d):%s affinity error %s (%d)\n", __FILE__, __LINE__, __FUNCTION__, name, GetLastError());
+			}
+		}
+		if (info.priority > 0)
+		{
+			SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_ABOVE_NORMAL);
+		}
+#else
+		pthread_setname_np(pthread_self(), name);
+		if (info.cpuMask != 0)
+		{
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			for (int cpu = 0; cpu < 64; cpu++)
+			{
+				if (info.cpuMask & (1ULL << cpu))
+				{
+					CPU_SET(cpu, &set);
+				}
+			}
+			int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+			if (ret != 0)
+			{
+				printf("%s(%d):%s affinity error %s (%d) %s\n", __FILE__, __LINE__, __FUNCTION__, name, ret, strerror(ret));
+			}
+		}
+#endif
+	}
+	//按页分配缓冲区；开了SCONTROL_NUMA时放在当前线程所在的NUMA节点上(线程绑了CPU才有意义)
+	static void* AllocLocal(size_t size)
+	{
+#ifdef _WIN32
+		if (Table().numaLocal)
+		{
+			UCHAR node = 0;
+			if (GetNumaProcessorNode((UCHAR)GetCurrentProcessorNumber(), &node))
+			{
+				return VirtualAllocExNuma(GetCurrentProcess(), NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, node);
+			}
+		}
+		return VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+		void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+		{
+			return NULL;
+		}
+		//Linux按第一次写入的线程分配物理页，在这里先写一遍
+		if (Table().numaLocal)
+		{
+			memset(p, 0, size);
+		}
+		return p;
+#endif
+	}
+	static void FreeLocal(void* p, size_t size)
+	{
+		if (p == NULL)
+		{
+			return;
+		}
+#ifdef _WIN32
+		(void)size;
+		VirtualFree(p, 0, MEM_RELEASE);
+#else
+		munmap(p, size);
+#endif
+	}
+};
+
+//任务优先级：线程池按车道严格优先取任务，高优先级的排着时低优先级的不会被取走
+//鼠标键盘这类交互命令走MP_HIGH，截屏、文件传输这类大块工作走MP_BULK
+enum MPriority
+{
+	MP_HIGH,		//交互输入，不受队列上限限制
+	MP_NORMAL,
+	MP_BULK,		//大块工作，耗时长的要在循环里调用CMThreadPool::Preempt()
+	MP_COUNT,
+};
+
+//线程池的运行数据：当前线程数、伸缩次数等，给监控和日志用
+struct MPoolStats
+{
+	size_t				threads;		//活着的线程数
+	size_t				idle;			//在等任务的线程数
+	size_t				queued;			//排着的任务数
+	size_t				peak;			//线程数最多时
+	unsigned long long	grows;			//扩容次数
+	unsigned long long	shrinks;		//缩容次数
+	unsigned long long	slowWaits;		//排队超过目标时间的任务数
+	size_t				busy;			//正在执行任务的线程数
+	unsigned long long	rejected;		//被拒绝的任务数(队列满了或已经关闭)
+};
+
+//任务标签：同一个线程池里按来源分开统计
+enum MTaskTag
+{
+	MTAG_OTHER,
+	MTAG_SCREEN,		//截屏、发屏幕
+	MTAG_FILE,			//文件列表、下载、删除
+	MTAG_NET,			//网络收发、转发
+	MTAG_INPUT,			//鼠标键盘、锁机
+	MTAG_COUNT,
+};
+
+//对数分桶的直方图(微秒)：0号桶放0，第i个桶放[2^(i-1), 2^i)
+//记录只是几次原子加，不加锁，任务执行路径上可以一直开着
+class CMHistogram
+{
+public:
+	enum
+	{
+		BUCKETS = 32,		//最后一个桶放所有更大的值(约18分钟以上)
+	};
+	struct MSnapshot
+	{
+		unsigned long long	buckets[BUCKETS];
+		unsigned long long	count;
+		unsigned long long	sum;
+		unsigned long long	max;
+		//近似分位数：落在哪个桶就取那个桶的上界，不超过最大值
+		unsigned long long Percentile(double p) const
+		{
+			if (count == 0)
+			{
+				return 0;
+			}
+			unsigned long long rank = (unsigned long long)(p * count);
+			unsigned long long seen = 0;
+			for (int i = 0; i < BUCKETS; i++)
+			{
+				seen += buckets[i];
+				if (seen > rank)
+				{
+					return (i == 0) ? 0 : std::min(1ULL << i, max);
+				}
+			}
+			return max;
+		}
+	};
+private:
+	std::atomic<unsigned long long>	m_buckets[BUCKETS];
+	std::atomic<unsigned long long>	m_sum;
+	std::atomic<unsigned long long>	m_max;
+public:
+	CMHistogram()
+	{
+		for (int i = 0; i < BUCKETS; i++)
+		{
+			m_buckets[i] = 0;
+		}
+		m_sum = 0;
+		m_max = 0;
+	}
+	void Record(unsigned long long us)
+	{
+		int bucket = 0;
+		while ((bucket < BUCKETS - 1) && (us >= (1ULL << bucket)))
+		{
+			bucket++;
+		}
+		m_buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+		m_sum.fetch_add(us, std::memory_order_relaxed);
+		unsigned long long max = m_max.load(std::memory_order_relaxed);
+		while ((us > max) && !m_max.compare_exchange_weak(max, us, std::memory_order_relaxed))
+		{
+		}
+	}
+	//各个桶分开读，和正在记录的线程之间可能差一两个，统计上没关系
+	MSnapshot Snapshot() const
+	{
+		MSnapshot snap;
+		snap.count = 0;
+		for (int i = 0; i < BUCKETS; i++)
+		{
+			snap.buckets[i] = m_buckets[i].load(std::memory_order_relaxed);
+			snap.count += snap.buckets[i];
+		}
+		snap.sum = m_sum.load(std::memory_order_relaxed);
+		snap.max = m_max.load(std::memory_order_relaxed);
+		return snap;
+	}
+};
+
+//线程池的调度统计：每个标签的排队时长、执行时长和被拒绝的次数
+struct MSchedStats
+{
+	CMHistogram::MSnapshot	wait[MTAG_COUNT];
+	CMHistogram::MSnapshot	run[MTAG_COUNT];
+	unsigned long long		rejected[MTAG_COUNT];
+	MPoolStats				pool;
+};
+
 class CMThreadPool
 {
 private:
-	std::vector<CMThread*>	m_vecThreads;
-	std::mutex				m_mutex;
+	enum
+	{
+		QUEUE_CAPACITY	= 1024,		//任务队列默认上限
+		STOP_TIMEOUT	= 1000,		//关闭时等线程退出的时间(毫秒)
+		ELASTIC_WAIT	= 20,		//排队时间目标(毫秒)，p95超过就加线程
+		ELASTIC_IDLE	= 30000,	//线程空闲多久退出(毫秒)，远大于加线程的间隔，不会来回抖
+		GROW_COOLDOWN	= 100,		//两次加线程至少隔多久(毫秒)，等新线程起作用再看
+		SAMPLE_WINDOW	= 64,		//每多少个任务算一次p95
+	};
+	typedef std::chrono::steady_clock MClock;
+	struct MQueued
+	{
+		CMTask				task;
+		MClock::time_point	enqueue;		//入队时间，算排队时长
+		MTaskTag			tag;
+	};
+	//所有活着的线程池，导出统计用
+	struct MRegistry
+	{
+		std::vector<CMThreadPool*>	pools;
+		int							nextId;
+		std::mutex					mutex;
+	};
+	std::vector<std::thread>	m_vecThreads;
+	std::vector<std::thread::id>	m_vecRetired;		//空闲退出的线程，下次加线程或关闭时回收
+	std::deque<MQueued>			m_queWorks[MP_COUNT];	//每个优先级一条任务队列(多生产者多消费者)
+	size_t						m_queued;			//所有车道排着的任务数
+	std::atomic<size_t>			m_urgent;			//高优先级车道排着的任务数，Preempt不加锁先看它
+	std::mutex					m_mutex;
+	std::condition_variable		m_condWork;			//有任务了/要关闭了
+	std::condition_variable		m_condExit;			//有线程退出了
+	size_t						m_count;			//线程数(伸缩时是下限)
+	size_t						m_maxCount;			//伸缩上限，和m_count一样就是固定大小
+	int							m_targetWait;		//排队时间目标(毫秒)
+	int							m_idleTimeout;		//空闲退出时间(毫秒)
+	size_t						m_capacity;
+	size_t						m_alive;			//还没退出的线程数
+	size_t						m_idle;				//在等任务的线程数
+	int							m_nextIndex;		//新线程的编号(线程名用)
+	MClock::time_point			m_lastGrow;
+	size_t						m_samples;			//当前窗口取了多少个任务
+	size_t						m_slowSamples;		//当前窗口里排队超过目标的
+	MPoolStats					m_stats;
+	bool						m_run;
+	bool						m_stopped;			//Stop过了，不再接任务
+	MDomain						m_domain;			//线程所在的执行域
+	int							m_id;				//进程里第几个线程池，导出时区分同一个域的线程池
+	CMHistogram					m_waitHist[MTAG_COUNT];		//入队到开始执行(微秒)
+	CMHistogram					m_runHist[MTAG_COUNT];		//执行一次的时长(微秒)
+	std::atomic<unsigned long long>	m_rejected[MTAG_COUNT];
+	static MRegistry& Registry()
+	{
+		static MRegistry registry;
+		return registry;
+	}
+	static unsigned long long Micros(MClock::duration duration)
+	{
+		return (unsigned long long)std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+	}
+	//当前线程所属的线程池，Preempt用
+	static CMThreadPool*& Current()
+	{
+		static thread_local CMThreadPool* pool = NULL;
+		return pool;
+	}
+	bool Elastic()
+	{
+		return m_maxCount > m_count;
+	}
+	//取出priority车道的第一个任务(调用方持锁)，顺便记下它排了多久
+	CMTask Take(int priority, MTaskTag& tag)
+	{
+		MQueued& front = m_queWorks[priority].front();
+		CMTask work = std::move(front.task);
+		MClock::time_point enqueue = front.enqueue;
+		tag = front.tag;
+		m_waitHist[tag].Record(Micros(MClock::now() - enqueue));
+		m_queWorks[priority].pop_front();
+		m_queued--;
+		if (priority == MP_HIGH)
+		{
+			m_urgent--;
+		}
+		if (Elastic())
+		{
+			Sample(enqueue);
+		}
+		return work;
+	}
+	void Push(int priority, MTaskTag tag, CMTask&& task)
+	{
+		MQueued queued;
+		queued.task = std::move(task);
+		queued.enqueue = MClock::now();
+		queued.tag = tag;
+		m_queWorks[priority].push_back(std::move(queued));
+		m_queued++;
+		if (priority == MP_HIGH)
+		{
+			m_urgent++;
+		}
+	}
+	//p95超过目标等价于超过目标的任务多于5%，不用排序(调用方持锁)
+	void Sample(MClock::time_point enqueue)
+	{
+		m_samples++;
+		if (MClock::now() - enqueue > std::chrono::milliseconds(m_targetWait))
+		{
+			m_slowSamples++;
+			m_stats.slowWaits++;
+		}
+		if (m_samples < SAMPLE_WINDOW)
+		{
+			return;
+		}
+		bool slow = m_slowSamples * 20 > m_samples;
+		m_samples = 0;
+		m_slowSamples = 0;
+		if (slow)
+		{
+			Grow("p95");
+		}
+	}
+	//没有空闲线程，排在最前面的任务已经等过了目标时间：线程都被长任务占着，等不到窗口算完(调用方持锁)
+	void CheckStarve()
+	{
+		if (!Elastic() || (m_idle > 0))
+		{
+			return;
+		}
+		for (int i = MP_HIGH; i < MP_COUNT; i++)
+		{
+			if (!m_queWorks[i].empty())
+			{
+				if (MClock::now() - m_queWorks[i].front().enqueue > std::chrono::milliseconds(m_targetWait))
+				{
+					Grow("starve");
+				}
+				return;
+			}
+		}
+	}
+	//加一个线程(调用方持锁)
+	void Grow(const char* reason)
+	{
+		MClock::time_point now = MClock::now();
+		if (!m_run || (m_alive >= m_maxCount) || (now - m_lastGrow < std::chrono::milliseconds(GROW_COOLDOWN)))
+		{
+			return;
+		}
+		m_lastGrow = now;
+		Reap();
+		m_vecThreads.push_back(std::thread(&CMThreadPool::ThreadMain, this, m_nextIndex++));
+		m_alive++;
+		m_stats.grows++;
+		m_stats.peak = std::max(m_stats.peak, m_alive);
+		printf("pool %s grow %d->%d (%s)\n", CMDomain::Name(m_domain), (int)m_alive - 1, (int)m_alive, reason);
+	}
+	//回收空闲退出的线程(调用方持锁，它们已经不再碰锁了)
+	void Reap()
+	{
+		for (size_t i = 0; i < m_vecRetired.size(); i++)
+		{
+			for (size_t j = 0; j < m_vecThreads.size(); j++)
+			{
+				if (m_vecThreads.at(j).get_id() == m_vecRetired.at(i))
+				{
+					m_vecThreads.at(j).join();
+					m_vecThreads.erase(m_vecThreads.begin() + j);
+					break;
+				}
+			}
+		}
+		m_vecRetired.clear();
+	}
+	//执行一次任务，返回0表示还要继续执行：放回原车道的队尾，让排着的任务也有机会执行(进出都持锁)
+	void Execute(CMTask& work, int priority, MTaskTag tag, std::unique_lock<std::mutex>& lock)
+	{
+		lock.unlock();
+		MClock::time_point start = MClock::now();
+		int ret = work();
+		m_runHist[tag].Record(Micros(MClock::now() - start));
+		lock.lock();
+		if ((ret == 0) && m_run)
+		{
+			Push(priority, tag, std::move(work));
+		}
+	}
+	void ThreadMain(int index)
+	{
+		CMDomain::Enter(m_domain, index);
+		Current() = this;
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (true)
+		{
+			//没有任务就睡，有任务或要关闭时被叫醒；伸缩时空闲太久、线程又多于下限就退出
+			m_idle++;
+			bool woken = m_condWork.wait_for(lock, std::chrono::milliseconds(m_idleTimeout), [this]() { return !m_run || (m_queued > 0); });
+			m_idle--;
+			if (!m_run)
+			{
+				break;
+			}
+			if (!woken)
+			{
+				if (Elastic() && (m_alive > m_count))
+				{
+					m_vecRetired.push_back(std::this_thread::get_id());
+					m_stats.shrinks++;
+					printf("pool %s shrink %d->%d (idle)\n", CMDomain::Name(m_domain), (int)m_alive, (int)m_alive - 1);
+					break;
+				}
+				continue;
+			}
+			//严格优先：从高到低找第一条不空的车道
+			int priority = MP_HIGH;
+			while (m_queWorks[priority].empty())
+			{
+				priority++;
+			}
+			MTaskTag tag = MTAG_OTHER;
+			CMTask work = Take(priority, tag);
+			Execute(work, priority, tag, lock);
+		}
+		Current() = NULL;
+		m_alive--;
+		m_condExit.notify_all();
+	}
 public:
-	CMThreadPool(int count)
+	CMThreadPool(int count, size_t capacity = QUEUE_CAPACITY)
 	{
-		m_mutex.lock();
-		for (int i = 0; i < count; i++)
+		m_count = (count > 0) ? count : 1;
+		m_maxCount = m_count;
+		m_targetWait = ELASTIC_WAIT;
+		m_idleTimeout = ELASTIC_IDLE;
+		m_capacity = capacity;
+		m_alive = 0;
+		m_idle = 0;
+		m_nextIndex = 0;
+		m_samples = 0;
+		m_slowSamples = 0;
+		memset(&m_stats, 0, sizeof(m_stats));
+		m_queued = 0;
+		m_urgent = 0;
+		m_run = false;
+		m_stopped = false;
+		m_domain = MD_DEFAULT;
+		for (int i = 0; i < MTAG_COUNT; i++)
 		{
-			m_vecThreads.push_back(new CMThread());
+			m_rejected[i] = 0;
 		}
-		m_mutex.unlock();
+		MRegistry& registry = Registry();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		m_id = registry.nextId++;
+		registry.pools.push_back(this);
 	}
 	~CMThreadPool()
 	{
 		Stop();
-		for (size_t i = 0; i < m_vecThreads.size(); i++)
+		MRegistry& registry = Registry();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		registry.pools.erase(std::remove(registry.pools.begin(), registry.pools.end(), this), registry.pools.end());
+	}
+	//设置执行域，要在Invoke之前调用
+	void SetDomain(MDomain domain)
+	{
+		m_domain = domain;
+	}
+	//按负载伸缩：从minCount个线程起步，排队时间的p95超过targetWait毫秒就加线程(最多maxCount个)
+	//多出下限的线程空闲idleTimeout毫秒后退出；要在Invoke之前调用
+	void SetElastic(int minCount, int maxCount, int targetWait = ELASTIC_WAIT, int idleTimeout = ELASTIC_IDLE)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_count = (minCount > 0) ? minCount : 1;
+		m_maxCount = std::max(m_count, (size_t)std::max(maxCount, 1));
+		m_targetWait = std::max(targetWait, 1);
+		m_idleTimeout = std::max(idleTimeout, 1);
+	}
+	//CPU核数，配置伸缩上限用
+	static int Cores()
+	{
+		int cores = (int)std::thread::hardware_concurrency();
+		return (cores > 0) ? cores : 1;
+	}
+	MPoolStats Stats()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		MPoolStats stats = m_stats;
+		stats.threads = m_alive;
+		stats.idle = m_idle;
+		stats.queued = m_queued;
+		stats.busy = m_alive - m_idle;
+		stats.rejected = 0;
+		for (int i = 0; i < MTAG_COUNT; i++)
 		{
-			delete m_vecThreads.at(i);
+			stats.rejected += m_rejected[i];
 		}
-		m_mutex.lock();
-		m_vecThreads.clear();
-		m_mutex.unlock();
+		return stats;
 	}
-	bool Invoke()
+	//运行中随时可以取，直方图是从启动开始累计的
+	MSchedStats SchedStats()
 	{
-		bool isOk = true;
-		for (size_t i = 0; i < m_vecThreads.size(); i++)
+		MSchedStats stats;
+		for (int i = 0; i < MTAG_COUNT; i++)
 		{
-			if (!m_vecThreads.at(i)->Start())
+			stats.wait[i] = m_waitHist[i].Snapshot();
+			stats.run[i] = m_runHist[i].Snapshot();
+			stats.rejected[i] = m_rejected[i];
+		}
+		stats.pool = Stats();
+		return stats;
+	}
+	static const char* TagName(int tag)
+	{
+		static const char* names[MTAG_COUNT] = { "other", "screen", "file", "net", "input" };
+		return ((tag >= 0) && (tag < MTAG_COUNT)) ? names[tag] : "?";
+	}
+	//写一个线程池的统计：一行概况，每个用过的标签一行分位数(微秒)
+	static void WriteStats(FILE* file, const char* name, int id, const MSchedStats& stats)
+	{
+		long long now = (long long)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+		fprintf(file, "%lld pool %s.%d threads %d busy %d queued %d peak %d grows %llu shrinks %llu rejected %llu\n",
+			now, name, id, (int)stats.pool.threads, (int)stats.pool.busy, (int)stats.pool.queued,
+			(int)stats.pool.peak, stats.pool.grows, stats.pool.shrinks, stats.pool.rejected);
+		for (int tag = 0; tag < MTAG_COUNT; tag++)
+		{
+			const CMHistogram::MSnapshot& wait = stats.wait[tag];
+			const CMHistogram::MSnapshot& run = stats.run[tag];
+			if ((run.count == 0) && (stats.rejected[tag] == 0))
 			{
-				isOk = false;
-				break;
+				continue;
 			}
+			fprintf(file, "%lld tag %s.%d.%s wait n %llu p50 %llu p95 %llu p99 %llu max %llu run n %llu p50 %llu p95 %llu p99 %llu max %llu rejected %llu\n",
+				now, name, id, TagName(tag),
+				wait.count, wait.Percentile(0.5), wait.Percentile(0.95), wait.Percentile(0.99), wait.max,
+				run.count, run.Percentile(0.5), run.Percentile(0.95), run.Percentile(0.99), run.max, stats.rejected[tag]);
 		}
-		if (isOk)
+	}
+	//把所有线程池的统计追加到trace文件
+	static bool DumpTrace(const char* path)
+	{
+		FILE* file = fopen(path, "a");
+		if (file == NULL)
 		{
-			return true;
+			printf("%s(%d):%s open %s error\n", __FILE__, __LINE__, __FUNCTION__, path);
+			return false;
 		}
-		for (size_t i = 0; i < m_vecThreads.size(); i++)
+		MRegistry& registry = Registry();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		for (size_t i = 0; i < registry.pools.size(); i++)
 		{
-			m_vecThreads.at(i)->Stop();
+			CMThreadPool* pool = registry.pools.at(i);
+			WriteStats(file, CMDomain::Name(pool->m_domain), pool->m_id, pool->SchedStats());
 		}
-		return false;
+		fclose(file);
+		return true;
+	}
+	//启动线程；启动前分派的任务会留在队列里，启动后开始执行
+	bool Invoke()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if (m_run || m_stopped)
+		{
+			return m_run;
+		}
+		m_run = true;
+		for (size_t i = 0; i < m_count; i++)
+		{
+			m_vecThreads.push_back(std::thread(&CMThreadPool::ThreadMain, this, m_nextIndex++));
+			m_alive++;
+		}
+		m_stats.peak = m_alive;
+		return true;
 	}
+	//关闭：叫醒所有线程，等它们做完手上的任务退出，队列里没执行的任务丢掉
+	//丢掉的Submit任务的future变成broken，等着的Get会返回；任务在锁外析构，析构里再分派任务不会死锁
 	bool Stop()
 	{
-		bool isOk = true;
+		std::deque<MQueued> dropped[MP_COUNT];
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_run = false;
+		m_stopped = true;
+		for (int i = 0; i < MP_COUNT; i++)
+		{
+			dropped[i].swap(m_queWorks[i]);
+		}
+		m_queued = 0;
+		m_urgent = 0;
+		m_condWork.notify_all();
+		lock.unlock();
+		for (int i = 0; i < MP_COUNT; i++)
+		{
+			dropped[i].clear();
+		}
+		lock.lock();
+		bool isOk = m_condExit.wait_for(lock, std::chrono::milliseconds(STOP_TIMEOUT), [this]() { return m_alive == 0; });
+		lock.unlock();
 		for (size_t i = 0; i < m_vecThreads.size(); i++)
 		{
-			if (!m_vecThreads.at(i)->Stop())
+			//还卡在任务里的线程只能放手不管
+			if (isOk)
 			{
-				isOk = false;
-				break;
+				m_vecThreads.at(i).join();
+			}
+			else
+			{
+				m_vecThreads.at(i).detach();
 			}
 		}
+		m_vecThreads.clear();
+		m_vecRetired.clear();
 		if (isOk == false)
 		{
 			printf("线程关闭失败");
 		}
 		return isOk;
 	}
-	void DispatchWork(const CMWork& work)
+	//分派任务：返回true表示已入队，false表示队列满了或线程池已关闭(任务被拒绝)
+	bool DispatchWork(const CMWork& work, MPriority priority = MP_NORMAL, MTaskTag tag = MTAG_OTHER)
 	{
-		for (size_t i = 0; i < m_vecThreads.size(); i++)
+		return DispatchTask(CMTask(work), priority, tag);
+	}
+	//分派任意可调用对象(lambda等)，放得进CMTask内部的不分配内存
+	//队列满了只拒绝普通和大块任务，交互输入不能因为文件传输排满了就丢
+	bool DispatchTask(CMTask&& task, MPriority priority = MP_NORMAL, MTaskTag tag = MTAG_OTHER)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if (m_stopped || ((priority != MP_HIGH) && (m_queued >= m_capacity)))
 		{
-			if (m_vecThreads.at(i)->IsFree())
-			{
-				m_vecThreads.at(i)->Work(work);
-				break;
-			}
+			m_rejected[tag]++;
+			return false;
 		}
+		Push(priority, tag, std::move(task));
+		CheckStarve();
+		lock.unlock();
+		m_condWork.notify_one();
+		return true;
+	}
+	//抢占点：在耗时的大块任务的循环里调用，有高优先级任务排着就先在当前线程里执行掉
+	//线程都被大块任务占着时，交互输入最多等一个分块；不在线程池线程里调用时什么也不做
+	static bool Preempt()
+	{
+		CMThreadPool* pool = Current();
+		if ((pool == NULL) || (pool->m_urgent == 0))
+		{
+			return false;
+		}
+		std::unique_lock<std::mutex> lock(pool->m_mutex);
+		//只执行进来时排着的这些，返回0的周期任务放回去，不会在这里转个不停
+		size_t count = pool->m_queWorks[MP_HIGH].size();
+		bool ran = false;
+		while ((count-- > 0) && pool->m_run && !pool->m_queWorks[MP_HIGH].empty())
+		{
+			MTaskTag tag = MTAG_OTHER;
+			CMTask work = pool->Take(MP_HIGH, tag);
+			pool->Execute(work, MP_HIGH, tag, lock);
+			ran = true;
+		}
+		return ran;
+	}
+	//分派任务并拿到结果的future(执行一次)，被拒绝时返回无效的future；没执行就关闭了future变成broken
+	template <typename F>
+	CMFuture<typename CMResult<decltype(std::declval<F&>()())>::type> Submit(F func)
+	{
+		typedef decltype(func()) R;
+		CMPromise<typename CMResult<R>::type> promise;
+		CMFuture<typename CMResult<R>::type> future = promise.GetFuture();
+		if (!DispatchTask(CMTask([promise, func]() mutable {
+			CMResult<R>::Call(promise, func);
+		})))
+		{
+			return CMFuture<typename CMResult<R>::type>();
+		}
+		return future;
 	}
 };
-
@@ -1,33 +1,34 @@
 #include "UDPPassNetWork.h"
 #include "Common.h"
 #include <list>
+#include <algorithm>
 
-int UDPPassNetWork::ThreadTcpProc()
+CMCo<> UDPPassNetWork::AcceptTcp()
 {
 	//接入客户端
 	while (!m_stop)
 	{
 		sockaddr_in clnt_addr{};
-		socklen_t   clnt_addr_len{ sizeof(clnt_addr) };
-		int clntSock = accept(m_tcpSock, (sockaddr*)(&clnt_addr), &clnt_addr_len);
-
-		m_thpool.DispatchWork(CMWork(this, (MT_FUNC2)&UDPPassNetWork::ThreadTcpClnt, reinterpret_cast<void*>(clntSock)));
+		int clntSock = (int)co_await m_reactor.AsyncAccept(m_tcpSock, &clnt_addr);
+		if (clntSock == -1)
+		{
+			//fd用完之类的错误会一直就绪，歇一下再试
+			printf("%s(%d):%s accept error (%d) %s\n", __FILE__, __LINE__, __FUNCTION__, errno, strerror(errno));
+			co_await m_reactor.SleepFor(ACCEPT_RETRY);
+			continue;
+		}
+		m_reactor.Spawn(ServeTcpClnt(clntSock));
 	}
-
-	return -1;
 }
 
-int UDPPassNetWork::ThreadUdpProc()
+CMCo<> UDPPassNetWork::RecvUdp()
 {
-	//接入客户端
+	char buf[1024]{};
 	while (!m_stop)
 	{
-		char        buf[1024]{};
 		sockaddr_in clnt_addr{};
-		socklen_t   clnt_addr_len{ sizeof(clnt_addr) };
-
 		//获取数据
-		ssize_t ret = recvfrom(m_udpSock, buf, 1024, 0, (sockaddr*)(&clnt_addr), &clnt_addr_len);	
+		ssize_t ret = co_await m_reactor.AsyncRecvFrom(m_udpSock, buf, sizeof(buf), &clnt_addr);
 		
 		//解析数据
 		int len = (int)ret;
@@ -40,23 +41,24 @@ int UDPPassNetWork::ThreadUdpProc()
 		//处理数据
 		DealUdp(pack, clnt_addr);
 	}
-	return -1;
 }
 
-int UDPPassNetWork::ThreadTcpClnt(void* arg)
+CMCo<> UDPPassNetWork::ServeTcpClnt(int sock)
 {
-	int sock = (int)(long long)arg;
-
+	char buf[1024]{};
+	m_sendQueue.Add(sock);
 	while (true)
 	{
-		char        buf[1024]{};
 		//获取数据
-		ssize_t ret = recv(sock, buf, sizeof(buf), 0);
+		ssize_t ret = co_await m_reactor.AsyncRead(sock, buf, sizeof(buf));
 		if (ret <= 0)
 		{
-			close(sock);
+			//先删用户(持锁)，之后广播、打洞都找不到这个连接；再删发送队列，最后关fd
+			//反过来的话，中间的广播会用这个fd重新建队列，fd复用后新连接收到旧的包
 			EraseAddrBySocket(sock);
-			SendAddrs();
+			m_sendQueue.Remove(sock);
+			m_reactor.Close(sock);
+			NotifyAddrs();
 			break;
 		}
 		//解析数据
@@ -70,18 +72,24 @@ int UDPPassNetWork::ThreadTcpClnt(void* arg)
 		//处理数据
 		DealTcp(pack,sock);
 	}
-
-	return -1;
 }
 
-UDPPassNetWork::UDPPassNetWork(const std::string& ip, short tcpPort, short udpPort) 
+UDPPassNetWork::UDPPassNetWork(const std::string& ip, short tcpPort, short udpPort, unsigned short gossipPort) 
 	: m_udpServAddr()
 	, m_tcpServAddr()
 	, m_udpSock(-1) 
 	, m_tcpSock(-1)
 	, m_thpool(10)
+	, m_cluster(ip, tcpPort, udpPort, gossipPort)
 {
 	m_stop = true;
+	m_addrsDirty = false;
+	m_addrsVersion = 0;
+	m_notifyWindow = NOTIFY_WINDOW;
+	m_onlineTimer = 0;
+	m_notifyTimer = 0;
+	//高16位区分节点，集群里各节点生成的打洞序号不重复
+	m_punchSession = (unsigned long long)((GetTick() ^ getpid()) & 0xFFFF) << 48;
 	//配置端口地址(TCP)
 	memset(&m_tcpServAddr, 0, sizeof(m_tcpServAddr));
 	m_tcpServAddr.sin_family = AF_INET;
@@ -97,7 +105,16 @@ UDPPassNetWork::UDPPassNetWork(const std::string& ip, short tcpPort, short udpPo
 
 UDPPassNetWork::~UDPPassNetWork()
 {
+	//Cancel会等定时器投递完，返回以后不会再往m_thpool里放广播
+	m_notifyMutex.lock();
 	m_stop = true;
+	m_notifyMutex.unlock();
+	CMTimer::Global().Cancel(m_onlineTimer);
+	CMTimer::Global().Cancel(m_notifyTimer);
+	//集群收包线程会回调DealCluster，在成员析构之前停掉
+	m_cluster.Stop();
+	//先停反应器，协程不会再碰下面要关的套接字
+	m_reactor.Stop();
 
 	for (std::map<long long, MUserInfo>::iterator it = m_mapAddrs.begin(); it != m_mapAddrs.end(); it++)
 	{
@@ -126,8 +143,8 @@ int UDPPassNetWork::Invoke()
 		printf("%s(%d):%s socket error tcp (%d) %s\n", __FILE__, __LINE__, __FUNCTION__, errno, strerror(errno));
 		return 0;
 	}
-	//监听(TCP)
-	if (listen(m_tcpSock, 5) == -1)
+	//监听(TCP)：连接都由协程处理，积压队列开到系统上限，连接潮时不被拒绝
+	if (listen(m_tcpSock, SOMAXCONN) == -1)
 	{
 		close(m_tcpSock);
 		printf("%s(%d):%s socket error tcp (%d) %s\n", __FILE__, __LINE__, __FUNCTION__, errno, strerror(errno));
@@ -148,10 +165,24 @@ int UDPPassNetWork::Invoke()
 		printf("%s(%d):%s socket error (%d) %s\n", __FILE__, __LINE__, __FUNCTION__, errno, strerror(errno));
 		return 0;
 	}
-	//启动
-	m_thpool.DispatchWork(CMWork(this, (MT_FUNC)&UDPPassNetWork::ThreadUdpProc));
-	m_thpool.DispatchWork(CMWork(this, (MT_FUNC)&UDPPassNetWork::ThreadTcpProc));
+	//收发和转发都是延迟敏感的，放在io域
+	m_thpool.SetDomain(MD_IO);
+	//反应器、发送队列、集群收包各占一个线程常驻，其余按排队时间伸缩
+	m_thpool.SetElastic(POOL_MIN, std::max(POOL_MIN * 2, CMThreadPool::Cores() * 2));
+	//发送队列
+	m_sendQueue.Invoke(m_thpool);
+	//加入集群
+	m_cluster.SetHandler(this, (MC_FUNC)&UDPPassNetWork::DealCluster, (MT_FUNC)&UDPPassNetWork::Rebalance);
+	m_cluster.Invoke(m_thpool);
+	//启动：收包都在反应器线程的协程里
+	CMReactor::SetNonBlock(m_tcpSock);
+	CMReactor::SetNonBlock(m_udpSock);
+	m_reactor.Invoke(m_thpool);
+	m_reactor.Spawn(AcceptTcp());
+	m_reactor.Spawn(RecvUdp());
 	m_thpool.Invoke();
+	//定时检查用户是否在线
+	m_onlineTimer = CMTimer::Global().Every(ONLINE_INTERVAL, CMWork(this, (MT_FUNC)&UDPPassNetWork::TestOnline), &m_thpool, ONLINE_SLACK);
 
 	return 0;
 }
@@ -171,14 +202,27 @@ int UDPPassNetWork::DealUdp(CPacket& pack,sockaddr_in& clnt_addr)
 				sprintf(ip, "%d.%d.%d.%d", pCharIp[0], pCharIp[1], pCharIp[2], pCharIp[3]);
 				port = ntohs(clnt_addr.sin_port);
 				long long id = *(long long*)pack.sData.c_str();
+				//不归本节点管的用户不登记，等TCP登记时重定向
+				if (!m_cluster.IsLocal(id))
+				{
+					CPacket ackPack(101);
+					sendto(m_udpSock, ackPack.Data(), ackPack.Size(), 0, (sockaddr*)&clnt_addr, sizeof(sockaddr_in));
+					break;
+				}
 				m_mutex.lock();
 				std::map<long long, MUserInfo>::iterator find = m_mapAddrs.find(id);
 				//根据id找到地址，就修改就行了
 				if (find != m_mapAddrs.end())
 				{
+					//同一个用户换了端口，记下端口变化量，顺序分配型NAT打洞时用来预测端口
+					short step = (short)(port - find->second.port);
+					if ((step != 0) && (step > -64) && (step < 64))
+					{
+						m_mapPortStep[id] = step;
+					}
 					memcpy(find->second.ip, ip, 16);
 					find->second.port = port;
-					SendAddrs();
+					NotifyAddrs();
 					printf("(exist)udp online :%s\n", ip);
 				}
 				//根据id找没到地址，就根据id创建一个
@@ -186,6 +230,7 @@ int UDPPassNetWork::DealUdp(CPacket& pack,sockaddr_in& clnt_addr)
 				{
 					MUserInfo mInfo(ip, port);
 					mInfo.id = id;
+					mInfo.last = GetTick();
 					m_mapAddrs.insert(std::pair<long long, MUserInfo>(mInfo.id, mInfo));
 					printf("udp online :%s\n", ip);
 				}
@@ -203,28 +248,38 @@ int UDPPassNetWork::DealUdp(CPacket& pack,sockaddr_in& clnt_addr)
 		case 103://用户发送心跳包（保持在线）
 		{
 			unsigned long long id = 0;
+			if (pack.sData.size() < sizeof(long long))
+			{
+				break;
+			}
 			memcpy(&id, pack.sData.c_str(), sizeof(long long));
+			m_mutex.lock();
 			std::map<long long, MUserInfo>::iterator it = m_mapAddrs.find(id);
 			if (it != m_mapAddrs.end())
 			{
-				//获得当前时间错（毫秒级别）
-				struct timeval tv;
-				gettimeofday(&tv, NULL);
-				it->second.last = tv.tv_sec * 1000 + tv.tv_usec / 1000;
+				it->second.last = GetTick();
 			}
+			m_mutex.unlock();
 			break;
 		}
 		case 104://控制端想要发起控制（建立udp穿透）【告诉两个客户端你们可以相互连接了】
 		{
 			ConnectIds ids;
+			if (pack.sData.size() < sizeof(ConnectIds))
+			{
+				break;
+			}
 			memcpy(&ids, pack.sData.c_str(), sizeof(ConnectIds));
-			
+
+			//查找到拼好打洞包都持锁：上下线、超时、集群转发会同时改这几张表
+			m_mutex.lock();
 			std::map<long long, MUserInfo>::iterator it0 = m_mapAddrs.find(ids.id0);
 			std::map<long long, MUserInfo>::iterator it1 = m_mapAddrs.find(ids.id1);
-			ssize_t ret = 0;
-			if ((it0 != m_mapAddrs.end()) && (it1 != m_mapAddrs.end()))
+			bool found = (it0 != m_mapAddrs.end()) && (it1 != m_mapAddrs.end());
+			sockaddr_in addr0{}, addr1{};
+			CPacket sendPack0, sendPack1;
+			if (found)
 			{
-				sockaddr_in addr0{}, addr1{};
 				addr0.sin_family = AF_INET;
 				addr0.sin_addr.s_addr = inet_addr(it0->second.ip);
 				addr0.sin_port = htons(it0->second.port);
@@ -232,12 +287,15 @@ int UDPPassNetWork::DealUdp(CPacket& pack,sockaddr_in& clnt_addr)
 				addr1.sin_addr.s_addr = inet_addr(it1->second.ip);
 				addr1.sin_port = htons(it1->second.port);
 
-				MUserInfo mInfo0(it1->second.ip, it1->second.port);
-				MUserInfo mInfo1(it0->second.ip, it0->second.port);
-				CPacket sendPack0(105, (unsigned char*)&mInfo0,sizeof(MUserInfo));
-				CPacket sendPack1(105, (unsigned char*)&mInfo1, sizeof(MUserInfo));
-
-				
+				//两边拿到同一个序号和开始时间，同时开始打洞
+				unsigned long long session = ++m_punchSession;
+				sendPack0 = GetPunchPack(it1->second, session);
+				sendPack1 = GetPunchPack(it0->second, session);
+			}
+			m_mutex.unlock();
+			ssize_t ret = 0;
+			if (found)
+			{
 				ret = sendto(m_udpSock, sendPack0.Data(), sendPack0.Size(), 0, (sockaddr*)&addr0, sizeof(sockaddr_in));
 				if (ret <= 0) 
 				{
@@ -251,6 +309,10 @@ int UDPPassNetWork::DealUdp(CPacket& pack,sockaddr_in& clnt_addr)
 					break;
 				}
 			}
+			else if (ForwardPair(ids))
+			{
+				//目标在别的节点，等那边应答(203/204)
+			}
 			else
 			{
 				CPacket sendPack(106);
@@ -273,11 +335,30 @@ int UDPPassNetWork::DealTcp(CPacket& pack,int sock)
 	{
 		case 101://用户连接上来了
 		{
+			if (pack.sData.size() < sizeof(MUserInfo))
+			{
+				break;
+			}
 			MUserInfo mInfo("",0);
-			memcpy(&mInfo, pack.sData.c_str(), pack.sData.size());
+			memcpy(&mInfo, pack.sData.c_str(), sizeof(MUserInfo));
 			mInfo.tcpSock = sock;
+			mInfo.last = GetTick();
+			//不归本节点管，告诉用户去哪个节点登记
+			if (!m_cluster.IsLocal(mInfo.id))
+			{
+				Redirect(sock, mInfo.id);
+				break;
+			}
 
 			m_mutex.lock();
+			//新版客户端在后面带上了局域网地址
+			if (pack.sData.size() >= sizeof(MUserInfo) + sizeof(MLocalAddrs))
+			{
+				MLocalAddrs local;
+				memcpy(&local, pack.sData.c_str() + sizeof(MUserInfo), sizeof(MLocalAddrs));
+				local.count = std::min<short>(std::max<short>(local.count, 0), LOCAL_ADDR_MAX);
+				m_mapLocal[mInfo.id] = local;
+			}
 			std::map<long long, MUserInfo>::iterator find_ = m_mapAddrs.find(mInfo.id);
 			//根据id找到地址，就修改就行了
 			if (find_ != m_mapAddrs.end())
@@ -287,7 +368,7 @@ int UDPPassNetWork::DealTcp(CPacket& pack,int sock)
 				memcpy(find_->second.ip, tmp.ip, 16);
 				find_->second.port = tmp.port;
 				printf("already exist:%s %d\n", mInfo.ip, ntohs(mInfo.port));
-				SendAddrs();
+				NotifyAddrs();
 
 			}
 			//根据id找没到地址，就根据id创建一个
@@ -302,51 +383,57 @@ int UDPPassNetWork::DealTcp(CPacket& pack,int sock)
 		case 103://用户发送心跳包（保持在线）
 		{
 			unsigned long long id = 0;
+			if (pack.sData.size() < sizeof(long long))
+			{
+				break;
+			}
 			memcpy(&id, pack.sData.c_str(), sizeof(long long));
+			m_mutex.lock();
 			std::map<long long, MUserInfo>::iterator it = m_mapAddrs.find(id);
 			if (it != m_mapAddrs.end())
 			{
-				//获得当前时间错（毫秒级别）
-				struct timeval tv;
-				gettimeofday(&tv, NULL);
-				it->second.last = tv.tv_sec * 1000 + tv.tv_usec / 1000;
+				it->second.last = GetTick();
 			}
+			m_mutex.unlock();
 			break;
 		}
 		case 104://控制端想要发起控制（建立udp穿透）【告诉两个客户端你们可以相互连接了】
 		{
 			ConnectIds ids;
+			if (pack.sData.size() < sizeof(ConnectIds))
+			{
+				break;
+			}
 			memcpy(&ids, pack.sData.c_str(), sizeof(ConnectIds));
 
+			//和101/103一样持锁；入队也在锁里，连接断开(先删用户再删发送队列)后不会发到复用的fd上
+			m_mutex.lock();
 			std::map<long long, MUserInfo>::iterator it0 = m_mapAddrs.find(ids.id0);
 			std::map<long long, MUserInfo>::iterator it1 = m_mapAddrs.find(ids.id1);
-			ssize_t ret = 0;
 			if ((it0 != m_mapAddrs.end()) && (it1 != m_mapAddrs.end()))
 			{
-				MUserInfo mInfo0(it1->second.ip, it1->second.port);
-				MUserInfo mInfo1(it0->second.ip, it0->second.port);
-				CPacket sendPack0(105, (unsigned char*)&mInfo0, sizeof(MUserInfo));
-				CPacket sendPack1(105, (unsigned char*)&mInfo1, sizeof(MUserInfo));
-				
+				//两边拿到同一个序号和开始时间，同时开始打洞
+				unsigned long long session = ++m_punchSession;
+				CPacket sendPack0 = GetPunchPack(it1->second, session);
+				CPacket sendPack1 = GetPunchPack(it0->second, session);
 
-				ret = send(it0->second.tcpSock, sendPack0.Data(), sendPack0.Size(), 0);
-				if (ret <= 0)
-				{
-					printf("%s(%d):%s hu xiang lian jie error (%d) %s\n", __FILE__, __LINE__, __FUNCTION__, errno, strerror(errno));
-					break;
-				}
-				ret = send(it1->second.tcpSock, sendPack1.Data(), sendPack1.Size(), 0);
-				if (ret <= 0)
+				bool isOk = m_sendQueue.Post(it0->second.tcpSock, sendPack0) && m_sendQueue.Post(it1->second.tcpSock, sendPack1);
+				m_mutex.unlock();
+				if (!isOk)
 				{
 					printf("%s(%d):%s hu xiang lian jie error (%d) %s\n", __FILE__, __LINE__, __FUNCTION__, errno, strerror(errno));
-					break;
 				}
+				break;
+			}
+			m_mutex.unlock();
+			if (ForwardPair(ids))
+			{
+				//目标在别的节点，等那边应答(203/204)
 			}
 			else
 			{
 				CPacket sendPack(106);
-				ret = send(m_tcpSock, sendPack.Data(), sendPack.Size(), 0);
-				if (ret <= 0)
+				if (!m_sendQueue.Post(sock, sendPack))
 				{
 					printf("%s(%d):%s hu xiang lian jie error (%d) %s\n", __FILE__, __LINE__, __FUNCTION__, errno, strerror(errno));
 					break;
@@ -354,59 +441,138 @@ int UDPPassNetWork::DealTcp(CPacket& pack,int sock)
 			}
 			break;
 		}
+		case 107://客户端上报打洞结果
+		{
+			MPunchResult result{};
+			memcpy(&result, pack.sData.c_str(), std::min(pack.sData.size(), sizeof(MPunchResult)));
+			printf("punch session:%llu id:%llu %s elapsed:%dms port:%d\n", result.session, result.id,
+				result.success ? "ok" : "timeout", result.elapsed, result.port);
+			break;
+		}
 	}
 
 	return 0;
 }
 
-int UDPPassNetWork::SendAddrs()
+void UDPPassNetWork::NotifyAddrs()
 {
-	
-	//给每个人发
+	m_addrsVersion++;
+	//窗口里第一次变化时定一个定时器，之后的变化等它一起发
+	//标记只在FlushAddrs里清，广播用MP_HIGH投递：线程池排满了也不会被拒绝，不然标记一直是true，以后的变化都不再广播
+	if (!m_addrsDirty.exchange(true))
+	{
+		ArmFlush(m_notifyWindow);
+	}
+}
+
+void UDPPassNetWork::ArmFlush(int ms)
+{
+	std::lock_guard<std::mutex> lock(m_notifyMutex);
+	if (m_stop)
+	{
+		return;
+	}
+	m_notifyTimer = CMTimer::Global().After(ms, CMWork(this, (MT_FUNC)&UDPPassNetWork::FlushAddrs), &m_thpool, 0, MP_HIGH);
+}
+
+int UDPPassNetWork::FlushAddrs()
+{
+	//先清标记：广播期间又有变化就再定一个窗口
+	m_addrsDirty = false;
+	m_mutex.lock();
+	long long wait = SendAddrs();
+	m_mutex.unlock();
+	//有用户刚收过被推迟了：到时间再发一次(已经有窗口在等就交给它)
+	if ((wait > 0) && !m_addrsDirty.exchange(true))
+	{
+		ArmFlush((int)wait);
+	}
+	return -1;
+}
+
+void UDPPassNetWork::SetNotifyWindow(int ms)
+{
+	m_notifyWindow = std::max(ms, 0);
+}
+
+long long UDPPassNetWork::SendAddrs()
+{
+	unsigned long long version = m_addrsVersion;
+	long long tick = GetTick();
+	long long wait = -1;
+	//下线的用户不用再记
+	for (std::map<long long, MAddrsSent>::iterator it = m_mapAddrsSent.begin(); it != m_mapAddrsSent.end();)
+	{
+		if (m_mapAddrs.find(it->first) == m_mapAddrs.end())
+		{
+			it = m_mapAddrsSent.erase(it);
+		}
+		else
+		{
+			it++;
+		}
+	}
+	//给列表过期的人发，刚发过的推迟到间隔满了再发(频繁上下线时一个用户每秒最多收1000/ADDRS_INTERVAL次)
 	printf("devices:%lld\n", m_mapAddrs.size());
 	for (std::map<long long, MUserInfo>::iterator it = m_mapAddrs.begin(); it != m_mapAddrs.end(); it++)
 	{
+		std::map<long long, MAddrsSent>::iterator sent = m_mapAddrsSent.find(it->first);
+		if (sent != m_mapAddrsSent.end())
+		{
+			if (sent->second.version == version)
+			{
+				continue;
+			}
+			long long left = sent->second.tick + ADDRS_INTERVAL - tick;
+			if (left > 0)
+			{
+				wait = (wait < 0) ? left : std::min(wait, left);
+				continue;
+			}
+		}
+		MAddrsSent& record = m_mapAddrsSent[it->first];
+		record.version = version;
+		record.tick = tick;
 		if (m_mapAddrs.size() > 1)
 		{
 			CPacket pack = GetSendAddr(it->first);
-			send(it->second.tcpSock, pack.Data(), pack.Size(), 0);
+			m_sendQueue.Post(it->second.tcpSock, pack);
 		}
 		else
 		{
 			CPacket pack(102);
-			send(it->second.tcpSock, pack.Data(), pack.Size(), 0);
+			m_sendQueue.Post(it->second.tcpSock, pack);
 		}
 		
 	}
-	return 0;
+	return wait;
 }
 
 int UDPPassNetWork::TestOnline()
 {
-	while (!m_stop)
+	bool isUpdate = false;
+	long long tick = GetTick();
+	m_mutex.lock();
+	for (std::map<long long, MUserInfo>::iterator it = m_mapAddrs.begin(); it != m_mapAddrs.end();)
 	{
-		if (m_mapAddrs.size() > 0)
+		//和上一次交互的时间大于5秒钟
+		if (tick - it->second.last > ONLINE_TIMEOUT)
 		{
-			bool isUpdate = false;
-			for (std::map<long long, MUserInfo>::iterator it = m_mapAddrs.begin(); it != m_mapAddrs.end(); it++)
-			{
-				//获得当前时间错（毫秒级别）
-				struct timeval tv;
-				gettimeofday(&tv, NULL);
-				long long tick = tv.tv_sec * 1000 + tv.tv_usec / 1000;
-				//和上一次交互的时间大于5秒钟
-				if (tick - it->second.last > (5000))
-				{
-					m_mapAddrs.erase(it);
-					isUpdate = true;
-				}
-			}
-			if (isUpdate)
-			{
-				SendAddrs();
-			}
+			printf("offline id:%lld\n", (long long)it->first);
+			m_mapPortStep.erase(it->first);
+			m_mapLocal.erase(it->first);
+			it = m_mapAddrs.erase(it);
+			isUpdate = true;
+		}
+		else
+		{
+			it++;
 		}
-		usleep(1000 * 1000 * 3);
+	}
+	m_mutex.unlock();
+	if (isUpdate)
+	{
+		NotifyAddrs();
 	}
 	return 0;
 }
@@ -440,9 +606,162 @@ void UDPPassNetWork::EraseAddrBySocket(int sock)
 	{
 		if (it->second.tcpSock == sock)
 		{
+			m_mapPortStep.erase(it->first);
+			m_mapLocal.erase(it->first);
 			m_mapAddrs.erase(it);
 			break;
 		}
 	}
 	m_mutex.unlock();
 }
+
+CPacket UDPPassNetWork::GetPunchPack(const MUserInfo& peer, unsigned long long session, const MLocalAddrs* pLocal)
+{
+	MPunchInfo info(peer);
+	info.session = session;
+	info.startDelay = PUNCH_START_DELAY;
+	info.probeCount = PUNCH_PROBE_COUNT;
+	info.probeInterval = PUNCH_PROBE_INTERVAL;
+	//对端端口变过，说明是顺序分配型NAT，按变化量预测一段端口
+	std::map<long long, short>::iterator it = m_mapPortStep.find(peer.id);
+	if (it != m_mapPortStep.end())
+	{
+		info.portRange = PUNCH_PORT_RANGE;
+		info.portStep = it->second;
+	}
+	//对端的局域网地址：别的节点转来的请求自带，本节点的用户查表
+	if (pLocal != NULL)
+	{
+		info.peerLocal = *pLocal;
+	}
+	else
+	{
+		std::map<long long, MLocalAddrs>::iterator itLocal = m_mapLocal.find(peer.id);
+		if (itLocal != m_mapLocal.end())
+		{
+			info.peerLocal = itLocal->second;
+		}
+	}
+	return CPacket(105, (unsigned char*)&info, sizeof(MPunchInfo));
+}
+
+long long UDPPassNetWork::GetTick()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+bool UDPPassNetWork::ForwardPair(const ConnectIds& ids)
+{
+	if (m_cluster.IsLocal(ids.id1))
+	{
+		return false;
+	}
+	m_mutex.lock();
+	std::map<long long, MUserInfo>::iterator it0 = m_mapAddrs.find(ids.id0);
+	if (it0 == m_mapAddrs.end())
+	{
+		m_mutex.unlock();
+		return false;
+	}
+	MClusterPair pair;
+	pair.session = ++m_punchSession;
+	pair.ids = ids;
+	pair.user = it0->second;
+	std::map<long long, MLocalAddrs>::iterator itLocal = m_mapLocal.find(ids.id0);
+	if (itLocal != m_mapLocal.end())
+	{
+		pair.local = itLocal->second;
+	}
+	m_mutex.unlock();
+	CPacket pack(202, (unsigned char*)&pair, sizeof(MClusterPair));
+	return m_cluster.SendTo(m_cluster.Owner(ids.id1), pack) > 0;
+}
+
+void UDPPassNetWork::Redirect(int sock, long long id)
+{
+	MNodeInfo node = m_cluster.Owner(id);
+	CPacket pack(108, (unsigned char*)&node, sizeof(MNodeInfo));
+	m_sendQueue.Post(sock, pack);
+	printf("redirect id:%lld -> %s:%d\n", id, node.ip, node.tcpPort);
+}
+
+int UDPPassNetWork::DealCluster(CPacket& pack, sockaddr_in& addr)
+{
+	if (pack.sData.size() < sizeof(MClusterPair))
+	{
+		return -1;
+	}
+	//202~204会让本节点给用户发打洞包，只认集群成员发来的，不然谁都能伪造
+	if (!m_cluster.IsMember(addr))
+	{
+		printf("%s(%d):%s cluster message %d from unknown node %s:%d\n", __FILE__, __LINE__, __FUNCTION__,
+			pack.nCmd, inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+		return -1;
+	}
+	MClusterPair pair;
+	memcpy(&pair, pack.sData.c_str(), sizeof(MClusterPair));
+	switch (pack.nCmd)
+	{
+		case 202://别的节点转来的配对请求：目标在我这
+		{
+			m_mutex.lock();
+			std::map<long long, MUserInfo>::iterator it1 = m_mapAddrs.find(pair.ids.id1);
+			if (it1 == m_mapAddrs.end())
+			{
+				m_mutex.unlock();
+				CPacket nak(204, (unsigned char*)&pair, sizeof(MClusterPair));
+				m_cluster.SendTo(m_cluster.Owner(pair.ids.id0), nak);
+				break;
+			}
+			//通知目标和发起方打洞，把目标信息回给发起方所在节点
+			CPacket punch = GetPunchPack(pair.user, pair.session, &pair.local);
+			m_sendQueue.Post(it1->second.tcpSock, punch);
+			pair.user = it1->second;
+			std::map<long long, MLocalAddrs>::iterator itLocal = m_mapLocal.find(pair.ids.id1);
+			memset(&pair.local, 0, sizeof(pair.local));
+			if (itLocal != m_mapLocal.end())
+			{
+				pair.local = itLocal->second;
+			}
+			m_mutex.unlock();
+			CPacket ack(203, (unsigned char*)&pair, sizeof(MClusterPair));
+			m_cluster.SendTo(m_cluster.Owner(pair.ids.id0), ack);
+			break;
+		}
+		case 203://目标节点同意配对：通知发起方
+		case 204://目标不在线
+		{
+			m_mutex.lock();
+			std::map<long long, MUserInfo>::iterator it0 = m_mapAddrs.find(pair.ids.id0);
+			if (it0 != m_mapAddrs.end())
+			{
+				CPacket reply = (pack.nCmd == 203) ? GetPunchPack(pair.user, pair.session, &pair.local) : CPacket(106);
+				m_sendQueue.Post(it0->second.tcpSock, reply);
+			}
+			m_mutex.unlock();
+			break;
+		}
+	}
+	return 0;
+}
+
+int UDPPassNetWork::Rebalance()
+{
+	m_mutex.lock();
+	for (std::map<long long, MUserInfo>::iterator it = m_mapAddrs.begin(); it != m_mapAddrs.end(); it++)
+	{
+		if (!m_cluster.IsLocal(it->first))
+		{
+			Redirect(it->second.tcpSock, it->first);
+		}
+	}
+	m_mutex.unlock();
+	return 0;
+}
+
+void UDPPassNetWork::AddSeed(const std::string& ip, unsigned short gossipPort)
+{
+	m_cluster.AddSeed(ip, gossipPort);
+}
@@ -14,9 +14,27 @@
 #include <mutex>
 #include "Common.h"
 #include "MThread.h"
+#include "MTimer.h"
+#include "MReactor.h"
+#include "MCluster.h"
+#include "MSendQueue.h"
 class UDPPassNetWork : public CMFuncBase
 {
 private:
+	enum
+	{
+		PUNCH_START_DELAY		= 300,	//打洞开始延迟(毫秒)，要大于两端TCP下发的时间差
+		PUNCH_PROBE_COUNT		= 10,	//探测轮数
+		PUNCH_PROBE_INTERVAL	= 20,	//每轮间隔(毫秒)
+		PUNCH_PORT_RANGE		= 4,	//顺序分配型NAT的端口预测范围
+		NOTIFY_WINDOW			= 50,	//上下线通知的合并窗口(毫秒)
+		ADDRS_INTERVAL			= 200,	//同一个用户最少隔多久收一次地址列表(毫秒)
+		ONLINE_INTERVAL			= 3000,	//检查在线的间隔(毫秒)
+		ONLINE_SLACK			= 500,	//检查在线可以推迟的时间，和其他定时器合并
+		ONLINE_TIMEOUT			= 5000,	//多久没有心跳就算下线(毫秒)
+		ACCEPT_RETRY			= 100,	//accept出错(比如fd用完)后多久再试(毫秒)
+		POOL_MIN				= 4,	//线程池下限：三个常驻循环加一个跑定时任务
+	};
 	std::map<long long, MUserInfo>	m_mapAddrs;
 	sockaddr_in						m_udpServAddr;
 	sockaddr_in						m_tcpServAddr;
@@ -25,28 +43,69 @@ private:
 	CMThreadPool					m_thpool;
 	std::atomic<bool>				m_stop;
 	std::mutex						m_mutex;
+	std::atomic<unsigned long long>	m_punchSession;		//打洞序号
+	std::map<long long, short>		m_mapPortStep;		//每个用户UDP端口的变化量(端口预测用)
+	std::map<long long, MLocalAddrs>	m_mapLocal;			//每个用户的局域网地址
+	struct MAddrsSent
+	{
+		unsigned long long	version;	//发过去的是第几版用户列表
+		long long			tick;		//什么时候发的
+	};
+	std::map<long long, MAddrsSent>	m_mapAddrsSent;		//每个用户收到的地址列表，限制发送频率用
+	MCluster						m_cluster;			//集群：按id划分用户到各个节点
+	MSendQueue						m_sendQueue;		//TCP发送都走这里，不在处理线程里阻塞
+	std::atomic<bool>				m_addrsDirty;		//用户列表变了，还没广播
+	std::atomic<unsigned long long>	m_addrsVersion;		//用户列表每变一次加一
+	std::atomic<int>				m_notifyWindow;		//合并窗口(毫秒)
+	std::atomic<CMTimer::TimerId>	m_notifyTimer;		//窗口结束时广播的定时器
+	std::mutex						m_notifyMutex;		//定广播定时器和析构互斥，析构取消以后不会再定新的
+	CMTimer::TimerId				m_onlineTimer;		//检查在线的定时器
+	CMReactor						m_reactor;			//TCP连接和UDP收包都是反应器上的协程，不再一个连接占一个线程
 private:
-	//TCP服务器主要逻辑
-	int ThreadTcpProc();
+	//TCP服务器主要逻辑：接入客户端，每个客户一个协程
+	CMCo<> AcceptTcp();
 	//UDP服务器主要逻辑
-	int ThreadUdpProc();
+	CMCo<> RecvUdp();
 	//处理每个TCP客户
-	int ThreadTcpClnt(void* arg);
-	//测试用户是否在线
+	CMCo<> ServeTcpClnt(int sock);
+	//合并窗口结束，统一广播
+	int FlushAddrs();
+	//ms毫秒后广播(已经关闭就不定了)
+	void ArmFlush(int ms);
+	//测试用户是否在线(定时器回调)
 	int TestOnline();
 	//获得所有用户地址信息(返回值：包的命令位-1表示错误)
 	CPacket GetSendAddr(long long id);
 	//根据socket删除信息
 	void EraseAddrBySocket(int sock);
+	//生成打洞协调包(105)：对端地址+开始时间+序号+端口预测范围(调用方持锁，要读端口变化量和局域网地址表)
+	CPacket GetPunchPack(const MUserInfo& peer, unsigned long long session, const MLocalAddrs* pLocal = NULL);
+	//获得当前时间(毫秒)
+	static long long GetTick();
+	//目标id归别的节点管，把配对请求转发过去(返回true表示已转发)
+	bool ForwardPair(const ConnectIds& ids);
+	//重定向用户到管理它的节点
+	void Redirect(int sock, long long id);
+	//处理其他节点发来的消息
+	int DealCluster(CPacket& pack, sockaddr_in& addr);
+	//集群成员变化后，把不归自己管的用户重定向走
+	int Rebalance();
 public:
-	UDPPassNetWork(const std::string& ip, short tcpPort, short udpPort);
+	UDPPassNetWork(const std::string& ip, short tcpPort, short udpPort, unsigned short gossipPort = 0);
 	~UDPPassNetWork();
+	//加入集群的种子节点
+	void AddSeed(const std::string& ip, unsigned short gossipPort);
 	//开启
 	int Invoke();
 	//处理用户请求
 	int DealUdp(CPacket& pack, sockaddr_in& clnt_addr);
 	int DealTcp(CPacket& pack,int sock);
-	//给所有用户发送地址
-	int SendAddrs();
+	//用户列表变了，合并一个窗口后再广播
+	void NotifyAddrs();
+	//设置上下线通知的合并窗口(毫秒)
+	void SetNotifyWindow(int ms);
+	//给列表过期的用户发送地址，每个用户最少隔ADDRS_INTERVAL发一次(调用方持锁)
+	//返回还要过多少毫秒再发给被推迟的用户，-1表示都发了
+	long long SendAddrs();
 };
 
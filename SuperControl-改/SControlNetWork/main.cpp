@@ -7,11 +7,38 @@
 #include <arpa/inet.h>
 #include <memory>
 #include <vector>
+#include <cstdlib>
 #include "UDPPassNetWork.h"
 
-int main()
+//用法：SControlNetWork [ip tcpPort udpPort [gossipPort [种子ip:gossipPort ...]]]
+int main(int argc, char* argv[])
 {
-	UDPPassNetWork net_work("192.168.1.100", 16888, 18888);
+	std::string ip = "192.168.1.100";
+	short tcpPort = 16888;
+	short udpPort = 18888;
+	unsigned short gossipPort = 0;
+	if (argc >= 4)
+	{
+		ip = argv[1];
+		tcpPort = (short)atoi(argv[2]);
+		udpPort = (short)atoi(argv[3]);
+	}
+	if (argc >= 5)
+	{
+		gossipPort = (unsigned short)atoi(argv[4]);
+	}
+	UDPPassNetWork net_work(ip, tcpPort, udpPort, gossipPort);
+	for (int i = 5; i < argc; i++)
+	{
+		std::string seed = argv[i];
+		size_t pos = seed.find(':');
+		if (pos == std::string::npos)
+		{
+			printf("bad seed:%s\n", argv[i]);
+			continue;
+		}
+		net_work.AddSeed(seed.substr(0, pos), (unsigned short)atoi(seed.c_str() + pos + 1));
+	}
 	net_work.Invoke();
 	
 	printf("input any key done...\n");
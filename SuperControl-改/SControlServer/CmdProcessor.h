@@ -4,6 +4,11 @@
 #include "resource.h"
 #include "ServerSocket.h"
 #include "LockMachineDlg.h"
+#include "MThread.h"
+#include "MByteQueue.h"
+#include "MCapture.h"
+#include "MTileCodec.h"
+#include "Screenshot.h"
 #include <io.h>
 #include <atlimage.h>
 #include <list>
@@ -13,7 +18,7 @@
 #define WM_UNLOCKMACHINE	(WM_USER + 2)
 
 class CCmdProcessor;
-typedef void (CCmdProcessor::*CMD_FUNC) (CPacket& recvPack, std::list<CPacket>& sendPacks);
+typedef void (CCmdProcessor::*CMD_FUNC) (CPacket& recvPack, CMByteQueue& sendPacks);
 
 class CCmdProcessor
 {
@@ -23,11 +28,17 @@ private:
 	UINT						m_nThreadIdLock;
 	HANDLE						m_hEventLock;
 	std::map<int, CMD_FUNC>		m_mapFuncs;
+	//单次截屏(5)：一份DIB和编码器，缓冲区反复用；同时来的请求排队，编码本身在EncodePool里按块行并行
+	CMCapture					m_capture;
+	CMTileEncoder				m_encoder;
+	std::vector<uint8_t>		m_stream;
+	std::mutex					m_screenMutex;
 public:
 	CCmdProcessor()
 	{
 		//pServer = CServerSocket::GetInstance();
 		m_hThreadLock = INVALID_HANDLE_VALUE;
+		CScreenshot::Parallelize(m_encoder);
 
 		//建立消息映射机制
 		struct
@@ -61,7 +72,43 @@ public:
 		
 	}
 
-	void DispatchCommand(CPacket& recvPack, std::list<CPacket>& sendPacks)
+	//命令的优先级：鼠标、锁屏这类交互命令插到截屏和文件传输前面
+	static MPriority Priority(int nCmd)
+	{
+		switch (nCmd)
+		{
+		case 6:		//鼠标
+		case 7:		//锁机
+		case 8:		//解锁
+			return MP_HIGH;
+		case 3:		//下载文件
+		case 5:		//截屏
+		case 9:		//推屏
+			return MP_BULK;
+		}
+		return MP_NORMAL;
+	}
+	//命令的统计标签：线程池按它分开记排队和执行时长
+	static MTaskTag Tag(int nCmd)
+	{
+		switch (nCmd)
+		{
+		case 5:
+		case 9:
+			return MTAG_SCREEN;
+		case 2:
+		case 3:
+		case 4:
+			return MTAG_FILE;
+		case 6:
+		case 7:
+		case 8:
+			return MTAG_INPUT;
+		}
+		return MTAG_OTHER;
+	}
+
+	void DispatchCommand(CPacket& recvPack, CMByteQueue& sendPacks)
 	{
 		std::map<int, CMD_FUNC>::iterator it = m_mapFuncs.find(recvPack.nCmd);
 		if (it != m_mapFuncs.end())
@@ -70,9 +117,17 @@ public:
 		}
 	}
 
+	//回复先全放进lstSends再一起发的调用方(截屏、UDP)，不限水位
+	void DispatchCommand(CPacket& recvPack, std::list<CPacket>& sendPacks)
+	{
+		CMByteQueue queue(NULL, NULL, 0, 0);
+		DispatchCommand(recvPack, queue);
+		queue.MoveTo(sendPacks);
+	}
+
 
 private:
-	void GetDriveInfo(CPacket& recvPack, std::list<CPacket>& sendPacks)
+	void GetDriveInfo(CPacket& recvPack, CMByteQueue& sendPacks)
 	{
 		DRIVEINFO driveInfo;
 		for (int i = 1; i <= 26; i++)
@@ -82,9 +137,9 @@ private:
 				driveInfo.drive[driveInfo.drive_count++] = 'A' + i - 1;
 			}
 		}
-		sendPacks.push_back(CPacket(recvPack.nCmd, (BYTE*)&driveInfo, sizeof(DRIVEINFO)));
+		sendPacks.Push(CPacket(recvPack.nCmd, (BYTE*)&driveInfo, sizeof(DRIVEINFO)));
 	}
-	void GetFileInfo(CPacket& recvPack, std::list<CPacket>& sendPacks)
+	void GetFileInfo(CPacket& recvPack, CMByteQueue& sendPacks)
 	{
 		std::string path = recvPack.sData;
 		if (_chdir(path.c_str()) == 0)
@@ -95,7 +150,7 @@ private:
 			{
 				//第一个就没找到：当前这个就是空的
 				fileInfo.isNull = 1;
-				sendPacks.push_back(CPacket(recvPack.nCmd, (BYTE*)&fileInfo, sizeof(FILEINFO)));
+				sendPacks.Push(CPacket(recvPack.nCmd, (BYTE*)&fileInfo, sizeof(FILEINFO)));
 				return;
 			}
 			else
@@ -104,33 +159,36 @@ private:
 				{
 					//正在发送
 					fileInfo.isNull = 0;
-					sendPacks.push_back(CPacket(recvPack.nCmd, (BYTE*)&fileInfo, sizeof(FILEINFO)));
+					sendPacks.Push(CPacket(recvPack.nCmd, (BYTE*)&fileInfo, sizeof(FILEINFO)));
 					memset(&fileInfo, 0, sizeof(FILEINFO));
+					//目录很大时让排着的交互命令先走
+					CMThreadPool::Preempt();
 
 				} while (_findnext(first, &fileInfo.data) == 0);
 				//发完了：当前这个就是空的
 				fileInfo.isNull = 1;
-				sendPacks.push_back(CPacket(recvPack.nCmd, (BYTE*)&fileInfo, sizeof(FILEINFO)));
+				sendPacks.Push(CPacket(recvPack.nCmd, (BYTE*)&fileInfo, sizeof(FILEINFO)));
 			}
 		}
 		else
 		{
 			FILEINFO fileInfo{};
 			fileInfo.isNull = 1;
-			sendPacks.push_back(CPacket(recvPack.nCmd, (BYTE*)&fileInfo, sizeof(FILEINFO)));
+			sendPacks.Push(CPacket(recvPack.nCmd, (BYTE*)&fileInfo, sizeof(FILEINFO)));
 		}
 	}
-	void DownLoadFile(CPacket& recvPack, std::list<CPacket>& sendPacks)
+	void DownLoadFile(CPacket& recvPack, CMByteQueue& sendPacks)
 	{
+		//多个线程可能同时在下载，缓冲区不能是静态的
 		static const int buffer_size = 1024 * 10;
-		static char buffer[buffer_size]{};
+		std::vector<char> buffer(buffer_size);
 		std::string path = recvPack.sData;
 		long long fileLen = 0;
 		FILE* pFile = fopen(path.c_str(), "rb+");
 		if (pFile == NULL)
 		{
 			//把长度发给控制端，0表示文件为空，或者没有权限
-			sendPacks.push_back(CPacket(recvPack.nCmd, (BYTE*)&fileLen, 8));
+			sendPacks.Push(CPacket(recvPack.nCmd, (BYTE*)&fileLen, 8));
 			return;
 		}
 		//获得文件长度
@@ -138,18 +196,23 @@ private:
 		fileLen = _ftelli64(pFile);
 		_fseeki64(pFile, 0, SEEK_SET);
 		//把长度发给控制端
-		sendPacks.push_back(CPacket(recvPack.nCmd, (BYTE*)&fileLen, 8));
-		//读取一点发一点
+		sendPacks.Push(CPacket(recvPack.nCmd, (BYTE*)&fileLen, 8));
+		//读取一点发一点：积压到高水位时Push会等发送端发出去一些，整个文件不会都堆在内存里
 		int readLen = 0;
-		while ((readLen = fread(buffer, 1, buffer_size, pFile)) > 0)
+		while ((readLen = fread(buffer.data(), 1, buffer_size, pFile)) > 0)
 		{
-			sendPacks.push_back(CPacket(recvPack.nCmd, (BYTE*)buffer, readLen));
-			memset(buffer, 0, buffer_size);
+			if (sendPacks.Push(CPacket(recvPack.nCmd, (BYTE*)buffer.data(), readLen)) == CMByteQueue::MB_ABORTED)
+			{
+				//连接断了，不用再读了
+				break;
+			}
+			//抢占点：每读一块看一下有没有交互命令在排队
+			CMThreadPool::Preempt();
 		}
 		//发完关闭
 		fclose(pFile);
 	}
-	void DelFile(CPacket& recvPack, std::list<CPacket>& sendPacks)
+	void DelFile(CPacket& recvPack, CMByteQueue& sendPacks)
 	{
 		std::string path = recvPack.sData;
 		WCHAR widePath[MAX_PATH]{};
@@ -163,41 +226,35 @@ private:
 		{
 			success = 0;
 		}
-		sendPacks.push_back(CPacket(recvPack.nCmd, (BYTE*)&success, sizeof(int)));
+		sendPacks.Push(CPacket(recvPack.nCmd, (BYTE*)&success, sizeof(int)));
 	}
-	void ScreenWatch(CPacket& recvPack, std::list<CPacket>& sendPacks)
+	//截屏：截到DIB里按块压缩(MTileCodec)，每次请求都是一个整帧
+	//请求里可以带1字节的质量：0或者不带是无损，1~100是有损(文字多的块还是无损)
+	void ScreenWatch(CPacket& recvPack, CMByteQueue& sendPacks)
 	{
-
-		CImage screen;
-		HDC hScreen = ::GetDC(NULL);
-		int nBitperPixel = GetDeviceCaps(hScreen, BITSPIXEL);
-		int nWidth = GetDeviceCaps(hScreen, HORZRES);
-		int nHeight = GetDeviceCaps(hScreen, VERTRES);
-		screen.Create(nWidth, nHeight, nBitperPixel);
-		BitBlt(screen.GetDC(), 0, 0, nWidth, nHeight, hScreen, 0, 0, SRCCOPY);
-
-		ReleaseDC(NULL, hScreen);
-
-		HGLOBAL hMem = GlobalAlloc(GMEM_MOVEABLE, 0);
-		if (hMem == NULL) return;
-		IStream* pStream = NULL;
-		HRESULT ret = CreateStreamOnHGlobal(hMem, TRUE, &pStream);
-
-		if (ret == S_OK)
+		//抢占点：截屏前先让排着的交互命令执行(不能持着m_screenMutex让，让出去的可能又是截屏)
+		CMThreadPool::Preempt();
+		int quality = recvPack.sData.empty() ? 0 : (BYTE)recvPack.sData[0];
+		CPacket pack;
 		{
-			screen.Save(pStream, Gdiplus::ImageFormatPNG);
-			LARGE_INTEGER li = { 0 };
-			pStream->Seek(li, STREAM_SEEK_SET, NULL);
-			LPVOID pData = GlobalLock(hMem);
-			sendPacks.push_back(CPacket(recvPack.nCmd, (BYTE*)pData, GlobalSize(hMem), false));
-
-			GlobalUnlock(hMem);
+			std::lock_guard<std::mutex> lock(m_screenMutex);
+			if (!m_capture.Grab())
+			{
+				return;
+			}
+			m_encoder.SetFormat((quality > 0) ? MTF_LOSSY : MTF_LOSSLESS);
+			m_encoder.SetQuality(quality);
+			m_encoder.Reset();
+			m_encoder.Encode(m_capture.Bits(), m_capture.Width(), m_capture.Height(), m_capture.Stride(), m_stream);
+			if (m_stream.empty())
+			{
+				return;
+			}
+			pack = CPacket(recvPack.nCmd, m_stream.data(), (DWORD)m_stream.size(), false);
 		}
-		GlobalFree(hMem);
-		screen.ReleaseDC();
-		screen.Destroy();
+		sendPacks.Push(pack);
 	}
-	void ControlMouse(CPacket& recvPack, std::list<CPacket>& sendPacks)
+	void ControlMouse(CPacket& recvPack, CMByteQueue& sendPacks)
 	{
 		//控制端发来的鼠标信息
 		MOUSEINFO mouseInfo;
@@ -270,9 +327,9 @@ private:
 			break;
 		}
 		//给个回应
-		sendPacks.push_back(CPacket(recvPack.nCmd));
+		sendPacks.Push(CPacket(recvPack.nCmd));
 	}
-	void LockMachine(CPacket& recvPack, std::list<CPacket>& sendPacks)
+	void LockMachine(CPacket& recvPack, CMByteQueue& sendPacks)
 	{
 		if (m_hThreadLock == INVALID_HANDLE_VALUE)
 		{
@@ -290,13 +347,13 @@ private:
 			PostThreadMessage(m_nThreadIdLock, WM_LOCKMACHINE, NULL, NULL);
 		}
 		//给个回应
-		sendPacks.push_back(CPacket(recvPack.nCmd));
+		sendPacks.Push(CPacket(recvPack.nCmd));
 	}
-	void UnLockMachine(CPacket& recvPack, std::list<CPacket>& sendPacks)
+	void UnLockMachine(CPacket& recvPack, CMByteQueue& sendPacks)
 	{
 		PostThreadMessage(m_nThreadIdLock, WM_UNLOCKMACHINE, NULL, NULL);
 		//给个回应
-		sendPacks.push_back(CPacket(recvPack.nCmd));
+		sendPacks.Push(CPacket(recvPack.nCmd));
 	}
 	static unsigned __stdcall ThreadEntryLock(void* arg)
 	{
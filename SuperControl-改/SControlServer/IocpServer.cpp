@@ -2,7 +2,7 @@
 #include "IocpServer.h"
 
 CCmdProcessor cmdProc;
-CMQueue<CPacket> lstScreenPcks;
+CMFrameRing screenFrames;
 std::mutex mtx_;
 
 CMClient::CMClient(CIocpServer* serv, HANDLE iocp) :
@@ -18,6 +18,9 @@ CMClient::CMClient(CIocpServer* serv, HANDLE iocp) :
 	m_iocpServer = serv;
 	m_iocp = iocp;
 	m_tick = GetTickCount64();
+	m_pending = 1;
+	m_recvStop = false;
+	m_send->m_queue.SetWatermark(serv->m_sendHigh, serv->m_sendLow);
 
 	m_clntSocket = WSASocket(PF_INET, SOCK_STREAM, 0, NULL, 0, WSA_FLAG_OVERLAPPED);
 	if (m_clntSocket == INVALID_SOCKET)
@@ -28,6 +31,95 @@ CMClient::CMClient(CIocpServer* serv, HANDLE iocp) :
 	m_iocpServer->IocpBindSocket(m_clntSocket);
 }
 
+void CMClient::StartStream(CPacket& pack, const char* rest, size_t size)
+{
+	//推屏的一方(截屏、发送)和接收各自结束，后结束的关连接
+	m_pending = 2;
+	CMClient* client = this;
+	m_stream = std::make_shared<CMScreenStream>(m_send->m_queue, m_iocpServer->m_pool, [client]() {
+		client->StopRecv();
+		if (client->m_send->m_queue.Close())
+		{
+			client->Release();
+		}
+	});
+	m_stream->Control(pack);
+	m_recvRest.assign(rest, size);
+	ParseControl();
+	NextRecv();
+}
+
+void CMClient::StreamRecv(const char* data, int size)
+{
+	if (size <= 0)
+	{
+		EndRecv();
+		return;
+	}
+	m_recvRest.append(data, size);
+	ParseControl();
+	if (m_recvRest.size() > STREAM_RECV_MAX)
+	{
+		printf("%s(%d):%s bad stream control data:%d\r\n", __FILE__, __LINE__, __FUNCTION__, (int)m_recvRest.size());
+		EndRecv();
+		return;
+	}
+	NextRecv();
+}
+
+//攒着的数据里凑出整包交给推屏会话
+void CMClient::ParseControl()
+{
+	while (!m_recvRest.empty())
+	{
+		DWORD len = (DWORD)m_recvRest.size();
+		CPacket pack((BYTE*)m_recvRest.data(), len);
+		if (len == 0)
+		{
+			break;
+		}
+		m_recvRest.erase(0, len);
+		if (pack.nCmd == CMScreenStream::STREAM_CMD)
+		{
+			m_stream->Control(pack);
+		}
+	}
+}
+
+//接着等下一个控制包；推屏已经结束或者投递失败就不收了
+void CMClient::NextRecv()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if (!m_recvStop)
+	{
+		DWORD flag = 0;
+		memset(&m_recv->m_overlapped, 0, sizeof(m_recv->m_overlapped));
+		if ((WSARecv(m_clntSocket, &m_recv->m_wsaBuf, 1, &m_recv->m_received, &flag, &m_recv->m_overlapped, NULL) != SOCKET_ERROR)
+			|| (WSAGetLastError() == WSA_IO_PENDING))
+		{
+			return;
+		}
+		printf("%s(%d):%s recv error:%d\r\n", __FILE__, __LINE__, __FUNCTION__, WSAGetLastError());
+	}
+	lock.unlock();
+	EndRecv();
+}
+
+//接收这方结束：推屏跟着停下
+void CMClient::EndRecv()
+{
+	m_stream->Stop();
+	Release();
+}
+
+//推屏结束了：取消等着的接收，完成端口会报接收失败，由那边结束接收
+void CMClient::StopRecv()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_recvStop = true;
+	CancelIoEx((HANDLE)m_clntSocket, &m_recv->m_overlapped);
+}
+
 void Screen2(CPacket& pack)
 {
 
@@ -1,8 +1,11 @@
 #pragma once
 #include "MThread.h"
 #include "CmdProcessor.h"
-#include "MQueue.h"
+#include "MFrameRing.h"
+#include "MByteQueue.h"
+#include "MTimer.h"
 #include "Screenshot.h"
+#include "MScreenStream.h"
 #include <map>
 #include <list>
 #include <MSWSock.h>
@@ -12,7 +15,7 @@
 class CMClient;
 class CIocpServer;
 extern CCmdProcessor cmdProc;
-extern CMQueue<CPacket> lstScreenPcks;
+extern CMFrameRing screenFrames;
 extern std::mutex mtx_;
 
 void Screen2(CPacket& pack);
@@ -62,25 +65,37 @@ public:
 	{
 		m_operator = op;
 		m_buffer.resize(1024 * 256);
+		//0字节的接收：只等有数据可读，数据在Func里用recv取
+		memset(&m_overlapped, 0, sizeof(m_overlapped));
+		m_wsaBuf.buf = m_buffer.data();
+		m_wsaBuf.len = 0;
 	}
 
 	int Func();
-	
+	int Failed();
 };
 typedef RecvOverlapped<MRecv> RECVOVERLAPPED;
 
+//发送：命令往m_queue里放回复，队列从空变非空时Start发队头；每次发完(完成端口通知，在IocpMain里处理)
+//Func接着发下一个。生产者积压到高水位会停在Push里，等这里发出去一些再继续
 template<CMOperator op>
 class SendtOverlapped : public CMFuncBase , public CMOverlapped
 {
 public:
-	std::list<CPacket> lstSendPacks;
+	CMByteQueue m_queue;
+	MPriority m_priority;			//回复按命令的优先级发
+	MTaskTag m_tag;
 	SendtOverlapped()
+		: m_queue(this, (MT_FUNC)&SendtOverlapped::Start)
 	{
 		m_operator = op;
-		m_buffer.resize(1024 * 256);
+		m_priority = MP_NORMAL;
+		m_tag = MTAG_NET;
 	}
 
+	int Start();
 	int Func();
+	int Failed();
 };
 typedef SendtOverlapped<MSend> SENDOVERLAPPED;
 
@@ -116,25 +131,68 @@ public:
 	HANDLE								m_iocp;
 	std::mutex							m_mutex;
 	ULONGLONG							m_tick;
+	std::atomic<int>					m_pending;		//还有几方没结束：命令和发送算一方，推屏时接收也算一方
+	std::shared_ptr<CMScreenStream>		m_stream;		//推屏会话，普通命令为空
+	std::string							m_recvRest;		//推屏连接上还没凑成整包的控制数据
+	bool								m_recvStop;		//推屏结束了，接收不用再投递(m_mutex保护)
 	CMClient(CIocpServer* serv,HANDLE iocp);
+	//两边都结束了，让IocpMain关连接
+	void PostClose()
+	{
+		PostQueuedCompletionStatus(m_iocp, 1, 1, &m_close->m_overlapped);
+	}
+	//一方结束了，最后一方让IocpMain关连接
+	void Release()
+	{
+		if (--m_pending == 0)
+		{
+			PostClose();
+		}
+	}
+	//命令9：连接不关，被控端一直推帧，后面收到的都是控制包；rest是和命令一起收上来的后续数据
+	void StartStream(CPacket& pack, const char* rest, size_t size);
+	//推屏连接上收到的size字节(小于等于0是断了)
+	void StreamRecv(const char* data, int size);
+private:
+	enum
+	{
+		STREAM_RECV_MAX	= 64 * 1024,		//控制包攒到这么多还凑不成包，当作连接坏了
+	};
+	void ParseControl();
+	void NextRecv();
+	void EndRecv();
+	void StopRecv();
 };
 
 class CIocpServer : public CMFuncBase
 {
 public:
-	CMThreadPool				m_pool;
+	CMThreadPool				m_pool;				//处理完成的收发、命令(bulk域)
+	CMThreadPool				m_ioPool;			//只跑IocpMain，单独一个线程，不和处理线程抢CPU
 	HANDLE						m_HIOCP;
 	std::mutex					m_mutex;
 	SOCKET						m_servSocket;
 	std::map<ULONGLONG, CMClient*> m_mapClients;
+	size_t						m_sendHigh;			//每个连接发送队列的高/低水位(字节)
+	size_t						m_sendLow;
+	CMTimer::TimerId			m_traceTimer;
 private:
+	enum
+	{
+		TRACE_INTERVAL	= 1000,		//导出发送队列、编码线程池统计的间隔(毫秒)
+	};
 	int IocpMain()
 	{
 		DWORD transferred;
 		ULONG_PTR completionKey;
 		LPOVERLAPPED lpOverlapped;
-		while (GetQueuedCompletionStatus(m_HIOCP, &transferred, &completionKey, &lpOverlapped, INFINITE))
+		while (true)
 		{
+			BOOL ok = GetQueuedCompletionStatus(m_HIOCP, &transferred, &completionKey, &lpOverlapped, INFINITE);
+			if (!ok && (lpOverlapped == NULL))
+			{
+				break;
+			}
 			ULONGLONG t1{}, t2{};
 			//结束IOCP
 			if ((transferred == -1) && (completionKey == -1) && (lpOverlapped == NULL))
@@ -143,27 +201,44 @@ private:
 			}
 			//根据信息，做对应的处理
 			CMOverlapped* pOverlapped = (CMOverlapped*) lpOverlapped;
+			if (!ok)
+			{
+				//发送失败(控制端断了)：丢掉积压的，放开等着的生产者
+				//接收失败(断了或者推屏结束时取消了)：这个连接不再收；其他的和以前一样退出
+				if (pOverlapped->m_operator == CMOperator::MSend)
+				{
+					((SENDOVERLAPPED*)pOverlapped)->Failed();
+					continue;
+				}
+				if (pOverlapped->m_operator == CMOperator::MRecv)
+				{
+					((RECVOVERLAPPED*)pOverlapped)->Failed();
+					continue;
+				}
+				break;
+			}
 			switch (pOverlapped->m_operator)
 			{
 				//让线程池处理连接事物
 				case CMOperator::MAccept:
 				{
 					ACCEPTOVERLAPPED* po = (ACCEPTOVERLAPPED*)pOverlapped;
-					m_pool.DispatchWork(CMWork(po, (MT_FUNC)&ACCEPTOVERLAPPED::Func));
+					m_pool.DispatchWork(CMWork(po, (MT_FUNC)&ACCEPTOVERLAPPED::Func), MP_HIGH, MTAG_NET);
 					break;
 				}
-				//让线程池处理接收事物
+				//让线程池处理接收事物(收包很快，先收上来才知道命令的优先级)
 				case CMOperator::MRecv:
 				{
 					RECVOVERLAPPED* po = (RECVOVERLAPPED*)pOverlapped;
-					m_pool.DispatchWork(CMWork(po, (MT_FUNC)&RECVOVERLAPPED::Func));
+					m_pool.DispatchWork(CMWork(po, (MT_FUNC)&RECVOVERLAPPED::Func), MP_HIGH, MTAG_NET);
 					break;
 				}
-				//让线程池处理发送事物
+				//发完一块：只是记账再投递下一次发送，不用进线程池，线程池都在等水位时也能发
 				case CMOperator::MSend:
 				{
 					SENDOVERLAPPED* po = (SENDOVERLAPPED*)pOverlapped;
-					m_pool.DispatchWork(CMWork(po, (MT_FUNC)&SENDOVERLAPPED::Func));
+					po->m_received = transferred;
+					po->Func();
 					break;
 				}
 				//关闭连接，释放内存，去除这个客户
@@ -183,21 +258,25 @@ private:
 		return -1;
 	}
 
+	//截一帧放进帧缓冲，发送端只取最新的，来不及发的旧帧被覆盖
+	//现在没有地方调用(原来的lstScreenPcks也是只放不取)：推屏走CMScreenStream，按额度流控、只发变了的块，不能跳帧
 	int Screen()
 	{
-		
-		if (lstScreenPcks.size() < 3)
+		MFrame* frame = screenFrames.BeginWrite();
+		std::list<CPacket> lst;
+		CPacket pack(5);
+		cmdProc.DispatchCommand(pack, lst);
+		if (lst.size() > 0)
 		{
-			std::list<CPacket> lst;
-			CPacket pack(5);
-			cmdProc.DispatchCommand(pack, lst);
-			lstScreenPcks.push_back(lst.front());
-		}		
+			frame->Assign(lst.front().sData.data(), lst.front().sData.size());
+			screenFrames.Publish();
+		}
 		return 0;
 	}
 
 public:
-	CIocpServer() : m_pool(10) , m_HIOCP(INVALID_HANDLE_VALUE)
+	CIocpServer() : m_pool(10), m_ioPool(1), m_HIOCP(INVALID_HANDLE_VALUE),
+		m_sendHigh(CMByteQueue::DEFAULT_HIGH), m_sendLow(CMByteQueue::DEFAULT_LOW), m_traceTimer(0)
 	{ 
 		
 		InitEnv();
@@ -217,6 +296,10 @@ public:
 
 	~CIocpServer()
 	{
+		if (m_traceTimer != 0)
+		{
+			CMTimer::Global().Cancel(m_traceTimer);
+		}
 		ResdEnv();
 		PostQueuedCompletionStatus(m_HIOCP, -1, -1, NULL);
 		std::map<ULONGLONG, CMClient*>::iterator it = m_mapClients.begin();
@@ -227,17 +310,39 @@ public:
 		m_mutex.lock();
 		m_mapClients.clear();
 		m_mutex.unlock();
-
-		lstScreenPcks.clear();
 	}
 
 	void StartServer()
 	{
+		m_pool.SetDomain(MD_BULK);
+		//平时两个线程够用，多个控制端同时下载、看屏幕时按排队时间加线程
+		m_pool.SetElastic(2, std::max(10, CMThreadPool::Cores() * 2));
+		m_ioPool.SetDomain(MD_IO);
 		m_pool.Invoke();
-		m_pool.DispatchWork(CMWork(this, (MT_FUNC)&CIocpServer::IocpMain));
+		m_ioPool.Invoke();
+		m_ioPool.DispatchWork(CMWork(this, (MT_FUNC)&CIocpServer::IocpMain));
+		//发送队列、截屏编码线程池的统计和CMThreadPool的写进同一个trace文件
+		const char* path = getenv("SCONTROL_TRACE");
+		if ((path != NULL) && (*path != '\0'))
+		{
+			std::string file(path);
+			m_traceTimer = CMTimer::Global().Every(TRACE_INTERVAL, CMTask([file]() {
+				CMByteQueue::DumpTrace(file.c_str());
+				//截屏编码的线程池不是CMThreadPool，单独写
+				CScreenshot::EncodePool().dump_trace(file.c_str(), "encode");
+				return 0;
+			}));
+		}
 		NewAccept();
 	}
 
+	//每个连接最多积压多少字节的回复，在StartServer之前设置；high为0表示不限
+	void SetSendWatermark(size_t high, size_t low)
+	{
+		m_sendHigh = high;
+		m_sendLow = low;
+	}
+
 	void NewAccept()
 	{
 		m_mutex.lock();
@@ -327,32 +432,102 @@ inline int RecvOverlapped<op>::Func()
 {
 	//TODO:接收命令
 	int readLen = recv(m_client->m_clntSocket, m_client->m_recv->m_buffer.data(), m_client->m_recv->m_buffer.size(), 0);
+	CMClient* client = m_client;
+	//推屏连接上后来收到的都是控制包
+	if (client->m_stream)
+	{
+		client->StreamRecv(m_buffer.data(), readLen);
+		return -1;
+	}
 	//解析命令
 	DWORD len = readLen;
 	CPacket pack((BYTE*)m_client->m_recv->m_buffer.data(), len);
-	//分派命令
-	cmdProc.DispatchCommand(pack, m_client->m_send->lstSendPacks);
-	//TODO:回复数据->(WSASend)
-	if (m_client->m_send->lstSendPacks.size() > 0)
+	//分派命令：按命令的优先级进线程池的车道，鼠标不用排在截屏和下载后面
+	client->m_send->m_priority = CCmdProcessor::Priority(pack.nCmd);
+	client->m_send->m_tag = CCmdProcessor::Tag(pack.nCmd);
+	if ((len > 0) && (pack.nCmd == CMScreenStream::STREAM_CMD))
+	{
+		client->StartStream(pack, m_buffer.data() + len, readLen - len);
+		return -1;
+	}
+	bool ret = client->m_iocpServer->m_pool.DispatchTask(CMTask([client, pack]() mutable {
+		//回复边产生边发：放进队列的第一个包就开始发，积压到高水位时命令停在Push里
+		cmdProc.DispatchCommand(pack, client->m_send->m_queue);
+		if (client->m_send->m_queue.Close())
+		{
+			//已经发完(或者断了)，这边最后结束，由这边关
+			client->Release();
+		}
+	}), client->m_send->m_priority, client->m_send->m_tag);
+	if (!ret)
+	{
+		//线程池满了：关掉连接，控制端会重试
+		printf("%s(%d):%s command rejected cmd:%d\r\n", __FILE__, __LINE__, __FUNCTION__, pack.nCmd);
+		client->Release();
+	}
+	return -1;
+}
+
+//接收没完成(控制端断了，或者推屏结束时被取消)
+template<CMOperator op>
+inline int RecvOverlapped<op>::Failed()
+{
+	if (m_client->m_stream)
+	{
+		m_client->StreamRecv(NULL, -1);
+	}
+	else
 	{
-		WSASend(m_client->m_clntSocket, &m_client->m_send->m_wsaBuf, 1,
-			&m_client->m_send->m_received, 0, &m_client->m_send->m_overlapped, NULL);
+		m_client->Release();
 	}
 	return -1;
 }
 
+//发队头还没发出去的部分(同一时间只有一次发送)
+template<CMOperator op>
+inline int SendtOverlapped<op>::Start()
+{
+	ULONG len = 0;
+	m_wsaBuf.buf = (CHAR*)m_queue.Front(len);
+	m_wsaBuf.len = len;
+	memset(&m_overlapped, 0, sizeof(m_overlapped));
+	if ((WSASend(m_client->m_clntSocket, &m_wsaBuf, 1, NULL, 0, &m_overlapped, NULL) == SOCKET_ERROR)
+		&& (WSAGetLastError() != WSA_IO_PENDING))
+	{
+		Failed();
+	}
+	return -1;
+}
+
+//一次发送完成(m_received是发出去的字节数)
 template<CMOperator op>
 inline int SendtOverlapped<op>::Func()
 {
-	//一次性发完数据包
-	while (m_client->m_send->lstSendPacks.size() > 0)
+	if (m_received == 0)
+	{
+		return Failed();
+	}
+	switch (m_queue.Sent(m_received))
+	{
+	case CMByteQueue::MB_MORE:
+		Start();
+		break;
+	case CMByteQueue::MB_FINISHED:
+		//命令早就结束了，发完由这边关
+		m_client->Release();
+		break;
+	}
+	return -1;
+}
+
+//发不出去了：积压的丢掉，停在Push里的命令会拿到MB_ABORTED
+template<CMOperator op>
+inline int SendtOverlapped<op>::Failed()
+{
+	printf("%s(%d):%s send error:%d\r\n", __FILE__, __LINE__, __FUNCTION__, WSAGetLastError());
+	if (m_queue.Abort())
 	{
-		int ret = send(m_client->m_clntSocket,
-			(char*)	m_client->m_send->lstSendPacks.front().Data(),
-					m_client->m_send->lstSendPacks.front().Size(), 0);
-		m_client->m_send->lstSendPacks.pop_front();
+		m_client->Release();
 	}
-	//关闭连接
-	PostQueuedCompletionStatus(m_client->m_iocp, 1, 1, &m_client->m_close->m_overlapped);
 	return -1;
 }
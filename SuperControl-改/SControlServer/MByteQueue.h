@@ -0,0 +1,274 @@
+#pragma once
+
+#include <deque>
+#include <list>
+#include <algorithm>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <condition_variable>
+#include "Common.h"
+#include "MThread.h"
+
+//一个队列的水位统计
+struct MByteStats
+{
+	size_t				bytes;			//现在积压的字节数
+	size_t				peak;			//积压的最大值
+	unsigned long long	highHits;		//碰到高水位生产者停下的次数
+	unsigned long long	resumes;		//降到低水位生产者继续的次数
+	unsigned long long	aborted;		//连接断了丢掉的包数
+	long long			pausedUs;		//生产者停着的总时间(微秒)
+	MByteStats() : bytes(0), peak(0), highHits(0), resumes(0), aborted(0), pausedUs(0)
+	{
+	}
+};
+
+//按字节计数的发送队列：积压到高水位时生产者(读文件、截屏)停下，发到低水位以下再继续
+//每个连接占的内存由水位决定，和文件有多大无关
+//发送方一次拿队头一个包去发，发完调用Sent；队列从空变成非空时调用m_starter开始发送
+class CMByteQueue
+{
+public:
+	enum
+	{
+		DEFAULT_HIGH	= 1024 * 1024,		//默认高水位
+		DEFAULT_LOW		= 256 * 1024,		//默认低水位
+	};
+	//Push的结果
+	enum MPushResult
+	{
+		MB_ABORTED	= -1,		//连接断了，生产者不用再放了
+		MB_QUEUED	= 0,
+	};
+	//Sent的结果
+	enum MSentResult
+	{
+		MB_IDLE		= 0,		//发空了，生产者还没结束
+		MB_MORE		= 1,		//还有，接着发
+		MB_FINISHED	= 2,		//发空了，生产者也结束了，可以关连接
+	};
+private:
+	std::deque<CPacket>		m_packs;
+	size_t					m_offset;		//队头的包已经发出去的字节数
+	size_t					m_high;			//0表示不限
+	size_t					m_low;
+	bool					m_sending;		//有一次发送在进行，队头归发送方
+	bool					m_closed;		//生产者不会再放了
+	bool					m_aborted;		//连接断了，放进来的都丢掉
+	bool					m_paused;		//有生产者在等水位降下来
+	CMWork					m_starter;
+	MByteStats				m_stats;
+	std::mutex				m_mutex;
+	std::condition_variable	m_cond;
+private:
+	CMByteQueue(const CMByteQueue&) = delete;
+	CMByteQueue& operator=(const CMByteQueue&) = delete;
+	//进程里所有队列的累计，导出到trace
+	struct MTotals
+	{
+		std::atomic<unsigned long long>	highHits;
+		std::atomic<unsigned long long>	resumes;
+		std::atomic<unsigned long long>	aborted;
+		std::atomic<long long>			pausedUs;
+		std::atomic<size_t>				peak;
+		std::atomic<size_t>				bytes;
+		MTotals() : highHits(0), resumes(0), aborted(0), pausedUs(0), peak(0), bytes(0)
+		{
+		}
+	};
+	static MTotals& Totals()
+	{
+		static MTotals totals;
+		return totals;
+	}
+	static long long NowUs()
+	{
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+	//积压变化时更新本队列和全局的统计(调用方持锁)
+	void Account(long long delta)
+	{
+		m_stats.bytes += delta;
+		Totals().bytes += delta;
+		if (m_stats.bytes > m_stats.peak)
+		{
+			m_stats.peak = m_stats.bytes;
+			size_t peak = Totals().peak;
+			while ((m_stats.peak > peak) && !Totals().peak.compare_exchange_weak(peak, m_stats.peak))
+			{
+			}
+		}
+	}
+	//丢掉还没发的(调用方持锁)
+	void Drop()
+	{
+		while (!m_packs.empty())
+		{
+			Account(-(long long)m_packs.back().Size());
+			m_packs.pop_back();
+			m_stats.aborted++;
+			Totals().aborted++;
+		}
+	}
+public:
+	//starter：队列从空变成非空时在生产者线程里调用obj->starter()，开始一次发送；obj为NULL时只排队不发
+	explicit CMByteQueue(CMFuncBase* obj = NULL, MT_FUNC starter = NULL, size_t high = DEFAULT_HIGH, size_t low = DEFAULT_LOW)
+		: m_offset(0)
+		, m_high(high)
+		, m_low(low)
+		, m_sending(false)
+		, m_closed(false)
+		, m_aborted(false)
+		, m_paused(false)
+		, m_starter(obj, starter)
+	{
+	}
+	~CMByteQueue()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		Account(-(long long)m_stats.bytes);
+	}
+	//high为0表示不限；low大于high时按high算
+	void SetWatermark(size_t high, size_t low)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_high = high;
+		m_low = (high > 0) ? std::min(low, high) : low;
+		m_cond.notify_all();
+	}
+	//放一个包，积压到高水位时等发到低水位；连接断了返回MB_ABORTED
+	int Push(const CPacket& pack)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if ((m_high > 0) && (m_stats.bytes >= m_high) && !m_aborted)
+		{
+			m_stats.highHits++;
+			Totals().highHits++;
+			m_paused = true;
+			long long start = NowUs();
+			m_cond.wait(lock, [this]() { return m_aborted || (m_high == 0) || (m_stats.bytes <= m_low); });
+			m_paused = false;
+			long long paused = NowUs() - start;
+			m_stats.pausedUs += paused;
+			Totals().pausedUs += paused;
+			if (!m_aborted)
+			{
+				m_stats.resumes++;
+				Totals().resumes++;
+			}
+		}
+		if (m_aborted)
+		{
+			return MB_ABORTED;
+		}
+		m_packs.push_back(pack);
+		Account(m_packs.back().Size());
+		if (m_sending || (m_starter.thiz == NULL))
+		{
+			return MB_QUEUED;
+		}
+		m_sending = true;
+		CMWork starter = m_starter;
+		lock.unlock();
+		starter();
+		return MB_QUEUED;
+	}
+	//发送方：队头还没发出去的部分，空了返回NULL
+	BYTE* Front(ULONG& len)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_packs.empty())
+		{
+			len = 0;
+			return NULL;
+		}
+		CPacket& head = m_packs.front();
+		len = (ULONG)(head.Size() - m_offset);
+		return head.Data() + m_offset;
+	}
+	//发送方：发出去bytes字节；队头发完就扔掉，降到低水位叫醒生产者
+	int Sent(size_t bytes)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!m_packs.empty())
+		{
+			m_offset += bytes;
+			size_t size = m_packs.front().Size();
+			if (m_offset >= size)
+			{
+				m_packs.pop_front();
+				m_offset = 0;
+				Account(-(long long)size);
+				if (m_paused && (m_stats.bytes <= m_low))
+				{
+					m_cond.notify_all();
+				}
+			}
+		}
+		if (!m_packs.empty() && !m_aborted)
+		{
+			return MB_MORE;
+		}
+		m_sending = false;
+		return m_closed ? MB_FINISHED : MB_IDLE;
+	}
+	//生产者：不会再放了；返回true表示已经发完，由调用方关连接，否则由发送方发完后关
+	bool Close()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_closed = true;
+		return !m_sending;
+	}
+	//发送方：连接断了，丢掉所有还没发的，叫醒等着的生产者；返回true表示生产者已经结束，由调用方关连接
+	bool Abort()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_aborted = true;
+		m_sending = false;
+		m_offset = 0;
+		Drop();
+		m_cond.notify_all();
+		return m_closed;
+	}
+	size_t Bytes()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_stats.bytes;
+	}
+	MByteStats Stats()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_stats;
+	}
+	//把全部取出来放进lst(不限水位的队列用)
+	void MoveTo(std::list<CPacket>& lst)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		while (!m_packs.empty())
+		{
+			Account(-(long long)m_packs.front().Size());
+			lst.push_back(m_packs.front());
+			m_packs.pop_front();
+		}
+		m_offset = 0;
+	}
+	//把所有发送队列的累计统计追加到trace文件，格式和线程池的一样
+	static bool DumpTrace(const char* path)
+	{
+		FILE* file = fopen(path, "a");
+		if (file == NULL)
+		{
+			printf("%s(%d):%s open %s error\n", __FILE__, __LINE__, __FUNCTION__, path);
+			return false;
+		}
+		MTotals& totals = Totals();
+		long long now = (long long)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+		fprintf(file, "%lld sendq bytes %llu peak %llu high %llu resume %llu paused_us %lld aborted %llu\n",
+			now, (unsigned long long)totals.bytes.load(), (unsigned long long)totals.peak.load(),
+			totals.highHits.load(), totals.resumes.load(), totals.pausedUs.load(), totals.aborted.load());
+		fclose(file);
+		return true;
+	}
+};
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <windows.h>
+#include <cstdint>
+#include <cstdio>
+
+//截屏到自己建的32位DIB(行从上往下)，编码器直接读它的像素，不经过CImage、GDI+和内存流
+//屏幕分辨率不变时DIB一直复用，每次只是一个BitBlt
+class CMCapture
+{
+private:
+	HDC			m_memDC;
+	HBITMAP		m_bitmap;
+	HGDIOBJ		m_old;
+	uint8_t*	m_bits;
+	int			m_width;
+	int			m_height;
+private:
+	CMCapture(const CMCapture&) = delete;
+	CMCapture& operator=(const CMCapture&) = delete;
+	void Release()
+	{
+		if (m_memDC != NULL)
+		{
+			SelectObject(m_memDC, m_old);
+			DeleteDC(m_memDC);
+			m_memDC = NULL;
+		}
+		if (m_bitmap != NULL)
+		{
+			DeleteObject(m_bitmap);
+			m_bitmap = NULL;
+		}
+		m_bits = NULL;
+		m_width = 0;
+		m_height = 0;
+	}
+	//屏幕没有透明度，BitBlt留在alpha里的值没有意义，统一成255(编码器就只存3个通道)
+	void NormalizeAlpha()
+	{
+		size_t count = (size_t)m_width * m_height;
+		uint32_t* p = (uint32_t*)m_bits;
+		for (size_t i = 0; i < count; i++)
+		{
+			p[i] |= 0xFF000000u;
+		}
+	}
+	bool Create(HDC hScreen, int width, int height)
+	{
+		Release();
+		BITMAPINFO info = {};
+		info.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+		info.bmiHeader.biWidth = width;
+		info.bmiHeader.biHeight = -height;		//负数：行从上往下
+		info.bmiHeader.biPlanes = 1;
+		info.bmiHeader.biBitCount = 32;
+		info.bmiHeader.biCompression = BI_RGB;
+		void* bits = NULL;
+		m_bitmap = CreateDIBSection(hScreen, &info, DIB_RGB_COLORS, &bits, NULL, 0);
+		m_memDC = CreateCompatibleDC(hScreen);
+		if ((m_bitmap == NULL) || (m_memDC == NULL))
+		{
+			printf("%s(%d):%s create dib %dx%d error %d\n", __FILE__, __LINE__, __FUNCTION__, width, height, GetLastError());
+			Release();
+			return false;
+		}
+		m_old = SelectObject(m_memDC, m_bitmap);
+		m_bits = (uint8_t*)bits;
+		m_width = width;
+		m_height = height;
+		return true;
+	}
+public:
+	CMCapture() : m_memDC(NULL), m_bitmap(NULL), m_old(NULL), m_bits(NULL), m_width(0), m_height(0)
+	{
+	}
+	~CMCapture()
+	{
+		Release();
+	}
+	//截一次整个屏幕，失败返回false
+	bool Grab()
+	{
+		HDC hScreen = ::GetDC(NULL);
+		int nWidth = GetDeviceCaps(hScreen, HORZRES);
+		int nHeight = GetDeviceCaps(hScreen, VERTRES);
+		bool isOk = ((nWidth == m_width) && (nHeight == m_height)) || Create(hScreen, nWidth, nHeight);
+		if (isOk)
+		{
+			isOk = BitBlt(m_memDC, 0, 0, nWidth, nHeight, hScreen, 0, 0, SRCCOPY) != FALSE;
+			GdiFlush();		//DIB的像素要等GDI画完才能读
+			NormalizeAlpha();
+		}
+		ReleaseDC(NULL, hScreen);
+		return isOk;
+	}
+	//BGRA，alpha都是255
+	const uint8_t* Bits() const
+	{
+		return m_bits;
+	}
+	int Width() const
+	{
+		return m_width;
+	}
+	int Height() const
+	{
+		return m_height;
+	}
+	ptrdiff_t Stride() const
+	{
+		return (ptrdiff_t)m_width * 4;
+	}
+};
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <chrono>
+#include <cstring>
+
+//一帧画面：缓冲区在槽里反复使用，只有帧比以前都大的时候才重新分配
+struct MFrame
+{
+	std::vector<unsigned char>	data;
+	size_t						size;			//data里有效的字节数
+	unsigned long long			seq;			//第几帧，消费者看差了几帧
+	long long					captureUs;		//开始截屏的时间(steady_clock微秒)
+	long long					publishUs;		//编码完放出来的时间
+	MFrame() : size(0), seq(0), captureUs(0), publishUs(0)
+	{
+	}
+	void Assign(const void* bytes, size_t len)
+	{
+		if (data.size() < len)
+		{
+			data.resize(len);
+		}
+		memcpy(data.data(), bytes, len);
+		size = len;
+	}
+};
+
+//单生产者单消费者的帧缓冲，新的覆盖旧的：消费者每次拿到的都是最新的完整帧，没来得及取的旧帧直接丢
+//三个槽轮换(生产者正在写的、最新待取的、消费者正在用的)，交换只是一次原子操作，不加锁不分配
+//只能有一个线程写、一个线程读
+class CMFrameRing
+{
+private:
+	enum
+	{
+		SLOTS		= 3,
+		INDEX_MASK	= 3,
+		FRESH		= 4,		//中间槽里是还没取过的新帧
+	};
+	MFrame						m_slots[SLOTS];
+	int							m_back;			//生产者的槽
+	int							m_front;		//消费者的槽
+	std::atomic<unsigned int>	m_middle;		//待取的槽号|FRESH
+	unsigned long long			m_nextSeq;
+	std::atomic<unsigned long long>	m_published;
+	std::atomic<unsigned long long>	m_dropped;		//没被取就被新帧覆盖的
+	std::atomic<unsigned long long>	m_consumed;
+	std::atomic<long long>		m_lastAgeUs;	//最近一次取到的帧从截屏到被取走用了多久
+public:
+	static long long NowUs()
+	{
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+	CMFrameRing()
+		: m_back(0)
+		, m_front(1)
+		, m_middle(2)
+		, m_nextSeq(0)
+		, m_published(0)
+		, m_dropped(0)
+		, m_consumed(0)
+		, m_lastAgeUs(0)
+	{
+	}
+	//预先分配每个槽的缓冲区，避免前几帧分配
+	void Reserve(size_t bytes)
+	{
+		for (int i = 0; i < SLOTS; i++)
+		{
+			m_slots[i].data.resize(bytes);
+		}
+	}
+	//生产者：拿到自己的槽开始写，记下截屏时间
+	MFrame* BeginWrite()
+	{
+		MFrame* frame = &m_slots[m_back];
+		frame->size = 0;
+		frame->captureUs = NowUs();
+		return frame;
+	}
+	//生产者：写完放出去，换回来的槽如果是没被取过的旧帧就算丢了
+	void Publish()
+	{
+		MFrame* frame = &m_slots[m_back];
+		frame->seq = ++m_nextSeq;
+		frame->publishUs = NowUs();
+		unsigned int prev = m_middle.exchange((unsigned int)m_back | FRESH, std::memory_order_acq_rel);
+		if (prev & FRESH)
+		{
+			m_dropped++;
+		}
+		m_back = prev & INDEX_MASK;
+		m_published++;
+	}
+	//消费者：有新帧就换过来，返回的帧在下一次Acquire之前都可以用；没有新帧返回NULL
+	const MFrame* Acquire()
+	{
+		if ((m_middle.load(std::memory_order_acquire) & FRESH) == 0)
+		{
+			return NULL;
+		}
+		unsigned int prev = m_middle.exchange((unsigned int)m_front, std::memory_order_acq_rel);
+		m_front = prev & INDEX_MASK;
+		const MFrame* frame = &m_slots[m_front];
+		m_consumed++;
+		m_lastAgeUs = NowUs() - frame->captureUs;
+		return frame;
+	}
+	//有没有还没取的新帧(任何线程都可以看)
+	bool Ready() const
+	{
+		return (m_middle.load(std::memory_order_acquire) & FRESH) != 0;
+	}
+	unsigned long long Published() const
+	{
+		return m_published;
+	}
+	unsigned long long Dropped() const
+	{
+		return m_dropped;
+	}
+	unsigned long long Consumed() const
+	{
+		return m_consumed;
+	}
+	long long LastAgeUs() const
+	{
+		return m_lastAgeUs;
+	}
+};
@@ -0,0 +1,437 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <cstring>
+#include <cstddef>
+#include <cstdint>
+
+//有损压缩(一块一块地压)，给慢的链路用：BGRA转YCbCr 4:2:0，8x8 DCT，按质量缩放JPEG的量化表
+//熵编码不用哈夫曼表：每个8x8块写DC差值、非零AC个数，再逐个写(前面几个0, 值)，都用指数哥伦布码
+//码流：质量(1字节) + Y的所有块 + Cb的所有块 + Cr的所有块；块宽高不是16的倍数时按边缘像素补齐
+//内层循环都是定点/浮点的简单循环，编译器能自动向量化，不依赖特定指令集和外部库
+class CMLossy
+{
+public:
+	enum
+	{
+		QUALITY_MIN		= 1,
+		QUALITY_MAX		= 100,
+		QUALITY_DEFAULT	= 75,
+	};
+private:
+	enum
+	{
+		BLOCK			= 8,
+		MCU				= 16,		//4:2:0，一个亮度16x16对应一个色度8x8
+		MAX_ZEROS		= 24,		//哥伦布码前导0的上限，超过就是坏数据
+	};
+	//位写入：高位先写
+	class CBitWriter
+	{
+	private:
+		std::vector<uint8_t>&	m_out;
+		uint64_t				m_acc;
+		int						m_bits;
+	public:
+		explicit CBitWriter(std::vector<uint8_t>& out) : m_out(out), m_acc(0), m_bits(0)
+		{
+		}
+		//写value的低bits位(bits<=32)
+		void Put(uint32_t value, int bits)
+		{
+			m_acc = (m_acc << bits) | (value & (uint32_t)((1ULL << bits) - 1));
+			m_bits += bits;
+			while (m_bits >= 8)
+			{
+				m_bits -= 8;
+				m_out.push_back((uint8_t)(m_acc >> m_bits));
+			}
+		}
+		//指数哥伦布码：v+1有n位，先写n-1个0再写v+1
+		void PutUnsigned(uint32_t v)
+		{
+			uint32_t x = v + 1;
+			int n = 0;
+			while ((x >> n) > 1)
+			{
+				n++;
+			}
+			Put(0, n);
+			Put(x, n + 1);
+		}
+		void PutSigned(int v)
+		{
+			PutUnsigned((v >= 0) ? ((uint32_t)v << 1) : (((uint32_t)(-v) << 1) - 1));
+		}
+		void Flush()
+		{
+			if (m_bits > 0)
+			{
+				Put(0, 8 - m_bits);
+			}
+		}
+	};
+	//位读取：一次补够一个码字要的位；读过了头返回false
+	class CBitReader
+	{
+	private:
+		const uint8_t*	m_data;
+		size_t			m_size;
+		size_t			m_pos;			//下一个要装进m_acc的字节
+		uint64_t		m_acc;
+		int				m_bits;			//m_acc里还有几位
+		size_t			m_padding;		//读过头补的0字节数
+	private:
+		void Fill(int need)
+		{
+			while (m_bits < need)
+			{
+				m_acc = (m_acc << 8) | ((m_pos < m_size) ? m_data[m_pos] : 0);
+				m_padding += (m_pos >= m_size);
+				m_pos++;
+				m_bits += 8;
+			}
+		}
+		uint32_t Take(int n)
+		{
+			m_bits -= n;
+			return (uint32_t)(m_acc >> m_bits) & (uint32_t)((1ULL << n) - 1);
+		}
+	public:
+		CBitReader(const uint8_t* data, size_t size) : m_data(data), m_size(size), m_pos(0), m_acc(0), m_bits(0), m_padding(0)
+		{
+		}
+		bool GetUnsigned(uint32_t& v)
+		{
+			Fill(MAX_ZEROS + 1);
+			uint32_t top = (uint32_t)(m_acc >> (m_bits - MAX_ZEROS - 1)) & ((1u << (MAX_ZEROS + 1)) - 1);
+			if (top == 0)
+			{
+				return false;
+			}
+			int zeros = 0;
+			while ((top & (1u << MAX_ZEROS)) == 0)
+			{
+				top <<= 1;
+				zeros++;
+			}
+			m_bits -= zeros;
+			Fill(zeros + 1);
+			v = Take(zeros + 1) - 1;
+			//补进来的0只能在最后一个字节之后，真正用到了就是数据不够
+			return (m_padding * 8 <= (size_t)m_bits);
+		}
+		bool GetSigned(int& v)
+		{
+			uint32_t u;
+			if (!GetUnsigned(u))
+			{
+				return false;
+			}
+			v = (u & 1) ? -(int)((u + 1) >> 1) : (int)(u >> 1);
+			return true;
+		}
+	};
+	std::vector<float>		m_planes[3];		//Y、Cb、Cr，已经减了128
+	float					m_cos[BLOCK][BLOCK];	//m_cos[u][x] = C(u)/2 * cos((2x+1)uπ/16)
+	float					m_quant[2][64];		//当前质量的量化步长(亮度、色度)，按自然顺序
+	float					m_scale[2][64];		//量化步长的倒数
+	int						m_quality;
+	uint8_t					m_zigzag[64];
+private:
+	static int Clamp(int v, int lo, int hi)
+	{
+		return (v < lo) ? lo : ((v > hi) ? hi : v);
+	}
+	static uint8_t ToByte(float v)
+	{
+		return (v <= 0) ? 0 : ((v >= 255) ? 255 : (uint8_t)(v + 0.5f));
+	}
+	//JPEG标准量化表按IJG的方法缩放
+	void SetQuality(int quality)
+	{
+		static const uint8_t luma[64] = {
+			16, 11, 10, 16, 24, 40, 51, 61,		12, 12, 14, 19, 26, 58, 60, 55,
+			14, 13, 16, 24, 40, 57, 69, 56,		14, 17, 22, 29, 51, 87, 80, 62,
+			18, 22, 37, 56, 68, 109, 103, 77,	24, 35, 55, 64, 81, 104, 113, 92,
+			49, 64, 78, 87, 103, 121, 120, 101,	72, 92, 95, 98, 112, 100, 103, 99 };
+		static const uint8_t chroma[64] = {
+			17, 18, 24, 47, 99, 99, 99, 99,		18, 21, 26, 66, 99, 99, 99, 99,
+			24, 26, 56, 99, 99, 99, 99, 99,		47, 66, 99, 99, 99, 99, 99, 99,
+			99, 99, 99, 99, 99, 99, 99, 99,		99, 99, 99, 99, 99, 99, 99, 99,
+			99, 99, 99, 99, 99, 99, 99, 99,		99, 99, 99, 99, 99, 99, 99, 99 };
+		if (quality == m_quality)
+		{
+			return;
+		}
+		m_quality = quality;
+		int scale = (quality < 50) ? (5000 / quality) : (200 - quality * 2);
+		for (int i = 0; i < 64; i++)
+		{
+			m_quant[0][i] = (float)Clamp((luma[i] * scale + 50) / 100, 1, 255);
+			m_quant[1][i] = (float)Clamp((chroma[i] * scale + 50) / 100, 1, 255);
+			m_scale[0][i] = 1.0f / m_quant[0][i];
+			m_scale[1][i] = 1.0f / m_quant[1][i];
+		}
+	}
+	//宽w高h的平面里(x,y)开始的8x8块做正变换，结果按自然顺序放进coef
+	void Forward(const float* plane, int w, int x, int y, float* coef) const
+	{
+		float tmp[64];
+		for (int r = 0; r < BLOCK; r++)
+		{
+			const float* row = plane + (size_t)(y + r) * w + x;
+			for (int u = 0; u < BLOCK; u++)
+			{
+				float sum = 0;
+				for (int i = 0; i < BLOCK; i++)
+				{
+					sum += m_cos[u][i] * row[i];
+				}
+				tmp[r * BLOCK + u] = sum;
+			}
+		}
+		for (int v = 0; v < BLOCK; v++)
+		{
+			for (int u = 0; u < BLOCK; u++)
+			{
+				float sum = 0;
+				for (int r = 0; r < BLOCK; r++)
+				{
+					sum += m_cos[v][r] * tmp[r * BLOCK + u];
+				}
+				coef[v * BLOCK + u] = sum;
+			}
+		}
+	}
+	void Inverse(const float* coef, float* plane, int w, int x, int y) const
+	{
+		float tmp[64];
+		for (int r = 0; r < BLOCK; r++)
+		{
+			for (int u = 0; u < BLOCK; u++)
+			{
+				float sum = 0;
+				for (int v = 0; v < BLOCK; v++)
+				{
+					sum += m_cos[v][r] * coef[v * BLOCK + u];
+				}
+				tmp[r * BLOCK + u] = sum;
+			}
+		}
+		for (int r = 0; r < BLOCK; r++)
+		{
+			float* row = plane + (size_t)(y + r) * w + x;
+			for (int i = 0; i < BLOCK; i++)
+			{
+				float sum = 0;
+				for (int u = 0; u < BLOCK; u++)
+				{
+					sum += m_cos[u][i] * tmp[r * BLOCK + u];
+				}
+				row[i] = sum;
+			}
+		}
+	}
+	//一个平面的所有8x8块：变换、量化、熵编码
+	void EncodePlane(CBitWriter& writer, const float* plane, int w, int h, const float* scale) const
+	{
+		float coef[64];
+		int dc = 0;
+		for (int y = 0; y < h; y += BLOCK)
+		{
+			for (int x = 0; x < w; x += BLOCK)
+			{
+				Forward(plane, w, x, y, coef);
+				int level[64];
+				int nonzero = 0;
+				for (int i = 0; i < 64; i++)
+				{
+					float q = coef[m_zigzag[i]] * scale[m_zigzag[i]];
+					level[i] = (int)((q >= 0) ? (q + 0.5f) : (q - 0.5f));
+					nonzero += (i > 0) && (level[i] != 0);
+				}
+				writer.PutSigned(level[0] - dc);
+				dc = level[0];
+				writer.PutUnsigned(nonzero);
+				int run = 0;
+				for (int i = 1; (i < 64) && (nonzero > 0); i++)
+				{
+					if (level[i] == 0)
+					{
+						run++;
+						continue;
+					}
+					writer.PutUnsigned(run);
+					writer.PutUnsigned((level[i] > 0) ? ((level[i] - 1) << 1) : (((-level[i] - 1) << 1) | 1));
+					run = 0;
+					nonzero--;
+				}
+			}
+		}
+	}
+	bool DecodePlane(CBitReader& reader, float* plane, int w, int h, const float* quant) const
+	{
+		float coef[64];
+		int dc = 0;
+		for (int y = 0; y < h; y += BLOCK)
+		{
+			for (int x = 0; x < w; x += BLOCK)
+			{
+				memset(coef, 0, sizeof(coef));
+				int diff;
+				uint32_t nonzero;
+				if (!reader.GetSigned(diff) || !reader.GetUnsigned(nonzero) || (nonzero > 63))
+				{
+					return false;
+				}
+				dc += diff;
+				coef[0] = dc * quant[0];
+				int pos = 0;
+				for (uint32_t k = 0; k < nonzero; k++)
+				{
+					uint32_t run, value;
+					if (!reader.GetUnsigned(run) || !reader.GetUnsigned(value))
+					{
+						return false;
+					}
+					pos += run + 1;
+					if (pos > 63)
+					{
+						return false;
+					}
+					int level = (value & 1) ? -(int)((value >> 1) + 1) : (int)((value >> 1) + 1);
+					coef[m_zigzag[pos]] = level * quant[m_zigzag[pos]];
+				}
+				Inverse(coef, plane, w, x, y);
+			}
+		}
+		return true;
+	}
+	static void PlaneSize(int w, int h, int& pw, int& ph)
+	{
+		pw = (w + MCU - 1) / MCU * MCU;
+		ph = (h + MCU - 1) / MCU * MCU;
+	}
+public:
+	CMLossy() : m_quality(0)
+	{
+		const double pi = 3.14159265358979323846;
+		for (int u = 0; u < BLOCK; u++)
+		{
+			for (int x = 0; x < BLOCK; x++)
+			{
+				double c = (u == 0) ? sqrt(0.5) : 1.0;
+				m_cos[u][x] = (float)(c / 2 * cos((2 * x + 1) * u * pi / 16));
+			}
+		}
+		//之字形扫描顺序：按对角线走，奇偶对角线方向相反
+		int i = 0;
+		for (int s = 0; s < 2 * BLOCK - 1; s++)
+		{
+			for (int k = 0; k <= s; k++)
+			{
+				int r = (s & 1) ? k : (s - k);
+				int c = s - r;
+				if ((r < BLOCK) && (c < BLOCK))
+				{
+					m_zigzag[i++] = (uint8_t)(r * BLOCK + c);
+				}
+			}
+		}
+	}
+	//像是文字/线条的块(相邻像素跳变多)，有损压会糊，留给无损
+	static bool HasSharpEdges(const uint8_t* src, int w, int h, ptrdiff_t stride)
+	{
+		int sharp = 0;
+		for (int y = 0; y < h; y++)
+		{
+			const uint8_t* p = src + y * stride;
+			for (int x = 1; x < w; x++)
+			{
+				int d = (int)p[x * 4 + 1] - p[x * 4 - 3];
+				sharp += (d > 96) || (d < -96);
+			}
+		}
+		return sharp * 24 > w * h;
+	}
+	//压一块：src指向左上角像素，stride是行间隔，quality在1~100；结果追加到out
+	void Encode(const uint8_t* src, int w, int h, ptrdiff_t stride, int quality, std::vector<uint8_t>& out)
+	{
+		quality = Clamp(quality, QUALITY_MIN, QUALITY_MAX);
+		SetQuality(quality);
+		int pw, ph;
+		PlaneSize(w, h, pw, ph);
+		int cw = pw / 2, ch = ph / 2;
+		m_planes[0].resize((size_t)pw * ph);
+		m_planes[1].assign((size_t)cw * ch, 0);
+		m_planes[2].assign((size_t)cw * ch, 0);
+		float* Y = m_planes[0].data();
+		float* Cb = m_planes[1].data();
+		float* Cr = m_planes[2].data();
+		//颜色转换(JPEG的全范围YCbCr，定点)；补齐的部分重复最后一行/列；色度按2x2累加后取平均
+		for (int y = 0; y < ph; y++)
+		{
+			const uint8_t* p = src + (ptrdiff_t)((y < h) ? y : (h - 1)) * stride;
+			float* yRow = Y + (size_t)y * pw;
+			float* cbRow = Cb + (size_t)(y >> 1) * cw;
+			float* crRow = Cr + (size_t)(y >> 1) * cw;
+			for (int x = 0; x < pw; x++)
+			{
+				const uint8_t* px = p + ((x < w) ? x : (w - 1)) * 4;
+				int b = px[0], g = px[1], r = px[2];
+				yRow[x] = (float)((77 * r + 150 * g + 29 * b + 128) >> 8) - 128;
+				cbRow[x >> 1] += (float)((-43 * r - 85 * g + 128 * b) >> 8) * 0.25f;
+				crRow[x >> 1] += (float)((128 * r - 107 * g - 21 * b) >> 8) * 0.25f;
+			}
+		}
+		out.push_back((uint8_t)quality);
+		CBitWriter writer(out);
+		EncodePlane(writer, Y, pw, ph, m_scale[0]);
+		EncodePlane(writer, Cb, cw, ch, m_scale[1]);
+		EncodePlane(writer, Cr, cw, ch, m_scale[1]);
+		writer.Flush();
+	}
+	//解一块到dst(左上角像素，stride是行间隔)，数据不对返回false
+	bool Decode(const uint8_t* data, size_t size, uint8_t* dst, int w, int h, ptrdiff_t stride)
+	{
+		if ((size < 1) || (data[0] < QUALITY_MIN) || (data[0] > QUALITY_MAX))
+		{
+			return false;
+		}
+		SetQuality(data[0]);
+		int pw, ph;
+		PlaneSize(w, h, pw, ph);
+		int cw = pw / 2, ch = ph / 2;
+		m_planes[0].resize((size_t)pw * ph);
+		m_planes[1].resize((size_t)cw * ch);
+		m_planes[2].resize((size_t)cw * ch);
+		float* Y = m_planes[0].data();
+		float* Cb = m_planes[1].data();
+		float* Cr = m_planes[2].data();
+		CBitReader reader(data + 1, size - 1);
+		if (!DecodePlane(reader, Y, pw, ph, m_quant[0]) || !DecodePlane(reader, Cb, cw, ch, m_quant[1]) || !DecodePlane(reader, Cr, cw, ch, m_quant[1]))
+		{
+			return false;
+		}
+		for (int y = 0; y < h; y++)
+		{
+			const float* yRow = Y + (size_t)y * pw;
+			const float* cbRow = Cb + (size_t)(y >> 1) * cw;
+			const float* crRow = Cr + (size_t)(y >> 1) * cw;
+			uint8_t* out = dst + y * stride;
+			for (int x = 0; x < w; x++)
+			{
+				float l = yRow[x] + 128;
+				float cb = cbRow[x >> 1];
+				float cr = crRow[x >> 1];
+				out[x * 4] = ToByte(l + 1.772f * cb);
+				out[x * 4 + 1] = ToByte(l - 0.344136f * cb - 0.714136f * cr);
+				out[x * 4 + 2] = ToByte(l + 1.402f * cr);
+				out[x * 4 + 3] = 255;
+			}
+		}
+		return true;
+	}
+};
@@ -1,187 +1,356 @@
 #pragma once
 
-#include <Windows.h>
-#include <list>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include <new>
+#include <utility>
+#include <type_traits>
+#include <cstddef>
+#include <cstdint>
+
+//有界多生产者多消费者环形队列(Vyukov)：每个槽带一个序号，生产者和消费者各抢一个位置，不加锁
+//以前每次调用都要经过完成端口转到专门的线程，还要创建销毁一个事件；现在size()只是读两个计数
+//push_back/pop_front不等待，满了/空了直接返回false；wait_push/wait_pop在满了/空了时睡眠等待
+//pop_n一次取走一批，消费者一次同步就把攒下的都拿走
 template<typename T>
 class CMQueue
 {
+public:
+	typedef std::chrono::steady_clock::time_point MDeadline;
 private:
 	enum
 	{
-		PUSH = 1001,
-		POP,
-		SIZE,
-		CLEAR,
+		DEFAULT_CAPACITY	= 256,		//默认容量，会向上取到2的幂
+		CACHE_LINE			= 64,
+		SPIN_COUNT			= 64,		//等待前先自旋几次，对面马上就放/取的话不用睡
 	};
-	struct M
+	struct MCell
 	{
-		HANDLE hEvent;
-		T t;
-		int wParam;
-		M(T _t){
-			hEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
-			t = _t;
-			wParam = -1;
-		}
-		~M()
-		{
-			CloseHandle(hEvent);
-		}
+		std::atomic<size_t>		seq;		//等于位置号：可以写；等于位置号+1：可以读
+		typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
 	};
+	//生产者和消费者的位置分开放在不同的缓存行里，互相不打架
+	char					m_pad0[CACHE_LINE];
+	MCell*					m_cells;
+	size_t					m_mask;
+	char					m_pad1[CACHE_LINE - sizeof(MCell*) - sizeof(size_t)];
+	std::atomic<size_t>		m_enqueue;
+	char					m_pad2[CACHE_LINE - sizeof(std::atomic<size_t>)];
+	std::atomic<size_t>		m_dequeue;
+	char					m_pad3[CACHE_LINE - sizeof(std::atomic<size_t>)];
+	//只有等待的时候才用锁，没有人等的时候放/取都不碰它
+	std::atomic<int>		m_popWaiters;
+	std::atomic<int>		m_pushWaiters;
+	std::mutex				m_mutex;
+	std::condition_variable	m_condPop;			//有数据了
+	std::condition_variable	m_condPush;			//有空位了
 private:
-	std::list<T>	lstData;
-	HANDLE			m_hIocp;
-	HANDLE			m_hThread;
-private:
-	static void ThreadEntry(void* arg)
+	CMQueue(const CMQueue&) = delete;
+	CMQueue& operator=(const CMQueue&) = delete;
+	T* Slot(MCell* cell)
 	{
-		CMQueue* thiz = (CMQueue*)arg;
-		thiz->ThreadMain();
-		_endthread();
+		return reinterpret_cast<T*>(&cell->storage);
 	}
-	void ThreadMain()
+	template<typename U>
+	bool TryPush(U&& t)
 	{
-		DWORD transferred;
-		ULONG_PTR completionKey;
-		LPOVERLAPPED lpOverlapped;
-		while (GetQueuedCompletionStatus(m_hIocp, &transferred, &completionKey, &lpOverlapped, INFINITE))
+		size_t pos = m_enqueue.load(std::memory_order_relaxed);
+		while (true)
 		{
-			if ((transferred == -1) && (completionKey != -1) && (lpOverlapped == NULL))
+			MCell* cell = &m_cells[pos & m_mask];
+			size_t seq = cell->seq.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+			if (diff == 0)
 			{
-				M* pM = (M*)completionKey;
-				SetEvent(pM->hEvent);
-				break;
+				if (m_enqueue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				{
+					new (Slot(cell)) T(std::forward<U>(t));
+					cell->seq.store(pos + 1, std::memory_order_release);
+					return true;
+				}
 			}
-
-			switch (transferred)
+			else if (diff < 0)
 			{
-			case PUSH:
+				return false;		//满了
+			}
+			else
 			{
-				lstData.push_back(*(T*)completionKey);
-				delete (T*)completionKey;
-				break;
+				pos = m_enqueue.load(std::memory_order_relaxed);
 			}
-			case POP:
+		}
+	}
+	//取出一个交给take处理，然后析构槽里的元素
+	template<typename F>
+	bool TryTake(F take)
+	{
+		size_t pos = m_dequeue.load(std::memory_order_relaxed);
+		while (true)
+		{
+			MCell* cell = &m_cells[pos & m_mask];
+			size_t seq = cell->seq.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+			if (diff == 0)
 			{
-				M* pM = (M*)completionKey;
-				if (lstData.size() > 0)
+				if (m_dequeue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
 				{
-					pM->t = lstData.front();
-					lstData.pop_front();
+					T* slot = Slot(cell);
+					take(slot);
+					slot->~T();
+					cell->seq.store(pos + m_mask + 1, std::memory_order_release);
+					return true;
 				}
-				else
-				{
-					pM->wParam = 0;
-				}
-				SetEvent(pM->hEvent);
-				break;
 			}
-			case SIZE:
+			else if (diff < 0)
 			{
-				M* pM = (M*)completionKey;
-				pM->wParam = lstData.size();
-				SetEvent(pM->hEvent);
-				break;
+				return false;		//空了
 			}
-			case CLEAR:
+			else
 			{
-				M* pM = (M*)completionKey;
-				while (lstData.size() > 0)
+				pos = m_dequeue.load(std::memory_order_relaxed);
+			}
+		}
+	}
+	bool TryPop(T& t)
+	{
+		return TryTake([&t](T* slot) { t = std::move(*slot); });
+	}
+	//一次CAS占下从队头开始连续可读的最多max个槽，再逐个取出；返回取到的个数
+	template<typename C>
+	size_t TryPopN(C& out, size_t max)
+	{
+		size_t pos = m_dequeue.load(std::memory_order_relaxed);
+		while (max > 0)
+		{
+			size_t count = 0;
+			while ((count < max) && (m_cells[(pos + count) & m_mask].seq.load(std::memory_order_acquire) == pos + count + 1))
+			{
+				count++;
+			}
+			if (count == 0)
+			{
+				MCell* cell = &m_cells[pos & m_mask];
+				intptr_t diff = (intptr_t)cell->seq.load(std::memory_order_acquire) - (intptr_t)(pos + 1);
+				if (diff < 0)
 				{
-					lstData.pop_front();
+					return 0;		//空了
 				}
-				SetEvent(pM->hEvent);
+				pos = m_dequeue.load(std::memory_order_relaxed);
+				continue;
+			}
+			if (m_dequeue.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed))
+			{
+				for (size_t i = 0; i < count; i++)
+				{
+					MCell* cell = &m_cells[(pos + i) & m_mask];
+					T* slot = Slot(cell);
+					out.push_back(std::move(*slot));
+					slot->~T();
+					cell->seq.store(pos + i + m_mask + 1, std::memory_order_release);
+				}
+				return count;
+			}
+		}
+		return 0;
+	}
+	//放/取成功后叫醒对面等着的线程；先有全序栅栏，和等待方"先登记再检查"配对，不会漏叫
+	void Wake(std::atomic<int>& waiters, std::condition_variable& cond, bool all = false)
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (waiters.load(std::memory_order_relaxed) > 0)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (all)
+			{
+				cond.notify_all();
+			}
+			else
+			{
+				cond.notify_one();
+			}
+		}
+	}
+	static MDeadline After(int timeout)
+	{
+		return (timeout < 0) ? MDeadline::max() : std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+	}
+	//先自旋几次，不行就登记后睡眠到deadline(max表示一直等)，返回false表示超时
+	template<typename F>
+	bool Wait(F tryOnce, std::atomic<int>& waiters, std::condition_variable& cond, MDeadline deadline)
+	{
+		for (int i = 0; i < SPIN_COUNT; i++)
+		{
+			if (tryOnce())
+			{
+				return true;
+			}
+		}
+		std::unique_lock<std::mutex> lock(m_mutex);
+		waiters.fetch_add(1, std::memory_order_seq_cst);
+		bool isOk = false;
+		while (true)
+		{
+			if (tryOnce())
+			{
+				isOk = true;
 				break;
 			}
+			if (deadline == MDeadline::max())
+			{
+				cond.wait(lock);
+			}
+			else if (cond.wait_until(lock, deadline) == std::cv_status::timeout)
+			{
+				isOk = tryOnce();
+				break;
 			}
 		}
+		waiters.fetch_sub(1, std::memory_order_relaxed);
+		return isOk;
 	}
 public:
-	CMQueue()
+	explicit CMQueue(size_t capacity = DEFAULT_CAPACITY)
 	{
-		m_hThread = (HANDLE) _beginthread(ThreadEntry, 0, this);
-		m_hIocp = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+		size_t size = 2;
+		while (size < capacity)
+		{
+			size <<= 1;
+		}
+		m_cells = new MCell[size];
+		m_mask = size - 1;
+		for (size_t i = 0; i < size; i++)
+		{
+			m_cells[i].seq.store(i, std::memory_order_relaxed);
+		}
+		m_enqueue.store(0, std::memory_order_relaxed);
+		m_dequeue.store(0, std::memory_order_relaxed);
+		m_popWaiters = 0;
+		m_pushWaiters = 0;
 	}
 
 	~CMQueue()
 	{
 		clear();
-		T t;
-		M m(t);
-		if (!PostQueuedCompletionStatus(m_hIocp, -1, (ULONG_PTR)&m, NULL))
+		delete[] m_cells;
+	}
+
+	//满了返回false
+	bool push_back(const T& t)
+	{
+		if (!TryPush(t))
 		{
-			::AfxMessageBox(L"~CMQueue Error1");
-			return;
+			return false;
 		}
-		if (WaitForSingleObject(m.hEvent, 100) != WAIT_OBJECT_0)
+		Wake(m_popWaiters, m_condPop);
+		return true;
+	}
+
+	bool push_back(T&& t)
+	{
+		if (!TryPush(std::move(t)))
 		{
-			::AfxMessageBox(L"~CMQueue Error2");
-			return;
+			return false;
 		}
+		Wake(m_popWaiters, m_condPop);
+		return true;
 	}
 
-	bool push_back(const T& t)
+	//空了返回false
+	bool pop_front(T& t)
 	{
-		T* pT = new T(t);
-		//memcpy(pT, &t, sizeof(T));
-		if (!PostQueuedCompletionStatus(m_hIocp, PUSH, (ULONG_PTR)pT, NULL))
+		if (!TryPop(t))
 		{
-			delete pT;
 			return false;
 		}
+		Wake(m_pushWaiters, m_condPush);
 		return true;
 	}
 
-	bool pop_front(T& t)
+	//满了等空位，timeout毫秒(小于0一直等)后还是满的返回false，t保持不变
+	bool wait_push(T&& t, int timeout = -1)
 	{
-		M m(t);
-		if (!PostQueuedCompletionStatus(m_hIocp, POP, (ULONG_PTR)&m, NULL))
+		if (!Wait([this, &t]() { return TryPush(std::move(t)); }, m_pushWaiters, m_condPush, After(timeout)))
 		{
 			return false;
 		}
-		if (WaitForSingleObject(m.hEvent, 100) != WAIT_OBJECT_0)
+		Wake(m_popWaiters, m_condPop);
+		return true;
+	}
+
+	bool wait_push(const T& t, int timeout = -1)
+	{
+		if (!Wait([this, &t]() { return TryPush(t); }, m_pushWaiters, m_condPush, After(timeout)))
 		{
 			return false;
 		}
-		if (m.wParam == 0)
+		Wake(m_popWaiters, m_condPop);
+		return true;
+	}
+
+	//空了等数据，timeout毫秒(小于0一直等)后还是空的返回false
+	bool wait_pop(T& t, int timeout = -1)
+	{
+		return wait_pop(t, After(timeout));
+	}
+
+	//空了等数据，到deadline还是空的返回false
+	bool wait_pop(T& t, MDeadline deadline)
+	{
+		if (!Wait([this, &t]() { return TryPop(t); }, m_popWaiters, m_condPop, deadline))
 		{
 			return false;
 		}
-		t = m.t;
+		Wake(m_pushWaiters, m_condPush);
 		return true;
 	}
 
-	size_t size()
+	//取走现有的最多max个追加到out(有push_back的容器)，一个都没有就等到deadline；返回取到的个数
+	//deadline默认是现在，即不等待
+	template<typename C>
+	size_t pop_n(C& out, size_t max, MDeadline deadline = MDeadline())
 	{
-		T t;
-		M m(t);
-		if (!PostQueuedCompletionStatus(m_hIocp, SIZE, (ULONG_PTR)&m, NULL))
+		size_t count = 0;
+		if (deadline == MDeadline())
 		{
-			return 0;
+			count = TryPopN(out, max);
 		}
-		if (WaitForSingleObject(m.hEvent, 100) != WAIT_OBJECT_0)
+		else
 		{
-			return 0;
+			Wait([this, &out, max, &count]() { count = TryPopN(out, max); return count > 0; }, m_popWaiters, m_condPop, deadline);
 		}
-		if (m.wParam != -1)
+		if (count > 0)
 		{
-			return m.wParam;
+			Wake(m_pushWaiters, m_condPush, count > 1);
 		}
-		return 0;
+		return count;
 	}
 
+	//近似值：别的线程正在放/取时可能差几个，不加锁
+	size_t size() const
+	{
+		size_t dequeue = m_dequeue.load(std::memory_order_relaxed);
+		size_t enqueue = m_enqueue.load(std::memory_order_relaxed);
+		return (enqueue > dequeue) ? (enqueue - dequeue) : 0;
+	}
+
+	size_t capacity() const
+	{
+		return m_mask + 1;
+	}
+
+	bool empty() const
+	{
+		return size() == 0;
+	}
+
+	//取空当前的数据(别的线程同时在放的可能留下)
 	bool clear()
 	{
-		T t;
-		M m(t);
-		if (!PostQueuedCompletionStatus(m_hIocp, CLEAR, (ULONG_PTR)&m, NULL))
-		{
-			return false;
-		}
-		if (WaitForSingleObject(m.hEvent, 100) != WAIT_OBJECT_0)
+		while (TryTake([](T*) {}))
 		{
-			return false;
 		}
+		Wake(m_pushWaiters, m_condPush);
 		return true;
 	}
 
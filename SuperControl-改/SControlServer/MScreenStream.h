@@ -0,0 +1,217 @@
+#pragma once
+
+#include "Common.h"
+#include "MThread.h"
+#include "MTimer.h"
+#include "MByteQueue.h"
+#include "MCapture.h"
+#include "MTileCodec.h"
+#include "Screenshot.h"
+#include <memory>
+#include <functional>
+
+//推屏会话：控制端发一次命令9，之后被控端在这个连接上一帧接一帧地推，不再每帧建一次连接
+//流控用额度：控制端说还能收几帧，推一帧用掉一个，画完再还回来；额度用完或者暂停就不截了
+//编码器跟着会话走，只有第一帧和控制端要求时整帧发，其他都是变了的块(观看端缓存里有的只发键)
+class CMScreenStream : public std::enable_shared_from_this<CMScreenStream>
+{
+public:
+	enum
+	{
+		STREAM_CMD		= 9,		//推屏命令，控制包和推出去的帧都用它
+		MAX_CREDIT		= 16,		//额度上限，控制端多给了也按这个算
+		IDLE_INTERVAL	= 20,		//画面没变时隔多久再截(毫秒)
+	};
+private:
+	CMByteQueue&			m_queue;		//连接的发送队列
+	CMThreadPool&			m_pool;			//截屏、编码在这里跑
+	std::function<void()>	m_onEnd;		//会话结束(断了、推不出去了)，只调一次
+	CMCapture				m_capture;
+	CMTileEncoder			m_encoder;
+	std::vector<uint8_t>	m_frame;		//编码结果，反复用
+	std::mutex				m_mutex;
+	int						m_credit;		//还能推几帧
+	int						m_quality;		//0是无损，1~100是有损
+	bool					m_key;			//下一帧整帧发
+	bool					m_paused;
+	bool					m_stopped;		//不再推了
+	bool					m_scheduled;	//有一个截屏任务在排队或执行(同一时间只有一个)
+	bool					m_ended;
+private:
+	CMScreenStream(const CMScreenStream&) = delete;
+	CMScreenStream& operator=(const CMScreenStream&) = delete;
+	//能推就排一个截屏任务(调用方持锁，排了以后会解锁)
+	void Kick(std::unique_lock<std::mutex>& lock)
+	{
+		if (m_scheduled || m_stopped || m_paused || (m_credit <= 0))
+		{
+			return;
+		}
+		m_scheduled = true;
+		lock.unlock();
+		Schedule(0);
+	}
+	//delay毫秒后截下一帧；线程池满了就等一会再试
+	void Schedule(int delay)
+	{
+		std::shared_ptr<CMScreenStream> self = shared_from_this();
+		if ((delay == 0) && m_pool.DispatchTask(CMTask([self]() { self->Produce(); }), MP_BULK, MTAG_SCREEN))
+		{
+			return;
+		}
+		CMTimer::Global().Schedule(std::max(delay, (int)IDLE_INTERVAL), 0, CMTask([self]() {
+			self->Schedule(0);
+		}));
+	}
+	void End()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_ended)
+			{
+				return;
+			}
+			m_ended = true;
+		}
+		m_onEnd();
+	}
+	//截一帧编一帧放进发送队列：1推出去了，0画面没变，-1连接断了
+	int Frame(int quality, bool key)
+	{
+		if (!m_capture.Grab())
+		{
+			return 0;
+		}
+		//抢占点：编码前先让排着的交互命令执行
+		CMThreadPool::Preempt();
+		m_encoder.SetFormat((quality > 0) ? MTF_LOSSY : MTF_LOSSLESS);
+		m_encoder.SetQuality(quality);
+		if (key)
+		{
+			m_encoder.Reset();
+		}
+		if (m_encoder.Encode(m_capture.Bits(), m_capture.Width(), m_capture.Height(), m_capture.Stride(), m_frame) == 0)
+		{
+			return 0;
+		}
+		if (m_queue.Push(CPacket(STREAM_CMD, m_frame.data(), (DWORD)m_frame.size(), false)) == CMByteQueue::MB_ABORTED)
+		{
+			return -1;
+		}
+		return 1;
+	}
+	//截屏任务：推一帧，还有额度就接着排下一个(画面没变的话隔一会)
+	void Produce()
+	{
+		int quality = 0;
+		bool key = false;
+		bool run = false;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			run = !m_stopped && !m_paused && (m_credit > 0);
+			if (run)
+			{
+				quality = m_quality;
+				key = m_key;
+				m_key = false;
+			}
+		}
+		int ret = run ? Frame(quality, key) : 0;
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if (key && (ret <= 0))
+		{
+			//整帧没推出去(没截到)，下一帧还得是整帧，不然控制端接着拿差量往没有的底图上贴
+			m_key = true;
+		}
+		if (ret < 0)
+		{
+			m_stopped = true;
+		}
+		else if (ret > 0)
+		{
+			m_credit--;
+		}
+		if (m_stopped)
+		{
+			lock.unlock();
+			End();
+			return;
+		}
+		if (m_paused || (m_credit <= 0))
+		{
+			m_scheduled = false;
+			return;
+		}
+		lock.unlock();
+		Schedule((ret > 0) ? 0 : IDLE_INTERVAL);
+	}
+public:
+	//onEnd在会话结束时调用一次，调用方在里面收尾(关连接)
+	CMScreenStream(CMByteQueue& queue, CMThreadPool& pool, std::function<void()> onEnd)
+		: m_queue(queue)
+		, m_pool(pool)
+		, m_onEnd(onEnd)
+		, m_credit(0)
+		, m_quality(0)
+		, m_key(true)
+		, m_paused(false)
+		, m_stopped(false)
+		, m_scheduled(false)
+		, m_ended(false)
+	{
+		CScreenshot::Parallelize(m_encoder);
+		//观看端一直连着，切回看过的窗口时只发块的键
+		m_encoder.SetCache(true);
+	}
+	//控制端发来的命令9：开始、给额度、暂停、继续、换质量、要整帧
+	void Control(const CPacket& pack)
+	{
+		STREAMCTRL ctrl{};
+		if (pack.sData.size() < sizeof(ctrl))
+		{
+			printf("%s(%d):%s bad stream control size:%d\r\n", __FILE__, __LINE__, __FUNCTION__, (int)pack.sData.size());
+			return;
+		}
+		memcpy(&ctrl, pack.sData.c_str(), sizeof(ctrl));
+		std::unique_lock<std::mutex> lock(m_mutex);
+		switch (ctrl.nOp)
+		{
+		case MS_START:
+			m_quality = ctrl.nQuality;
+			m_credit = std::min((int)ctrl.nCredit, (int)MAX_CREDIT);
+			m_key = true;
+			break;
+		case MS_CREDIT:
+			m_credit = std::min(m_credit + ctrl.nCredit, (int)MAX_CREDIT);
+			break;
+		case MS_PAUSE:
+			m_paused = true;
+			break;
+		case MS_RESUME:
+			m_paused = false;
+			break;
+		case MS_QUALITY:
+			//换了质量整帧重发，没变的块也按新质量来
+			m_quality = ctrl.nQuality;
+			m_key = true;
+			break;
+		case MS_KEY:
+			m_key = true;
+			break;
+		}
+		Kick(lock);
+	}
+	//连接断了：正在截的那帧做完就结束，没在截的话马上结束
+	void Stop()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_stopped = true;
+		if (m_scheduled)
+		{
+			return;
+		}
+		m_scheduled = true;
+		lock.unlock();
+		End();
+	}
+};
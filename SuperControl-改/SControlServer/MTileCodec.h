@@ -0,0 +1,770 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <cstring>
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include "MLossless.h"
+#include "MLossy.h"
+
+//屏幕按固定大小的块切开，每块算一个哈希，和上一帧比只发变了的块(带块坐标)
+//输入是原始BGRA像素(每像素4字节，行从上往下，stride可以是负数表示倒着放的DIB)，不依赖GDI，Linux上也能编
+//码流：MTileFrameHeader + count个(MTileHeader + 数据)，所有字段小端
+//帧头带MTILE_CACHE时每块的数据前面多8字节的内容键，观看端缓存里有的块(MTF_CACHED)只有这个键
+enum MTileFormat
+{
+	MTF_RAW			= 0,		//原始BGRA，按行紧密排列
+	MTF_LOSSLESS	= 1,		//CMLossless压过的
+	MTF_LOSSY		= 2,		//CMLossy压过的
+	MTF_CACHED		= 3,		//观看端缓存里的块，只有键
+};
+
+#pragma pack(push, 1)
+struct MTileFrameHeader
+{
+	uint32_t	magic;			//MTILE_MAGIC
+	uint16_t	width;
+	uint16_t	height;
+	uint16_t	tileSize;
+	uint16_t	flags;			//MTILE_KEY：整帧都发了，解码端不用依赖上一帧；MTILE_CACHE：块带内容键
+	uint32_t	count;			//后面跟着几个块
+};
+struct MTileHeader
+{
+	uint16_t	tx;				//第几列块
+	uint16_t	ty;				//第几行块
+	uint8_t		format;			//MTileFormat
+	uint8_t		reserved;
+	uint32_t	size;			//后面数据的字节数
+};
+#pragma pack(pop)
+
+enum
+{
+	MTILE_MAGIC		= 0x31544C4D,		//"MLT1"
+	MTILE_KEY		= 1,
+	MTILE_CACHE		= 2,
+	MTILE_SIZE		= 64,				//默认块边长(像素)
+	MTILE_MAX_SIDE	= 8192,				//最大宽高，解码端码流坏了也不会按65535x65535分配
+	MTILE_CACHE_TILES	= 2048,			//块缓存能放几块，两边必须一样(64像素的块观看端最多占32MB，够放一整个4K屏)
+};
+
+//CMTileDecoder::Receive的结果
+enum MTileReceive
+{
+	MTR_SHOWN,			//解出来了，可以画
+	MTR_SKIPPED,		//在等整帧，这一帧是变化帧，没解
+	MTR_NEED_KEY,		//解码失败，要让编码端下一帧发整帧
+};
+
+//编码统计：一帧或者累计
+struct MTileStats
+{
+	unsigned long long	frames;
+	unsigned long long	tiles;			//看过的块数
+	unsigned long long	changed;		//发出去的块数
+	unsigned long long	cached;			//其中观看端缓存里有、只发了键的块数
+	unsigned long long	bytes;			//码流字节数
+	long long			hashUs;			//算哈希用的时间
+	long long			encodeUs;		//整个Encode用的时间
+	MTileStats() : frames(0), tiles(0), changed(0), cached(0), bytes(0), hashUs(0), encodeUs(0)
+	{
+	}
+};
+
+//块哈希：4路独立累加(每步32字节)，乘法流水线不用互相等；不用特定指令集，MSVC/GCC都能编
+class CMTileHash
+{
+private:
+	static const uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+	static const uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+	static const uint64_t PRIME3 = 0x165667B19E3779F9ULL;
+	static uint64_t Rotl(uint64_t v, int bits)
+	{
+		return (v << bits) | (v >> (64 - bits));
+	}
+	static uint64_t Round(uint64_t acc, uint64_t v)
+	{
+		acc += v * PRIME2;
+		acc = Rotl(acc, 31);
+		return acc * PRIME1;
+	}
+	static uint64_t Load64(const uint8_t* p)
+	{
+		uint64_t v;
+		memcpy(&v, p, sizeof(v));
+		return v;
+	}
+public:
+	//rows行，每行rowBytes字节，行首相隔stride字节
+	static uint64_t Hash(const uint8_t* data, int rows, size_t rowBytes, ptrdiff_t stride)
+	{
+		uint64_t lane[4] = { PRIME1 + PRIME2, PRIME2, 0, 0 - PRIME1 };
+		uint64_t tail = PRIME3;
+		for (int y = 0; y < rows; y++)
+		{
+			const uint8_t* p = data + y * stride;
+			size_t i = 0;
+			for (; i + 32 <= rowBytes; i += 32)
+			{
+				lane[0] = Round(lane[0], Load64(p + i));
+				lane[1] = Round(lane[1], Load64(p + i + 8));
+				lane[2] = Round(lane[2], Load64(p + i + 16));
+				lane[3] = Round(lane[3], Load64(p + i + 24));
+			}
+			//边上的块一行不满32字节
+			for (; i + 8 <= rowBytes; i += 8)
+			{
+				tail = Round(tail, Load64(p + i));
+			}
+			for (; i < rowBytes; i++)
+			{
+				tail = Round(tail, p[i]);
+			}
+		}
+		uint64_t h = Rotl(lane[0], 1) + Rotl(lane[1], 7) + Rotl(lane[2], 12) + Rotl(lane[3], 18);
+		h = (h ^ tail) * PRIME1 + (uint64_t)rows * rowBytes;
+		h ^= h >> 33;
+		h *= PRIME2;
+		h ^= h >> 29;
+		h *= PRIME3;
+		h ^= h >> 32;
+		return h;
+	}
+};
+
+//块缓存：内容键 -> 槽，满了挤掉最久没用的
+//编码端和观看端各一份，每帧按同样的顺序更新(先命中的、再新发的，都按码流顺序)，两边的内容一直一样
+//编码端只记键；观看端在槽里存块的像素，切回看过的窗口时直接从这里贴
+class CMTileCache
+{
+public:
+	//帧里一个块对缓存做的事：命中(slot>=0)或者新放进去
+	struct MOp
+	{
+		uint64_t	key;
+		int			slot;
+		int			x, y, w, h;
+	};
+private:
+	struct MSlot
+	{
+		uint64_t	key;
+		int			prev;			//更近用过的
+		int			next;			//更久没用的
+		int			w, h;
+	};
+	int										m_capacity;
+	bool									m_pixels;	//槽里存不存像素
+	std::vector<MSlot>						m_slots;
+	std::vector<std::vector<uint8_t>>		m_tiles;	//每个槽的像素(按行紧密排列)，挤掉时缓冲区留着给下一块用
+	std::unordered_map<uint64_t, int>		m_map;
+	int										m_head;		//最近用过的
+	int										m_tail;		//最久没用的
+private:
+	void Unlink(int slot)
+	{
+		MSlot& s = m_slots[slot];
+		(s.prev >= 0) ? (m_slots[s.prev].next = s.next) : (m_head = s.next);
+		(s.next >= 0) ? (m_slots[s.next].prev = s.prev) : (m_tail = s.prev);
+	}
+	void PushFront(int slot)
+	{
+		MSlot& s = m_slots[slot];
+		s.prev = -1;
+		s.next = m_head;
+		(m_head >= 0) ? (m_slots[m_head].prev = slot) : (m_tail = slot);
+		m_head = slot;
+	}
+public:
+	CMTileCache(int capacity, bool pixels) : m_capacity(capacity), m_pixels(pixels), m_head(-1), m_tail(-1)
+	{
+	}
+	//键：块的哈希再混进尺寸，边上不满一块的和整块的不会撞
+	static uint64_t Key(uint64_t hash, int w, int h)
+	{
+		return hash ^ (((uint64_t)w << 48) | ((uint64_t)h << 32));
+	}
+	void Clear()
+	{
+		m_slots.clear();
+		m_map.clear();
+		m_head = -1;
+		m_tail = -1;
+	}
+	//没有返回-1
+	int Find(uint64_t key) const
+	{
+		std::unordered_map<uint64_t, int>::const_iterator it = m_map.find(key);
+		return (it != m_map.end()) ? it->second : -1;
+	}
+	void Touch(int slot)
+	{
+		if (slot != m_head)
+		{
+			Unlink(slot);
+			PushFront(slot);
+		}
+	}
+	//放进一块，满了挤掉最久没用的；已经有了就只是挪到最前面
+	int Insert(uint64_t key, int w, int h)
+	{
+		int slot = Find(key);
+		if (slot >= 0)
+		{
+			Touch(slot);
+			return slot;
+		}
+		if ((int)m_slots.size() < m_capacity)
+		{
+			slot = (int)m_slots.size();
+			m_slots.push_back(MSlot());
+		}
+		else
+		{
+			slot = m_tail;
+			Unlink(slot);
+			m_map.erase(m_slots[slot].key);
+		}
+		MSlot& s = m_slots[slot];
+		s.key = key;
+		s.w = w;
+		s.h = h;
+		PushFront(slot);
+		m_map[key] = slot;
+		if (m_pixels)
+		{
+			if ((int)m_tiles.size() <= slot)
+			{
+				m_tiles.resize(slot + 1);
+			}
+			m_tiles[slot].resize((size_t)w * h * 4);
+		}
+		return slot;
+	}
+	//一帧的更新：ops是码流顺序，先做命中的再放新的；frame不为空时新块的像素从整帧(行宽stride)里拷进槽
+	void Apply(const std::vector<MOp>& ops, const uint8_t* frame, ptrdiff_t stride)
+	{
+		for (size_t i = 0; i < ops.size(); i++)
+		{
+			if (ops[i].slot >= 0)
+			{
+				Touch(ops[i].slot);
+			}
+		}
+		for (size_t i = 0; i < ops.size(); i++)
+		{
+			const MOp& op = ops[i];
+			if (op.slot >= 0)
+			{
+				continue;
+			}
+			int slot = Insert(op.key, op.w, op.h);
+			if (m_pixels && (frame != NULL))
+			{
+				size_t rowBytes = (size_t)op.w * 4;
+				const uint8_t* src = frame + op.y * stride + (ptrdiff_t)op.x * 4;
+				uint8_t* dst = m_tiles[slot].data();
+				for (int y = 0; y < op.h; y++)
+				{
+					memcpy(dst + y * rowBytes, src + y * stride, rowBytes);
+				}
+			}
+		}
+	}
+	int Width(int slot) const
+	{
+		return m_slots[slot].w;
+	}
+	int Height(int slot) const
+	{
+		return m_slots[slot].h;
+	}
+	const uint8_t* Pixels(int slot) const
+	{
+		return m_tiles[slot].data();
+	}
+	size_t Size() const
+	{
+		return m_slots.size();
+	}
+};
+
+//并行执行：把body(0)..body(count-1)分给多个线程，全部做完才返回(线程池的parallel_for包一下)
+typedef std::function<void(size_t count, const std::function<void(size_t)>& body)> MTileParallel;
+
+//编码端：记住上一帧每块的哈希，只把变了的块写进码流；尺寸变了或者Reset后整帧都发
+//设置了并行时按块行切成几段，各段用自己的压缩器和缓冲区同时编，再按顺序拼起来
+class CMTileEncoder
+{
+private:
+	//一段块行的编码现场，缓冲区反复用，稳定以后不再分配
+	struct MBand
+	{
+		CMLossless				lossless;
+		CMLossy					lossy;
+		std::vector<uint8_t>	out;
+		std::vector<CMTileCache::MOp>	ops;	//这段的块对缓存做的事，帧编完按段的顺序更新缓存
+		uint32_t				count;
+		uint32_t				cached;
+		long long				hashUs;
+	};
+	int						m_tileSize;
+	int						m_width;
+	int						m_height;
+	int						m_cols;
+	int						m_rows;
+	bool					m_key;			//下一帧整帧发
+	MTileFormat				m_format;
+	int						m_quality;		//MTF_LOSSY的质量
+	size_t					m_bandCount;	//并行时切几段
+	MTileParallel			m_parallel;
+	std::vector<std::unique_ptr<MBand>>	m_bands;
+	std::vector<uint64_t>	m_hashes;		//上一帧每块的哈希(每段只写自己的块行)
+	bool					m_cacheOn;		//观看端留着最近的块，内容一样的只发键
+	CMTileCache				m_cache;		//观看端块缓存的镜像，编的时候只读，帧编完再更新
+	std::vector<CMTileCache::MOp>	m_ops;	//各段的缓存操作按顺序拼起来
+	MTileStats				m_last;			//最近一帧
+	MTileStats				m_total;		//累计
+private:
+	static long long NowUs()
+	{
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+	template<typename T>
+	static void Append(std::vector<uint8_t>& out, const T& t)
+	{
+		size_t pos = out.size();
+		out.resize(pos + sizeof(T));
+		memcpy(out.data() + pos, &t, sizeof(T));
+	}
+	//块的原始像素按行紧密排列追加到out
+	static void AppendRaw(std::vector<uint8_t>& out, const uint8_t* src, int rows, size_t rowBytes, ptrdiff_t stride)
+	{
+		size_t pos = out.size();
+		out.resize(pos + rows * rowBytes);
+		uint8_t* dst = out.data() + pos;
+		for (int y = 0; y < rows; y++)
+		{
+			memcpy(dst + y * rowBytes, src + y * stride, rowBytes);
+		}
+	}
+	void Resize(int width, int height)
+	{
+		m_width = width;
+		m_height = height;
+		m_cols = (width + m_tileSize - 1) / m_tileSize;
+		m_rows = (height + m_tileSize - 1) / m_tileSize;
+		m_hashes.assign((size_t)m_cols * m_rows, 0);
+		m_key = true;
+	}
+	//编第rowBegin到rowEnd-1行块，块追加到out
+	void EncodeRows(MBand& band, std::vector<uint8_t>& out, const uint8_t* bgra, int width, int height, ptrdiff_t stride, int rowBegin, int rowEnd)
+	{
+		band.count = 0;
+		band.cached = 0;
+		band.hashUs = 0;
+		band.ops.clear();
+		for (int ty = rowBegin; ty < rowEnd; ty++)
+		{
+			int y = ty * m_tileSize;
+			int h = (y + m_tileSize <= height) ? m_tileSize : (height - y);
+			for (int tx = 0; tx < m_cols; tx++)
+			{
+				int x = tx * m_tileSize;
+				int w = (x + m_tileSize <= width) ? m_tileSize : (width - x);
+				const uint8_t* src = bgra + y * stride + (ptrdiff_t)x * 4;
+				long long hashStart = NowUs();
+				uint64_t hash = CMTileHash::Hash(src, h, (size_t)w * 4, stride);
+				band.hashUs += NowUs() - hashStart;
+				uint64_t& last = m_hashes[(size_t)ty * m_cols + tx];
+				if (!m_key && (hash == last))
+				{
+					continue;
+				}
+				last = hash;
+				MTileFormat format = m_format;
+				uint64_t key = CMTileCache::Key(hash, w, h);
+				int slot = -1;
+				if (m_cacheOn)
+				{
+					//整帧发的时候两边的缓存都清空了，不会命中
+					slot = m_cache.Find(key);
+					CMTileCache::MOp op = { key, slot, x, y, w, h };
+					band.ops.push_back(op);
+					if (slot >= 0)
+					{
+						format = MTF_CACHED;
+						band.cached++;
+					}
+				}
+				if ((format == MTF_LOSSY) && ((band.lossless.Colors(src, w, h, stride) > 0) || CMLossy::HasSharpEdges(src, w, h, stride)))
+				{
+					format = MTF_LOSSLESS;
+				}
+				MTileHeader tile = { (uint16_t)tx, (uint16_t)ty, (uint8_t)format, 0, 0 };
+				size_t pos = out.size();
+				Append(out, tile);
+				if (m_cacheOn)
+				{
+					Append(out, key);
+				}
+				if (format == MTF_LOSSY)
+				{
+					band.lossy.Encode(src, w, h, stride, m_quality, out);
+				}
+				else if (format == MTF_LOSSLESS)
+				{
+					band.lossless.Encode(src, w, h, stride, out);
+				}
+				else if (format == MTF_RAW)
+				{
+					AppendRaw(out, src, h, (size_t)w * 4, stride);
+				}
+				tile.size = (uint32_t)(out.size() - pos - sizeof(tile));
+				memcpy(out.data() + pos, &tile, sizeof(tile));
+				band.count++;
+			}
+		}
+	}
+public:
+	explicit CMTileEncoder(int tileSize = MTILE_SIZE)
+		: m_tileSize((tileSize > 0) ? tileSize : (int)MTILE_SIZE)
+		, m_width(0)
+		, m_height(0)
+		, m_cols(0)
+		, m_rows(0)
+		, m_key(true)
+		, m_format(MTF_LOSSLESS)
+		, m_quality(CMLossy::QUALITY_DEFAULT)
+		, m_bandCount(1)
+		, m_cacheOn(false)
+		, m_cache(MTILE_CACHE_TILES, false)
+	{
+	}
+	//MTF_RAW省CPU(局域网、调试)，MTF_LOSSLESS省带宽，MTF_LOSSY给慢的链路(文字多的块还是无损)
+	void SetFormat(MTileFormat format)
+	{
+		m_format = format;
+	}
+	//MTF_LOSSY的质量(1~100)，越小越省带宽
+	void SetQuality(int quality)
+	{
+		m_quality = quality;
+	}
+	//并行编码：每帧切成bands段交给parallel执行；bands<=1或者parallel为空时在调用线程里编
+	void SetParallel(size_t bands, MTileParallel parallel)
+	{
+		m_bandCount = bands;
+		m_parallel = parallel;
+	}
+	//下一帧整帧发(新的观看端连上来、观看端丢了帧)
+	void Reset()
+	{
+		m_key = true;
+	}
+	//块缓存：只给一直连着的观看端开(推屏)，每帧都整帧发的用不上；开关时下一帧整帧发，两边从空缓存开始
+	void SetCache(bool on)
+	{
+		if (on != m_cacheOn)
+		{
+			m_cacheOn = on;
+			m_key = true;
+		}
+	}
+	int TileSize() const
+	{
+		return m_tileSize;
+	}
+	//编一帧：bgra指向最上面一行，stride是相邻两行的字节差；out先清空再写，返回变了的块数
+	size_t Encode(const uint8_t* bgra, int width, int height, ptrdiff_t stride, std::vector<uint8_t>& out)
+	{
+		long long start = NowUs();
+		out.clear();
+		if ((width <= 0) || (height <= 0) || (width > MTILE_MAX_SIDE) || (height > MTILE_MAX_SIDE))
+		{
+			return 0;
+		}
+		if ((width != m_width) || (height != m_height))
+		{
+			Resize(width, height);
+		}
+		uint16_t flags = (uint16_t)((m_key ? MTILE_KEY : 0) | (m_cacheOn ? MTILE_CACHE : 0));
+		MTileFrameHeader frame = { MTILE_MAGIC, (uint16_t)width, (uint16_t)height, (uint16_t)m_tileSize, flags, 0 };
+		Append(out, frame);
+		if (m_key)
+		{
+			m_cache.Clear();
+		}
+		//按块行平均切段，段比线程多一些，快慢不均时线程池能匀开
+		size_t bands = (m_parallel && (m_bandCount > 1)) ? std::min(m_bandCount, (size_t)m_rows) : 1;
+		while (m_bands.size() < bands)
+		{
+			m_bands.emplace_back(new MBand());
+		}
+		long long hashUs = 0;
+		uint32_t count = 0;
+		uint32_t cached = 0;
+		if (bands == 1)
+		{
+			EncodeRows(*m_bands[0], out, bgra, width, height, stride, 0, m_rows);
+			hashUs = m_bands[0]->hashUs;
+			count = m_bands[0]->count;
+			cached = m_bands[0]->cached;
+		}
+		else
+		{
+			m_parallel(bands, [this, bands, bgra, width, height, stride](size_t i) {
+				MBand& band = *m_bands[i];
+				band.out.clear();
+				EncodeRows(band, band.out, bgra, width, height, stride, (int)(m_rows * i / bands), (int)(m_rows * (i + 1) / bands));
+			});
+			size_t total = out.size();
+			for (size_t i = 0; i < bands; i++)
+			{
+				total += m_bands[i]->out.size();
+			}
+			out.reserve(total);
+			for (size_t i = 0; i < bands; i++)
+			{
+				MBand& band = *m_bands[i];
+				out.insert(out.end(), band.out.begin(), band.out.end());
+				hashUs += band.hashUs;
+				count += band.count;
+				cached += band.cached;
+			}
+		}
+		//缓存按码流的顺序更新，和观看端解完这帧后一样
+		if (m_cacheOn)
+		{
+			m_ops.clear();
+			for (size_t i = 0; i < bands; i++)
+			{
+				m_ops.insert(m_ops.end(), m_bands[i]->ops.begin(), m_bands[i]->ops.end());
+			}
+			m_cache.Apply(m_ops, NULL, 0);
+		}
+		memcpy(out.data() + offsetof(MTileFrameHeader, count), &count, sizeof(count));
+		m_key = false;
+		m_last = MTileStats();
+		m_last.frames = 1;
+		m_last.tiles = (unsigned long long)m_cols * m_rows;
+		m_last.changed = count;
+		m_last.cached = cached;
+		m_last.bytes = out.size();
+		m_last.hashUs = hashUs;
+		m_last.encodeUs = NowUs() - start;
+		m_total.frames++;
+		m_total.tiles += m_last.tiles;
+		m_total.changed += m_last.changed;
+		m_total.cached += m_last.cached;
+		m_total.bytes += m_last.bytes;
+		m_total.hashUs += m_last.hashUs;
+		m_total.encodeUs += m_last.encodeUs;
+		return count;
+	}
+	const MTileStats& LastStats() const
+	{
+		return m_last;
+	}
+	const MTileStats& TotalStats() const
+	{
+		return m_total;
+	}
+};
+
+//解码端：维护一整帧BGRA(行从上往下，紧密排列)，把码流里的块贴上去
+class CMTileDecoder
+{
+public:
+	struct MDirty
+	{
+		int x, y, w, h;
+	};
+private:
+	int						m_width;
+	int						m_height;
+	int						m_tileSize;
+	std::vector<uint8_t>	m_frame;
+	std::vector<MDirty>		m_dirty;		//最近一次Decode改了哪些块，界面只重画这些
+	CMLossless				m_codec;
+	CMLossy					m_lossy;
+	CMTileCache				m_cache;		//看过的块，编码端有一份一样的索引
+	std::vector<CMTileCache::MOp>	m_ops;	//这一帧对缓存做的事，整帧解完再更新
+	bool					m_waitKey;		//解码失败过，在等整帧
+public:
+	CMTileDecoder() : m_width(0), m_height(0), m_tileSize(0), m_cache(MTILE_CACHE_TILES, true), m_waitKey(false)
+	{
+	}
+	//码流是不是整帧(不依赖上一帧)
+	static bool IsKey(const uint8_t* data, size_t size)
+	{
+		MTileFrameHeader frame;
+		if ((data == NULL) || (size < sizeof(frame)))
+		{
+			return false;
+		}
+		memcpy(&frame, data, sizeof(frame));
+		return (frame.magic == MTILE_MAGIC) && ((frame.flags & MTILE_KEY) != 0);
+	}
+	//推屏接收端用，返回MTileReceive。解码失败以后画面和编码端对不上了，在旧画面上改的变化帧解了也是错的：
+	//之后的变化帧都不解，只在失败的那一帧要一次整帧，等来整帧再接着画(整帧也坏了就再要)
+	int Receive(const uint8_t* data, size_t size)
+	{
+		if (m_waitKey && !IsKey(data, size))
+		{
+			m_dirty.clear();
+			return MTR_SKIPPED;
+		}
+		if (!Decode(data, size))
+		{
+			m_waitKey = true;
+			return MTR_NEED_KEY;
+		}
+		m_waitKey = false;
+		return MTR_SHOWN;
+	}
+	bool WaitingKey() const
+	{
+		return m_waitKey;
+	}
+	//码流不对返回false，画面保持原样(已经贴上去的块不回退)
+	bool Decode(const uint8_t* data, size_t size)
+	{
+		m_dirty.clear();
+		MTileFrameHeader frame;
+		if ((data == NULL) || (size < sizeof(frame)))
+		{
+			return false;
+		}
+		memcpy(&frame, data, sizeof(frame));
+		if ((frame.magic != MTILE_MAGIC) || (frame.width == 0) || (frame.height == 0) || (frame.tileSize == 0)
+			|| (frame.width > MTILE_MAX_SIDE) || (frame.height > MTILE_MAX_SIDE))
+		{
+			return false;
+		}
+		if ((frame.width != m_width) || (frame.height != m_height) || (frame.tileSize != m_tileSize))
+		{
+			//尺寸变了只能从整帧开始
+			if ((frame.flags & MTILE_KEY) == 0)
+			{
+				return false;
+			}
+			m_width = frame.width;
+			m_height = frame.height;
+			m_tileSize = frame.tileSize;
+			m_frame.assign((size_t)m_width * m_height * 4, 0);
+		}
+		bool cache = (frame.flags & MTILE_CACHE) != 0;
+		if (frame.flags & MTILE_KEY)
+		{
+			m_cache.Clear();
+		}
+		m_ops.clear();
+		int cols = (m_width + m_tileSize - 1) / m_tileSize;
+		int rows = (m_height + m_tileSize - 1) / m_tileSize;
+		size_t pos = sizeof(frame);
+		for (uint32_t i = 0; i < frame.count; i++)
+		{
+			MTileHeader tile;
+			if (size - pos < sizeof(tile))
+			{
+				return false;
+			}
+			memcpy(&tile, data + pos, sizeof(tile));
+			pos += sizeof(tile);
+			if ((tile.tx >= cols) || (tile.ty >= rows) || (size - pos < tile.size))
+			{
+				return false;
+			}
+			MDirty rect;
+			rect.x = tile.tx * m_tileSize;
+			rect.y = tile.ty * m_tileSize;
+			rect.w = (rect.x + m_tileSize <= m_width) ? m_tileSize : (m_width - rect.x);
+			rect.h = (rect.y + m_tileSize <= m_height) ? m_tileSize : (m_height - rect.y);
+			size_t rowBytes = (size_t)rect.w * 4;
+			uint8_t* dst = &m_frame[((size_t)rect.y * m_width + rect.x) * 4];
+			const uint8_t* src = data + pos;
+			uint32_t payload = tile.size;
+			CMTileCache::MOp op = { 0, -1, rect.x, rect.y, rect.w, rect.h };
+			if (cache)
+			{
+				if (payload < sizeof(op.key))
+				{
+					return false;
+				}
+				memcpy(&op.key, src, sizeof(op.key));
+				src += sizeof(op.key);
+				payload -= sizeof(op.key);
+			}
+			if (tile.format == MTF_LOSSLESS)
+			{
+				if (!m_codec.Decode(src, payload, dst, rect.w, rect.h, (ptrdiff_t)m_width * 4))
+				{
+					return false;
+				}
+			}
+			else if (tile.format == MTF_LOSSY)
+			{
+				if (!m_lossy.Decode(src, payload, dst, rect.w, rect.h, (ptrdiff_t)m_width * 4))
+				{
+					return false;
+				}
+			}
+			else if ((tile.format == MTF_RAW) && (payload == rowBytes * rect.h))
+			{
+				for (int y = 0; y < rect.h; y++)
+				{
+					memcpy(dst + (size_t)y * m_width * 4, src + y * rowBytes, rowBytes);
+				}
+			}
+			else if ((tile.format == MTF_CACHED) && cache && (payload == 0))
+			{
+				//缓存里没有(两边对不上了)返回false，控制端要一个整帧
+				op.slot = m_cache.Find(op.key);
+				if ((op.slot < 0) || (m_cache.Width(op.slot) != rect.w) || (m_cache.Height(op.slot) != rect.h))
+				{
+					return false;
+				}
+				const uint8_t* pixels = m_cache.Pixels(op.slot);
+				for (int y = 0; y < rect.h; y++)
+				{
+					memcpy(dst + (size_t)y * m_width * 4, pixels + y * rowBytes, rowBytes);
+				}
+			}
+			else
+			{
+				return false;
+			}
+			if (cache)
+			{
+				m_ops.push_back(op);
+			}
+			pos += tile.size;
+			m_dirty.push_back(rect);
+		}
+		m_cache.Apply(m_ops, m_frame.data(), (ptrdiff_t)m_width * 4);
+		return true;
+	}
+	const uint8_t* Frame() const
+	{
+		return m_frame.data();
+	}
+	int Width() const
+	{
+		return m_width;
+	}
+	int Height() const
+	{
+		return m_height;
+	}
+	const std::vector<MDirty>& Dirty() const
+	{
+		return m_dirty;
+	}
+};
@@ -6,44 +6,226 @@
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
+#include <memory>
+#include <random>
+#include <functional>
+#include <algorithm>
+#include <cstdint>
+#include <chrono>
+#include "MThread.h"
 
 class Task
 {
 public:
+	std::chrono::steady_clock::time_point	enqueue_;		//提交时间，统计排队时长
+	MTaskTag								tag_;
+	Task() : tag_(MTAG_OTHER)
+	{
+	}
+	virtual ~Task()
+	{
+	}
 	virtual void run()
 	{
 	}
 };
 
+//Chase-Lev双端队列：本线程在底部push/pop，其他线程从顶部steal，都不加锁
+class CSWorkDeque
+{
+private:
+	//环形数组，满了换成两倍大的新数组，旧数组留到析构再释放(steal的线程可能还在读)
+	struct Ring
+	{
+		int64_t					cap_;
+		std::atomic<Task*>*		buf_;
+		explicit Ring(int64_t cap) : cap_(cap), buf_(new std::atomic<Task*>[cap])
+		{
+		}
+		~Ring()
+		{
+			delete[] buf_;
+		}
+		Task* get(int64_t i)
+		{
+			return buf_[i & (cap_ - 1)].load(std::memory_order_relaxed);
+		}
+		void put(int64_t i, Task* task)
+		{
+			buf_[i & (cap_ - 1)].store(task, std::memory_order_relaxed);
+		}
+	};
+	std::atomic<int64_t>	top_;
+	std::atomic<int64_t>	bottom_;
+	std::atomic<Ring*>		ring_;
+	std::vector<Ring*>		garbage_;
+public:
+	CSWorkDeque(int64_t cap = 256) : top_(0), bottom_(0), ring_(new Ring(cap))
+	{
+	}
+	~CSWorkDeque()
+	{
+		delete ring_.load();
+		for (size_t i = 0; i < garbage_.size(); i++)
+		{
+			delete garbage_[i];
+		}
+	}
+	//只有所属线程能调用
+	void push(Task* task)
+	{
+		int64_t b = bottom_.load(std::memory_order_relaxed);
+		int64_t t = top_.load(std::memory_order_acquire);
+		Ring* ring = ring_.load(std::memory_order_relaxed);
+		if (b - t > ring->cap_ - 1)
+		{
+			Ring* bigger = new Ring(ring->cap_ * 2);
+			for (int64_t i = t; i < b; i++)
+			{
+				bigger->put(i, ring->get(i));
+			}
+			garbage_.push_back(ring);
+			ring = bigger;
+			ring_.store(ring, std::memory_order_release);
+		}
+		ring->put(b, task);
+		std::atomic_thread_fence(std::memory_order_release);
+		bottom_.store(b + 1, std::memory_order_relaxed);
+	}
+	//只有所属线程能调用，后进先出(刚拆出来的子任务数据还在缓存里)
+	Task* pop()
+	{
+		int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+		Ring* ring = ring_.load(std::memory_order_relaxed);
+		bottom_.store(b, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t t = top_.load(std::memory_order_relaxed);
+		Task* task = nullptr;
+		if (t <= b)
+		{
+			task = ring->get(b);
+			//只剩最后一个，和steal抢
+			if (t == b)
+			{
+				if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+				{
+					task = nullptr;
+				}
+				bottom_.store(b + 1, std::memory_order_relaxed);
+			}
+		}
+		else
+		{
+			bottom_.store(b + 1, std::memory_order_relaxed);
+		}
+		return task;
+	}
+	//任何线程都能调用，先进先出(偷大块的老任务)
+	Task* steal()
+	{
+		int64_t t = top_.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t b = bottom_.load(std::memory_order_acquire);
+		if (t >= b)
+		{
+			return nullptr;
+		}
+		Ring* ring = ring_.load(std::memory_order_acquire);
+		Task* task = ring->get(t);
+		if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+		{
+			return nullptr;
+		}
+		return task;
+	}
+};
+
+//工作窃取线程池：每个线程一个Chase-Lev队列，自己的任务做完了随机去偷别人的
+//池子外面的线程提交的任务先放进公共队列
 class CSThreadPool
 {
 private:
+	//包装lambda的任务，执行完自己删除
+	class FuncTask : public Task
+	{
+	private:
+		std::function<void()> func_;
+	public:
+		explicit FuncTask(std::function<void()> func) : func_(std::move(func))
+		{
+		}
+		void run() override
+		{
+			func_();
+			delete this;
+		}
+	};
+	struct Worker
+	{
+		CSWorkDeque		deque_;
+		std::minstd_rand rng_;
+	};
+	//当前线程属于哪个线程池的第几个线程
+	struct Current
+	{
+		CSThreadPool*	pool_;
+		size_t			index_;
+	};
+	static Current& current()
+	{
+		thread_local Current cur = { nullptr, 0 };
+		return cur;
+	}
 	std::vector<std::thread> threads_;
-	std::queue<Task*> tasks_;
+	std::vector<std::unique_ptr<Worker>> workers_;
+	std::queue<Task*> tasks_;				//外部线程提交的任务
+	std::atomic<int> injected_;				//tasks_里的任务数(不加锁先看一眼)
 	std::mutex mtx_;
 	std::atomic_bool running_flag_;
+	std::atomic_bool stop_flag_;
+	std::atomic<int> pending_;				//排着还没被取走的任务数
+	std::atomic<int> sleeping_;
+	std::atomic<int> busy_;					//正在执行任务的线程数
 	std::condition_variable cv_;
+	MDomain domain_;						//线程所在的执行域
+	CMHistogram wait_hist_[MTAG_COUNT];		//提交到开始执行(微秒)
+	CMHistogram run_hist_[MTAG_COUNT];		//执行时长(微秒)
 public:
-	CSThreadPool(int count) :
-		running_flag_(false)
+	CSThreadPool(int count, MDomain domain = MD_DEFAULT) :
+		injected_(0),
+		running_flag_(false),
+		stop_flag_(false),
+		pending_(0),
+		sleeping_(0),
+		busy_(0),
+		domain_(domain)
 	{
+		count = std::max(count, 1);
+		for (int i = 0; i < count; i++)
+		{
+			workers_.emplace_back(new Worker());
+			workers_.back()->rng_.seed((unsigned int)(i + 1));
+		}
 		for (int i = 0; i < count; i++)
 		{
-			threads_.emplace_back(&CSThreadPool::work, this);
+			threads_.emplace_back(&CSThreadPool::work, this, (size_t)i);
 		}
 	}
 	~CSThreadPool()
 	{
 		stop();
 	}
+	//开始执行任务，之前提交的任务排着等
 	void start()
 	{
 		running_flag_ = true;
+		wake(true);
 	}
+	//停下所有线程；还排着的任务在调用线程里执行完(FuncTask执行完才删除自己，等着的CSTaskGroup也要它们做完才返回)
 	void stop()
 	{
-		cv_.notify_all();
-		running_flag_ = false;
+		stop_flag_ = true;
+		wake(true);
 		for (auto& th : threads_)
 		{
 			if (th.joinable())
@@ -51,36 +233,236 @@ public:
 				th.join();
 			}
 		}
+		while (run_one())
+		{
+		}
 	}
+	//提交任务(task由调用方管理)：池子里的线程放进自己的队列，外部线程放进公共队列
 	void push_task(Task* task)
 	{
-		std::unique_lock<std::mutex> ulock(this->mtx_);
-		this->tasks_.push(task);
-		ulock.unlock();
-		this->cv_.notify_one();
+		task->enqueue_ = std::chrono::steady_clock::now();
+		Current& cur = current();
+		if (cur.pool_ == this)
+		{
+			workers_[cur.index_]->deque_.push(task);
+		}
+		else
+		{
+			std::lock_guard<std::mutex> lock(mtx_);
+			tasks_.push(task);
+			injected_++;
+		}
+		pending_++;
+		//已经停了：没有线程会来取，在提交的线程里执行掉
+		if (stop_flag_)
+		{
+			while (run_one())
+			{
+			}
+			return;
+		}
+		if (sleeping_ > 0)
+		{
+			wake(false);
+		}
+	}
+	//提交lambda
+	void push_func(std::function<void()> func, MTaskTag tag = MTAG_OTHER)
+	{
+		Task* task = new FuncTask(std::move(func));
+		task->tag_ = tag;
+		push_task(task);
+	}
+	//取一个任务执行，没有任务返回false(等待子任务时用来帮忙，不会死等)
+	bool run_one()
+	{
+		Task* task = find_task();
+		if (task == nullptr)
+		{
+			return false;
+		}
+		execute(task);
+		return true;
+	}
+	//把[begin, end)按grain切块并行执行func(i)，全部做完才返回
+	template <typename Func>
+	void parallel_for(size_t begin, size_t end, size_t grain, Func func, MTaskTag tag = MTAG_OTHER);
+	size_t size() const
+	{
+		return workers_.size();
+	}
+	//运行中随时可以取；这个线程池不拒绝任务，rejected都是0
+	MSchedStats stats()
+	{
+		MSchedStats stats;
+		memset(&stats, 0, sizeof(stats));
+		for (int i = 0; i < MTAG_COUNT; i++)
+		{
+			stats.wait[i] = wait_hist_[i].Snapshot();
+			stats.run[i] = run_hist_[i].Snapshot();
+		}
+		stats.pool.threads = workers_.size();
+		stats.pool.peak = workers_.size();
+		stats.pool.busy = busy_;
+		stats.pool.idle = workers_.size() - stats.pool.busy;
+		stats.pool.queued = std::max(pending_.load(), 0);
+		return stats;
+	}
+	//统计追加到trace文件，格式和CMThreadPool::DumpTrace一样
+	bool dump_trace(const char* path, const char* name)
+	{
+		FILE* file = fopen(path, "a");
+		if (file == nullptr)
+		{
+			return false;
+		}
+		CMThreadPool::WriteStats(file, name, 0, stats());
+		fclose(file);
+		return true;
 	}
 private:
-	void work()
+	//执行一个任务并记下排队和执行时长，run之后task可能已经自己删掉了，先取出标签
+	void execute(Task* task)
+	{
+		MTaskTag tag = task->tag_;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		wait_hist_[tag].Record((unsigned long long)std::chrono::duration_cast<std::chrono::microseconds>(start - task->enqueue_).count());
+		busy_++;
+		task->run();
+		busy_--;
+		run_hist_[tag].Record((unsigned long long)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+	}
+	void wake(bool all)
 	{
-		while (running_flag_)
+		std::lock_guard<std::mutex> lock(mtx_);
+		if (all)
 		{
-			Task* task = nullptr;
-
-			std::unique_lock<std::mutex> ulock(this->mtx_);
-			while (this->tasks_.empty())
+			cv_.notify_all();
+		}
+		else
+		{
+			cv_.notify_one();
+		}
+	}
+	Task* find_task()
+	{
+		Current& cur = current();
+		Task* task = nullptr;
+		//1.自己的队列
+		if (cur.pool_ == this)
+		{
+			task = workers_[cur.index_]->deque_.pop();
+		}
+		//2.公共队列
+		if ((task == nullptr) && (injected_ > 0))
+		{
+			std::lock_guard<std::mutex> lock(mtx_);
+			if (!tasks_.empty())
 			{
-				cv_.wait(ulock);
+				task = tasks_.front();
+				tasks_.pop();
+				injected_--;
 			}
-			if (running_flag_)
+		}
+		//3.随机挑别人偷，每个人最多试一次
+		if (task == nullptr)
+		{
+			thread_local std::minstd_rand rng((unsigned int)std::hash<std::thread::id>()(std::this_thread::get_id()));
+			std::minstd_rand& r = (cur.pool_ == this) ? workers_[cur.index_]->rng_ : rng;
+			size_t n = workers_.size();
+			size_t start = r() % n;
+			for (size_t i = 0; (i < n) && (task == nullptr); i++)
 			{
-				task = this->tasks_.front();
-				this->tasks_.pop();
+				size_t victim = (start + i) % n;
+				if ((cur.pool_ == this) && (victim == cur.index_))
+				{
+					continue;
+				}
+				task = workers_[victim]->deque_.steal();
 			}
-
+		}
+		if (task != nullptr)
+		{
+			pending_--;
+		}
+		return task;
+	}
+	void work(size_t index)
+	{
+		if (domain_ != MD_DEFAULT)
+		{
+			CMDomain::Enter(domain_, (int)index);
+		}
+		current().pool_ = this;
+		current().index_ = index;
+		while (!stop_flag_)
+		{
+			Task* task = running_flag_ ? find_task() : nullptr;
 			if (task != nullptr)
 			{
-				task->run();
+				execute(task);
+				continue;
 			}
+			//没活干就睡，有新任务、开始或关闭时被叫醒
+			std::unique_lock<std::mutex> ulock(this->mtx_);
+			sleeping_++;
+			cv_.wait(ulock, [this]() { return stop_flag_ || (running_flag_ && (pending_ > 0)); });
+			sleeping_--;
 		}
+		current().pool_ = nullptr;
+	}
+};
+
+//分叉-合并：run提交子任务，wait等它们全部完成，等的时候自己也去执行任务
+class CSTaskGroup
+{
+private:
+	CSThreadPool&		pool_;
+	std::atomic<int>	count_;
+	MTaskTag			tag_;
+public:
+	explicit CSTaskGroup(CSThreadPool& pool, MTaskTag tag = MTAG_OTHER) : pool_(pool), count_(0), tag_(tag)
+	{
+	}
+	~CSTaskGroup()
+	{
+		wait();
+	}
+	template <typename Func>
+	void run(Func func)
+	{
+		count_++;
+		pool_.push_func([this, func]() {
+			func();
+			count_--;
+		}, tag_);
+	}
+	void wait()
+	{
+		while (count_ > 0)
+		{
+			if (!pool_.run_one())
+			{
+				std::this_thread::yield();
+			}
+		}
+	}
+};
+
+template <typename Func>
+void CSThreadPool::parallel_for(size_t begin, size_t end, size_t grain, Func func, MTaskTag tag)
+{
+	grain = std::max<size_t>(grain, 1);
+	CSTaskGroup group(*this, tag);
+	for (size_t i = begin; i < end; i += grain)
+	{
+		size_t last = std::min(end, i + grain);
+		group.run([i, last, &func]() {
+			for (size_t j = i; j < last; j++)
+			{
+				func(j);
+			}
+		});
 	}
-};
\ No newline at end of file
+	group.wait();
+}
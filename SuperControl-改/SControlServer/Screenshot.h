@@ -1,88 +1,111 @@
 #pragma once
 
-#include "MQueue.h"
+#include "MFrameRing.h"
 #include "Common.h"
 #include "MThread.h"
-#include <atlimage.h>
+#include "MTimer.h"
+#include "SThreadPool.h"
+#include "MCapture.h"
+#include "MTileCodec.h"
+#include <atomic>
 
 class CScreenshot : public CMFuncBase
 {
 private:
-	//隔开一定时间，启动俩个线程
-	int Invoke()
+	enum
 	{
-		for (int i = 0; i < 2; i++)
-		{
-			m_pool.DispatchWork(CMWork(this, (MT_FUNC)&CScreenshot::Screen));
-			Sleep(10);
-		}
-		return -1;
-	}
-	//截图
+		SCREEN_INTERVAL		= 10,		//截图间隔(毫秒)，上一张没截完下一次不会开始
+		FRAME_RESERVE		= 4 << 20,	//帧缓冲区预留的大小
+		BANDS_PER_THREAD	= 4,		//并行编码时每个线程分几段
+	};
+	CMTimer::TimerId m_timer;
+	//截图(定时器回调，返回0继续)：直接写进帧缓冲的槽里，来不及发的旧帧被新帧覆盖
 	int Screen()
 	{
-		Sleep(10);
-		CPacket screenPacket;
-		ScreenWatch(screenPacket);
-		if (m_queScreenPackets.size() >= 10)
+		MFrame* frame = m_frames.BeginWrite();
+		if (ScreenWatch(frame))
 		{
-			CPacket p;
-			m_queScreenPackets.pop_front(p);
-		}		
-		m_queScreenPackets.push_back(screenPacket);
-		printf("[Thread Id : %08X] {Tick : %lld}<------截图-----> count : %d\r\n",GetThreadId(GetCurrentThread()),GetTickCount64(), m_queScreenPackets.size());
+			m_frames.Publish();
+		}
 		return 0;
 	}
-	//截屏功能
-	void ScreenWatch(CPacket& screenPacket)
+	//截屏功能：截到DIB里，按块无损压缩后写进帧
+	//帧缓冲是新帧覆盖旧帧，发送端不一定每帧都拿到，所以每帧都是整帧(关键帧)
+	bool ScreenWatch(MFrame* frame)
 	{
-		CImage screen;
-		HDC hScreen = ::GetDC(NULL);
-		int nBitperPixel = GetDeviceCaps(hScreen, BITSPIXEL);
-		int nWidth = GetDeviceCaps(hScreen, HORZRES);
-		int nHeight = GetDeviceCaps(hScreen, VERTRES);
-		screen.Create(nWidth, nHeight, nBitperPixel);
-		BitBlt(screen.GetDC(), 0, 0, nWidth, nHeight, hScreen, 0, 0, SRCCOPY);
-
-		ReleaseDC(NULL, hScreen);
-
-		HGLOBAL hMem = GlobalAlloc(GMEM_MOVEABLE, 0);
-		if (hMem == NULL) return;
-		IStream* pStream = NULL;
-		HRESULT ret = CreateStreamOnHGlobal(hMem, TRUE, &pStream);
-		
-
-		if (ret == S_OK)
+		if (!m_capture.Grab())
 		{
-			screen.Save(pStream, Gdiplus::ImageFormatPNG);
-			LARGE_INTEGER li = { 0 };
-			pStream->Seek(li, STREAM_SEEK_SET, NULL);
-			LPVOID pData = GlobalLock(hMem);
-			screenPacket = CPacket(5, (BYTE*)pData, GlobalSize(hMem));
-
-			GlobalUnlock(hMem);
+			return false;
+		}
+		int quality = m_quality;
+		m_encoder.SetFormat((quality > 0) ? MTF_LOSSY : MTF_LOSSLESS);
+		m_encoder.SetQuality(quality);
+		m_encoder.Reset();
+		m_encoder.Encode(m_capture.Bits(), m_capture.Width(), m_capture.Height(), m_capture.Stride(), m_stream);
+		if (m_stream.empty())
+		{
+			return false;
 		}
-		GlobalFree(hMem);
-		screen.ReleaseDC();
-		screen.Destroy();
+		frame->Assign(m_stream.data(), m_stream.size());
+		return true;
 	}
+	CMCapture				m_capture;
+	CMTileEncoder			m_encoder;
+	std::vector<uint8_t>	m_stream;		//编码结果，反复用
+	std::atomic<int>		m_quality;		//0是无损，1~100是有损的质量
 public:
-	//线程安全队列
-	CMQueue<CPacket> m_queScreenPackets;
+	//截屏线程写、发送线程读的帧缓冲(只有一个定时器在截，单生产者)
+	CMFrameRing      m_frames;
 	//线程池
 	CMThreadPool     m_pool;
-	CScreenshot() : m_pool(3)
+	CScreenshot() : m_quality(0), m_pool(1)
 	{
+		Parallelize(m_encoder);
+		m_frames.Reserve(FRAME_RESERVE);
+		m_pool.SetDomain(MD_CAPTURE);
 		m_pool.Invoke();
-		m_pool.DispatchWork(CMWork(this, (MT_FUNC)&CScreenshot::Invoke));
+		m_timer = CMTimer::Global().Every(SCREEN_INTERVAL, CMWork(this, (MT_FUNC)&CScreenshot::Screen), &m_pool);
 	}
-	void Pop_Screen(CPacket& screenPack)
+	~CScreenshot()
 	{
-		m_queScreenPackets.pop_front(screenPack);
+		CMTimer::Global().Cancel(m_timer);
+		m_pool.Stop();
+	}
+	//屏幕编码共用的线程池，每核一个线程，第一次用的时候建
+	static CSThreadPool& EncodePool()
+	{
+		static CSThreadPool pool(CMThreadPool::Cores(), MD_ENCODE);
+		static bool started = (pool.start(), true);
+		return pool;
+	}
+	//让encoder按块行切段，在EncodePool里并行编码；段数是线程数的几倍，内容不均匀时也能分匀
+	static void Parallelize(CMTileEncoder& encoder)
+	{
+		CSThreadPool& pool = EncodePool();
+		encoder.SetParallel(pool.size() * BANDS_PER_THREAD, [&pool](size_t count, const std::function<void(size_t)>& body) {
+			pool.parallel_for(0, count, 1, body, MTAG_SCREEN);
+		});
+	}
+	//0是无损，1~100是有损(链路慢的时候用)，下一帧生效
+	void SetQuality(int quality)
+	{
+		m_quality = quality;
+	}
+	//取最新的一帧，没有新帧返回false；只能在一个线程里调用
+	bool Pop_Screen(CPacket& screenPack)
+	{
+		const MFrame* frame = m_frames.Acquire();
+		if (frame == NULL)
+		{
+			return false;
+		}
+		screenPack = CPacket(5, (BYTE*)frame->data.data(), (DWORD)frame->size);
+		return true;
 	}
+	//有新帧是1，没有是0
 	size_t Size()
 	{
-		return m_queScreenPackets.size();
+		return m_frames.Ready() ? 1 : 0;
 	}
 };
 
@@ -14,8 +14,11 @@ int UDPPassServer::ThreadTcpProc()
 		printf("%s(%d):%s socket error tcp (%d) %s\n", __FILE__, __LINE__, __FUNCTION__, GetLastError(), strerror(errno));
 		return -1;
 	}
-	//向服务器发个包，表示我上线了
-	CPacket pack(101, (BYTE*)&m_currentUser, sizeof(MUserInfo));
+	//向服务器发个包，表示我上线了，后面带上局域网地址
+	MLocalAddrs local = GetLocalAddrs();
+	std::string regData((char*)&m_currentUser, sizeof(MUserInfo));
+	regData.append((char*)&local, sizeof(MLocalAddrs));
+	CPacket pack(101, (BYTE*)regData.c_str(), (DWORD)regData.size());
 	send(m_tcpSock, (char*)pack.Data(), pack.Size(), 0);
 
 	//
@@ -39,6 +42,14 @@ int UDPPassServer::ThreadTcpProc()
 		}
 		//处理数据
 		DealTcp(pack);
+		if (m_redirect)
+		{
+			//换节点：关掉旧连接，返回0让线程池再调一次，连到新节点重新登记
+			closesocket(m_tcpSock);
+			m_tcpSock = socket(AF_INET, SOCK_STREAM, 0);
+			m_redirect = false;
+			return 0;
+		}
 	}
 
 	return -1;
@@ -56,13 +67,17 @@ int UDPPassServer::ThreadUdpProc()
 	int serv_addr_len = sizeof(serv_addr);
 	recvfrom(m_udpSock, buf, sizeof(buf), 0, (sockaddr*)&serv_addr, &serv_addr_len);
 	//等待服务器，发来数据
-	while (true)
+	while (!m_stop)
 	{
 		char buf[1024]{};
 		sockaddr_in addr{};
 		int addr_len{ sizeof(addr) };
 		//获取数据
 		int ret = recvfrom(m_udpSock, buf, 1024, 0, reinterpret_cast<sockaddr*>(&addr), &addr_len);
+		if ((ret < 0) && m_stop)
+		{
+			break;
+		}
 		//解析数据
 		DWORD len = (int)ret;
 		CPacket pack = CPacket(reinterpret_cast<byte*>(buf), len);
@@ -79,34 +94,146 @@ int UDPPassServer::ThreadUdpProc()
 
 int UDPPassServer::KeepOnline()
 {
-	CPacket pack(103);
-	while (true)
-	{
-		sendto(m_udpSock, (char*)pack.Data(), pack.Size(),
-			0, reinterpret_cast<sockaddr*>(&m_udpAddr), sizeof(sockaddr_in));
-		Sleep(1000);
-	}
-	return -1;
+	//心跳带上自己的id，服务器按id刷新在线时间
+	CPacket pack(103, (BYTE*)&m_currentUser.id, sizeof(m_currentUser.id));
+	sendto(m_udpSock, (char*)pack.Data(), pack.Size(),
+		0, reinterpret_cast<sockaddr*>(&m_udpAddr), sizeof(sockaddr_in));
+	return 0;
 }
 
 int UDPPassServer::ThreadUDPPass()
 {
-	CPacket pack(123, (BYTE*)"ping", 4);
-	MUserInfo* pMInfo = (MUserInfo*)m_udpConectPack.sData.c_str();
+	//协调包TCP线程随时可能换成新的，拷一份出来用
+	MPunchInfo info;
+	ULONGLONG recvTick = 0;
+	{
+		std::lock_guard<std::mutex> lock(m_punchMutex);
+		if (m_udpConectPack.sData.size() < sizeof(MPunchInfo))
+		{
+			return -1;
+		}
+		memcpy(&info, m_udpConectPack.sData.c_str(), sizeof(MPunchInfo));
+		recvTick = m_punchRecvTick;
+	}
+	//等到服务器约定的时间，两边同时开始发，先发的一方的包才不会被对方NAT丢掉
+	ULONGLONG startTick = recvTick + info.startDelay;
+	ULONGLONG now = GetTickCount64();
+	if (startTick > now)
+	{
+		Sleep(DWORD(startTick - now));
+	}
+	m_punchStartTick = GetTickCount64();
 	sockaddr_in addr{};
 	addr.sin_family = AF_INET;
-	addr.sin_addr.s_addr = inet_addr(pMInfo->ip);
-	addr.sin_port = htons(pMInfo->port);
-	for (int i = 0; i < 3; i++)
+	addr.sin_addr.s_addr = inet_addr(info.peer.ip);
+	MPunchProbe probe{};
+	probe.session = info.session;
+	probe.id = m_currentUser.id;
+	//对端的局域网地址：登记时带的网卡地址，加上组播发现的地址
+	std::vector<sockaddr_in> vecLan;
+	for (int l = 0; (l < info.peerLocal.count) && (l < LOCAL_ADDR_MAX); l++)
 	{
-		sendto(m_udpSock, (char*)pack.Data(), pack.Size(), 0, (sockaddr*)&addr, sizeof(sockaddr_in));
+		sockaddr_in lanAddr{};
+		lanAddr.sin_family = AF_INET;
+		lanAddr.sin_addr.s_addr = inet_addr(info.peerLocal.ip[l]);
+		lanAddr.sin_port = htons(info.peerLocal.port);
+		vecLan.push_back(lanAddr);
 	}
-
+	m_lanMutex.lock();
+	std::map<long long, sockaddr_in>::iterator itLan = m_mapLanAddrs.find(info.peer.id);
+	if (itLan != m_mapLanAddrs.end())
+	{
+		vecLan.push_back(itLan->second);
+	}
+	m_lanMutex.unlock();
+	//按节奏分轮发送，每轮把预测范围内的端口都打一遍，直到收到应答
+	for (int i = 0; (i < info.probeCount) && !m_punchOk && !m_stop; i++)
+	{
+		for (int p = 0; p <= info.portRange; p++)
+		{
+			addr.sin_port = htons((u_short)(info.peer.port + p * info.portStep));
+			probe.seq = i * (info.portRange + 1) + p;
+			probe.sendTick = GetTickCount64();
+			CPacket pack(123, (BYTE*)&probe, sizeof(MPunchProbe));
+			sendto(m_udpSock, (char*)pack.Data(), pack.Size(), 0, (sockaddr*)&addr, sizeof(sockaddr_in));
+		}
+		//局域网地址和公网地址一起探测，谁的应答先到就用谁(序号用负数区分)
+		for (size_t l = 0; l < vecLan.size(); l++)
+		{
+			probe.seq = -1 - (int)l;
+			probe.sendTick = GetTickCount64();
+			CPacket pack(123, (BYTE*)&probe, sizeof(MPunchProbe));
+			sendto(m_udpSock, (char*)pack.Data(), pack.Size(), 0, (sockaddr*)&vecLan.at(l), sizeof(sockaddr_in));
+		}
+		Sleep(info.probeInterval);
+	}
+	//最后一轮发完再等一会儿应答
+	ULONGLONG deadline = GetTickCount64() + 1000;
+	while (!m_punchOk && !m_stop && (GetTickCount64() < deadline))
+	{
+		Sleep(info.probeInterval);
+	}
+	//把结果告诉服务器
+	MPunchResult result{};
+	result.session = info.session;
+	result.id = m_currentUser.id;
+	result.success = m_punchOk ? 1 : 0;
+	result.elapsed = (int)(GetTickCount64() - m_punchStartTick);
+	result.port = m_punchOk ? ntohs(m_punchAddr.sin_port) : 0;
+	CPacket pack(107, (BYTE*)&result, sizeof(MPunchResult));
+	send(m_tcpSock, (char*)pack.Data(), pack.Size(), 0);
 	return -1;
 }
 
-UDPPassServer::UDPPassServer(const std::string& ip, short tcpPort, short udpPort) : m_tcpAddr(), m_udpAddr(), m_tcpSock(-1), m_udpSock(-1) ,m_thpool(5)
+bool UDPPassServer::DealPunch(CPacket& pack, sockaddr_in& addr)
+{
+	if (((pack.nCmd != 123) && (pack.nCmd != 124)) || (pack.sData.size() < sizeof(MPunchProbe)))
+	{
+		return false;
+	}
+	MPunchProbe* pProbe = (MPunchProbe*)pack.sData.c_str();
+	bool current = false;
+	m_punchMutex.lock();
+	if (m_udpConectPack.sData.size() >= sizeof(MPunchInfo))
+	{
+		MPunchInfo* pInfo = (MPunchInfo*)m_udpConectPack.sData.c_str();
+		current = (pProbe->session == pInfo->session);
+	}
+	m_punchMutex.unlock();
+	if (!current)
+	{
+		return true;
+	}
+	//对端的探测包：原样回一个应答，对端收到应答才算打通
+	if (pack.nCmd == 123)
+	{
+		CPacket ack(124, (BYTE*)pack.sData.c_str(), pack.sData.size());
+		sendto(m_udpSock, (char*)ack.Data(), ack.Size(), 0, (sockaddr*)&addr, sizeof(sockaddr_in));
+		return true;
+	}
+	//自己探测包的应答：记下实际打通的地址(端口预测时可能不是对端登记的端口)
+	if (!m_punchOk)
+	{
+		m_punchAddr = addr;
+		m_punchOk = true;
+		TRACE("打洞成功(%s) session:%llu rtt:%lldms\r\n", (pProbe->seq < 0) ? "局域网" : "公网",
+			pProbe->session, GetTickCount64() - pProbe->sendTick);
+	}
+	return true;
+}
+
+UDPPassServer::UDPPassServer(const std::string& ip, short tcpPort, short udpPort) : m_tcpAddr(), m_udpAddr(), m_tcpSock(-1), m_udpSock(-1) ,m_thpool(5), m_cmdPool(CMD_THREADS)
 {
+	m_stop = false;
+	m_pacing = false;
+	m_paceTimer = 0;
+	m_punchOk = false;
+	m_redirect = false;
+	m_lanSock = -1;
+	m_keepTimer = 0;
+	m_punchRecvTick = 0;
+	m_punchStartTick = 0;
+	memset(&m_punchAddr, 0, sizeof(m_punchAddr));
 	//配置端口地址(TCP)
 	memset(&m_tcpAddr, 0, sizeof(m_tcpAddr));
 	m_tcpAddr.sin_family = AF_INET;
@@ -121,8 +248,18 @@ UDPPassServer::UDPPassServer(const std::string& ip, short tcpPort, short udpPort
 
 UDPPassServer::~UDPPassServer()
 {
+	m_stop = true;
+	CMTimer::Global().Cancel(m_keepTimer);
+	CMTimer::Global().Cancel(m_paceTimer);
+	m_cmdPool.Stop();
 	closesocket(m_tcpSock);
 	closesocket(m_udpSock);
+	if (m_lanSock != -1)
+	{
+		closesocket(m_lanSock);
+	}
+	//套接字关了收包线程才会退出，等它们退出再析构成员
+	m_thpool.Stop();
 }
 
 int UDPPassServer::Invoke()
@@ -155,24 +292,118 @@ int UDPPassServer::Invoke()
 
 	m_thpool.DispatchWork(CMWork(this, (MT_FUNC)&UDPPassServer::ThreadUdpProc));
 	m_thpool.DispatchWork(CMWork(this, (MT_FUNC)&UDPPassServer::ThreadTcpProc));
+	//局域网发现(组播)，失败了也不影响走公网
+	m_lanSock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (m_lanSock != -1)
+	{
+		BOOL reuse = TRUE;
+		setsockopt(m_lanSock, SOL_SOCKET, SO_REUSEADDR, (char*)&reuse, sizeof(reuse));
+		sockaddr_in lanAddr{};
+		lanAddr.sin_family = AF_INET;
+		lanAddr.sin_addr.s_addr = INADDR_ANY;
+		lanAddr.sin_port = htons(LAN_PORT);
+		ip_mreq mreq{};
+		mreq.imr_multiaddr.s_addr = inet_addr(LAN_GROUP);
+		mreq.imr_interface.s_addr = INADDR_ANY;
+		if ((bind(m_lanSock, (sockaddr*)&lanAddr, sizeof(sockaddr_in)) == -1)
+			|| (setsockopt(m_lanSock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (char*)&mreq, sizeof(mreq)) == -1))
+		{
+			printf("%s(%d):%s socket error lan (%d)\n", __FILE__, __LINE__, __FUNCTION__, WSAGetLastError());
+			closesocket(m_lanSock);
+			m_lanSock = -1;
+		}
+		else
+		{
+			m_thpool.DispatchWork(CMWork(this, (MT_FUNC)&UDPPassServer::ThreadLanDiscover));
+		}
+	}
+	m_thpool.SetDomain(MD_IO);
 	m_thpool.Invoke();
+	m_cmdPool.SetDomain(MD_BULK);
+	//命令有时很久没有，有时(拖文件、看屏幕)一下子很多
+	m_cmdPool.SetElastic(1, std::max((int)CMD_THREADS, CMThreadPool::Cores()));
+	m_cmdPool.Invoke();
+	//心跳交给定时器，不再单独占一个线程
+	m_keepTimer = CMTimer::Global().Every(KEEP_ONLINE_INTERVAL, CMWork(this, (MT_FUNC)&UDPPassServer::KeepOnline), &m_thpool);
 	return 1;
 }
 
 void UDPPassServer::DealUdp(CPacket& pack, sockaddr_in& addr)
 {
-	std::list<CPacket> lstSends;
-	cmdProc.DispatchCommand(pack,lstSends);
+	if (DealPunch(pack, addr))
+	{
+		return;
+	}
+	//命令不在收包线程里执行：下载文件时收包线程不再被占住，后面的鼠标事件按优先级插队
+	MPriority priority = CCmdProcessor::Priority(pack.nCmd);
+	sockaddr_in from = addr;
+	bool ret = m_cmdPool.DispatchTask(CMTask([this, pack, from, priority]() mutable {
+		std::list<CPacket> lstSends;
+		cmdProc.DispatchCommand(pack, lstSends);
+		PostSend(lstSends, from, priority);
+	}), priority, CCmdProcessor::Tag(pack.nCmd));
+	if (!ret)
+	{
+		printf("%s(%d):%s command rejected cmd:%d\n", __FILE__, __LINE__, __FUNCTION__, pack.nCmd);
+	}
+}
+
+void UDPPassServer::PostSend(std::list<CPacket>& lstSends, const sockaddr_in& addr, MPriority priority)
+{
+	std::lock_guard<std::mutex> lock(m_outMutex);
 	while (lstSends.size() > 0)
 	{
-		PFILEINFO pFileInfo = (PFILEINFO)lstSends.front().sData.c_str();
-		TRACE("* %s\r\n", pFileInfo->data.name);
-		sendto(m_udpSock, (char*)lstSends.front().Data(), lstSends.front().Size(),0, (sockaddr*)&addr,sizeof(sockaddr_in));
+		MOutPack out = { lstSends.front(), addr };
+		m_outLanes[priority].push_back(out);
 		lstSends.pop_front();
-		Sleep(10);
+	}
+	if (priority != MP_BULK)
+	{
+		FlushSend(false);
+		return;
+	}
+	if (!m_pacing)
+	{
+		m_pacing = true;
+		m_paceTimer = CMTimer::Global().Every(SEND_PACE, CMWork(this, (MT_FUNC)&UDPPassServer::PaceSend), &m_cmdPool);
+	}
+}
+
+void UDPPassServer::FlushSend(bool bulk)
+{
+	for (int i = MP_HIGH; i < MP_COUNT; i++)
+	{
+		std::deque<MOutPack>& lane = m_outLanes[i];
+		while (lane.size() > 0)
+		{
+			if ((i == MP_BULK) && !bulk)
+			{
+				return;
+			}
+			MOutPack& out = lane.front();
+			sendto(m_udpSock, (char*)out.pack.Data(), out.pack.Size(), 0, (sockaddr*)&out.addr, sizeof(sockaddr_in));
+			lane.pop_front();
+			if (i == MP_BULK)
+			{
+				//大块的一次只发一个，剩下的等下一拍
+				return;
+			}
+		}
 	}
 }
 
+int UDPPassServer::PaceSend()
+{
+	std::lock_guard<std::mutex> lock(m_outMutex);
+	FlushSend(true);
+	if (m_outLanes[MP_BULK].size() > 0)
+	{
+		return 0;
+	}
+	m_pacing = false;
+	return -1;
+}
+
 void UDPPassServer::DealTcp(CPacket& pack)
 {
 	switch (pack.nCmd)
@@ -192,9 +423,123 @@ void UDPPassServer::DealTcp(CPacket& pack)
 		}
 		case 105://服务器发来数据，叫我和指定用户连接
 		{
+			m_punchMutex.lock();
+			m_punchRecvTick = GetTickCount64();
+			m_punchOk = false;
 			m_udpConectPack = pack;
+			m_punchMutex.unlock();
 			m_thpool.DispatchWork(CMWork(this, (MT_FUNC)&UDPPassServer::ThreadUDPPass));
 			break;
 		}
+		case 108://服务器叫我换到管理我的节点
+		{
+			Redirect(pack);
+			break;
+		}
+	}
+}
+
+void UDPPassServer::Redirect(CPacket& pack)
+{
+	if (pack.sData.size() < sizeof(MNodeInfo))
+	{
+		return;
+	}
+	MNodeInfo* pNode = (MNodeInfo*)pack.sData.c_str();
+	TRACE("重定向到节点 %s:%d\r\n", pNode->ip, pNode->tcpPort);
+	m_tcpAddr.sin_addr.s_addr = inet_addr(pNode->ip);
+	m_tcpAddr.sin_port = htons(pNode->tcpPort);
+	m_udpAddr.sin_addr.s_addr = inet_addr(pNode->ip);
+	m_udpAddr.sin_port = htons(pNode->udpPort);
+	//UDP也到新节点登记一下，让它记下我的公网端口
+	CPacket udpPack(101, (BYTE*)&m_currentUser.id, sizeof(m_currentUser.id));
+	sendto(m_udpSock, (char*)udpPack.Data(), udpPack.Size(), 0, (sockaddr*)&m_udpAddr, sizeof(sockaddr_in));
+	m_redirect = true;
+}
+
+int UDPPassServer::ThreadLanDiscover()
+{
+	//收广播最多等一个广播间隔，超时了就再广播一次自己
+	DWORD timeout = LAN_BEACON_INTERVAL;
+	setsockopt(m_lanSock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+	int ttl = 1;
+	setsockopt(m_lanSock, IPPROTO_IP, IP_MULTICAST_TTL, (char*)&ttl, sizeof(ttl));
+	sockaddr_in groupAddr{};
+	groupAddr.sin_family = AF_INET;
+	groupAddr.sin_addr.s_addr = inet_addr(LAN_GROUP);
+	groupAddr.sin_port = htons(LAN_PORT);
+	MLanBeacon beacon{};
+	beacon.port = GetLocalAddrs().port;
+	ULONGLONG lastBeacon = 0;
+	while (!m_stop)
+	{
+		if (GetTickCount64() - lastBeacon >= LAN_BEACON_INTERVAL)
+		{
+			beacon.id = m_currentUser.id;
+			CPacket pack(125, (BYTE*)&beacon, sizeof(MLanBeacon));
+			sendto(m_lanSock, (char*)pack.Data(), pack.Size(), 0, (sockaddr*)&groupAddr, sizeof(sockaddr_in));
+			lastBeacon = GetTickCount64();
+		}
+		char buf[256]{};
+		sockaddr_in addr{};
+		int addr_len{ sizeof(addr) };
+		int ret = recvfrom(m_lanSock, buf, sizeof(buf), 0, (sockaddr*)&addr, &addr_len);
+		if (ret <= 0)
+		{
+			//超时了接着广播；套接字关了(析构)或者坏了就退出，不然这里空转
+			int err = WSAGetLastError();
+			if ((ret == 0) || (err == WSAETIMEDOUT) || (err == WSAECONNRESET))
+			{
+				continue;
+			}
+			break;
+		}
+		DWORD len = (int)ret;
+		CPacket pack((BYTE*)buf, len);
+		if ((len <= 0) || (pack.nCmd != 125) || (pack.sData.size() < sizeof(MLanBeacon)))
+		{
+			continue;
+		}
+		MLanBeacon* pBeacon = (MLanBeacon*)pack.sData.c_str();
+		//组播会回环，自己的广播不要
+		if (pBeacon->id == m_currentUser.id)
+		{
+			continue;
+		}
+		addr.sin_port = htons(pBeacon->port);
+		m_lanMutex.lock();
+		m_mapLanAddrs[pBeacon->id] = addr;
+		m_lanMutex.unlock();
+	}
+	return -1;
+}
+
+MLocalAddrs UDPPassServer::GetLocalAddrs()
+{
+	MLocalAddrs local{};
+	//本地UDP端口(打洞用的那个套接字)
+	sockaddr_in udpAddr{};
+	int addr_len{ sizeof(udpAddr) };
+	getsockname(m_udpSock, (sockaddr*)&udpAddr, &addr_len);
+	local.port = ntohs(udpAddr.sin_port);
+	//本机所有IPv4网卡地址，回环地址不要
+	char hostName[256]{};
+	gethostname(hostName, sizeof(hostName));
+	hostent* pHost = gethostbyname(hostName);
+	if (pHost == NULL)
+	{
+		return local;
+	}
+	for (int i = 0; (pHost->h_addr_list[i] != NULL) && (local.count < LOCAL_ADDR_MAX); i++)
+	{
+		in_addr inAddr;
+		memcpy(&inAddr, pHost->h_addr_list[i], sizeof(in_addr));
+		if (inAddr.S_un.S_un_b.s_b1 == 127)
+		{
+			continue;
+		}
+		strncpy(local.ip[local.count], inet_ntoa(inAddr), sizeof(local.ip[0]) - 1);
+		local.count++;
 	}
+	return local;
 }
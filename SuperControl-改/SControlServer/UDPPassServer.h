@@ -1,10 +1,26 @@
 #pragma once
 #include <vector>
+#include <deque>
+#include <list>
+#include <atomic>
+#include <mutex>
+#include <map>
 #include "Common.h"
 #include "MThread.h"
+#include "MTimer.h"
 class UDPPassServer : public CMFuncBase
 {
 private:
+	enum
+	{
+		CMD_THREADS		= 4,		//执行控制端命令的线程数
+		SEND_PACE		= 10,		//大块回复的发送节奏(毫秒一个包)，UDP没有流控，发太快会丢
+	};
+	struct MOutPack
+	{
+		CPacket			pack;
+		sockaddr_in		addr;
+	};
 	MUserInfo				m_currentUser;
 	std::vector<MUserInfo>	m_vecSockAddrs;
 	sockaddr_in				m_udpAddr;
@@ -12,12 +28,43 @@ private:
 	int						m_tcpSock;
 	int						m_udpSock;
 	CMThreadPool			m_thpool;
-	CPacket					m_udpConectPack;
+	CMThreadPool			m_cmdPool;				//执行控制端发来的命令，按命令优先级分车道
+	std::deque<MOutPack>	m_outLanes[MP_COUNT];	//待发的回复，每个优先级一条
+	std::mutex				m_outMutex;
+	bool					m_pacing;				//大块回复的发送定时器在跑
+	CMTimer::TimerId		m_paceTimer;
+	std::atomic<bool>		m_stop;					//析构了，收包线程退出
+	CPacket					m_udpConectPack;		//打洞协调包(105)
+	std::mutex				m_punchMutex;			//m_udpConectPack和m_punchRecvTick：TCP线程写，打洞线程、收包线程读
+	ULONGLONG				m_punchRecvTick;		//收到打洞协调包(105)的时间
+	ULONGLONG				m_punchStartTick;		//开始探测的时间
+	std::atomic<bool>		m_punchOk;				//收到对端应答，打洞成功
+	sockaddr_in				m_punchAddr;			//实际打通的对端地址
+	std::atomic<bool>		m_redirect;				//服务器叫我换节点(108)，TCP线程重连
+	int						m_lanSock;				//局域网发现用的组播套接字
+	std::map<long long, sockaddr_in>	m_mapLanAddrs;	//组播发现的同一局域网用户的地址
+	std::mutex				m_lanMutex;
+	CMTimer::TimerId		m_keepTimer;			//心跳定时器
 private:
 	int ThreadTcpProc();
 	int ThreadUdpProc();
+	//发一次心跳(103)，定时器每秒调一次
 	int KeepOnline();
 	int ThreadUDPPass();
+	//处理打洞探测包(123)和应答包(124)
+	bool DealPunch(CPacket& pack, sockaddr_in& addr);
+	//换到管理自己的节点(108)
+	void Redirect(CPacket& pack);
+	//组播广播自己，顺便收同一局域网其他用户的广播
+	int ThreadLanDiscover();
+	//本机的局域网地址(登记时带给服务器)
+	MLocalAddrs GetLocalAddrs();
+	//回复进对应优先级的发送队列：交互的马上发，大块的按节奏发
+	void PostSend(std::list<CPacket>& lstSends, const sockaddr_in& addr, MPriority priority);
+	//发送队列里的包(调用方持m_outMutex)：高、普通的全发，bulk为true时再发一个大块的
+	void FlushSend(bool bulk);
+	//发送节奏定时器，大块的发完就停
+	int PaceSend();
 public:
 	UDPPassServer(const std::string& ip, short tcpPort, short udpPort);
 	~UDPPassServer();
@@ -0,0 +1,165 @@
+#include "UDPPassNetWork.h"
+#include "MNetClient.h"
+#include <thread>
+#include <memory>
+#include <cstdlib>
+
+//集群压测：本机起1~N个节点，T个客户线程各登记U个用户(先连第一个节点，收到重定向就去目标节点)
+//然后每个线程闭环地发配对请求(104)：挑自己的两个用户，等两边都收到105再发下一个
+//两个用户在不同节点时走202/203转发；看每秒配对数随节点数怎么变
+//用法：ClusterBench [最多几个节点 客户线程数 每线程用户数 每档秒数]，默认3 4 50 5
+
+static unsigned short g_base = 0;
+
+static unsigned short TcpPort(int node)
+{
+	return (unsigned short)(g_base + node * 3);
+}
+
+//登记一个用户，跟着重定向走，返回最后登记上的连接
+static bool RegisterHome(CMNetClient& client, unsigned long long id, int nodes)
+{
+	int node = (int)(id % nodes);
+	for (int hop = 0; hop < 3; hop++)
+	{
+		CPacket pack;
+		if (!client.Connect(TcpPort(node), TcpPort(node) + 1) || !client.Register(id) || !client.Recv(pack, 2000))
+		{
+			return false;
+		}
+		if (pack.nCmd != 108)
+		{
+			return true;
+		}
+		MNodeInfo info;
+		memcpy(&info, pack.sData.c_str(), sizeof(info));
+		node = (info.tcpPort - g_base) / 3;
+	}
+	return false;
+}
+
+struct MBenchResult
+{
+	double		registerMs;
+	long long	pairs;
+	long long	failed;
+	double		seconds;
+};
+
+static MBenchResult Run(int nodes, int threads, int users, int seconds)
+{
+	MBenchResult result{};
+	std::vector<std::unique_ptr<UDPPassNetWork> > nets;
+	for (int i = 0; i < nodes; i++)
+	{
+		unsigned short port = TcpPort(i);
+		nets.emplace_back(new UDPPassNetWork("127.0.0.1", port, port + 1, (nodes > 1) ? port + 2 : 0));
+		if (i > 0)
+		{
+			nets.back()->AddSeed("127.0.0.1", TcpPort(0) + 2);
+		}
+		nets.back()->Invoke();
+	}
+	//等成员同步(测试里一般1秒就同步好了)
+	std::this_thread::sleep_for(std::chrono::milliseconds((nodes > 1) ? 3000 : 100));
+	std::atomic<long long> pairs(0), failed(0);
+	std::atomic<bool> stop(false);
+	std::atomic<int> ready(0);
+	std::vector<std::thread> vecThreads;
+	double start = MTestNowMs();
+	for (int t = 0; t < threads; t++)
+	{
+		vecThreads.emplace_back([&, t]() {
+			std::vector<std::unique_ptr<CMNetClient> > clients;
+			std::vector<unsigned long long> ids;
+			//服务器5秒收不到心跳就当下线了，登记的时候也要发
+			double keep = MTestNowMs();
+			auto keepAlive = [&clients, &ids, &keep]() {
+				if (MTestNowMs() - keep > 1000)
+				{
+					keep = MTestNowMs();
+					for (size_t u = 0; u < clients.size(); u++)
+					{
+						clients[u]->KeepAlive(ids[u]);
+					}
+				}
+			};
+			for (int u = 0; u < users; u++)
+			{
+				unsigned long long id = 100000ULL * (nodes * 10 + 1) + t * users + u;
+				clients.emplace_back(new CMNetClient());
+				ids.push_back(id);
+				if (!RegisterHome(*clients.back(), id, nodes))
+				{
+					failed++;
+				}
+				keepAlive();
+			}
+			ready++;
+			while (ready < threads)
+			{
+				keepAlive();
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+			unsigned int r = (unsigned int)t * 7919 + 1;
+			while (!stop)
+			{
+				keepAlive();
+				r = r * 1103515245 + 12345;
+				int a = (int)((r >> 8) % users);
+				int b = (int)((r >> 16) % users);
+				if (a == b)
+				{
+					continue;
+				}
+				ConnectIds pair{ ids[a], ids[b] };
+				CPacket request(104, (unsigned char*)&pair, sizeof(pair));
+				CPacket pack;
+				if (clients[a]->Send(request) && clients[a]->RecvCmd(105, pack, 1000) && clients[b]->RecvCmd(105, pack, 1000))
+				{
+					pairs++;
+				}
+				else
+				{
+					failed++;
+				}
+			}
+		});
+	}
+	while (ready < threads)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	result.registerMs = MTestNowMs() - start;
+	long long before = pairs;
+	start = MTestNowMs();
+	std::this_thread::sleep_for(std::chrono::seconds(seconds));
+	result.pairs = pairs - before;
+	result.seconds = (MTestNowMs() - start) / 1000;
+	stop = true;
+	for (size_t i = 0; i < vecThreads.size(); i++)
+	{
+		vecThreads[i].join();
+	}
+	result.failed = failed;
+	nets.clear();
+	return result;
+}
+
+int main(int argc, char* argv[])
+{
+	int maxNodes = (argc > 1) ? std::max(atoi(argv[1]), 1) : 3;
+	int threads = (argc > 2) ? std::max(atoi(argv[2]), 1) : 4;
+	int users = (argc > 3) ? std::max(atoi(argv[3]), 2) : 50;
+	int seconds = (argc > 4) ? std::max(atoi(argv[4]), 1) : 5;
+	printf("cores %u, %d client threads x %d users, %d s per run\n", std::thread::hardware_concurrency(), threads, users, seconds);
+	for (int nodes = 1; nodes <= maxNodes; nodes++)
+	{
+		//每一档换一段端口，上一档的TIME_WAIT不影响
+		g_base = (unsigned short)(20000 + (getpid() % 300) * 30 + nodes * 9);
+		MBenchResult result = Run(nodes, threads, nodes * users, seconds);
+		printf("nodes %d: register %d users %7.0f ms, %8.0f pairs/s, failed %lld\n",
+			nodes, threads * nodes * users, result.registerMs, result.pairs / result.seconds, result.failed);
+	}
+	return 0;
+}
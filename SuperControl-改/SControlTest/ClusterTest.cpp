@@ -0,0 +1,271 @@
+#include "UDPPassNetWork.h"
+#include "MNetClient.h"
+#include <thread>
+#include <memory>
+
+//集群：三个节点的哈希环对每个id的归属一致；节点停了超时后被删掉，剩下的接管它的id；
+//104配对转发到目标所在节点(202)，目标在线回203，不在线回204；不是成员发来的202不理
+//都在本机跑，端口按进程号错开
+
+enum
+{
+	NODES		= 3,
+	IDS			= 2000,		//检查归属用的id数
+	CONVERGE	= 15000,	//等成员同步的上限(毫秒)
+};
+
+static unsigned short g_base = 0;
+
+//最多等ms毫秒，直到cond成立
+template<typename Cond>
+static bool WaitFor(Cond cond, int ms)
+{
+	double start = MTestNowMs();
+	while (!cond())
+	{
+		if (MTestNowMs() - start > ms)
+		{
+			return false;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	}
+	return true;
+}
+
+//每个id在nodes里正好归一个节点管，各节点算出来的归属一样；owned是每个节点管几个
+static bool Agree(std::vector<MCluster*>& nodes, std::vector<int>& owned)
+{
+	owned.assign(nodes.size(), 0);
+	for (long long id = 1; id <= IDS; id++)
+	{
+		int local = -1;
+		for (size_t i = 0; i < nodes.size(); i++)
+		{
+			if (nodes[i]->IsLocal(id))
+			{
+				if (local != -1)
+				{
+					return false;
+				}
+				local = (int)i;
+			}
+		}
+		if (local == -1)
+		{
+			return false;
+		}
+		owned[local]++;
+		for (size_t i = 0; i < nodes.size(); i++)
+		{
+			if (nodes[i]->Owner(id).tcpPort != nodes[local]->Self().tcpPort)
+			{
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+//三个MCluster，后两个以第一个为种子：同步后归属一致、分得大致均匀；停掉一个，超时后剩下两个接管
+static void TestRing()
+{
+	CMThreadPool pool(NODES + 2);
+	pool.Invoke();
+	std::vector<std::unique_ptr<MCluster> > clusters;
+	std::vector<MCluster*> nodes;
+	for (int i = 0; i < NODES; i++)
+	{
+		unsigned short port = (unsigned short)(g_base + i * 3);
+		clusters.emplace_back(new MCluster("127.0.0.1", port, port + 1, port + 2));
+		if (i > 0)
+		{
+			clusters.back()->AddSeed("127.0.0.1", g_base + 2);
+		}
+		nodes.push_back(clusters.back().get());
+	}
+	//没同步之前每个节点都认为所有id归自己
+	std::vector<int> owned;
+	MCHECK(!Agree(nodes, owned));
+	for (int i = 0; i < NODES; i++)
+	{
+		clusters[i]->Invoke(pool);
+	}
+	double start = MTestNowMs();
+	MCHECK(WaitFor([&nodes, &owned]() { return Agree(nodes, owned); }, CONVERGE));
+	printf("ring agreed after %.0f ms, owned %d/%d/%d\n", MTestNowMs() - start, owned[0], owned[1], owned[2]);
+	for (int i = 0; i < NODES; i++)
+	{
+		MCHECK(owned[i] > IDS / 6);
+	}
+	//停掉最后一个：超时(NODE_TIMEOUT)前它的id没人接，之后剩下两个分掉
+	std::vector<int> before = owned;
+	clusters.back()->Stop();
+	nodes.pop_back();
+	MCHECK(!Agree(nodes, owned));
+	start = MTestNowMs();
+	MCHECK(WaitFor([&nodes, &owned]() { return Agree(nodes, owned); }, CONVERGE));
+	printf("node removed after %.0f ms, owned %d/%d\n", MTestNowMs() - start, owned[0], owned[1]);
+	MCHECK(MTestNowMs() - start > 3000);
+	//一致性哈希：原来归前两个的id不动
+	MCHECK((owned[0] >= before[0]) && (owned[1] >= before[1]) && (owned[0] + owned[1] == IDS));
+	clusters.clear();
+	pool.Stop();
+}
+
+static unsigned short TcpPort(int node)
+{
+	return (unsigned short)(g_base + 100 + node * 3);
+}
+
+//在node上登记id，看它收不收：收了(过一会收到地址列表102)返回node，重定向(108)返回目标节点，没应答返回-1
+static int Home(unsigned long long id, int node)
+{
+	CMNetClient client;
+	CPacket pack;
+	if (!client.Connect(TcpPort(node), TcpPort(node) + 1) || !client.Register(id) || !client.Recv(pack, 2000))
+	{
+		return -1;
+	}
+	if (pack.nCmd == 102)
+	{
+		return node;
+	}
+	if ((pack.nCmd != 108) || (pack.sData.size() < sizeof(MNodeInfo)))
+	{
+		return -1;
+	}
+	MNodeInfo info;
+	memcpy(&info, pack.sData.c_str(), sizeof(info));
+	for (int i = 0; i < NODES; i++)
+	{
+		if (info.tcpPort == TcpPort(i))
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+//三个节点对这些id的回答一致
+static bool Converged(std::vector<unsigned long long>& ids, std::vector<int>& homes)
+{
+	homes.clear();
+	for (size_t k = 0; k < ids.size(); k++)
+	{
+		int home = Home(ids[k], 0);
+		for (int i = 1; i < NODES; i++)
+		{
+			if ((home == -1) || (Home(ids[k], i) != home))
+			{
+				return false;
+			}
+		}
+		homes.push_back(home);
+	}
+	return true;
+}
+
+static bool ReadPunch(CPacket& pack, MPunchInfo& info)
+{
+	if (pack.sData.size() < sizeof(MPunchInfo))
+	{
+		return false;
+	}
+	memcpy(&info, pack.sData.c_str(), sizeof(MPunchInfo));
+	return true;
+}
+
+//三个UDPPassNetWork：A和B在不同节点，A发104，两边都收到105(同一个序号，对端是对方)
+//目标C不在线：A收到106；伪造的202(不是从成员的gossip端口发的)：B什么都收不到
+static void TestForward()
+{
+	std::vector<std::unique_ptr<UDPPassNetWork> > nets;
+	for (int i = 0; i < NODES; i++)
+	{
+		unsigned short port = TcpPort(i);
+		nets.emplace_back(new UDPPassNetWork("127.0.0.1", port, port + 1, port + 2));
+		if (i > 0)
+		{
+			nets.back()->AddSeed("127.0.0.1", TcpPort(0) + 2);
+		}
+		nets.back()->Invoke();
+	}
+	std::vector<unsigned long long> ids;
+	for (unsigned long long id = 1001; id <= 1012; id++)
+	{
+		ids.push_back(id);
+	}
+	std::vector<int> homes;
+	MCHECK(WaitFor([&ids, &homes]() { return Converged(ids, homes); }, CONVERGE));
+	if (homes.size() != ids.size())
+	{
+		return;
+	}
+	//挑A、B在不同节点，C和A也不在一个节点
+	size_t a = 0, b = 0, c = 0;
+	for (size_t k = 1; k < ids.size(); k++)
+	{
+		if ((b == 0) && (homes[k] != homes[a]))
+		{
+			b = k;
+		}
+		else if ((c == 0) && (homes[k] != homes[a]))
+		{
+			c = k;
+		}
+	}
+	MCHECK((b != 0) && (c != 0));
+	if ((b == 0) || (c == 0))
+	{
+		return;
+	}
+	CMNetClient clientA, clientB;
+	CPacket pack;
+	MCHECK(clientA.Connect(TcpPort(homes[a]), TcpPort(homes[a]) + 1) && clientA.Register(ids[a]));
+	MCHECK(clientB.Connect(TcpPort(homes[b]), TcpPort(homes[b]) + 1) && clientB.Register(ids[b]));
+	MCHECK(clientA.RecvCmd(102, pack, 2000) && clientB.RecvCmd(102, pack, 2000));
+
+	ConnectIds pair{ ids[a], ids[b] };
+	CPacket request(104, (unsigned char*)&pair, sizeof(pair));
+	MCHECK(clientA.Send(request));
+	MPunchInfo infoA(MUserInfo(CMNetClient::Ip(), 0)), infoB(MUserInfo(CMNetClient::Ip(), 0));
+	MCHECK(clientA.RecvCmd(105, pack, 2000) && ReadPunch(pack, infoA));
+	MCHECK(clientB.RecvCmd(105, pack, 2000) && ReadPunch(pack, infoB));
+	MCHECK((infoA.peer.id == ids[b]) && (infoB.peer.id == ids[a]));
+	MCHECK((infoA.session == infoB.session) && (infoA.session != 0));
+
+	//C没有登记：C所在节点回204，A收到106
+	ConnectIds missing{ ids[a], ids[c] };
+	CPacket request2(104, (unsigned char*)&missing, sizeof(missing));
+	MCHECK(clientA.Send(request2));
+	MCHECK(clientA.RecvCmd(106, pack, 2000));
+
+	//伪造的202：随便一个UDP端口发给B所在节点的gossip端口，要B和我打洞
+	int fake = socket(AF_INET, SOCK_DGRAM, 0);
+	MClusterPair forged;
+	forged.session = 12345;
+	forged.ids.id0 = 999;
+	forged.ids.id1 = ids[b];
+	memcpy(forged.user.ip, CMNetClient::Ip(), 16);
+	forged.user.port = 40000;
+	forged.user.id = 999;
+	CPacket attack(202, (unsigned char*)&forged, sizeof(forged));
+	sockaddr_in addr{};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	addr.sin_port = htons(TcpPort(homes[b]) + 2);
+	MCHECK(sendto(fake, attack.Data(), attack.Size(), 0, (sockaddr*)&addr, sizeof(addr)) > 0);
+	MCHECK(!clientB.RecvCmd(105, pack, 500));
+	close(fake);
+	clientA.Close();
+	clientB.Close();
+	nets.clear();
+}
+
+int main()
+{
+	g_base = (unsigned short)(20000 + (getpid() % 400) * 25);
+	TestRing();
+	TestForward();
+	return MTestResult("ClusterTest");
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+//Linux上编测试用，代替MFC和Windows头文件：只有被测头文件用到的类型和函数
+//事件、线程句柄用标准库实现，够测试里用，不追求和Windows行为完全一样
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+typedef uint8_t				BYTE;
+typedef uint16_t			WORD;
+typedef uint32_t			DWORD;
+typedef unsigned long		ULONG;
+typedef unsigned long long	ULONGLONG;
+typedef int					BOOL;
+typedef void*				HANDLE;
+
+#ifndef TRUE
+#define TRUE				1
+#define FALSE				0
+#endif
+#define INFINITE			0xFFFFFFFF
+#define WAIT_OBJECT_0		0
+#define WAIT_TIMEOUT		258
+#define INVALID_HANDLE_VALUE	((HANDLE)(intptr_t)-1)
+
+#ifndef TRACE
+#define TRACE(...)
+#endif
+
+struct CPoint
+{
+	long	x;
+	long	y;
+};
+
+struct _finddata64i32_t
+{
+	unsigned	attrib;
+	long long	time_create;
+	long long	time_access;
+	long long	time_write;
+	uint32_t	size;
+	char		name[260];
+};
+
+inline ULONGLONG GetTickCount64()
+{
+	return (ULONGLONG)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline void Sleep(DWORD ms)
+{
+	std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+//事件：CreateEvent/SetEvent/ResetEvent/WaitForSingleObject，线程句柄也是一个事件(线程结束时置位)
+struct MCompatEvent
+{
+	std::mutex				mutex;
+	std::condition_variable	cond;
+	bool					manual;
+	bool					set;
+};
+
+inline HANDLE CreateEvent(void*, BOOL manual, BOOL initial, const char*)
+{
+	MCompatEvent* event = new MCompatEvent();
+	event->manual = manual != FALSE;
+	event->set = initial != FALSE;
+	return event;
+}
+
+inline BOOL SetEvent(HANDLE handle)
+{
+	MCompatEvent* event = (MCompatEvent*)handle;
+	std::lock_guard<std::mutex> lock(event->mutex);
+	event->set = true;
+	event->cond.notify_all();
+	return TRUE;
+}
+
+inline BOOL ResetEvent(HANDLE handle)
+{
+	MCompatEvent* event = (MCompatEvent*)handle;
+	std::lock_guard<std::mutex> lock(event->mutex);
+	event->set = false;
+	return TRUE;
+}
+
+inline DWORD WaitForSingleObject(HANDLE handle, DWORD ms)
+{
+	MCompatEvent* event = (MCompatEvent*)handle;
+	std::unique_lock<std::mutex> lock(event->mutex);
+	if (ms == INFINITE)
+	{
+		event->cond.wait(lock, [event]() { return event->set; });
+	}
+	else if (!event->cond.wait_for(lock, std::chrono::milliseconds(ms), [event]() { return event->set; }))
+	{
+		return WAIT_TIMEOUT;
+	}
+	if (!event->manual)
+	{
+		event->set = false;
+	}
+	return WAIT_OBJECT_0;
+}
+
+inline BOOL CloseHandle(HANDLE handle)
+{
+	delete (MCompatEvent*)handle;
+	return TRUE;
+}
+
+inline uintptr_t _beginthread(void (*entry)(void*), unsigned, void* arg)
+{
+	HANDLE done = CreateEvent(NULL, TRUE, FALSE, NULL);
+	std::thread([entry, arg, done]() {
+		entry(arg);
+		SetEvent(done);
+	}).detach();
+	return (uintptr_t)done;
+}
+
+inline void _endthread()
+{
+}
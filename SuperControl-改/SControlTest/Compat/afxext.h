@@ -0,0 +1,3 @@
+#pragma once
+
+//Linux上编测试用，被控端framework.h包含的<afxext.h>在这里不需要任何东西
@@ -0,0 +1,3 @@
+#pragma once
+
+//Linux上编测试用，VS工程的framework.h在这里不需要任何东西
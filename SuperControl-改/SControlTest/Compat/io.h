@@ -0,0 +1,3 @@
+#pragma once
+
+//Linux上编测试用，Common.h包含的<io.h>在这里不需要任何东西
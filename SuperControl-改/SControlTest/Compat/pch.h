@@ -0,0 +1,4 @@
+#pragma once
+
+//Linux上编测试用，代替VS工程的预编译头
+#include "afx.h"
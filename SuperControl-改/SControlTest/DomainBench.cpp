@@ -0,0 +1,98 @@
+#include "pch.h"
+#include "MThread.h"
+#include "MTest.h"
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+
+//执行域：大块任务把线程占满的时候，一个输入任务从提交到开始执行要多久(p50/p99/最大，微秒)
+//混在一起：输入和大块在同一个线程池里排队(原来的做法)
+//分域：输入走MD_IO的线程池，大块走MD_BULK的线程池，各自绑CPU(核数够的时候io占0号，bulk用其余的)
+//用法：DomainBench [大块线程数]，不给就用核数
+
+enum
+{
+	BULK_US		= 2000,		//一个大块任务忙多久(微秒)
+	SAMPLES		= 300,		//输入任务个数
+	SAMPLE_GAP	= 3,		//输入任务间隔(毫秒)
+};
+
+static void Busy(int us)
+{
+	double end = MTestNowMs() + us / 1000.0;
+	while (MTestNowMs() < end)
+	{
+	}
+}
+
+//大块任务：返回0放回队尾接着跑，一直占着线程池；和输入同一个优先级，只看分域的效果(车道见LaneBench)
+static void FillBulk(CMThreadPool& pool, int count, std::atomic<bool>& run)
+{
+	for (int i = 0; i < count; i++)
+	{
+		pool.DispatchTask(CMTask([&run]() {
+			Busy(BULK_US);
+			return run ? 0 : -1;
+		}), MP_NORMAL, MTAG_FILE);
+	}
+}
+
+static void Measure(const char* name, CMThreadPool& input)
+{
+	std::vector<double> lat;
+	std::mutex mutex;
+	std::atomic<int> done(0);
+	for (int i = 0; i < SAMPLES; i++)
+	{
+		double submit = MTestNowMs();
+		input.DispatchTask(CMTask([submit, &lat, &mutex, &done]() {
+			double us = (MTestNowMs() - submit) * 1000;
+			std::lock_guard<std::mutex> lock(mutex);
+			lat.push_back(us);
+			done++;
+		}), MP_NORMAL, MTAG_INPUT);
+		std::this_thread::sleep_for(std::chrono::milliseconds(SAMPLE_GAP));
+	}
+	while (done < SAMPLES)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	std::sort(lat.begin(), lat.end());
+	printf("%-12s input latency p50 %8.0f us  p99 %8.0f us  max %8.0f us\n", name,
+		lat[lat.size() / 2], lat[lat.size() * 99 / 100], lat.back());
+}
+
+int main(int argc, char* argv[])
+{
+	int cores = CMThreadPool::Cores();
+	int bulk = (argc > 1) ? atoi(argv[1]) : cores;
+	bulk = std::max(bulk, 1);
+	printf("cores %d bulk threads %d\n", cores, bulk);
+	{
+		std::atomic<bool> run(true);
+		CMThreadPool pool(bulk, 1 << 16);
+		pool.Invoke();
+		FillBulk(pool, bulk * 4, run);
+		Measure("shared", pool);
+		run = false;
+		pool.Stop();
+	}
+	{
+		std::string spec = (cores > 1) ? ("io=0;bulk=1-" + std::to_string(cores - 1)) : "io=0;bulk=0";
+		CMDomain::Configure(spec.c_str());
+		printf("affinity %s\n", spec.c_str());
+		std::atomic<bool> run(true);
+		CMThreadPool bulkPool(bulk, 1 << 16);
+		bulkPool.SetDomain(MD_BULK);
+		bulkPool.Invoke();
+		CMThreadPool ioPool(1);
+		ioPool.SetDomain(MD_IO);
+		ioPool.Invoke();
+		FillBulk(bulkPool, bulk * 4, run);
+		Measure("domains", ioPool);
+		run = false;
+		bulkPool.Stop();
+		ioPool.Stop();
+	}
+	return 0;
+}
@@ -0,0 +1,132 @@
+#include "MFrameRing.h"
+#include "MTest.h"
+#include <thread>
+#include <set>
+
+//帧缓冲：消费者拿到的总是最新的完整帧，没取的旧帧算丢；放出去的 = 丢掉的 + 取走的(+ 还没取的一帧)
+//两个线程一写一读时帧不会被写坏，序号只增不减，最后一帧一定能取到
+
+static void Fill(MFrame* frame, unsigned long long seq, size_t len)
+{
+	unsigned char buf[256];
+	for (size_t i = 0; i < len; i++)
+	{
+		buf[i] = (unsigned char)(seq + i);
+	}
+	frame->Assign(buf, len);
+}
+
+//内容和序号对得上
+static bool Intact(const MFrame* frame)
+{
+	for (size_t i = 0; i < frame->size; i++)
+	{
+		if (frame->data[i] != (unsigned char)(frame->seq + i))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+static void Produce(CMFrameRing& ring, size_t len)
+{
+	MFrame* frame = ring.BeginWrite();
+	//序号在Publish里才定，先按下一个序号写
+	Fill(frame, ring.Published() + 1, len);
+	ring.Publish();
+}
+
+//单线程看顺序：连放三帧只取到第三帧，前两帧算丢；取过以后没有新帧返回NULL
+static void TestLatestWins()
+{
+	CMFrameRing ring;
+	ring.Reserve(256);
+	MCHECK(!ring.Ready() && (ring.Acquire() == NULL));
+	Produce(ring, 10);
+	Produce(ring, 20);
+	Produce(ring, 30);
+	MCHECK(ring.Ready());
+	const MFrame* frame = ring.Acquire();
+	MCHECK((frame != NULL) && (frame->seq == 3) && (frame->size == 30) && Intact(frame));
+	MCHECK((ring.Published() == 3) && (ring.Dropped() == 2) && (ring.Consumed() == 1));
+	MCHECK(!ring.Ready() && (ring.Acquire() == NULL));
+	//时间戳：截屏不晚于放出，取走时的延迟不是负的
+	MCHECK((frame->captureUs > 0) && (frame->captureUs <= frame->publishUs) && (ring.LastAgeUs() >= 0));
+	//取一帧放一帧：一帧不丢
+	for (unsigned long long seq = 4; seq <= 10; seq++)
+	{
+		Produce(ring, (size_t)seq);
+		frame = ring.Acquire();
+		MCHECK((frame != NULL) && (frame->seq == seq) && Intact(frame));
+	}
+	MCHECK((ring.Published() == 10) && (ring.Dropped() == 2) && (ring.Consumed() == 8));
+	MCHECK(ring.Published() == ring.Dropped() + ring.Consumed());
+	//预留够了：之后的帧都写在三个槽原来的缓冲区里，不再分配
+	std::set<const unsigned char*> buffers;
+	for (int i = 0; i < 30; i++)
+	{
+		Produce(ring, 100 + i);
+		frame = ring.Acquire();
+		buffers.insert(frame->data.data());
+	}
+	MCHECK(buffers.size() <= 3);
+}
+
+//一个线程放20万帧，一个线程一直取：序号递增、内容完整、最后一帧取到、计数对得上
+static void TestThreads()
+{
+	const unsigned long long FRAMES = 200000;
+	CMFrameRing ring;
+	ring.Reserve(256);
+	std::atomic<bool> done(false);
+	std::thread producer([&ring, &done, FRAMES]() {
+		for (unsigned long long i = 0; i < FRAMES; i++)
+		{
+			Produce(ring, 16 + (size_t)(i % 200));
+			//单核上也让消费者插进来
+			if ((i % 64) == 0)
+			{
+				std::this_thread::yield();
+			}
+		}
+		done = true;
+	});
+	unsigned long long last = 0, acquired = 0, torn = 0, backwards = 0;
+	while (true)
+	{
+		bool finished = done;
+		const MFrame* frame = ring.Acquire();
+		if (frame != NULL)
+		{
+			acquired++;
+			if (frame->seq <= last)
+			{
+				backwards++;
+			}
+			if (!Intact(frame))
+			{
+				torn++;
+			}
+			last = frame->seq;
+		}
+		else if (finished)
+		{
+			break;
+		}
+	}
+	producer.join();
+	printf("frames %llu, consumed %llu, dropped %llu\n", ring.Published(), ring.Consumed(), ring.Dropped());
+	MCHECK((torn == 0) && (backwards == 0));
+	MCHECK(last == FRAMES);
+	MCHECK(acquired == ring.Consumed());
+	MCHECK(ring.Published() == FRAMES);
+	MCHECK(ring.Published() == ring.Dropped() + ring.Consumed());
+}
+
+int main()
+{
+	TestLatestWins();
+	TestThreads();
+	return MTestResult("FrameRingTest");
+}
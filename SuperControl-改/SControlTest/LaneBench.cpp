@@ -0,0 +1,106 @@
+#include "pch.h"
+#include "Common.h"
+#include "MThread.h"
+#include "MByteQueue.h"
+#include "MTest.h"
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+
+//优先级车道：下载把线程池占满的时候，鼠标命令从提交到执行要多久(p50/p99/最大，微秒)
+//下载按DownLoadFile的样子：读一块(忙一会儿)放进按字节计数的发送队列，链路按固定速度发；一个文件读完再放一个
+//fifo：输入和下载同一条车道；lanes：输入MP_HIGH、下载MP_BULK；lanes+preempt：下载每块之后调Preempt
+//用法：LaneBench [线程数]，默认2
+
+enum
+{
+	CHUNK		= 64 * 1024,	//一块
+	CHUNK_US	= 500,			//读一块要多久(微秒)
+	FILE_CHUNKS	= 200,			//一个文件多少块(约100毫秒)
+	LINK_US		= 400,			//链路发一块要多久(微秒)
+	SAMPLES		= 200,
+	SAMPLE_GAP	= 5,			//输入间隔(毫秒)
+};
+
+static void Busy(int us)
+{
+	double end = MTestNowMs() + us / 1000.0;
+	while (MTestNowMs() < end)
+	{
+	}
+}
+
+static void Run(const char* name, int threads, MPriority input, MPriority bulk, bool preempt)
+{
+	CMThreadPool pool(threads, 1 << 16);
+	pool.Invoke();
+	CMByteQueue queue;
+	std::atomic<bool> run(true);
+	//链路：固定速度把发送队列发空
+	std::thread link([&queue, &run]() {
+		while (run)
+		{
+			ULONG len = 0;
+			if (queue.Front(len) == NULL)
+			{
+				std::this_thread::sleep_for(std::chrono::microseconds(LINK_US));
+				continue;
+			}
+			std::this_thread::sleep_for(std::chrono::microseconds(LINK_US));
+			queue.Sent(len);
+		}
+	});
+	std::vector<BYTE> chunk(CHUNK, 0x5A);
+	//下载：每个线程一个，读完一个文件放回队尾再来
+	for (int i = 0; i < threads; i++)
+	{
+		pool.DispatchTask(CMTask([&queue, &run, &chunk, preempt]() {
+			for (int c = 0; (c < FILE_CHUNKS) && run; c++)
+			{
+				Busy(CHUNK_US);
+				queue.Push(CPacket(3, chunk.data(), (DWORD)chunk.size(), false));
+				if (preempt)
+				{
+					CMThreadPool::Preempt();
+				}
+			}
+			return run ? 0 : -1;
+		}), bulk, MTAG_FILE);
+	}
+	std::vector<double> lat;
+	std::mutex mutex;
+	std::atomic<int> done(0);
+	for (int i = 0; i < SAMPLES; i++)
+	{
+		double submit = MTestNowMs();
+		pool.DispatchTask(CMTask([submit, &lat, &mutex, &done]() {
+			double us = (MTestNowMs() - submit) * 1000;
+			std::lock_guard<std::mutex> lock(mutex);
+			lat.push_back(us);
+			done++;
+		}), input, MTAG_INPUT);
+		std::this_thread::sleep_for(std::chrono::milliseconds(SAMPLE_GAP));
+	}
+	while (done < SAMPLES)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	run = false;
+	queue.SetWatermark(0, 0);
+	pool.Stop();
+	link.join();
+	std::sort(lat.begin(), lat.end());
+	printf("%-16s input latency p50 %8.0f us  p99 %8.0f us  max %8.0f us\n", name,
+		lat[lat.size() / 2], lat[lat.size() * 99 / 100], lat.back());
+}
+
+int main(int argc, char* argv[])
+{
+	int threads = (argc > 1) ? atoi(argv[1]) : 2;
+	threads = std::max(threads, 1);
+	printf("threads %d, chunk %d KB every %d us, link %d us per chunk\n", threads, CHUNK / 1024, CHUNK_US, LINK_US);
+	Run("fifo", threads, MP_NORMAL, MP_NORMAL, false);
+	Run("lanes", threads, MP_HIGH, MP_BULK, false);
+	Run("lanes+preempt", threads, MP_HIGH, MP_BULK, true);
+	return 0;
+}
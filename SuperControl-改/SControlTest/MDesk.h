@@ -0,0 +1,257 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+//测试用的合成桌面：渐变背景、带标题栏的窗口、一行行像字的点阵
+//随机数种子固定，每次跑出来的画面都一样，编码的字节数可以直接比
+class CMDesk
+{
+public:
+	enum
+	{
+		SCENE_IDLE		= 0,		//什么都不动
+		SCENE_TYPING	= 1,		//在左边窗口里打字
+		SCENE_SCROLL	= 2,		//右边窗口往上滚
+		SCENE_VIDEO		= 3,		//中间放视频
+	};
+	int						W;
+	int						H;
+	std::vector<uint8_t>	px;			//BGRA，行从上往下
+private:
+	uint32_t				m_rng;
+	uint32_t Rand()
+	{
+		m_rng ^= m_rng << 13;
+		m_rng ^= m_rng >> 17;
+		m_rng ^= m_rng << 5;
+		return m_rng;
+	}
+	uint8_t* At(int x, int y)
+	{
+		return &px[((size_t)y * W + x) * 4];
+	}
+public:
+	CMDesk(int width, int height) : W(width), H(height), px((size_t)width * height * 4), m_rng(12345)
+	{
+		for (int y = 0; y < H; y++)
+		{
+			for (int x = 0; x < W; x++)
+			{
+				uint8_t* p = At(x, y);
+				p[0] = (uint8_t)(60 + y * 80 / H);
+				p[1] = (uint8_t)(90 + x * 60 / W);
+				p[2] = 140;
+				p[3] = 255;
+			}
+		}
+		Window(W * 5 / 96, H * 2 / 27, W * 15 / 32, H * 35 / 54, 0xF0F0F0);
+		Window(W * 25 / 48, H * 5 / 36, W * 41 / 96, H * 5 / 9, 0xFFFFFF);
+		for (int r = 0; r < 30 && 120 + r * 20 + 12 < H; r++)
+		{
+			Text(W * 5 / 96 + 20, 120 + r * 20, (W * 15 / 32 - 40) / 9, r);
+		}
+	}
+	void Fill(int x, int y, int w, int h, uint32_t c)
+	{
+		for (int j = y; (j < y + h) && (j < H); j++)
+		{
+			for (int i = x; (i < x + w) && (i < W); i++)
+			{
+				uint8_t* p = At(i, j);
+				p[0] = c & 255;
+				p[1] = (c >> 8) & 255;
+				p[2] = (c >> 16) & 255;
+				p[3] = 255;
+			}
+		}
+	}
+	void Window(int x, int y, int w, int h, uint32_t c)
+	{
+		Fill(x, y, w, h, c);
+		Fill(x, y, w, 24, 0x2B579A);
+		Fill(x + w - 20, y + 4, 16, 16, 0xE81123);
+	}
+	//一个7x12的字
+	void Glyph(int x, int y, uint32_t seed)
+	{
+		uint32_t s = seed * 2654435761u;
+		for (int j = 0; j < 12; j++)
+		{
+			for (int i = 0; i < 7; i++)
+			{
+				s = s * 1103515245 + 12345;
+				if (((s >> 16) & 3) == 0)
+				{
+					Fill(x + i, y + j, 1, 1, 0x202020);
+				}
+			}
+		}
+	}
+	void Text(int x, int y, int chars, int seed)
+	{
+		for (int c = 0; c < chars; c++)
+		{
+			if ((c * 7 + seed) % 11)
+			{
+				Glyph(x + c * 9, y, seed * 131 + c);
+			}
+		}
+	}
+	void Scroll(int x, int y, int w, int h, int dy)
+	{
+		for (int j = y; j < y + h - dy; j++)
+		{
+			memmove(At(x, j), At(x, j + dy), (size_t)w * 4);
+		}
+		Fill(x, y + h - dy, w, dy, 0xFFFFFF);
+	}
+	void Video(int x, int y, int w, int h, int t)
+	{
+		for (int j = 0; j < h; j++)
+		{
+			for (int i = 0; i < w; i++)
+			{
+				uint8_t* p = At(x + i, y + j);
+				int v = (i * 3 + j * 2 + t * 7) & 255;
+				p[0] = (uint8_t)(v ^ (Rand() & 7));
+				p[1] = (uint8_t)((v + i / 4 + t) & 255);
+				p[2] = (uint8_t)((j + t * 3) & 255);
+			}
+		}
+	}
+	//按场景走一步(t是第几步)
+	void Step(int scene, int t)
+	{
+		int left = W * 5 / 96 + 20;
+		int right = W * 25 / 48;
+		switch (scene)
+		{
+		case SCENE_TYPING:
+		{
+			//打满一行换行，打满窗口从头再来
+			int cols = (W * 15 / 32 - 40) / 9;
+			int lines = (H * 35 / 54 - 60) / 20;
+			int line = H * 2 / 27 + 40 + 20 * ((t / cols) % lines);
+			Glyph(left + (t % cols) * 9, line, t * 77);
+			Fill(left + ((t + 1) % cols) * 9, line, 1, 12, (t & 4) ? 0 : 0xF0F0F0);
+			break;
+		}
+		case SCENE_SCROLL:
+		{
+			int top = H * 5 / 36 + 24;
+			int height = H * 5 / 9 - 24;
+			Scroll(right, top, W * 41 / 96, height, 16);
+			Text(right + 20, top + height - 16, (W * 41 / 96 - 40) / 9, t);
+			break;
+		}
+		case SCENE_VIDEO:
+			Video(W / 10, H * 5 / 18, W / 3, H / 3, t);
+			break;
+		}
+	}
+};
+
+//录好的一段操作：三个程序的窗口在同一个位置来回切换、切标签页、开关对话框，中间打字
+//块缓存就是给这种画面用的：切回去的窗口观看端见过，只发键；种子固定，每次的帧一样
+class CMDeskSession
+{
+public:
+	CMDesk					screen;		//当前画面
+private:
+	std::vector<CMDesk>		m_apps;		//三个程序各自的画面
+	std::vector<CMDesk>		m_tabs;		//切到另一个标签页的样子
+	uint32_t				m_rng;
+	int						m_cur;
+	bool					m_tab;
+	bool					m_dialog;
+	int						m_typed;
+	int						m_x, m_y, m_w, m_h;		//窗口的位置
+	int Rand(int n)
+	{
+		m_rng ^= m_rng << 13;
+		m_rng ^= m_rng >> 17;
+		m_rng ^= m_rng << 5;
+		return (int)(m_rng % n);
+	}
+	//把当前程序的窗口贴到屏幕上
+	void Show()
+	{
+		const CMDesk& src = m_tab ? m_tabs[m_cur] : m_apps[m_cur];
+		for (int j = m_y; j < m_y + m_h; j++)
+		{
+			size_t at = ((size_t)j * screen.W + m_x) * 4;
+			memcpy(&screen.px[at], &src.px[at], (size_t)m_w * 4);
+		}
+	}
+public:
+	CMDeskSession(int width, int height)
+		: screen(width, height), m_rng(777), m_cur(0), m_tab(false), m_dialog(false), m_typed(0)
+		, m_x(width * 5 / 96), m_y(height * 2 / 27), m_w(width * 35 / 48), m_h(height * 85 / 108)
+	{
+		int lines = (m_h - 60) / 20;
+		for (int a = 0; a < 3; a++)
+		{
+			m_apps.push_back(screen);
+			CMDesk& app = m_apps.back();
+			app.Window(m_x, m_y, m_w, m_h, 0xFFFFFF - a * 0x101010);
+			for (int r = 0; r < lines; r++)
+			{
+				app.Text(m_x + 30, m_y + 50 + r * 20, (m_w - 60) / 9, r * 3 + a * 101);
+			}
+			m_tabs.push_back(app);
+			CMDesk& tab = m_tabs.back();
+			tab.Fill(m_x + m_w * 5 / 7, m_y + 50, m_w * 2 / 7 - 20, m_h - 70, 0xE8F0FF);
+			for (int r = 0; r < (m_h - 80) / 24; r++)
+			{
+				tab.Text(m_x + m_w * 5 / 7 + 10, m_y + 60 + r * 24, (m_w * 2 / 7 - 40) / 9, a * 7 + r);
+			}
+		}
+		Show();
+	}
+	//走一步：切窗口、切标签页、开关对话框或者打一个字
+	void Step()
+	{
+		int event = Rand(100);
+		if (event < 20)
+		{
+			m_cur = (m_cur + 1 + Rand(2)) % 3;
+			m_dialog = false;
+			Show();
+		}
+		else if (event < 35)
+		{
+			m_tab = !m_tab;
+			m_dialog = false;
+			Show();
+		}
+		else if (event < 50)
+		{
+			m_dialog = !m_dialog;
+			if (m_dialog)
+			{
+				screen.Window(screen.W * 5 / 16, screen.H * 5 / 18, screen.W / 3, screen.H * 7 / 18, 0xF4F4F4);
+				screen.Text(screen.W * 5 / 16 + 20, screen.H * 5 / 18 + 40, (screen.W / 3 - 40) / 9, 99);
+			}
+			else
+			{
+				Show();
+			}
+		}
+		else
+		{
+			//打字：两个标签页的样子都要跟着变，切回来时看到的是新的
+			int cols = (m_w * 5 / 7 - 60) / 9;
+			int x = m_x + 30 + (m_typed % cols) * 9;
+			int y = m_y + 50 + 20 * ((m_typed / cols) % ((m_h - 60) / 20));
+			m_apps[m_cur].Glyph(x, y, m_typed * 31);
+			m_tabs[m_cur].Glyph(x, y, m_typed * 31);
+			m_typed++;
+			if (!m_dialog)
+			{
+				Show();
+			}
+		}
+	}
+};
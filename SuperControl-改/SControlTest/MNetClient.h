@@ -0,0 +1,174 @@
+#pragma once
+
+#include <string>
+#include <cstring>
+#include <unistd.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "Common.h"
+#include "MTest.h"
+
+//测试用的汇合服务器客户端：和真的客户端一样先UDP再TCP登记(101)、发请求、按命令等应答
+//收到的字节先攒着，一次read里有几个包也能一个一个拆出来
+class CMNetClient
+{
+public:
+	int				sock;
+	int				udpSock;
+	sockaddr_in		udpAddr;		//服务器的UDP地址
+	std::string		buf;
+public:
+	CMNetClient() : sock(-1), udpSock(-1), udpAddr()
+	{
+	}
+	~CMNetClient()
+	{
+		Close();
+	}
+	//服务器的TCP端口和UDP端口；localUdp不是0时UDP绑在这个本地端口上(模拟NAT换端口)
+	bool Connect(unsigned short port, unsigned short udpPort, unsigned short localUdp = 0)
+	{
+		Close();
+		udpSock = socket(AF_INET, SOCK_DGRAM, 0);
+		if (localUdp != 0)
+		{
+			sockaddr_in local{};
+			local.sin_family = AF_INET;
+			local.sin_addr.s_addr = inet_addr("127.0.0.1");
+			local.sin_port = htons(localUdp);
+			if (bind(udpSock, (sockaddr*)&local, sizeof(local)) != 0)
+			{
+				Close();
+				return false;
+			}
+		}
+		udpAddr.sin_family = AF_INET;
+		udpAddr.sin_addr.s_addr = inet_addr("127.0.0.1");
+		udpAddr.sin_port = htons(udpPort);
+		sock = socket(AF_INET, SOCK_STREAM, 0);
+		sockaddr_in addr{};
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+		addr.sin_port = htons(port);
+		if (connect(sock, (sockaddr*)&addr, sizeof(addr)) != 0)
+		{
+			Close();
+			return false;
+		}
+		int one = 1;
+		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		return true;
+	}
+	void Close()
+	{
+		if (sock != -1)
+		{
+			close(sock);
+			sock = -1;
+		}
+		if (udpSock != -1)
+		{
+			close(udpSock);
+			udpSock = -1;
+		}
+		buf.clear();
+	}
+	bool Send(CPacket& pack)
+	{
+		return send(sock, pack.Data(), pack.Size(), MSG_NOSIGNAL) == pack.Size();
+	}
+	//UDP的101：让服务器记下(或更新)公网地址，等它回101
+	bool Hello(unsigned long long id)
+	{
+		CPacket hello(101, (unsigned char*)&id, sizeof(id));
+		if (sendto(udpSock, hello.Data(), hello.Size(), 0, (sockaddr*)&udpAddr, sizeof(udpAddr)) <= 0)
+		{
+			return false;
+		}
+		pollfd pfd{ udpSock, POLLIN, 0 };
+		char ack[256];
+		return (poll(&pfd, 1, 1000) > 0) && (recv(udpSock, ack, sizeof(ack), 0) > 0);
+	}
+	//登记：先UDP的101，再TCP的101登记连接；pLocal不是NULL时像新版客户端一样在后面带上局域网地址
+	bool Register(unsigned long long id, const MLocalAddrs* pLocal = NULL)
+	{
+		if (!Hello(id))
+		{
+			return false;
+		}
+		MUserInfo info(Ip(), 0);
+		info.tcpSock = 0;
+		info.id = id;
+		info.last = 0;
+		std::string data((char*)&info, sizeof(info));
+		if (pLocal != NULL)
+		{
+			data.append((const char*)pLocal, sizeof(MLocalAddrs));
+		}
+		CPacket pack(101, (unsigned char*)data.c_str(), (unsigned int)data.size());
+		return Send(pack);
+	}
+	//心跳(103)走UDP：和TCP上的请求分开，不会和它挤在一次read里
+	bool KeepAlive(unsigned long long id)
+	{
+		CPacket pack(103, (unsigned char*)&id, sizeof(id));
+		return sendto(udpSock, pack.Data(), pack.Size(), 0, (sockaddr*)&udpAddr, sizeof(udpAddr)) > 0;
+	}
+	//等下一个包，timeout毫秒内没有返回false
+	bool Recv(CPacket& out, int timeout)
+	{
+		double start = MTestNowMs();
+		while (true)
+		{
+			int len = (int)buf.size();
+			if (len > 0)
+			{
+				CPacket pack((unsigned char*)buf.data(), len);
+				if (len > 0)
+				{
+					buf.erase(0, len);
+					out = pack;
+					return true;
+				}
+			}
+			int left = timeout - (int)(MTestNowMs() - start);
+			pollfd pfd{ sock, POLLIN, 0 };
+			if ((left <= 0) || (poll(&pfd, 1, left) <= 0))
+			{
+				return false;
+			}
+			char data[4096];
+			ssize_t ret = read(sock, data, sizeof(data));
+			if (ret <= 0)
+			{
+				return false;
+			}
+			buf.append(data, ret);
+		}
+	}
+	//等命令是cmd的包，地址列表(102)这类广播跳过
+	bool RecvCmd(unsigned short cmd, CPacket& out, int timeout)
+	{
+		double start = MTestNowMs();
+		while (true)
+		{
+			int left = timeout - (int)(MTestNowMs() - start);
+			if ((left <= 0) || !Recv(out, left))
+			{
+				return false;
+			}
+			if (out.nCmd == cmd)
+			{
+				return true;
+			}
+		}
+	}
+	static const char* Ip()
+	{
+		static const char ip[16] = "127.0.0.1";
+		return ip;
+	}
+};
@@ -0,0 +1,157 @@
+#include "MQueue.h"
+#include "MTest.h"
+#include <thread>
+#include <vector>
+#include <deque>
+#include <cstdlib>
+
+//队列吞吐：P个生产者P个消费者，每个生产者放N个，看每秒多少百万次(放+取算一次)
+//lock：一把锁加条件变量的有界队列(原来的队列要走完成端口，Linux上编不了，用它当对照)
+//ring：CMQueue，满了/空了等待；ring-spin：CMQueue只用push_back/pop_front，满了/空了让一下再试
+//成批取：一个生产者一个消费者，消费者用wait_pop一个一个取，或者用pop_n一次最多取1/8/64个(带deadline)，看每个多少纳秒
+//用法：MQueueBench [每个生产者放多少]，默认1000000
+
+enum
+{
+	CAPACITY	= 1024,
+};
+
+//对照：一把锁保护的deque，满了/空了在条件变量上等
+class CLockQueue
+{
+	std::deque<long long>	m_items;
+	std::mutex				m_mutex;
+	std::condition_variable	m_condPop;
+	std::condition_variable	m_condPush;
+public:
+	void wait_push(long long v)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_condPush.wait(lock, [this]() { return m_items.size() < CAPACITY; });
+		m_items.push_back(v);
+		m_condPop.notify_one();
+	}
+	long long wait_pop()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_condPop.wait(lock, [this]() { return !m_items.empty(); });
+		long long v = m_items.front();
+		m_items.pop_front();
+		m_condPush.notify_one();
+		return v;
+	}
+};
+
+//P个生产者P个消费者跑完，返回每秒百万次；sum用来确认一个都没丢
+template<typename Push, typename Pop>
+static double Run(int P, int N, Push push, Pop pop)
+{
+	std::atomic<long long> sum(0);
+	std::vector<std::thread> threads;
+	double start = MTestNowMs();
+	for (int p = 0; p < P; p++)
+	{
+		threads.emplace_back([&push, N]() {
+			for (int i = 1; i <= N; i++)
+			{
+				push(i);
+			}
+		});
+	}
+	for (int c = 0; c < P; c++)
+	{
+		threads.emplace_back([&pop, &sum, N]() {
+			long long local = 0;
+			for (int i = 0; i < N; i++)
+			{
+				local += pop();
+			}
+			sum += local;
+		});
+	}
+	for (size_t i = 0; i < threads.size(); i++)
+	{
+		threads[i].join();
+	}
+	double ms = MTestNowMs() - start;
+	if (sum != (long long)P * N * (N + 1) / 2)
+	{
+		printf("sum mismatch\n");
+	}
+	return (double)P * N / ms / 1000;
+}
+
+//一个生产者一个消费者；batch为0表示消费者用wait_pop，否则用pop_n一次最多取batch个；返回每个多少纳秒
+static double RunBatch(int batch, int N)
+{
+	CMQueue<long long> queue(CAPACITY);
+	long long sum = 0;
+	double start = MTestNowMs();
+	std::thread producer([&queue, N]() {
+		for (int i = 1; i <= N; i++)
+		{
+			queue.wait_push((long long)i);
+		}
+	});
+	std::vector<long long> out;
+	out.reserve(CAPACITY);
+	for (int got = 0; got < N;)
+	{
+		CMQueue<long long>::MDeadline deadline = CMQueue<long long>::MDeadline::clock::now() + std::chrono::milliseconds(100);
+		if (batch == 0)
+		{
+			long long v = 0;
+			if (queue.wait_pop(v, deadline))
+			{
+				sum += v;
+				got++;
+			}
+			continue;
+		}
+		out.clear();
+		got += (int)queue.pop_n(out, batch, deadline);
+		for (size_t i = 0; i < out.size(); i++)
+		{
+			sum += out[i];
+		}
+	}
+	producer.join();
+	double ms = MTestNowMs() - start;
+	if (sum != (long long)N * (N + 1) / 2)
+	{
+		printf("sum mismatch\n");
+	}
+	return ms * 1000000 / N;
+}
+
+int main(int argc, char* argv[])
+{
+	int N = (argc > 1) ? atoi(argv[1]) : 1000000;
+	N = std::max(N, 1);
+	printf("cores %u, %d items per producer, capacity %d\n", std::thread::hardware_concurrency(), N, (int)CAPACITY);
+	int counts[] = { 1, 2, 4 };
+	for (int P : counts)
+	{
+		CLockQueue lock;
+		double lockOps = Run(P, N,
+			[&lock](long long v) { lock.wait_push(v); },
+			[&lock]() { return lock.wait_pop(); });
+		CMQueue<long long> ring(CAPACITY);
+		double ringOps = Run(P, N,
+			[&ring](long long v) { ring.wait_push(std::move(v)); },
+			[&ring]() { long long v = 0; ring.wait_pop(v); return v; });
+		CMQueue<long long> spin(CAPACITY);
+		double spinOps = Run(P, N,
+			[&spin](long long v) { while (!spin.push_back(v)) { std::this_thread::yield(); } },
+			[&spin]() { long long v = 0; while (!spin.pop_front(v)) { std::this_thread::yield(); } return v; });
+		printf("P=C=%d  lock %6.2f  ring %6.2f  ring-spin %6.2f  Mops/s\n", P, lockOps, ringOps, spinOps);
+	}
+	printf("batch  wait_pop %6.1f", RunBatch(0, N));
+	int batches[] = { 1, 8, 64 };
+	for (int batch : batches)
+	{
+		printf("  pop_n(%d) %6.1f", batch, RunBatch(batch, N));
+	}
+	printf("  ns/item\n");
+	return 0;
+}
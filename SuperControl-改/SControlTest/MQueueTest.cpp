@@ -0,0 +1,260 @@
+#include "MQueue.h"
+#include "MTest.h"
+#include <thread>
+#include <vector>
+#include <memory>
+#include <string>
+#include <list>
+
+//无锁有界队列：只能移动的元素、满了拒绝、多生产者多消费者不丢不重、等待超时、清空、成批取
+
+//只能移动的元素；满了push_back返回false，放不进去的不动
+static void TestMoveOnly()
+{
+	CMQueue<std::unique_ptr<int>> queue(4);
+	MCHECK(queue.capacity() == 4);
+	for (int i = 0; i < 4; i++)
+	{
+		MCHECK(queue.push_back(std::make_unique<int>(i)));
+	}
+	std::unique_ptr<int> extra = std::make_unique<int>(9);
+	MCHECK(!queue.push_back(std::move(extra)));
+	MCHECK((extra != nullptr) && (*extra == 9));
+	MCHECK(!queue.wait_push(std::move(extra), 10));
+	MCHECK(extra != nullptr);
+	MCHECK(queue.size() == 4);
+	std::unique_ptr<int> p;
+	for (int i = 0; i < 4; i++)
+	{
+		MCHECK(queue.pop_front(p) && (p != nullptr) && (*p == i));
+	}
+	MCHECK(!queue.pop_front(p));
+	MCHECK(queue.empty());
+}
+
+//4个生产者4个消费者，容量比生产的少得多：每个值正好取到一次
+static void TestStress()
+{
+	const int P = 4, C = 4, N = 100000;
+	CMQueue<int> queue(64);
+	std::vector<std::atomic<unsigned char>> hit(P * N);
+	for (size_t i = 0; i < hit.size(); i++)
+	{
+		hit[i] = 0;
+	}
+	std::atomic<int> count(0);
+	std::vector<std::thread> threads;
+	for (int p = 0; p < P; p++)
+	{
+		threads.emplace_back([&queue, p, N]() {
+			for (int i = 0; i < N; i++)
+			{
+				int v = p * N + i;
+				if ((i % 3) == 0)
+				{
+					//不等待的放法：满了让一下再试
+					while (!queue.push_back(v))
+					{
+						std::this_thread::yield();
+					}
+				}
+				else
+				{
+					queue.wait_push(std::move(v));
+				}
+			}
+		});
+	}
+	for (int c = 0; c < C; c++)
+	{
+		threads.emplace_back([&queue, &hit, &count, P, N]() {
+			int v = 0;
+			while (count < P * N)
+			{
+				if (queue.wait_pop(v, 10))
+				{
+					hit[v]++;
+					count++;
+				}
+			}
+		});
+	}
+	for (size_t i = 0; i < threads.size(); i++)
+	{
+		threads[i].join();
+	}
+	int once = 0;
+	for (size_t i = 0; i < hit.size(); i++)
+	{
+		once += (hit[i] == 1) ? 1 : 0;
+	}
+	MCHECK(count == P * N);
+	MCHECK(once == P * N);
+	MCHECK(queue.empty());
+}
+
+//空队列等待：到时间返回false；等的时候有人放就马上返回
+static void TestTimeout()
+{
+	CMQueue<int> queue(8);
+	int v = 0;
+	double start = MTestNowMs();
+	MCHECK(!queue.wait_pop(v, 50));
+	double waited = MTestNowMs() - start;
+	MCHECK((waited >= 45) && (waited < 1000));
+	std::thread producer([&queue]() {
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		queue.push_back(7);
+	});
+	start = MTestNowMs();
+	MCHECK(queue.wait_pop(v) && (v == 7));
+	MCHECK(MTestNowMs() - start < 1000);
+	producer.join();
+}
+
+//清空后析构掉元素，队列还能接着用；满着的时候清空叫醒等空位的生产者
+static void TestClear()
+{
+	std::shared_ptr<int> token = std::make_shared<int>(0);
+	CMQueue<std::shared_ptr<int>> queue(4);
+	for (int i = 0; i < 4; i++)
+	{
+		queue.push_back(token);
+	}
+	MCHECK(token.use_count() == 5);
+	std::thread producer([&queue, &token]() {
+		MCHECK(queue.wait_push(token, 1000));
+	});
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	queue.clear();
+	producer.join();
+	MCHECK(queue.size() == 1);
+	MCHECK(token.use_count() == 2);
+	CMQueue<std::string> strings(8);
+	strings.push_back("a");
+	strings.push_back(std::string(100, 'x'));
+	strings.clear();
+	MCHECK(strings.empty());
+	MCHECK(strings.push_back("keep"));
+	std::string s;
+	MCHECK(strings.pop_front(s) && (s == "keep"));
+}
+
+//成批取：不超过max、按放进去的顺序；不给deadline不等；空了等到deadline；一批取走后等空位的生产者都要醒
+static void TestPopN()
+{
+	CMQueue<int> queue(16);
+	std::vector<int> out;
+	MCHECK(queue.pop_n(out, 8) == 0);
+	for (int i = 0; i < 10; i++)
+	{
+		queue.push_back(i);
+	}
+	MCHECK(queue.pop_n(out, 8) == 8);
+	MCHECK(queue.pop_n(out, 8) == 2);
+	bool ordered = (out.size() == 10);
+	for (size_t i = 0; ordered && (i < out.size()); i++)
+	{
+		ordered = (out[i] == (int)i);
+	}
+	MCHECK(ordered);
+	double start = MTestNowMs();
+	MCHECK(queue.pop_n(out, 4, CMQueue<int>::MDeadline::clock::now() + std::chrono::milliseconds(30)) == 0);
+	MCHECK(MTestNowMs() - start >= 25);
+	int v = 0;
+	start = MTestNowMs();
+	MCHECK(!queue.wait_pop(v, CMQueue<int>::MDeadline::clock::now() + std::chrono::milliseconds(30)));
+	MCHECK(MTestNowMs() - start >= 25);
+	//队列满着，两个生产者等空位，一次取走一批两个都能放进去
+	for (int i = 0; i < 16; i++)
+	{
+		queue.push_back(i);
+	}
+	std::atomic<int> pushed(0);
+	std::vector<std::thread> producers;
+	for (int p = 0; p < 2; p++)
+	{
+		producers.emplace_back([&queue, &pushed]() {
+			if (queue.wait_push(100, 1000))
+			{
+				pushed++;
+			}
+		});
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	out.clear();
+	MCHECK(queue.pop_n(out, 16) == 16);
+	for (size_t p = 0; p < producers.size(); p++)
+	{
+		producers[p].join();
+	}
+	MCHECK(pushed == 2);
+	MCHECK(queue.size() == 2);
+}
+
+//成批取和单个取混着来的消费者，字符串元素：每个值正好取到一次
+static void TestPopNStress()
+{
+	const int P = 3, N = 20000;
+	CMQueue<std::string> queue(64);
+	std::atomic<long long> sum(0);
+	std::atomic<int> got(0);
+	std::vector<std::thread> threads;
+	for (int p = 0; p < P; p++)
+	{
+		threads.emplace_back([&queue, N]() {
+			for (int i = 1; i <= N; i++)
+			{
+				queue.wait_push(std::to_string(i));
+			}
+		});
+	}
+	for (int c = 0; c < 3; c++)
+	{
+		threads.emplace_back([&queue, &sum, &got, c, P, N]() {
+			while (got < P * N)
+			{
+				std::list<std::string> items;
+				CMQueue<std::string>::MDeadline deadline = CMQueue<std::string>::MDeadline::clock::now() + std::chrono::milliseconds(5);
+				size_t count = 0;
+				if (c == 2)
+				{
+					std::string s;
+					if (queue.wait_pop(s, deadline))
+					{
+						items.push_back(s);
+						count = 1;
+					}
+				}
+				else
+				{
+					count = queue.pop_n(items, (c == 0) ? 8 : 64, deadline);
+				}
+				MCHECK(count == items.size());
+				for (std::list<std::string>::iterator it = items.begin(); it != items.end(); it++)
+				{
+					sum += std::stoll(*it);
+				}
+				got += (int)count;
+			}
+		});
+	}
+	for (size_t i = 0; i < threads.size(); i++)
+	{
+		threads[i].join();
+	}
+	MCHECK(got == P * N);
+	MCHECK(sum == (long long)P * N * (N + 1) / 2);
+	MCHECK(queue.empty());
+}
+
+int main()
+{
+	TestMoveOnly();
+	TestStress();
+	TestTimeout();
+	TestClear();
+	TestPopN();
+	TestPopNStress();
+	return MTestResult("MQueueTest");
+}
@@ -0,0 +1,192 @@
+#include "pch.h"
+#include "MThread.h"
+#include "MTest.h"
+#include <new>
+#include <cstdlib>
+
+//CMTask和CMFuture：小的可调用对象不分配内存、大的放堆上，移动和析构都只做一次
+//Then链的结果要对；线程池关闭丢掉的任务future变成broken，Get不会卡住，没有结果的链不泄漏
+
+//数一下new的次数，看CMTask有没有分配内存
+static std::atomic<long> g_news(0);
+
+void* operator new(size_t size)
+{
+	g_news++;
+	void* p = malloc(size ? size : 1);
+	if (p == NULL)
+	{
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	free(p);
+}
+
+//移动构造可能抛异常的，不能放在内部(移动的时候出错没法回滚)
+struct MThrowMove
+{
+	int* ran;
+	MThrowMove(int* r) : ran(r)
+	{
+	}
+	MThrowMove(MThrowMove&& other) noexcept(false) : ran(other.ran)
+	{
+	}
+	void operator()()
+	{
+		(*ran)++;
+	}
+};
+
+static void TestInlineHeap()
+{
+	std::shared_ptr<int> token = std::make_shared<int>(0);
+	int ran = 0;
+	//小的：不分配，移动后还是那一个，析构一次
+	{
+		long before = g_news;
+		CMTask small([token, &ran]() { ran++; });
+		MCHECK(g_news == before);
+		MCHECK(token.use_count() == 2);
+		CMTask moved(std::move(small));
+		MCHECK(!small.IsValid() && moved.IsValid());
+		MCHECK(token.use_count() == 2);
+		MCHECK(moved() == -1);
+		MCHECK(ran == 1);
+	}
+	MCHECK(token.use_count() == 1);
+	//大的：new一次，移动只是换指针
+	{
+		char pad[128] = { 1 };
+		long before = g_news;
+		CMTask big([token, pad, &ran]() { ran += pad[0]; });
+		MCHECK(g_news == before + 1);
+		CMTask moved;
+		moved = std::move(big);
+		MCHECK(g_news == before + 1);
+		MCHECK(token.use_count() == 2);
+		moved();
+		MCHECK(ran == 2);
+	}
+	MCHECK(token.use_count() == 1);
+	{
+		long before = g_news;
+		CMTask task{ MThrowMove(&ran) };
+		MCHECK(g_news == before + 1);
+		task();
+		MCHECK(ran == 3);
+	}
+	//返回int的沿用CMWork的约定：返回0再执行一次
+	CMThreadPool pool(1);
+	pool.Invoke();
+	std::atomic<int> count(0);
+	CMPromise<int> done;
+	CMFuture<int> future = done.GetFuture();
+	MCHECK(pool.DispatchTask(CMTask([&count, done]() mutable {
+		if (++count < 5)
+		{
+			return 0;
+		}
+		done.SetValue(count);
+		return -1;
+	})));
+	MCHECK(future.Get() == 5);
+	pool.Stop();
+}
+
+static void TestThen()
+{
+	CMThreadPool pool(2);
+	pool.Invoke();
+	CMFuture<int> result = pool.Submit([]() { return 20; })
+		.Then([](int& v) { return v + 1; })
+		.Then([](int& v) { return v * 2; });
+	MCHECK(result.Get() == 42);
+	MCHECK(result.IsReady() && !result.IsBroken());
+	//已经有结果了再接：在当前线程马上执行
+	std::thread::id where;
+	CMFuture<CMVoid> after = result.Then([&where](int& v) { where = std::this_thread::get_id(); });
+	MCHECK(after.IsReady());
+	MCHECK(where == std::this_thread::get_id());
+	//void任务
+	std::atomic<int> ran(0);
+	CMFuture<CMVoid> empty = pool.Submit([&ran]() { ran++; });
+	empty.Get();
+	MCHECK(ran == 1);
+	pool.Stop();
+}
+
+//没启动就关闭：排着的任务丢掉，future都broken，后面接的也broken，func不执行
+static void TestStopBreaks()
+{
+	std::atomic<int> ran(0);
+	CMThreadPool pool(1);
+	CMFuture<int> first = pool.Submit([&ran]() { ran++; return 1; });
+	CMFuture<int> chained = pool.Submit([&ran]() { ran++; return 2; }).Then([&ran](int& v) { ran++; return v; });
+	MCHECK(first.IsValid() && !first.IsReady());
+	std::atomic<bool> woke(false);
+	std::thread waiter([&first, &woke]() {
+		first.Get();
+		woke = true;
+	});
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	MCHECK(!woke);
+	pool.Stop();
+	waiter.join();
+	MCHECK(woke);
+	MCHECK(first.IsReady() && first.IsBroken());
+	MCHECK(chained.IsBroken());
+	MCHECK(chained.Get() == 0);
+	MCHECK(ran == 0);
+	//关闭以后提交：拒绝，返回无效的future
+	CMFuture<int> late = pool.Submit([]() { return 3; });
+	MCHECK(!late.IsValid());
+	//broken以后再接
+	CMFuture<int> next = first.Then([&ran](int& v) { ran++; return v; });
+	MCHECK(next.IsBroken());
+	MCHECK(ran == 0);
+}
+
+//promise没设置结果就没了：接在后面的lambda抓的东西要释放(以前后续抓着自己的状态，谁也释放不了)
+static void TestNoLeak()
+{
+	std::shared_ptr<int> token = std::make_shared<int>(0);
+	std::weak_ptr<int> weak = token;
+	{
+		CMPromise<int> promise;
+		CMFuture<int> future = promise.GetFuture();
+		future.Then([token](int& v) { return v + *token; }).Then([token](int& v) { return v; });
+		token.reset();
+		MCHECK(!weak.expired());
+	}
+	MCHECK(weak.expired());
+	//设置了结果的链也一样
+	token = std::make_shared<int>(1);
+	weak = token;
+	{
+		CMPromise<int> promise;
+		CMFuture<int> tail = promise.GetFuture().Then([token](int& v) { return v + *token; });
+		token.reset();
+		promise.SetValue(1);
+		MCHECK(tail.Get() == 2);
+	}
+	MCHECK(weak.expired());
+}
+
+int main()
+{
+	TestInlineHeap();
+	TestThen();
+	TestStopBreaks();
+	TestNoLeak();
+	return MTestResult("MTaskTest");
+}
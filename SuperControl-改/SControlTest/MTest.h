@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdio>
+#include <chrono>
+
+//测试用的检查：失败只打印位置和条件，接着往下跑，最后main返回失败个数(ctest看返回值)
+inline int& MTestFailed()
+{
+	static int failed = 0;
+	return failed;
+}
+
+#define MCHECK(cond) \
+	do \
+	{ \
+		if (!(cond)) \
+		{ \
+			printf("%s(%d): check failed: %s\n", __FILE__, __LINE__, #cond); \
+			MTestFailed()++; \
+		} \
+	} while (0)
+
+inline int MTestResult(const char* name)
+{
+	printf("%s: %s\n", name, (MTestFailed() == 0) ? "ok" : "FAILED");
+	return MTestFailed();
+}
+
+inline double MTestNowMs()
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
@@ -0,0 +1,325 @@
+#include "pch.h"
+#include "MThread.h"
+#include "MTest.h"
+#include <thread>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+//CMThreadPool的伸缩：排队时间超过目标就加线程(不超过上限)，负载没了空闲超时后退回下限；
+//加减次数和峰值记在统计里；没设伸缩的线程池怎么排队都不加线程
+//调度统计：直方图的分桶和分位数、按标签记的执行时长和拒绝次数、DumpTrace写出来的行格式
+
+//最多等ms毫秒，直到cond成立
+template<typename Cond>
+static bool WaitFor(Cond cond, int ms = 3000)
+{
+	double start = MTestNowMs();
+	while (!cond())
+	{
+		if (MTestNowMs() - start > ms)
+		{
+			return false;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	return true;
+}
+
+//每毫秒来一个要执行3毫秒的任务，一个线程肯定排不过来；返回执行完的个数
+static int Load(CMThreadPool& pool, int count)
+{
+	std::atomic<int> done(0);
+	int dispatched = 0;
+	for (int i = 0; i < count; i++)
+	{
+		if (pool.DispatchTask(CMTask([&done]() {
+			std::this_thread::sleep_for(std::chrono::milliseconds(3));
+			done++;
+		})))
+		{
+			dispatched++;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	WaitFor([&done, dispatched]() { return done == dispatched; }, 10000);
+	return done;
+}
+
+//1到4个线程，排队目标5毫秒，空闲200毫秒退出：压上去涨到4个，停了以后退回1个
+static void TestElastic()
+{
+	CMThreadPool pool(1);
+	pool.SetElastic(1, 4, 5, 200);
+	pool.Invoke();
+	MPoolStats stats = pool.Stats();
+	MCHECK((stats.threads == 1) && (stats.peak == 1) && (stats.grows == 0));
+	MCHECK(Load(pool, 400) == 400);
+	stats = pool.Stats();
+	printf("elastic under load: threads %d peak %d grows %llu slow waits %llu\n",
+		(int)stats.threads, (int)stats.peak, stats.grows, stats.slowWaits);
+	MCHECK(stats.peak == 4);
+	MCHECK(stats.grows == 3);
+	MCHECK(stats.slowWaits > 0);
+	//刚忙完还没到空闲超时，线程不退
+	MCHECK(stats.threads == 4);
+	MCHECK(stats.shrinks == 0);
+	double start = MTestNowMs();
+	MCHECK(WaitFor([&pool]() { return pool.Stats().threads == 1; }));
+	stats = pool.Stats();
+	printf("elastic idle: back to %d thread after %.0f ms, shrinks %llu\n", (int)stats.threads, MTestNowMs() - start, stats.shrinks);
+	MCHECK(MTestNowMs() - start > 100);
+	MCHECK((stats.shrinks == 3) && (stats.peak == 4) && (stats.idle == 1));
+	//退掉的线程下次加线程时回收，再压一次还能涨上去
+	MCHECK(Load(pool, 200) == 200);
+	stats = pool.Stats();
+	MCHECK((stats.peak == 4) && (stats.grows > 3) && (stats.threads <= 4));
+	MCHECK(pool.Stop());
+	MCHECK(pool.Stats().threads == 0);
+}
+
+//固定大小：同样的负载只是排队，不加线程
+static void TestFixed()
+{
+	CMThreadPool pool(1);
+	pool.Invoke();
+	MCHECK(Load(pool, 100) == 100);
+	MPoolStats stats = pool.Stats();
+	MCHECK((stats.threads == 1) && (stats.peak == 1) && (stats.grows == 0) && (stats.shrinks == 0));
+	MCHECK(stats.slowWaits == 0);
+	pool.Stop();
+}
+
+//分桶：0单独一个桶，第i个桶放[2^(i-1), 2^i)，太大的都进最后一个桶
+static void TestHistogramBuckets()
+{
+	CMHistogram hist;
+	unsigned long long values[] = { 0, 1, 2, 3, 4, 1000, 1023, 1024, 1ULL << 40 };
+	int buckets[] = { 0, 1, 2, 2, 3, 10, 10, 11, CMHistogram::BUCKETS - 1 };
+	unsigned long long sum = 0;
+	for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+	{
+		hist.Record(values[i]);
+		sum += values[i];
+	}
+	CMHistogram::MSnapshot snap = hist.Snapshot();
+	unsigned long long want[CMHistogram::BUCKETS] = {};
+	for (size_t i = 0; i < sizeof(buckets) / sizeof(buckets[0]); i++)
+	{
+		want[buckets[i]]++;
+	}
+	for (int i = 0; i < CMHistogram::BUCKETS; i++)
+	{
+		MCHECK(snap.buckets[i] == want[i]);
+	}
+	MCHECK((snap.count == 9) && (snap.sum == sum) && (snap.max == (1ULL << 40)));
+}
+
+//分位数取所在桶的上界，不超过最大值；空的返回0
+static void TestHistogramPercentile()
+{
+	CMHistogram empty;
+	MCHECK(empty.Snapshot().Percentile(0.5) == 0);
+	//95个10微秒(桶[8,16))，5个1000微秒(桶[512,1024))
+	CMHistogram hist;
+	for (int i = 0; i < 95; i++)
+	{
+		hist.Record(10);
+	}
+	for (int i = 0; i < 5; i++)
+	{
+		hist.Record(1000);
+	}
+	CMHistogram::MSnapshot snap = hist.Snapshot();
+	MCHECK(snap.Percentile(0.5) == 16);
+	MCHECK(snap.Percentile(0.94) == 16);
+	MCHECK(snap.Percentile(0.95) == 1000);
+	MCHECK(snap.Percentile(0.99) == 1000);
+	MCHECK(snap.Percentile(1.0) == 1000);
+	//只有0
+	CMHistogram zero;
+	zero.Record(0);
+	MCHECK(zero.Snapshot().Percentile(0.99) == 0);
+	//几个线程一起记，一个不丢
+	CMHistogram shared;
+	std::vector<std::thread> threads;
+	for (int t = 0; t < 4; t++)
+	{
+		threads.emplace_back([&shared, t]() {
+			for (int i = 0; i < 10000; i++)
+			{
+				shared.Record((unsigned long long)(t * 10000 + i));
+			}
+		});
+	}
+	for (size_t t = 0; t < threads.size(); t++)
+	{
+		threads[t].join();
+	}
+	snap = shared.Snapshot();
+	MCHECK((snap.count == 40000) && (snap.sum == 40000ULL * 39999 / 2) && (snap.max == 39999));
+}
+
+//按标签统计：执行时长进对应标签的直方图，被拒绝的记在任务的标签上；执行中的线程算busy
+static void TestSchedStats()
+{
+	CMThreadPool pool(1, 2);
+	MCHECK(pool.DispatchTask(CMTask([]() { std::this_thread::sleep_for(std::chrono::milliseconds(2)); }), MP_NORMAL, MTAG_FILE));
+	MCHECK(pool.DispatchTask(CMTask([]() { std::this_thread::sleep_for(std::chrono::milliseconds(2)); }), MP_NORMAL, MTAG_FILE));
+	//队列满了：普通的拒绝，交互输入照样收
+	MCHECK(!pool.DispatchTask(CMTask([]() {}), MP_NORMAL, MTAG_SCREEN));
+	MCHECK(pool.DispatchTask(CMTask([]() {}), MP_HIGH, MTAG_INPUT));
+	MSchedStats stats = pool.SchedStats();
+	MCHECK((stats.rejected[MTAG_SCREEN] == 1) && (stats.rejected[MTAG_FILE] == 0) && (stats.pool.rejected == 1));
+	MCHECK(stats.pool.queued == 3);
+	pool.Invoke();
+	MCHECK(WaitFor([&pool]() { return pool.Stats().queued == 0; }));
+	std::atomic<bool> release(false), running(false);
+	MCHECK(pool.DispatchTask(CMTask([&release, &running]() {
+		running = true;
+		while (!release)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}), MP_NORMAL, MTAG_NET));
+	MCHECK(WaitFor([&running]() { return running.load(); }));
+	stats = pool.SchedStats();
+	MCHECK((stats.pool.busy == 1) && (stats.pool.idle == 0) && (stats.pool.queued == 0));
+	release = true;
+	MCHECK(WaitFor([&pool]() { return pool.SchedStats().run[MTAG_NET].count == 1; }));
+	stats = pool.SchedStats();
+	MCHECK((stats.run[MTAG_FILE].count == 2) && (stats.wait[MTAG_FILE].count == 2));
+	MCHECK((stats.run[MTAG_INPUT].count == 1) && (stats.run[MTAG_SCREEN].count == 0));
+	//2毫秒的任务落在[2048,4096)或者更大的桶里
+	MCHECK((stats.run[MTAG_FILE].Percentile(0.5) >= 2048) && (stats.run[MTAG_FILE].max >= 2000));
+	MCHECK(stats.pool.busy == 0);
+	pool.Stop();
+}
+
+//一行行按空格拆开
+static std::vector<std::vector<std::string> > ReadLines(const char* path)
+{
+	std::vector<std::vector<std::string> > lines;
+	FILE* file = fopen(path, "r");
+	if (file == NULL)
+	{
+		return lines;
+	}
+	char buf[1024];
+	while (fgets(buf, sizeof(buf), file) != NULL)
+	{
+		std::vector<std::string> words;
+		for (char* word = strtok(buf, " \n"); word != NULL; word = strtok(NULL, " \n"))
+		{
+			words.push_back(word);
+		}
+		lines.push_back(words);
+	}
+	fclose(file);
+	return lines;
+}
+
+//DumpTrace：每个线程池一行"时间 pool 域.编号 键 值..."，用过的标签一行"时间 tag 域.编号.标签 wait ... run ..."
+//值和SchedStats一样；文件是追加写的
+static void TestDumpTrace()
+{
+	CMThreadPool pool(1, 1);
+	pool.SetDomain(MD_BULK);
+	pool.Invoke();
+	for (int i = 0; i < 3; i++)
+	{
+		MCHECK(pool.DispatchTask(CMTask([]() {}), MP_HIGH, MTAG_FILE));
+	}
+	MCHECK(WaitFor([&pool]() { return pool.SchedStats().run[MTAG_FILE].count == 3; }));
+	//停了以后再投：拒绝记在input上
+	pool.Stop();
+	MCHECK(!pool.DispatchTask(CMTask([]() {}), MP_HIGH, MTAG_INPUT));
+	MSchedStats stats = pool.SchedStats();
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/MThreadPoolTest.%d.trace", (int)getpid());
+	remove(path);
+	MCHECK(CMThreadPool::DumpTrace(path));
+	MCHECK(CMThreadPool::DumpTrace(path));
+	std::vector<std::vector<std::string> > lines = ReadLines(path);
+	remove(path);
+	MCHECK(!CMThreadPool::DumpTrace("/nonexistent/dir/trace"));
+
+	//域.编号：只有这一个线程池活着，编号从pool行里取
+	std::string domain = std::string(CMDomain::Name(MD_BULK)) + ".";
+	std::string name;
+	int poolLines = 0, fileLines = 0, inputLines = 0;
+	for (size_t i = 0; i < lines.size(); i++)
+	{
+		std::vector<std::string>& words = lines[i];
+		MCHECK(words.size() >= 3);
+		if (words.size() < 3)
+		{
+			continue;
+		}
+		MCHECK(atoll(words[0].c_str()) > 0);
+		MCHECK((words[1] == "pool") || (words[1] == "tag"));
+		if (words[2].compare(0, domain.size(), domain) != 0)
+		{
+			continue;
+		}
+		if (words[1] == "pool")
+		{
+			MCHECK(name.empty() || (name == words[2] + "."));
+			name = words[2] + ".";
+			const char* keys[] = { "threads", "busy", "queued", "peak", "grows", "shrinks", "rejected" };
+			MCHECK(words.size() == 3 + 2 * 7);
+			for (int k = 0; (k < 7) && (words.size() == 3 + 2 * 7); k++)
+			{
+				MCHECK(words[3 + 2 * k] == keys[k]);
+			}
+			if (words.size() == 17)
+			{
+				MCHECK((words[4] == "0") && (words[10] == "1") && (words[16] == "1"));
+			}
+			poolLines++;
+			continue;
+		}
+		//wait和run各5个键值，最后是rejected
+		MCHECK(words.size() == 3 + 11 + 11 + 2);
+		if (words.size() != 27)
+		{
+			continue;
+		}
+		MCHECK((words[3] == "wait") && (words[4] == "n") && (words[6] == "p50") && (words[8] == "p95") && (words[10] == "p99") && (words[12] == "max"));
+		MCHECK((words[14] == "run") && (words[15] == "n") && (words[25] == "rejected"));
+		if (words[2] == name + "file")
+		{
+			const CMHistogram::MSnapshot& run = stats.run[MTAG_FILE];
+			MCHECK(words[5] == std::to_string(stats.wait[MTAG_FILE].count));
+			MCHECK(words[16] == std::to_string(run.count));
+			MCHECK(words[18] == std::to_string(run.Percentile(0.5)));
+			MCHECK(words[20] == std::to_string(run.Percentile(0.95)));
+			MCHECK(words[24] == std::to_string(run.max));
+			MCHECK(words[26] == "0");
+			fileLines++;
+		}
+		else if (words[2] == name + "input")
+		{
+			MCHECK((words[16] == "0") && (words[26] == "1"));
+			inputLines++;
+		}
+		else
+		{
+			//没用过的标签不写
+			MCHECK(false);
+		}
+	}
+	//追加写了两次
+	MCHECK((poolLines == 2) && (fileLines == 2) && (inputLines == 2));
+}
+
+int main()
+{
+	TestElastic();
+	TestFixed();
+	TestHistogramBuckets();
+	TestHistogramPercentile();
+	TestSchedStats();
+	TestDumpTrace();
+	return MTestResult("MThreadPoolTest");
+}
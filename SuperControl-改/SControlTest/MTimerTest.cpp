@@ -0,0 +1,194 @@
+#include "pch.h"
+#include "MTimer.h"
+#include "MTest.h"
+#include <thread>
+#include <memory>
+
+//定时器：时间轮各层往下摊、堆里的挪进时间轮、取消、slack合并、线程池拒绝后周期的接着排
+//用手动拨的时钟，几个小时以后的定时器也能马上测到
+
+//手动时钟：拨到某个刻度后叫醒驱动线程；要在定时器之前定义，定时器析构时还会看时间
+class CFakeClock
+{
+public:
+	std::atomic<long long>	now;
+	CMTimer*				timer;
+	CFakeClock() : now(0), timer(NULL)
+	{
+	}
+	void Attach(CMTimer& t)
+	{
+		timer = &t;
+		timer->SetClock([this]() { return now.load(); });
+	}
+	void Set(long long tick)
+	{
+		now = tick;
+		timer->Poke();
+	}
+};
+
+//最多等ms毫秒(真实时间)，直到cond成立
+template<typename Cond>
+static bool WaitFor(Cond cond, int ms = 2000)
+{
+	double start = MTestNowMs();
+	while (!cond())
+	{
+		if (MTestNowMs() - start > ms)
+		{
+			return false;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	return true;
+}
+
+//拨到at-1不执行，拨到at执行，执行时看到的时钟正好是at
+static void CheckFires(CFakeClock& clock, std::atomic<long long>& fired, long long at)
+{
+	clock.Set(at - 1);
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	MCHECK(fired == -1);
+	clock.Set(at);
+	MCHECK(WaitFor([&fired]() { return fired != -1; }));
+	MCHECK(fired == at);
+}
+
+//第0层、第1层、第2层、第3层和堆里各放一个，按顺序拨过去：不早不晚
+static void TestLevels()
+{
+	CFakeClock clock;
+	CMTimer timer;
+	clock.Attach(timer);
+	long long delays[] = { 10, 100, 5000, 300000, 20000000 };
+	const int COUNT = sizeof(delays) / sizeof(delays[0]);
+	std::atomic<long long> fired[COUNT];
+	for (int i = 0; i < COUNT; i++)
+	{
+		fired[i] = -1;
+		std::atomic<long long>* slot = &fired[i];
+		timer.After((int)delays[i], CMTask([slot, &clock]() { *slot = clock.now.load(); }));
+	}
+	MCHECK(timer.Count() == COUNT);
+	for (int i = 0; i < COUNT; i++)
+	{
+		CheckFires(clock, fired[i], delays[i]);
+	}
+	MCHECK(WaitFor([&timer]() { return timer.Count() == 0; }));
+}
+
+//周期定时器跨过层的边界也是一个周期一次
+static void TestPeriodic()
+{
+	CFakeClock clock;
+	CMTimer timer;
+	clock.Attach(timer);
+	std::atomic<int> count(0);
+	timer.Every(1000, CMTask([&count]() { count++; return 0; }));
+	for (int i = 1; i <= 10; i++)
+	{
+		clock.Set(i * 1000 - 1);
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		MCHECK(count == i - 1);
+		clock.Set(i * 1000);
+		MCHECK(WaitFor([&count, i]() { return count == i; }));
+	}
+	MCHECK(timer.Count() == 1);
+}
+
+//取消：时间轮里的、堆里的、周期的都不再执行
+static void TestCancel()
+{
+	CFakeClock clock;
+	CMTimer timer;
+	clock.Attach(timer);
+	std::atomic<int> count(0);
+	CMTimer::TimerId near = timer.After(50, CMTask([&count]() { count++; }));
+	CMTimer::TimerId far = timer.After(20000000, CMTask([&count]() { count++; }));
+	CMTimer::TimerId every = timer.Every(10, CMTask([&count]() { count++; return 0; }));
+	MCHECK(timer.Cancel(near));
+	MCHECK(timer.Cancel(far));
+	MCHECK(timer.Cancel(every));
+	MCHECK(!timer.Cancel(near));
+	MCHECK(timer.Count() == 0);
+	clock.Set(100);
+	clock.Set(30000000);
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	MCHECK(count == 0);
+}
+
+//slack：10毫秒和60毫秒后到期的，slack都是100，一起在100执行
+static void TestSlack()
+{
+	CFakeClock clock;
+	CMTimer timer;
+	clock.Attach(timer);
+	std::atomic<long long> first(-1), second(-1);
+	timer.After(10, CMTask([&first, &clock]() { first = clock.now.load(); }), NULL, 100);
+	timer.After(60, CMTask([&second, &clock]() { second = clock.now.load(); }), NULL, 100);
+	clock.Set(60);
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	MCHECK((first == -1) && (second == -1));
+	clock.Set(100);
+	MCHECK(WaitFor([&first, &second]() { return (first != -1) && (second != -1); }));
+	MCHECK((first == 100) && (second == 100));
+}
+
+//线程池排满了：一次性的MP_NORMAL被丢掉，周期的排下一次，MP_HIGH照样投进去
+static void TestRejected()
+{
+	CFakeClock clock;
+	CMTimer timer;
+	clock.Attach(timer);
+	CMThreadPool pool(1, 1);
+	std::atomic<int> filler(0), once(0), every(0), high(0);
+	MCHECK(pool.DispatchTask(CMTask([&filler]() { filler++; })));
+	timer.After(10, CMTask([&once]() { once++; }), &pool);
+	CMTimer::TimerId id = timer.Every(10, CMTask([&every]() { every++; return 0; }), &pool);
+	timer.After(10, CMTask([&high]() { high++; }), &pool, 0, MP_HIGH);
+	clock.Set(10);
+	MCHECK(WaitFor([&timer]() { return timer.Count() == 2; }));
+	pool.Invoke();
+	MCHECK(WaitFor([&filler, &high]() { return (filler == 1) && (high == 1); }));
+	MCHECK(timer.Count() == 1);
+	MCHECK(every == 0);
+	clock.Set(20);
+	MCHECK(WaitFor([&every]() { return every == 1; }));
+	MCHECK(once == 0);
+	//线程池析构前取消用它的定时器
+	MCHECK(timer.Cancel(id));
+	pool.Stop();
+}
+
+//Cancel返回以后定时器不再碰线程池：马上析构线程池，反复做(ASan/TSan下跑)
+static void TestCancelThenDestroy()
+{
+	CMTimer timer;
+	std::atomic<int> count(0);
+	for (int i = 0; i < 2000; i++)
+	{
+		std::unique_ptr<CMThreadPool> pool(new CMThreadPool(1));
+		pool->Invoke();
+		CMTimer::TimerId id = timer.Every(1, CMTask([&count]() { count++; return 0; }), pool.get());
+		if ((i % 4) != 0)
+		{
+			std::this_thread::sleep_for(std::chrono::microseconds(500 * (i % 4)));
+		}
+		timer.Cancel(id);
+		pool.reset();
+	}
+	MCHECK(timer.Count() == 0);
+	printf("cancel then destroy: %d runs\n", count.load());
+}
+
+int main()
+{
+	TestLevels();
+	TestPeriodic();
+	TestCancel();
+	TestSlack();
+	TestRejected();
+	TestCancelThenDestroy();
+	return MTestResult("MTimerTest");
+}
@@ -0,0 +1,172 @@
+#include "UDPPassNetWork.h"
+#include "MNetClient.h"
+
+//打洞协调：A发104，两边收到同一个序号的105；B换过UDP端口(顺序分配型NAT)，A拿到的105里带端口预测；
+//A登记时带的局域网地址转给B。再按客户端ThreadUDPPass的节奏(PunchPort/PunchSeq)探测一个模拟的NAT：
+//B的新映射端口在预测范围里，第一轮就打通；不预测只打登记的端口，打不通
+//单节点，都在本机跑，端口按进程号错开
+
+//和UDPPassNetWork.h里的PUNCH_*一样
+enum
+{
+	START_DELAY		= 300,
+	PROBE_COUNT		= 10,
+	PROBE_INTERVAL	= 20,
+	PORT_RANGE		= 4,
+};
+
+static unsigned short g_base = 0;
+
+static bool ReadPunch(CPacket& pack, MPunchInfo& info)
+{
+	if ((pack.nCmd != 105) || (pack.sData.size() < sizeof(MPunchInfo)))
+	{
+		return false;
+	}
+	memcpy(&info, pack.sData.c_str(), sizeof(MPunchInfo));
+	return true;
+}
+
+static int UdpSocket(unsigned short port)
+{
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	sockaddr_in addr{};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	addr.sin_port = htons(port);
+	if (bind(sock, (sockaddr*)&addr, sizeof(addr)) != 0)
+	{
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+//对端收到的探测包(123)原样回应答(124)，和客户端DealPunch一样
+static void Answer(int sock, unsigned long long session)
+{
+	char data[256];
+	sockaddr_in from{};
+	socklen_t len = sizeof(from);
+	ssize_t ret = 0;
+	while ((ret = recvfrom(sock, data, sizeof(data), MSG_DONTWAIT, (sockaddr*)&from, &len)) > 0)
+	{
+		int size = (int)ret;
+		CPacket pack((unsigned char*)data, size);
+		if ((size <= 0) || (pack.nCmd != 123) || (pack.sData.size() < sizeof(MPunchProbe)))
+		{
+			continue;
+		}
+		MPunchProbe* pProbe = (MPunchProbe*)pack.sData.c_str();
+		if (pProbe->session == session)
+		{
+			CPacket ack(124, (unsigned char*)pack.sData.c_str(), (unsigned int)pack.sData.size());
+			sendto(sock, ack.Data(), ack.Size(), 0, (sockaddr*)&from, len);
+		}
+		len = sizeof(from);
+	}
+}
+
+//按ThreadUDPPass的节奏探测：每轮把预测范围里的端口都打一遍，等一个间隔；
+//peer是模拟的对端NAT新映射，只有它会应答。打通返回应答里的序号，打不通返回-1
+static int Probe(int sock, const MPunchInfo& info, unsigned long long self, int peer)
+{
+	sockaddr_in addr{};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr(info.peer.ip);
+	MPunchProbe probe{};
+	probe.session = info.session;
+	probe.id = self;
+	for (int i = 0; i < info.probeCount; i++)
+	{
+		for (int p = 0; p <= info.portRange; p++)
+		{
+			addr.sin_port = htons(PunchPort(info, p));
+			probe.seq = PunchSeq(info, i, p);
+			CPacket pack(123, (unsigned char*)&probe, sizeof(MPunchProbe));
+			sendto(sock, pack.Data(), pack.Size(), 0, (sockaddr*)&addr, sizeof(addr));
+		}
+		Answer(peer, info.session);
+		pollfd pfd{ sock, POLLIN, 0 };
+		char data[256];
+		if ((poll(&pfd, 1, info.probeInterval) > 0) && (recv(sock, data, sizeof(data), 0) > 0))
+		{
+			int size = sizeof(data);
+			CPacket ack((unsigned char*)data, size);
+			if ((ack.nCmd == 124) && (ack.sData.size() >= sizeof(MPunchProbe)))
+			{
+				return ((MPunchProbe*)ack.sData.c_str())->seq;
+			}
+		}
+	}
+	return -1;
+}
+
+static void TestPunch()
+{
+	unsigned short tcpPort = g_base, udpPort = g_base + 1;
+	UDPPassNetWork net("127.0.0.1", tcpPort, udpPort, 0);
+	net.Invoke();
+	const unsigned long long idA = 501, idB = 502;
+	//A带上局域网地址登记
+	MLocalAddrs local{};
+	strcpy(local.ip[0], "192.168.1.5");
+	local.port = 5000;
+	local.count = 1;
+	CMNetClient clientA, clientB, clientB2;
+	MCHECK(clientA.Connect(tcpPort, udpPort, g_base + 5) && clientA.Register(idA, &local));
+	MCHECK(clientB.Connect(tcpPort, udpPort, g_base + 10) && clientB.Register(idB));
+	CPacket pack;
+	MCHECK(clientA.RecvCmd(102, pack, 2000) && clientB.RecvCmd(102, pack, 2000));
+	//B的NAT给下一条映射分了+2的端口，又发了一次UDP的101：服务器记下步长2
+	MCHECK(clientB2.Connect(tcpPort, udpPort, g_base + 12) && clientB2.Hello(idB));
+
+	ConnectIds pair{ idA, idB };
+	CPacket request(104, (unsigned char*)&pair, sizeof(pair));
+	MCHECK(clientA.Send(request));
+	MPunchInfo infoA(MUserInfo(CMNetClient::Ip(), 0)), infoB(MUserInfo(CMNetClient::Ip(), 0));
+	MCHECK(clientA.RecvCmd(105, pack, 2000) && ReadPunch(pack, infoA));
+	MCHECK(clientB.RecvCmd(105, pack, 2000) && ReadPunch(pack, infoB));
+	MCHECK((infoA.session == infoB.session) && (infoA.session != 0));
+	MCHECK((infoA.peer.id == idB) && (infoB.peer.id == idA));
+	//两边的节奏一样，同时开始
+	MCHECK((infoA.startDelay == START_DELAY) && (infoB.startDelay == infoA.startDelay));
+	MCHECK((infoA.probeCount == PROBE_COUNT) && (infoB.probeCount == infoA.probeCount));
+	MCHECK((infoA.probeInterval == PROBE_INTERVAL) && (infoB.probeInterval == infoA.probeInterval));
+	//B的地址是最后一次登记的端口，带步长预测；A的端口没变过，只探测登记的端口
+	//MUserInfo的port是short，大于32767的端口要按无符号比
+	MCHECK((unsigned short)infoA.peer.port == g_base + 12);
+	MCHECK((infoA.portRange == PORT_RANGE) && (infoA.portStep == 2));
+	MCHECK(((unsigned short)infoB.peer.port == g_base + 5) && (infoB.portRange == 0) && (infoB.portStep == 0));
+	//局域网地址：B拿到A的，A拿不到(B没带)
+	MCHECK((infoB.peerLocal.count == 1) && (infoB.peerLocal.port == 5000) && (strcmp(infoB.peerLocal.ip[0], "192.168.1.5") == 0));
+	MCHECK(infoA.peerLocal.count == 0);
+	for (int p = 0; p <= infoA.portRange; p++)
+	{
+		MCHECK(PunchPort(infoA, p) == g_base + 12 + p * 2);
+	}
+	MCHECK((PunchSeq(infoA, 0, 0) == 0) && (PunchSeq(infoA, 1, 0) == infoA.portRange + 1));
+
+	//模拟B的NAT：发往A的新映射是+14。登记的+12只对服务器开(对称型NAT)，A打过去没有应答
+	int sockA = UdpSocket(g_base + 6);
+	int natB = UdpSocket(g_base + 14);
+	MCHECK((sockA != -1) && (natB != -1));
+	double start = MTestNowMs();
+	int seq = Probe(sockA, infoA, idA, natB);
+	printf("predicted probe seq %d after %.0f ms\n", seq, MTestNowMs() - start);
+	MCHECK(seq == PunchSeq(infoA, 0, 1));
+	//不预测：每轮只打登记的端口，探测完都打不通
+	MPunchInfo plain = infoA;
+	plain.portRange = 0;
+	plain.portStep = 0;
+	MCHECK(Probe(sockA, plain, idA, natB) == -1);
+	close(sockA);
+	close(natB);
+}
+
+int main()
+{
+	g_base = (unsigned short)(30000 + (getpid() % 500) * 20);
+	TestPunch();
+	return MTestResult("PunchTest");
+}
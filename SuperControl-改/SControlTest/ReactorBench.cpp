@@ -0,0 +1,220 @@
+#include "MReactor.h"
+#include "MTest.h"
+#include <thread>
+#include <cstdlib>
+#include <sys/resource.h>
+
+//协程反应器压测，都在一个反应器线程里跑：
+//汇合：N个协程同时活着(先都睡100毫秒)，两两配对，每轮在汇合点碰一次头，看每秒碰头多少次、每个协程占多少内存
+//回显：C对socketpair，一边回显协程一边客户协程，客户每轮写64字节等回显，看每秒往返多少次
+//用法：ReactorBench [协程数 汇合轮数 回显连接数 回显轮数]，默认100000 10 5000 20；连接数受打开文件数上限限制
+
+//两个协程的汇合点：先到的挂起，后到的把它投递回反应器，自己接着走(都在反应器线程里，不用锁)
+class CMRendezvous
+{
+public:
+	CMReactor*					m_reactor;
+	std::coroutine_handle<>		m_waiting;
+	struct MMeet
+	{
+		CMRendezvous*	m_point;
+		bool await_ready()
+		{
+			if (m_point->m_waiting)
+			{
+				m_point->m_reactor->Post(m_point->m_waiting);
+				m_point->m_waiting = NULL;
+				return true;
+			}
+			return false;
+		}
+		void await_suspend(std::coroutine_handle<> handle)
+		{
+			m_point->m_waiting = handle;
+		}
+		void await_resume() {}
+	};
+	CMRendezvous() : m_reactor(NULL), m_waiting(NULL) {}
+	MMeet Meet()
+	{
+		return MMeet{ this };
+	}
+};
+
+struct MCounters
+{
+	std::atomic<int>		alive;
+	std::atomic<int>		peak;
+	std::atomic<int>		done;
+	std::atomic<long long>	meets;
+	std::atomic<long long>	failed;
+};
+
+//当前进程的常驻内存(KB)
+static long RssKb()
+{
+	long pages = 0, rss = 0;
+	FILE* file = fopen("/proc/self/statm", "r");
+	if (file != NULL)
+	{
+		if (fscanf(file, "%ld %ld", &pages, &rss) != 2)
+		{
+			rss = 0;
+		}
+		fclose(file);
+	}
+	return rss * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static CMCo<> Meeter(CMReactor* reactor, CMRendezvous* point, int rounds, MCounters* counters)
+{
+	int alive = ++counters->alive;
+	int peak = counters->peak;
+	while ((alive > peak) && !counters->peak.compare_exchange_weak(peak, alive))
+	{
+	}
+	co_await reactor->SleepFor(100);
+	for (int i = 0; i < rounds; i++)
+	{
+		co_await point->Meet();
+		counters->meets++;
+	}
+	counters->alive--;
+	counters->done++;
+}
+
+static void BenchRendezvous(CMReactor& reactor, int count, int rounds)
+{
+	std::vector<CMRendezvous> points(count / 2);
+	for (size_t i = 0; i < points.size(); i++)
+	{
+		points[i].m_reactor = &reactor;
+	}
+	MCounters counters{};
+	long rss = RssKb();
+	double start = MTestNowMs();
+	for (int i = 0; i < count; i++)
+	{
+		reactor.Spawn(Meeter(&reactor, &points[i / 2], rounds, &counters));
+	}
+	double spawned = MTestNowMs();
+	//都睡下了(还没有醒)的时候量内存
+	while ((counters.peak < count) && (MTestNowMs() - start < 30000))
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	long rssPeak = RssKb();
+	while ((counters.done < count) && (MTestNowMs() - start < 60000))
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	double seconds = (MTestNowMs() - start - 100) / 1000;
+	printf("rendezvous: %d coroutines, peak alive %d, spawn %.0f ms, %.0f bytes each, %lld meets in %.2f s = %.0f meets/s\n",
+		count, counters.peak.load(), spawned - start, (rssPeak - rss) * 1024.0 / count,
+		counters.meets.load(), seconds, counters.meets / seconds);
+}
+
+static CMCo<> EchoServer(CMReactor* reactor, int fd)
+{
+	char buf[256];
+	while (true)
+	{
+		ssize_t ret = co_await reactor->AsyncRead(fd, buf, sizeof(buf));
+		if ((ret <= 0) || (co_await reactor->AsyncWrite(fd, buf, ret) != ret))
+		{
+			break;
+		}
+	}
+	reactor->Close(fd);
+}
+
+static CMCo<> EchoClient(CMReactor* reactor, int fd, int rounds, MCounters* counters)
+{
+	char msg[64], buf[64];
+	memset(msg, 'e', sizeof(msg));
+	for (int i = 0; i < rounds; i++)
+	{
+		if (co_await reactor->AsyncWrite(fd, msg, sizeof(msg)) != (ssize_t)sizeof(msg))
+		{
+			counters->failed++;
+			break;
+		}
+		size_t got = 0;
+		while (got < sizeof(buf))
+		{
+			ssize_t ret = co_await reactor->AsyncRead(fd, buf + got, sizeof(buf) - got);
+			if (ret <= 0)
+			{
+				break;
+			}
+			got += (size_t)ret;
+		}
+		if (got != sizeof(buf))
+		{
+			counters->failed++;
+			break;
+		}
+		counters->meets++;
+	}
+	reactor->Close(fd);
+	counters->done++;
+}
+
+static void BenchEcho(CMReactor& reactor, int connections, int rounds)
+{
+	//打开文件数调到硬上限，每个连接两个fd
+	rlimit limit{};
+	getrlimit(RLIMIT_NOFILE, &limit);
+	limit.rlim_cur = limit.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &limit);
+	int most = (int)std::min<rlim_t>(limit.rlim_cur, 1 << 20) / 2 - 64;
+	if (connections > most)
+	{
+		printf("echo: open file limit %llu, connections %d -> %d\n", (unsigned long long)limit.rlim_cur, connections, most);
+		connections = most;
+	}
+	std::vector<int> clients;
+	for (int i = 0; i < connections; i++)
+	{
+		int fds[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) != 0)
+		{
+			printf("echo: socketpair failed at %d (%d) %s\n", i, errno, strerror(errno));
+			connections = i;
+			break;
+		}
+		reactor.Spawn(EchoServer(&reactor, fds[1]));
+		clients.push_back(fds[0]);
+	}
+	MCounters counters{};
+	double start = MTestNowMs();
+	for (int i = 0; i < connections; i++)
+	{
+		reactor.Spawn(EchoClient(&reactor, clients[i], rounds, &counters));
+	}
+	while ((counters.done < connections) && (MTestNowMs() - start < 120000))
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	double seconds = (MTestNowMs() - start) / 1000;
+	printf("echo: %d connections (%d coroutines), %lld round trips in %.2f s = %.0f round trips/s, failed %lld\n",
+		connections, connections * 2, counters.meets.load(), seconds, counters.meets / seconds, counters.failed.load());
+}
+
+int main(int argc, char* argv[])
+{
+	int count = (argc > 1) ? std::max(atoi(argv[1]), 2) : 100000;
+	int rounds = (argc > 2) ? std::max(atoi(argv[2]), 1) : 10;
+	int connections = (argc > 3) ? std::max(atoi(argv[3]), 1) : 5000;
+	int echoRounds = (argc > 4) ? std::max(atoi(argv[4]), 1) : 20;
+	printf("cores %u\n", std::thread::hardware_concurrency());
+	CMThreadPool pool(1);
+	CMReactor reactor;
+	reactor.Invoke(pool);
+	pool.Invoke();
+	BenchRendezvous(reactor, count, rounds);
+	BenchEcho(reactor, connections, echoRounds);
+	reactor.Stop();
+	pool.Stop();
+	return 0;
+}
@@ -0,0 +1,247 @@
+#include "MReactor.h"
+#include "MTest.h"
+#include <thread>
+#include <string>
+
+//协程反应器：边沿触发下读写都能反复挂起再被叫醒(一个fd上同时等读和等写)；
+//别的协程还在等IO时Close，等的协程按ECANCELED返回；还有协程在睡的时候Stop，定时器都取消、协程都销毁
+
+//最多等ms毫秒，直到cond成立
+template<typename Cond>
+static bool WaitFor(Cond cond, int ms = 3000)
+{
+	double start = MTestNowMs();
+	while (!cond())
+	{
+		if (MTestNowMs() - start > ms)
+		{
+			return false;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	return true;
+}
+
+static char Pattern(size_t i)
+{
+	return (char)(i % 251);
+}
+
+//读满want字节，内容要是Pattern；读到的字节数放在got里，出错或对端关闭时提前结束
+static CMCo<> ReadAll(CMReactor* reactor, int fd, size_t want, std::atomic<long long>* got, std::atomic<bool>* bad, std::atomic<bool>* done)
+{
+	char buf[4096];
+	size_t total = 0;
+	while (total < want)
+	{
+		ssize_t ret = co_await reactor->AsyncRead(fd, buf, sizeof(buf));
+		if (ret <= 0)
+		{
+			break;
+		}
+		for (ssize_t i = 0; i < ret; i++)
+		{
+			if (buf[i] != Pattern(total + i))
+			{
+				*bad = true;
+			}
+		}
+		total += (size_t)ret;
+		*got = (long long)total;
+	}
+	*done = true;
+}
+
+static CMCo<> WriteAll(CMReactor* reactor, int fd, const std::string* data, std::atomic<long long>* result)
+{
+	ssize_t ret = co_await reactor->AsyncWrite(fd, data->data(), data->size());
+	*result = ret;
+}
+
+//EPOLLET只在状态变化时通知一次：对方分很多次慢慢写，读协程每次读空以后都要能再被叫醒；
+//同一个fd上写协程写满缓冲区挂起，对方慢慢读，写协程要接着写完
+static void TestEdgeRearm(CMReactor& reactor)
+{
+	int fds[2];
+	MCHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+	int size = 4096;
+	setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	MCHECK(CMReactor::SetNonBlock(fds[0]));
+	const size_t IN_BYTES = 64 * 1024, OUT_BYTES = 1024 * 1024;
+	std::string out(OUT_BYTES, 0);
+	for (size_t i = 0; i < OUT_BYTES; i++)
+	{
+		out[i] = Pattern(i);
+	}
+	std::atomic<long long> got(0), written(-2);
+	std::atomic<bool> bad(false), done(false);
+	reactor.Spawn(ReadAll(&reactor, fds[0], IN_BYTES, &got, &bad, &done));
+	reactor.Spawn(WriteAll(&reactor, fds[0], &out, &written));
+	//对方：一个线程每次写1000字节停1毫秒，一个线程每次读4K停一下
+	std::thread writer([&fds, IN_BYTES]() {
+		char chunk[1000];
+		for (size_t sent = 0; sent < IN_BYTES; )
+		{
+			size_t len = std::min(sizeof(chunk), IN_BYTES - sent);
+			for (size_t i = 0; i < len; i++)
+			{
+				chunk[i] = Pattern(sent + i);
+			}
+			ssize_t ret = write(fds[1], chunk, len);
+			if (ret <= 0)
+			{
+				break;
+			}
+			sent += (size_t)ret;
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	});
+	std::string in;
+	std::thread reader([&fds, &in, OUT_BYTES]() {
+		char buf[4096];
+		while (in.size() < OUT_BYTES)
+		{
+			ssize_t ret = read(fds[1], buf, sizeof(buf));
+			if (ret <= 0)
+			{
+				break;
+			}
+			in.append(buf, ret);
+			if ((in.size() / sizeof(buf)) % 16 == 0)
+			{
+				std::this_thread::sleep_for(std::chrono::microseconds(200));
+			}
+		}
+	});
+	writer.join();
+	reader.join();
+	MCHECK(WaitFor([&done, &written]() { return done && (written != -2); }));
+	MCHECK((got == (long long)IN_BYTES) && !bad);
+	MCHECK(written == (long long)OUT_BYTES);
+	MCHECK(in == out);
+	close(fds[0]);
+	close(fds[1]);
+}
+
+static CMCo<> WaitRead(CMReactor* reactor, int fd, std::atomic<long long>* result, std::atomic<int>* error)
+{
+	char buf[64];
+	ssize_t ret = co_await reactor->AsyncRead(fd, buf, sizeof(buf));
+	*error = errno;
+	*result = ret;
+}
+
+static CMCo<> WaitWrite(CMReactor* reactor, int fd, const std::string* data, std::atomic<long long>* result, std::atomic<int>* error)
+{
+	ssize_t ret = co_await reactor->AsyncWrite(fd, data->data(), data->size());
+	*error = errno;
+	*result = ret;
+}
+
+static CMCo<> CloseLater(CMReactor* reactor, int fd, int ms)
+{
+	co_await reactor->SleepFor(ms);
+	reactor->Close(fd);
+}
+
+//一个协程等读、一个协程等写(缓冲区满了)，第三个协程把fd关了：两个都按ECANCELED返回；
+//同一个fd号再用上，新连接照常收发
+static void TestCloseWhileWaiting(CMReactor& reactor)
+{
+	int fds[2];
+	MCHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+	int size = 4096;
+	setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	MCHECK(CMReactor::SetNonBlock(fds[0]));
+	std::string big(1024 * 1024, 'x');
+	std::atomic<long long> readRet(-2), writeRet(-2);
+	std::atomic<int> readErr(0), writeErr(0);
+	reactor.Spawn(WaitRead(&reactor, fds[0], &readRet, &readErr));
+	reactor.Spawn(WaitWrite(&reactor, fds[0], &big, &writeRet, &writeErr));
+	reactor.Spawn(CloseLater(&reactor, fds[0], 50));
+	MCHECK(WaitFor([&readRet, &writeRet]() { return (readRet != -2) && (writeRet != -2); }));
+	MCHECK((readRet == -1) && (readErr == ECANCELED));
+	MCHECK((writeRet == -1) && (writeErr == ECANCELED));
+	int oldFd = fds[0];
+	close(fds[1]);
+
+	MCHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+	MCHECK(fds[0] == oldFd);
+	MCHECK(CMReactor::SetNonBlock(fds[0]));
+	std::atomic<long long> got(0);
+	std::atomic<bool> bad(false), done(false);
+	reactor.Spawn(ReadAll(&reactor, fds[0], 3, &got, &bad, &done));
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	char data[3] = { Pattern(0), Pattern(1), Pattern(2) };
+	MCHECK(write(fds[1], data, sizeof(data)) == 3);
+	MCHECK(WaitFor([&done]() { return done.load(); }));
+	MCHECK((got == 3) && !bad);
+	close(fds[0]);
+	close(fds[1]);
+}
+
+//协程销毁时记一下：Stop销毁还在睡的协程，局部变量要正常析构
+struct MGuard
+{
+	std::atomic<int>*	count;
+	~MGuard()
+	{
+		(*count)++;
+	}
+};
+
+static CMCo<> SleepLong(CMReactor* reactor, std::atomic<int>* asleep, std::atomic<int>* destroyed, std::atomic<int>* woke)
+{
+	MGuard guard{ destroyed };
+	(*asleep)++;
+	co_await reactor->SleepFor(60000);
+	(*woke)++;
+}
+
+static CMCo<> SleepShort(CMReactor* reactor, std::atomic<bool>* woke)
+{
+	co_await reactor->SleepFor(10);
+	*woke = true;
+}
+
+//一千个协程在睡1分钟时Stop：马上返回，睡眠定时器全取消，协程全销毁；之后还能再Invoke
+static void TestStopWithSleeps(CMReactor& reactor, CMThreadPool& pool)
+{
+	const int COUNT = 1000;
+	size_t timers = CMTimer::Global().Count();
+	std::atomic<int> asleep(0), destroyed(0), woke(0);
+	for (int i = 0; i < COUNT; i++)
+	{
+		reactor.Spawn(SleepLong(&reactor, &asleep, &destroyed, &woke));
+	}
+	MCHECK(WaitFor([&asleep, timers]() { return (asleep == COUNT) && (CMTimer::Global().Count() == timers + COUNT); }));
+	double start = MTestNowMs();
+	reactor.Stop();
+	double ms = MTestNowMs() - start;
+	printf("stop with %d sleeping coroutines: %.1f ms\n", COUNT, ms);
+	MCHECK(ms < 500);
+	MCHECK((destroyed == COUNT) && (woke == 0));
+	MCHECK(CMTimer::Global().Count() == timers);
+
+	MCHECK(reactor.Invoke(pool) == 1);
+	std::atomic<bool> shortWoke(false);
+	reactor.Spawn(SleepShort(&reactor, &shortWoke));
+	MCHECK(WaitFor([&shortWoke]() { return shortWoke.load(); }));
+	MCHECK(WaitFor([timers]() { return CMTimer::Global().Count() == timers; }));
+}
+
+int main()
+{
+	CMThreadPool pool(2);
+	CMReactor reactor;
+	MCHECK(reactor.Invoke(pool) == 1);
+	pool.Invoke();
+	TestEdgeRearm(reactor);
+	TestCloseWhileWaiting(reactor);
+	TestStopWithSleeps(reactor, pool);
+	reactor.Stop();
+	pool.Stop();
+	return MTestResult("ReactorTest");
+}
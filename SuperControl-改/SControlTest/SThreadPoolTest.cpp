@@ -0,0 +1,100 @@
+#include "SThreadPool.h"
+#include "MTest.h"
+#include <vector>
+
+//工作窃取线程池：parallel_for、嵌套的分叉-合并结果要对；stop时排着的任务要执行完(不漏、不泄漏)
+
+//每个下标只做一次
+static void TestParallelFor()
+{
+	CSThreadPool pool(4);
+	pool.start();
+	const size_t N = 1000000;
+	std::vector<unsigned char> hit(N, 0);
+	pool.parallel_for(0, N, 1000, [&hit](size_t i) { hit[i]++; });
+	size_t once = 0;
+	for (size_t i = 0; i < N; i++)
+	{
+		once += (hit[i] == 1) ? 1 : 0;
+	}
+	MCHECK(once == N);
+	pool.stop();
+}
+
+//递归拆子任务：等子任务的线程自己也去执行任务，线程比任务层数少也不会卡住
+static long long Fib(CSThreadPool& pool, int n)
+{
+	if (n < 16)
+	{
+		return (n < 2) ? n : Fib(pool, n - 1) + Fib(pool, n - 2);
+	}
+	long long a = 0, b = 0;
+	CSTaskGroup group(pool);
+	group.run([&pool, &a, n]() { a = Fib(pool, n - 1); });
+	b = Fib(pool, n - 2);
+	group.wait();
+	return a + b;
+}
+
+static void TestForkJoin()
+{
+	CSThreadPool pool(2);
+	pool.start();
+	MCHECK(Fib(pool, 27) == 196418);
+	pool.stop();
+}
+
+//没开始就停：排着的任务在stop里执行掉，lambda(和它抓的东西)跟着任务一起释放
+static void TestStopDrains()
+{
+	std::atomic<int> ran(0);
+	std::shared_ptr<int> token = std::make_shared<int>(0);
+	{
+		CSThreadPool pool(3);
+		for (int i = 0; i < 10000; i++)
+		{
+			pool.push_func([&ran, token]() { ran++; });
+		}
+		MCHECK(ran == 0);
+		pool.stop();
+		MCHECK(ran == 10000);
+		MCHECK(token.use_count() == 1);
+		//停了以后再提交：在提交的线程里直接执行
+		pool.push_func([&ran]() { ran++; });
+		MCHECK(ran == 10001);
+	}
+	//停的时候别的线程还在提交、还在等任务组：一个都不能丢，等的人都要返回
+	std::atomic<int> done(0);
+	CSThreadPool pool(2);
+	pool.start();
+	std::vector<std::thread> producers;
+	for (int p = 0; p < 4; p++)
+	{
+		producers.emplace_back([&pool, &done]() {
+			for (int i = 0; i < 200; i++)
+			{
+				CSTaskGroup group(pool);
+				for (int j = 0; j < 50; j++)
+				{
+					group.run([&done]() { done++; });
+				}
+				group.wait();
+			}
+		});
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	pool.stop();
+	for (size_t p = 0; p < producers.size(); p++)
+	{
+		producers[p].join();
+	}
+	MCHECK(done == 4 * 200 * 50);
+}
+
+int main()
+{
+	TestParallelFor();
+	TestForkJoin();
+	TestStopDrains();
+	return MTestResult("SThreadPoolTest");
+}
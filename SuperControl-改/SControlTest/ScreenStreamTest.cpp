@@ -0,0 +1,220 @@
+#include "pch.h"
+#include "Common.h"
+#include "MThread.h"
+#include "MTimer.h"
+#include "MByteQueue.h"
+#include "MScreenStream.h"
+#include "MTest.h"
+#include <deque>
+#include <thread>
+
+//推屏会话的额度、暂停、整帧请求：会话和发送队列是真的，截屏是合成桌面，连接换成内存里的字节流
+
+//观看端：发送队列开始发的时候把字节全收下来，按包切开，帧放进m_frames
+class CMViewer : public CMFuncBase
+{
+public:
+	CMByteQueue					m_queue;
+private:
+	std::mutex					m_mutex;
+	std::condition_variable		m_cond;
+	std::vector<BYTE>			m_wire;
+	std::deque<std::string>		m_frames;
+	int Drain()
+	{
+		ULONG len = 0;
+		BYTE* data = NULL;
+		while ((data = m_queue.Front(len)) != NULL)
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_wire.insert(m_wire.end(), data, data + len);
+				while (!m_wire.empty())
+				{
+					DWORD used = (DWORD)m_wire.size();
+					CPacket pack(m_wire.data(), used);
+					if (used == 0)
+					{
+						break;
+					}
+					m_wire.erase(m_wire.begin(), m_wire.begin() + used);
+					if (pack.nCmd == CMScreenStream::STREAM_CMD)
+					{
+						m_frames.push_back(pack.sData);
+					}
+				}
+			}
+			m_cond.notify_all();
+			if (m_queue.Sent(len) != CMByteQueue::MB_MORE)
+			{
+				break;
+			}
+		}
+		return -1;
+	}
+public:
+	CMViewer() : m_queue(this, (MT_FUNC)&CMViewer::Drain)
+	{
+	}
+	//等下一帧，ms毫秒内没有返回false
+	bool Next(std::string& frame, int ms)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if (!m_cond.wait_for(lock, std::chrono::milliseconds(ms), [this]() { return !m_frames.empty(); }))
+		{
+			return false;
+		}
+		frame = m_frames.front();
+		m_frames.pop_front();
+		return true;
+	}
+	//ms毫秒内收到几帧
+	int Count(int ms)
+	{
+		std::string frame;
+		int count = 0;
+		while (Next(frame, ms))
+		{
+			count++;
+		}
+		return count;
+	}
+};
+
+static void SendCtrl(CMScreenStream& stream, BYTE op, WORD credit = 0, BYTE quality = 0)
+{
+	STREAMCTRL ctrl = {};
+	ctrl.nOp = op;
+	ctrl.nCredit = credit;
+	ctrl.nQuality = quality;
+	stream.Control(CPacket(CMScreenStream::STREAM_CMD, (BYTE*)&ctrl, sizeof(ctrl)));
+}
+
+static bool IsKey(const std::string& frame)
+{
+	MTileFrameHeader header;
+	if (frame.size() < sizeof(header))
+	{
+		return false;
+	}
+	memcpy(&header, frame.data(), sizeof(header));
+	return (header.flags & MTILE_KEY) != 0;
+}
+
+int main()
+{
+	const int W = 640, H = 360;
+	CMDesk desk(W, H);
+	CMCapture::Desk() = &desk;
+	//屏幕一直在变(打字)，每一帧都有东西推
+	std::atomic<bool> typing(true);
+	std::thread mutator([&]() {
+		for (int t = 0; typing; t++)
+		{
+			{
+				std::lock_guard<std::mutex> lock(CMCapture::Mutex());
+				desk.Step(CMDesk::SCENE_TYPING, t);
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		}
+	});
+	CMThreadPool pool(2);
+	pool.Invoke();
+	CMViewer viewer;
+	std::atomic<int> ended(0);
+	std::shared_ptr<CMScreenStream> stream = std::make_shared<CMScreenStream>(viewer.m_queue, pool, [&ended]() { ended++; });
+	CMTileDecoder decoder;
+	std::string frame;
+	int bad = 0;
+
+	//额度3、一个都不还：推3帧就停，第一帧是整帧
+	SendCtrl(*stream, MS_START, 3);
+	MCHECK(viewer.Next(frame, 2000) && IsKey(frame));
+	bad += decoder.Decode((const uint8_t*)frame.data(), frame.size()) ? 0 : 1;
+	for (int i = 0; i < 2; i++)
+	{
+		MCHECK(viewer.Next(frame, 2000) && !IsKey(frame));
+		bad += decoder.Decode((const uint8_t*)frame.data(), frame.size()) ? 0 : 1;
+	}
+	MCHECK(viewer.Count(300) == 0);
+	MCHECK(bad == 0);
+
+	//暂停时给额度不推，继续以后把额度用完
+	SendCtrl(*stream, MS_PAUSE);
+	SendCtrl(*stream, MS_CREDIT, 5);
+	MCHECK(viewer.Count(300) == 0);
+	SendCtrl(*stream, MS_RESUME);
+	MCHECK(viewer.Count(300) == 5);
+
+	//额度超过上限按上限算
+	SendCtrl(*stream, MS_CREDIT, 1000);
+	MCHECK(viewer.Count(500) == CMScreenStream::MAX_CREDIT);
+
+	//换质量：下一帧整帧
+	SendCtrl(*stream, MS_QUALITY, 0, 40);
+	SendCtrl(*stream, MS_CREDIT, 1);
+	MCHECK(viewer.Next(frame, 2000) && IsKey(frame));
+	MCHECK(viewer.Count(300) == 0);
+
+	//要整帧的时候截屏失败了：整帧的请求不能丢，截到以后推的第一帧还得是整帧
+	CMCapture::Fail() = 3;
+	SendCtrl(*stream, MS_KEY);
+	SendCtrl(*stream, MS_CREDIT, 2);
+	MCHECK(viewer.Next(frame, 2000) && IsKey(frame));
+	MCHECK(viewer.Next(frame, 2000) && !IsKey(frame));
+	MCHECK(CMCapture::Fail() == 0);
+
+	//观看端解坏一帧：和ScreenWatch一样只发一次MS_KEY，已经在路上的变化帧扔掉但额度照还，整帧来了接着画
+	SendCtrl(*stream, MS_KEY);
+	SendCtrl(*stream, MS_CREDIT, 1);
+	MCHECK(viewer.Next(frame, 2000) && IsKey(frame));
+	MCHECK(decoder.Receive((const uint8_t*)frame.data(), frame.size()) == MTR_SHOWN);
+	std::string lost, inFlight;
+	SendCtrl(*stream, MS_CREDIT, 2);
+	MCHECK(viewer.Next(lost, 2000) && !IsKey(lost) && (lost.size() > sizeof(MTileFrameHeader)));
+	MCHECK(viewer.Next(inFlight, 2000) && !IsKey(inFlight));
+	lost.resize(lost.size() - 1);
+	MCHECK(decoder.Receive((const uint8_t*)lost.data(), lost.size()) == MTR_NEED_KEY);
+	SendCtrl(*stream, MS_KEY);
+	SendCtrl(*stream, MS_CREDIT, 1);
+	MCHECK(decoder.Receive((const uint8_t*)inFlight.data(), inFlight.size()) == MTR_SKIPPED);
+	SendCtrl(*stream, MS_CREDIT, 1);
+	int skipped = 1;
+	bool resynced = false;
+	while (!resynced && viewer.Next(frame, 2000))
+	{
+		int ret = decoder.Receive((const uint8_t*)frame.data(), frame.size());
+		SendCtrl(*stream, MS_CREDIT, 1);
+		if (IsKey(frame))
+		{
+			MCHECK(ret == MTR_SHOWN);
+			resynced = true;
+		}
+		else
+		{
+			MCHECK(ret == MTR_SKIPPED);
+			skipped++;
+		}
+	}
+	MCHECK(resynced && (skipped <= 2));
+	MCHECK(viewer.Next(frame, 2000) && !IsKey(frame));
+	MCHECK(decoder.Receive((const uint8_t*)frame.data(), frame.size()) == MTR_SHOWN);
+	//扔掉的帧额度都还了：推屏没停，最后这一帧没还额度，只剩一帧在路上
+	MCHECK(viewer.Count(300) == 1);
+
+	//结束：onEnd只调一次，之后给额度也不推
+	stream->Stop();
+	for (int i = 0; (i < 100) && (ended == 0); i++)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	SendCtrl(*stream, MS_CREDIT, 4);
+	MCHECK(viewer.Count(300) == 0);
+	MCHECK(ended == 1);
+
+	typing = false;
+	mutator.join();
+	stream.reset();
+	pool.Stop();
+	return MTestResult("ScreenStreamTest");
+}
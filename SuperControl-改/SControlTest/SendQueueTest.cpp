@@ -0,0 +1,146 @@
+#include "MSendQueue.h"
+#include "MTest.h"
+#include <string>
+#include <memory>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+//TCP发送队列：没登记和Remove以后的连接入队要拒绝；积压太多断开后表项也要删掉；
+//fd被新连接复用时，新连接只收到自己的包
+
+//从fd上读，直到读满want字节或者timeout毫秒内没有新数据；返回读到的
+static std::string ReadFor(int fd, size_t want, int timeout)
+{
+	std::string data;
+	char buf[4096];
+	while (data.size() < want)
+	{
+		pollfd pfd{ fd, POLLIN, 0 };
+		if (poll(&pfd, 1, timeout) <= 0)
+		{
+			break;
+		}
+		ssize_t ret = read(fd, buf, sizeof(buf));
+		if (ret <= 0)
+		{
+			break;
+		}
+		data.append(buf, ret);
+	}
+	return data;
+}
+
+static std::string Bytes(CPacket& pack)
+{
+	return std::string((char*)pack.Data(), pack.Size());
+}
+
+static CPacket MakePack(unsigned short cmd, size_t size, char fill)
+{
+	std::string data(size, fill);
+	return CPacket(cmd, (unsigned char*)data.c_str(), (unsigned int)data.size());
+}
+
+//登记了才能入队，发得出去；Remove以后再入队拒绝
+static void TestRegister(MSendQueue& queue)
+{
+	int fds[2];
+	MCHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+	CPacket pack = MakePack(7, 100, 'a');
+	MCHECK(!queue.Post(fds[0], pack));
+	queue.Add(fds[0]);
+	MCHECK(queue.Post(fds[0], pack));
+	CPacket second = MakePack(8, 10, 'b');
+	MCHECK(queue.Post(fds[0], second));
+	std::string want = Bytes(pack) + Bytes(second);
+	MCHECK(ReadFor(fds[1], want.size(), 1000) == want);
+	queue.Remove(fds[0]);
+	MCHECK(!queue.Post(fds[0], pack));
+	MCHECK(ReadFor(fds[1], 1, 100).empty());
+	close(fds[0]);
+	close(fds[1]);
+}
+
+//对方不读：积压超过上限时断开，表项删掉，之后入队都拒绝(不会重新建队列)
+static void TestHighWater(MSendQueue& queue)
+{
+	int fds[2];
+	MCHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+	int size = 4096;
+	setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	queue.Add(fds[0]);
+	CPacket pack = MakePack(7, 16 * 1024, 'c');
+	int posted = 0;
+	while ((posted < 1000) && queue.Post(fds[0], pack))
+	{
+		posted++;
+	}
+	MCHECK((posted > 0) && (posted < 1000));
+	MCHECK(!queue.Post(fds[0], pack));
+	//被shutdown了：对方读完缓冲区里的就是EOF
+	fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+	char buf[4096];
+	ssize_t ret = 0;
+	double start = MTestNowMs();
+	while (MTestNowMs() - start < 1000)
+	{
+		ret = read(fds[1], buf, sizeof(buf));
+		if (ret == 0)
+		{
+			break;
+		}
+	}
+	MCHECK(ret == 0);
+	close(fds[0]);
+	close(fds[1]);
+}
+
+//旧连接还有没发的包就关掉，同一个fd号被新连接用上：新连接只收到新的包
+static void TestReuse(MSendQueue& queue)
+{
+	int fds[2];
+	MCHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+	int size = 4096;
+	setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	queue.Add(fds[0]);
+	CPacket old = MakePack(7, 16 * 1024, 'o');
+	MCHECK(queue.Post(fds[0], old));
+	MCHECK(queue.Post(fds[0], old));
+	int oldFd = fds[0];
+	//和ServeTcpClnt断开时的顺序一样：先Remove再close
+	queue.Remove(fds[0]);
+	close(fds[0]);
+	close(fds[1]);
+	MCHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+	MCHECK(fds[0] == oldFd);
+	CPacket pack = MakePack(9, 50, 'n');
+	MCHECK(!queue.Post(fds[0], pack));
+	queue.Add(fds[0]);
+	MCHECK(queue.Post(fds[0], pack));
+	std::string want = Bytes(pack);
+	MCHECK(ReadFor(fds[1], want.size() + 1, 200) == want);
+	queue.Remove(fds[0]);
+	close(fds[0]);
+	close(fds[1]);
+}
+
+int main()
+{
+	CMThreadPool pool(1);
+	pool.Invoke();
+	std::unique_ptr<MSendQueue> queue(new MSendQueue());
+	MCHECK(queue->Invoke(pool) == 1);
+	TestRegister(*queue);
+	TestHighWater(*queue);
+	TestReuse(*queue);
+	//析构叫醒发送线程等它退出，不用等poll超时；之后线程池里没有碰它的任务
+	double start = MTestNowMs();
+	queue.reset();
+	MCHECK(MTestNowMs() - start < 500);
+	pool.Stop();
+	return MTestResult("SendQueueTest");
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "MDesk.h"
+#include <mutex>
+#include <atomic>
+
+//推屏测试用的截屏：屏幕是测试里的合成桌面，Grab拷一份当前画面
+//Fail()让接下来几次Grab失败(截屏失败的路径)
+class CMCapture
+{
+private:
+	std::vector<uint8_t>	m_bits;
+	int						m_width;
+	int						m_height;
+public:
+	static CMDesk*& Desk()
+	{
+		static CMDesk* desk = NULL;
+		return desk;
+	}
+	static std::mutex& Mutex()
+	{
+		static std::mutex mutex;
+		return mutex;
+	}
+	static std::atomic<int>& Fail()
+	{
+		static std::atomic<int> fail(0);
+		return fail;
+	}
+	CMCapture() : m_width(0), m_height(0)
+	{
+	}
+	bool Grab()
+	{
+		if (Fail() > 0)
+		{
+			Fail()--;
+			return false;
+		}
+		std::lock_guard<std::mutex> lock(Mutex());
+		m_bits = Desk()->px;
+		m_width = Desk()->W;
+		m_height = Desk()->H;
+		return true;
+	}
+	const uint8_t* Bits() const
+	{
+		return m_bits.data();
+	}
+	int Width() const
+	{
+		return m_width;
+	}
+	int Height() const
+	{
+		return m_height;
+	}
+	ptrdiff_t Stride() const
+	{
+		return (ptrdiff_t)m_width * 4;
+	}
+};
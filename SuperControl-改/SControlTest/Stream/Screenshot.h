@@ -0,0 +1,24 @@
+#pragma once
+
+#include "MTileCodec.h"
+#include "SThreadPool.h"
+
+//推屏测试用：只有推屏会话用到的并行编码，和被控端的CScreenshot::Parallelize一样接到共用的编码线程池
+class CScreenshot
+{
+public:
+	static CSThreadPool& EncodePool()
+	{
+		static CSThreadPool pool(2, MD_ENCODE);
+		static bool started = (pool.start(), true);
+		(void)started;
+		return pool;
+	}
+	static void Parallelize(CMTileEncoder& encoder)
+	{
+		CSThreadPool& pool = EncodePool();
+		encoder.SetParallel(pool.size() * 4, [&pool](size_t count, const std::function<void(size_t)>& body) {
+			pool.parallel_for(0, count, 1, body, MTAG_SCREEN);
+		});
+	}
+};
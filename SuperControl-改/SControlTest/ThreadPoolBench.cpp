@@ -0,0 +1,136 @@
+#include "SThreadPool.h"
+#include "MTest.h"
+#include <vector>
+#include <cstdlib>
+
+//线程池吞吐：1万~100万个很小的任务(加一个计数)，从提交第一个到最后一个执行完的时间
+//对比：原来的CSThreadPool(一个互斥锁保护一个队列)、CMThreadPool、工作窃取的CSThreadPool(外部提交和parallel_for)
+//用法：ThreadPoolBench [线程数]，不给就用核数
+
+//原来的CSThreadPool：所有线程抢一把锁取一个队列，这里只补上了能正常停下来
+class CMutexPool
+{
+private:
+	std::vector<std::thread>			m_threads;
+	std::queue<std::function<void()> >	m_tasks;
+	std::mutex							m_mutex;
+	std::condition_variable				m_cond;
+	bool								m_stop;
+	void Work()
+	{
+		for (;;)
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_cond.wait(lock, [this]() { return m_stop || !m_tasks.empty(); });
+			if (m_tasks.empty())
+			{
+				return;
+			}
+			std::function<void()> task = std::move(m_tasks.front());
+			m_tasks.pop();
+			lock.unlock();
+			task();
+		}
+	}
+public:
+	explicit CMutexPool(int count) : m_stop(false)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			m_threads.emplace_back(&CMutexPool::Work, this);
+		}
+	}
+	~CMutexPool()
+	{
+		m_mutex.lock();
+		m_stop = true;
+		m_mutex.unlock();
+		m_cond.notify_all();
+		for (size_t i = 0; i < m_threads.size(); i++)
+		{
+			m_threads[i].join();
+		}
+	}
+	void Push(std::function<void()> task)
+	{
+		m_mutex.lock();
+		m_tasks.push(std::move(task));
+		m_mutex.unlock();
+		m_cond.notify_one();
+	}
+};
+
+static void WaitAll(std::atomic<int>& done, int count)
+{
+	while (done < count)
+	{
+		std::this_thread::yield();
+	}
+}
+
+static void Report(const char* name, int count, double ms)
+{
+	printf("%-24s %8d tasks %9.1f ms %8.1f ns/task\n", name, count, ms, ms * 1e6 / count);
+}
+
+int main(int argc, char* argv[])
+{
+	int threads = (argc > 1) ? atoi(argv[1]) : CMThreadPool::Cores();
+	threads = std::max(threads, 1);
+	printf("threads %d\n", threads);
+	static const int sizes[] = { 10000, 100000, 1000000 };
+	for (int count : sizes)
+	{
+		std::atomic<int> done(0);
+		{
+			CMutexPool pool(threads);
+			double start = MTestNowMs();
+			for (int i = 0; i < count; i++)
+			{
+				pool.Push([&done]() { done++; });
+			}
+			WaitAll(done, count);
+			Report("mutex queue (old)", count, MTestNowMs() - start);
+		}
+		done = 0;
+		{
+			CMThreadPool pool(threads, (size_t)count);
+			pool.Invoke();
+			double start = MTestNowMs();
+			for (int i = 0; i < count; i++)
+			{
+				pool.DispatchTask(CMTask([&done]() { done++; }));
+			}
+			WaitAll(done, count);
+			Report("CMThreadPool", count, MTestNowMs() - start);
+			pool.Stop();
+		}
+		done = 0;
+		{
+			CSThreadPool pool(threads);
+			pool.start();
+			double start = MTestNowMs();
+			for (int i = 0; i < count; i++)
+			{
+				pool.push_func([&done]() { done++; });
+			}
+			WaitAll(done, count);
+			Report("stealing push_func", count, MTestNowMs() - start);
+			pool.stop();
+		}
+		done = 0;
+		{
+			//在池子里的线程上拆：子任务进它自己的队列，别的线程空了去偷
+			CSThreadPool pool(threads);
+			pool.start();
+			double start = MTestNowMs();
+			pool.push_func([&pool, &done, count]() {
+				pool.parallel_for(0, (size_t)count, 1, [&done](size_t) { done++; });
+			});
+			WaitAll(done, count);
+			Report("stealing parallel_for", count, MTestNowMs() - start);
+			pool.stop();
+		}
+	}
+	return 0;
+}
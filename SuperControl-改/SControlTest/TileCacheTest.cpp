@@ -0,0 +1,241 @@
+#include "MTileCodec.h"
+#include "SThreadPool.h"
+#include "MDesk.h"
+#include "MTest.h"
+
+//块缓存：开着缓存解回去要和原图一样；来回切窗口时大部分块只发键；并行编出来的和串行的一样
+//中途加入的观看端、对不上的键要拒绝，等整帧；坏的码流不能崩；解坏一帧以后跳过变化帧等整帧
+
+//来回切窗口的一段操作，开和不开缓存各编一遍
+static void TestSession()
+{
+	const int W = 1280, H = 720, STEPS = 200;
+	size_t bytes[2] = { 0, 0 };
+	for (int on = 0; on < 2; on++)
+	{
+		CMDeskSession session(W, H);
+		CMTileEncoder encoder;
+		CMTileEncoder parallel;
+		CSThreadPool pool(3);
+		pool.start();
+		parallel.SetParallel(8, [&pool](size_t count, const std::function<void(size_t)>& body) {
+			pool.parallel_for(0, count, 1, body);
+		});
+		encoder.SetCache(on != 0);
+		parallel.SetCache(on != 0);
+		CMTileDecoder decoder;
+		std::vector<uint8_t> out, other;
+		int bad = 0;
+		int differ = 0;
+		for (int t = 0; t < STEPS; t++)
+		{
+			if (t > 0)
+			{
+				session.Step();
+			}
+			encoder.Encode(session.screen.px.data(), W, H, (ptrdiff_t)W * 4, out);
+			parallel.Encode(session.screen.px.data(), W, H, (ptrdiff_t)W * 4, other);
+			differ += (out != other) ? 1 : 0;
+			bytes[on] += out.size();
+			if (!decoder.Decode(out.data(), out.size()) || (memcmp(decoder.Frame(), session.screen.px.data(), session.screen.px.size()) != 0))
+			{
+				bad++;
+			}
+		}
+		pool.stop();
+		const MTileStats& total = encoder.TotalStats();
+		printf("session cache %d: %zu bytes, tiles sent %llu, by reference %llu\n", on, bytes[on], total.changed, total.cached);
+		MCHECK(bad == 0);
+		MCHECK(differ == 0);
+		MCHECK((on != 0) || (total.cached == 0));
+		MCHECK((on == 0) || (total.cached * 2 > total.changed));
+	}
+	MCHECK(bytes[1] * 4 < bytes[0]);
+}
+
+//中途加入的观看端没有缓存：带键的帧不收；Reset后整帧能解，后面的键也能对上
+static void TestLateViewer()
+{
+	const int W = 640, H = 480;
+	CMDesk desk(W, H);
+	CMDesk other = desk;
+	other.Window(0, 0, 320, 320, 0x123456);
+	CMTileEncoder encoder;
+	encoder.SetCache(true);
+	std::vector<uint8_t> out;
+	encoder.Encode(desk.px.data(), W, H, (ptrdiff_t)W * 4, out);
+	encoder.Encode(other.px.data(), W, H, (ptrdiff_t)W * 4, out);
+	encoder.Encode(desk.px.data(), W, H, (ptrdiff_t)W * 4, out);
+	MCHECK(encoder.LastStats().cached > 0);
+	CMTileDecoder late;
+	MCHECK(!late.Decode(out.data(), out.size()));
+	encoder.Reset();
+	encoder.Encode(other.px.data(), W, H, (ptrdiff_t)W * 4, out);
+	MCHECK(encoder.LastStats().cached == 0);
+	MCHECK(late.Decode(out.data(), out.size()) && (memcmp(late.Frame(), other.px.data(), other.px.size()) == 0));
+	encoder.Encode(desk.px.data(), W, H, (ptrdiff_t)W * 4, out);
+	encoder.Encode(other.px.data(), W, H, (ptrdiff_t)W * 4, out);
+	MCHECK(encoder.LastStats().cached > 0);
+	CMTileDecoder viewer;
+	encoder.Reset();
+	encoder.Encode(desk.px.data(), W, H, (ptrdiff_t)W * 4, out);
+	MCHECK(viewer.Decode(out.data(), out.size()));
+	encoder.Encode(other.px.data(), W, H, (ptrdiff_t)W * 4, out);
+	MCHECK(viewer.Decode(out.data(), out.size()));
+	encoder.Encode(desk.px.data(), W, H, (ptrdiff_t)W * 4, out);
+	MCHECK(viewer.Decode(out.data(), out.size()) && (memcmp(viewer.Frame(), desk.px.data(), desk.px.size()) == 0));
+}
+
+//改掉第一个只发键的块的键：观看端缓存里找不到，整帧拒绝
+static void TestBadReference()
+{
+	const int W = 640, H = 480;
+	CMDesk desk(W, H);
+	CMDesk other = desk;
+	other.Window(0, 0, 320, 320, 0x123456);
+	CMTileEncoder encoder;
+	encoder.SetCache(true);
+	CMTileDecoder viewer;
+	std::vector<uint8_t> out;
+	encoder.Encode(desk.px.data(), W, H, (ptrdiff_t)W * 4, out);
+	MCHECK(viewer.Decode(out.data(), out.size()));
+	encoder.Encode(other.px.data(), W, H, (ptrdiff_t)W * 4, out);
+	MCHECK(viewer.Decode(out.data(), out.size()));
+	encoder.Encode(desk.px.data(), W, H, (ptrdiff_t)W * 4, out);
+	size_t pos = sizeof(MTileFrameHeader);
+	bool found = false;
+	while (pos + sizeof(MTileHeader) + sizeof(uint64_t) <= out.size())
+	{
+		MTileHeader tile;
+		memcpy(&tile, &out[pos], sizeof(tile));
+		if (tile.format == MTF_CACHED)
+		{
+			found = true;
+			break;
+		}
+		pos += sizeof(tile) + tile.size;
+	}
+	MCHECK(found);
+	if (!found)
+	{
+		return;
+	}
+	std::vector<uint8_t> bad = out;
+	bad[pos + sizeof(MTileHeader)] ^= 1;
+	CMTileDecoder copy = viewer;
+	MCHECK(!copy.Decode(bad.data(), bad.size()));
+	MCHECK(viewer.Decode(out.data(), out.size()) && (memcmp(viewer.Frame(), desk.px.data(), desk.px.size()) == 0));
+}
+
+//随机改字节、截断(种子固定)：可以接受也可以拒绝，不能崩
+static void TestCorrupt()
+{
+	const int W = 640, H = 480;
+	CMDesk desk(W, H);
+	CMDesk other = desk;
+	other.Fill(0, 0, 400, 300, 0xFF00FF);
+	CMTileEncoder encoder;
+	encoder.SetCache(true);
+	std::vector<uint8_t> key, out;
+	encoder.Encode(desk.px.data(), W, H, (ptrdiff_t)W * 4, key);
+	encoder.Encode(other.px.data(), W, H, (ptrdiff_t)W * 4, out);
+	CMTileDecoder ready;
+	MCHECK(ready.Decode(key.data(), key.size()));
+	MCHECK(ready.Decode(out.data(), out.size()));
+	encoder.Encode(desk.px.data(), W, H, (ptrdiff_t)W * 4, out);
+	uint32_t r = 1;
+	int accepted = 0;
+	for (int i = 0; i < 2000; i++)
+	{
+		CMTileDecoder decoder = ready;
+		std::vector<uint8_t> bad = out;
+		for (int k = 0; k < 1 + i % 4; k++)
+		{
+			r = r * 1103515245 + 12345;
+			bad[(r >> 8) % bad.size()] ^= (uint8_t)((r >> 3) | 1);
+		}
+		if ((i % 7) == 0)
+		{
+			bad.resize((r >> 5) % bad.size());
+		}
+		accepted += decoder.Decode(bad.data(), bad.size()) ? 1 : 0;
+	}
+	printf("corrupt cached frames: %d of 2000 accepted\n", accepted);
+}
+
+//推屏接收端：一帧解坏了只要一次整帧，之后在路上的变化帧(好的坏的)都不解、画面不动，整帧来了接着画；
+//整帧本身坏了再要一次
+static void TestResync()
+{
+	const int W = 1280, H = 720;
+	CMDeskSession session(W, H);
+	CMTileEncoder encoder;
+	encoder.SetCache(true);
+	CMTileDecoder viewer;
+	std::vector<uint8_t> out;
+	encoder.Encode(session.screen.px.data(), W, H, (ptrdiff_t)W * 4, out);
+	MCHECK(CMTileDecoder::IsKey(out.data(), out.size()));
+	MCHECK(viewer.Receive(out.data(), out.size()) == MTR_SHOWN);
+	session.Step();
+	encoder.Encode(session.screen.px.data(), W, H, (ptrdiff_t)W * 4, out);
+	MCHECK(!CMTileDecoder::IsKey(out.data(), out.size()));
+	out.resize(out.size() - 1);
+	MCHECK(viewer.Receive(out.data(), out.size()) == MTR_NEED_KEY);
+	MCHECK(viewer.WaitingKey());
+	std::vector<uint8_t> shown(viewer.Frame(), viewer.Frame() + (size_t)W * H * 4);
+	int needKey = 0;
+	for (int t = 0; t < 5; t++)
+	{
+		session.Step();
+		encoder.Encode(session.screen.px.data(), W, H, (ptrdiff_t)W * 4, out);
+		if ((t % 2) == 1)
+		{
+			out.resize(out.size() / 2);
+		}
+		int ret = viewer.Receive(out.data(), out.size());
+		needKey += (ret == MTR_NEED_KEY) ? 1 : 0;
+		MCHECK(ret == MTR_SKIPPED);
+		MCHECK(viewer.Dirty().empty());
+	}
+	MCHECK(needKey == 0);
+	MCHECK(memcmp(viewer.Frame(), shown.data(), shown.size()) == 0);
+	//被控端收到MS_KEY
+	encoder.Reset();
+	session.Step();
+	encoder.Encode(session.screen.px.data(), W, H, (ptrdiff_t)W * 4, out);
+	MCHECK(CMTileDecoder::IsKey(out.data(), out.size()));
+	MCHECK(viewer.Receive(out.data(), out.size()) == MTR_SHOWN);
+	MCHECK(!viewer.WaitingKey() && (memcmp(viewer.Frame(), session.screen.px.data(), session.screen.px.size()) == 0));
+	for (int t = 0; t < 20; t++)
+	{
+		session.Step();
+		encoder.Encode(session.screen.px.data(), W, H, (ptrdiff_t)W * 4, out);
+		MCHECK(viewer.Receive(out.data(), out.size()) == MTR_SHOWN);
+	}
+	MCHECK(memcmp(viewer.Frame(), session.screen.px.data(), session.screen.px.size()) == 0);
+	//要来的整帧也坏了：再要一次，下一个整帧接上
+	encoder.Reset();
+	encoder.Encode(session.screen.px.data(), W, H, (ptrdiff_t)W * 4, out);
+	out.resize(out.size() - 1);
+	MCHECK(viewer.Receive(out.data(), out.size()) == MTR_NEED_KEY);
+	encoder.Reset();
+	encoder.Encode(session.screen.px.data(), W, H, (ptrdiff_t)W * 4, out);
+	MCHECK(CMTileDecoder::IsKey(out.data(), out.size()) && (out.size() > 1));
+	out.resize(out.size() - 1);
+	MCHECK(viewer.Receive(out.data(), out.size()) == MTR_NEED_KEY);
+	encoder.Reset();
+	session.Step();
+	encoder.Encode(session.screen.px.data(), W, H, (ptrdiff_t)W * 4, out);
+	MCHECK(viewer.Receive(out.data(), out.size()) == MTR_SHOWN);
+	MCHECK(memcmp(viewer.Frame(), session.screen.px.data(), session.screen.px.size()) == 0);
+}
+
+int main()
+{
+	TestSession();
+	TestLateViewer();
+	TestBadReference();
+	TestCorrupt();
+	TestResync();
+	return MTestResult("TileCacheTest");
+}
@@ -0,0 +1,164 @@
+#include "MTileCodec.h"
+#include "SThreadPool.h"
+#include "MDesk.h"
+#include "MTest.h"
+#include <cstdlib>
+
+//块编码：每种场景、每种块格式每帧多少字节、编一帧多少毫秒、变了几块；整帧(关键帧)的大小作为对照
+//每帧都解回去，无损格式和原图比对
+//session：来回切窗口的一段操作(CMDeskSession)，块缓存开和不开各编一遍
+//threads：3840x2160在CSThreadPool里按1/2/4/8个线程并行编码(SetParallel)，和不并行的比速度，码流要一模一样
+//用法：TileCodecBench [宽 高]，默认1920 1080
+
+enum
+{
+	FRAMES	= 30,
+	STEPS	= 600,		//session走多少步
+	SWEEP_W	= 3840,		//并行编码扫线程数用的分辨率
+	SWEEP_H	= 2160,
+	BANDS_PER_THREAD = 4,	//和CScreenshot::Parallelize一样，每个线程分几段
+};
+
+static const char* SceneName(int scene)
+{
+	static const char* names[] = { "idle", "typing", "scroll", "video" };
+	return names[scene];
+}
+
+static void Run(int W, int H, int scene, MTileFormat format, const char* name)
+{
+	CMDesk desk(W, H);
+	CMTileEncoder encoder;
+	CMTileDecoder decoder;
+	encoder.SetFormat(format);
+	encoder.SetQuality(60);
+	std::vector<uint8_t> out;
+	encoder.Encode(desk.px.data(), W, H, (ptrdiff_t)W * 4, out);
+	size_t key = out.size();
+	decoder.Decode(out.data(), out.size());
+	size_t bytes = 0;
+	size_t changed = 0;
+	double ms = 0;
+	int bad = 0;
+	for (int t = 0; t < FRAMES; t++)
+	{
+		desk.Step(scene, t);
+		double start = MTestNowMs();
+		changed += encoder.Encode(desk.px.data(), W, H, (ptrdiff_t)W * 4, out);
+		ms += MTestNowMs() - start;
+		bytes += out.size();
+		if (!decoder.Decode(out.data(), out.size())
+			|| ((format != MTF_LOSSY) && (memcmp(decoder.Frame(), desk.px.data(), desk.px.size()) != 0)))
+		{
+			bad++;
+		}
+	}
+	printf("%-7s %-9s %9zu B/frame %7.2f ms/frame %6.1f tiles/frame | key frame %9zu B%s\n",
+		SceneName(scene), name, bytes / FRAMES, ms / (int)FRAMES, (double)changed / (int)FRAMES, key, bad ? "  MISMATCH" : "");
+}
+
+static void RunSession(int W, int H, bool cache)
+{
+	CMDeskSession session(W, H);
+	CMTileEncoder encoder;
+	CMTileDecoder decoder;
+	encoder.SetCache(cache);
+	std::vector<uint8_t> out;
+	int bad = 0;
+	for (int t = 0; t < STEPS; t++)
+	{
+		if (t > 0)
+		{
+			session.Step();
+		}
+		encoder.Encode(session.screen.px.data(), W, H, (ptrdiff_t)W * 4, out);
+		if (!decoder.Decode(out.data(), out.size()) || (memcmp(decoder.Frame(), session.screen.px.data(), session.screen.px.size()) != 0))
+		{
+			bad++;
+		}
+	}
+	const MTileStats& total = encoder.TotalStats();
+	printf("session cache %-3s %9.1f KB (%6.1f KB/frame) %6.2f ms/frame, tiles sent %llu, by reference %llu%s\n",
+		cache ? "on" : "off", total.bytes / 1024.0, total.bytes / 1024.0 / (int)STEPS, total.encodeUs / 1000.0 / (int)STEPS,
+		total.changed, total.cached, bad ? "  MISMATCH" : "");
+}
+
+//整帧(Reset后第一帧)和视频场景的变化帧各编FRAMES次，threads是0时不并行；码流放进streams里比对
+static void RunThreads(int threads, std::vector<std::vector<uint8_t> >& streams, double& keyMs, double& deltaMs)
+{
+	const int W = SWEEP_W, H = SWEEP_H;
+	std::unique_ptr<CSThreadPool> pool;
+	CMDesk desk(W, H);
+	CMTileEncoder encoder;
+	encoder.SetFormat(MTF_LOSSLESS);
+	if (threads > 0)
+	{
+		pool.reset(new CSThreadPool(threads, MD_ENCODE));
+		pool->start();
+		CSThreadPool* p = pool.get();
+		encoder.SetParallel(threads * BANDS_PER_THREAD, [p](size_t count, const std::function<void(size_t)>& body) {
+			p->parallel_for(0, count, 1, body, MTAG_SCREEN);
+		});
+	}
+	std::vector<uint8_t> out;
+	streams.clear();
+	keyMs = 0;
+	deltaMs = 0;
+	for (int t = 0; t < FRAMES; t++)
+	{
+		encoder.Reset();
+		double start = MTestNowMs();
+		encoder.Encode(desk.px.data(), W, H, (ptrdiff_t)W * 4, out);
+		keyMs += MTestNowMs() - start;
+	}
+	streams.push_back(out);
+	for (int t = 0; t < FRAMES; t++)
+	{
+		desk.Step(CMDesk::SCENE_VIDEO, t);
+		double start = MTestNowMs();
+		encoder.Encode(desk.px.data(), W, H, (ptrdiff_t)W * 4, out);
+		deltaMs += MTestNowMs() - start;
+		streams.push_back(out);
+	}
+	keyMs /= (int)FRAMES;
+	deltaMs /= (int)FRAMES;
+}
+
+static void RunSweep()
+{
+	printf("threads: %d x %d lossless, key frame and video frames, %u cores\n", (int)SWEEP_W, (int)SWEEP_H, std::thread::hardware_concurrency());
+	std::vector<std::vector<uint8_t> > serial, streams;
+	double serialKey = 0, serialDelta = 0;
+	RunThreads(0, serial, serialKey, serialDelta);
+	printf("serial    key %7.2f ms  video %7.2f ms\n", serialKey, serialDelta);
+	int counts[] = { 1, 2, 4, 8 };
+	for (int i = 0; i < 4; i++)
+	{
+		double keyMs = 0, deltaMs = 0;
+		RunThreads(counts[i], streams, keyMs, deltaMs);
+		printf("threads %d key %7.2f ms  video %7.2f ms  speedup %.2fx / %.2fx%s\n", counts[i], keyMs, deltaMs,
+			serialKey / keyMs, serialDelta / deltaMs, (streams != serial) ? "  MISMATCH" : "");
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	int W = (argc > 2) ? atoi(argv[1]) : 1920;
+	int H = (argc > 2) ? atoi(argv[2]) : 1080;
+	if ((W <= 0) || (H <= 0) || (W > MTILE_MAX_SIDE) || (H > MTILE_MAX_SIDE))
+	{
+		printf("bad size %d x %d\n", W, H);
+		return 1;
+	}
+	printf("%d x %d, %d frames per scene, raw frame %zu B\n", W, H, (int)FRAMES, (size_t)W * H * 4);
+	for (int scene = CMDesk::SCENE_IDLE; scene <= CMDesk::SCENE_VIDEO; scene++)
+	{
+		Run(W, H, scene, MTF_RAW, "raw");
+		Run(W, H, scene, MTF_LOSSLESS, "lossless");
+		Run(W, H, scene, MTF_LOSSY, "lossy60");
+	}
+	RunSession(W, H, false);
+	RunSession(W, H, true);
+	RunSweep();
+	return 0;
+}
@@ -0,0 +1,267 @@
+#include "MTileCodec.h"
+#include "MDesk.h"
+#include "MTest.h"
+#include <sys/resource.h>
+#include <cmath>
+
+//块编解码：编出来的码流解回去要和原图一模一样；坏的码流要拒绝，不能崩、不能按码流里的长度乱分配内存
+
+static long MaxRssMB()
+{
+	struct rusage usage = {};
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss / 1024;
+}
+
+//几种场景各走一段，每帧都解回去比对
+static void TestLosslessRoundTrip()
+{
+	const int W = 1280, H = 720;
+	for (int scene = CMDesk::SCENE_IDLE; scene <= CMDesk::SCENE_VIDEO; scene++)
+	{
+		CMDesk desk(W, H);
+		CMTileEncoder encoder;
+		CMTileDecoder decoder;
+		std::vector<uint8_t> out;
+		int bad = 0;
+		for (int t = 0; t < 30; t++)
+		{
+			desk.Step(scene, t);
+			encoder.Encode(desk.px.data(), W, H, (ptrdiff_t)W * 4, out);
+			if (!decoder.Decode(out.data(), out.size()) || (memcmp(decoder.Frame(), desk.px.data(), desk.px.size()) != 0))
+			{
+				bad++;
+			}
+		}
+		MCHECK(bad == 0);
+	}
+}
+
+//把单块码流里LZ的原始长度改掉：要在分配内存之前就拒绝
+static void TestLosslessBadLength()
+{
+	const int W = 64, H = 64;
+	CMDesk desk(W * 4, H * 4);
+	desk.Video(0, 0, W, H, 1);				//颜色多，走MODE_FILTERED
+	desk.Fill(W, 0, W, H, 0xFFFFFF);
+	desk.Text(W, 8, 6, 3);					//两种颜色，走MODE_PALETTE
+	CMLossless codec;
+	std::vector<uint8_t> dst((size_t)W * H * 4);
+	long before = MaxRssMB();
+	for (int x = 0; x < 2; x++)
+	{
+		std::vector<uint8_t> out;
+		codec.Encode(desk.px.data() + (size_t)x * W * 4, W, H, (ptrdiff_t)desk.W * 4, out);
+		MCHECK(codec.Decode(out.data(), out.size(), dst.data(), W, H, (ptrdiff_t)W * 4));
+		size_t at = 0;
+		if (out[0] == CMLossless::MODE_FILTERED)
+		{
+			at = 2;
+		}
+		else if (out[0] == CMLossless::MODE_PALETTE)
+		{
+			at = 2 + ((size_t)out[1] + 1) * 4;
+		}
+		MCHECK(at != 0);
+		if (at == 0)
+		{
+			continue;
+		}
+		const uint32_t sizes[] = { 0xFFFFFFF0u, 0x7FFFFFFFu, 0x10000000u, 1 };
+		for (uint32_t size : sizes)
+		{
+			std::vector<uint8_t> bad = out;
+			memcpy(&bad[at], &size, 4);
+			MCHECK(!codec.Decode(bad.data(), bad.size(), dst.data(), W, H, (ptrdiff_t)W * 4));
+		}
+	}
+	long grown = MaxRssMB() - before;
+	printf("bad length: peak memory grew %ld MB\n", grown);
+	MCHECK(grown < 64);
+}
+
+//整帧码流：截断、改字节、改帧头尺寸都只能返回false
+static void TestFrameCorrupt()
+{
+	const int W = 640, H = 360;
+	CMDesk desk(W, H);
+	CMTileEncoder encoder;
+	std::vector<uint8_t> key, delta;
+	encoder.Encode(desk.px.data(), W, H, (ptrdiff_t)W * 4, key);
+	desk.Step(CMDesk::SCENE_TYPING, 0);
+	desk.Step(CMDesk::SCENE_VIDEO, 0);
+	encoder.Encode(desk.px.data(), W, H, (ptrdiff_t)W * 4, delta);
+	long before = MaxRssMB();
+	//帧头写一个很大的尺寸
+	{
+		std::vector<uint8_t> bad = key;
+		MTileFrameHeader frame;
+		memcpy(&frame, bad.data(), sizeof(frame));
+		frame.width = 0xFFFF;
+		frame.height = 0xFFFF;
+		memcpy(bad.data(), &frame, sizeof(frame));
+		CMTileDecoder decoder;
+		MCHECK(!decoder.Decode(bad.data(), bad.size()));
+	}
+	CMTileDecoder ready;
+	MCHECK(ready.Decode(key.data(), key.size()));
+	//截断：开头一段每个长度都试(帧头、块头)，后面隔几个字节试一次
+	{
+		CMTileDecoder decoder = ready;
+		int accepted = 0;
+		for (size_t len = 0; len < delta.size(); len += (len < 4096) ? 1 : 61)
+		{
+			accepted += decoder.Decode(delta.data(), len) ? 1 : 0;
+		}
+		MCHECK(accepted == 0);
+	}
+	//随机改几个字节(种子固定)：可以接受(改的是像素)，但不能崩
+	{
+		uint32_t r = 1;
+		int accepted = 0;
+		for (int i = 0; i < 2000; i++)
+		{
+			CMTileDecoder decoder = ready;
+			std::vector<uint8_t> bad = delta;
+			for (int k = 0; k < 1 + i % 4; k++)
+			{
+				r = r * 1103515245 + 12345;
+				bad[(r >> 8) % bad.size()] ^= (uint8_t)((r >> 3) | 1);
+			}
+			accepted += decoder.Decode(bad.data(), bad.size()) ? 1 : 0;
+		}
+		printf("corrupt frames: %d of 2000 accepted\n", accepted);
+	}
+	long grown = MaxRssMB() - before;
+	printf("corrupt frames: peak memory grew %ld MB\n", grown);
+	MCHECK(grown < 64);
+}
+
+//只发变了的块：不动的画面只有帧头；打字只动几块，观看端只重画这几块；Reset和尺寸变了整帧发
+static void TestDirtyTiles()
+{
+	const int W = 1280, H = 720;
+	CMDesk desk(W, H);
+	CMTileEncoder encoder;
+	CMTileDecoder decoder;
+	encoder.SetFormat(MTF_RAW);
+	std::vector<uint8_t> out;
+	size_t all = encoder.Encode(desk.px.data(), W, H, (ptrdiff_t)W * 4, out);
+	MCHECK(all == encoder.LastStats().tiles);
+	MCHECK(decoder.Decode(out.data(), out.size()));
+	for (int t = 0; t < 5; t++)
+	{
+		desk.Step(CMDesk::SCENE_IDLE, t);
+		MCHECK(encoder.Encode(desk.px.data(), W, H, (ptrdiff_t)W * 4, out) == 0);
+		MCHECK(out.size() == sizeof(MTileFrameHeader));
+		MCHECK(decoder.Decode(out.data(), out.size()) && decoder.Dirty().empty());
+	}
+	int bad = 0;
+	for (int t = 0; t < 20; t++)
+	{
+		desk.Step(CMDesk::SCENE_TYPING, t);
+		size_t changed = encoder.Encode(desk.px.data(), W, H, (ptrdiff_t)W * 4, out);
+		MCHECK((changed > 0) && (changed <= 4));
+		if (!decoder.Decode(out.data(), out.size()) || (decoder.Dirty().size() != changed)
+			|| (memcmp(decoder.Frame(), desk.px.data(), desk.px.size()) != 0))
+		{
+			bad++;
+		}
+	}
+	MCHECK(bad == 0);
+	encoder.Reset();
+	MCHECK(encoder.Encode(desk.px.data(), W, H, (ptrdiff_t)W * 4, out) == all);
+	//尺寸变了：不是整帧的码流观看端不收
+	CMDesk small(W / 2, H / 2);
+	MCHECK(encoder.Encode(small.px.data(), small.W, small.H, (ptrdiff_t)small.W * 4, out) == encoder.LastStats().tiles);
+	MCHECK(decoder.Decode(out.data(), out.size()) && (memcmp(decoder.Frame(), small.px.data(), small.px.size()) == 0));
+	MTileFrameHeader frame;
+	memcpy(&frame, out.data(), sizeof(frame));
+	frame.flags &= ~MTILE_KEY;
+	frame.width = W;
+	frame.height = H;
+	memcpy(out.data(), &frame, sizeof(frame));
+	CMTileDecoder other;
+	MCHECK(!other.Decode(out.data(), out.size()));
+}
+
+//倒着放的DIB(stride为负)，宽高不是块大小的整数倍
+static void TestBottomUp()
+{
+	CMDesk desk(333, 217);
+	size_t rowBytes = (size_t)desk.W * 4;
+	std::vector<uint8_t> flip(desk.px.size());
+	for (int y = 0; y < desk.H; y++)
+	{
+		memcpy(&flip[(size_t)(desk.H - 1 - y) * rowBytes], &desk.px[(size_t)y * rowBytes], rowBytes);
+	}
+	const MTileFormat formats[] = { MTF_RAW, MTF_LOSSLESS };
+	for (MTileFormat format : formats)
+	{
+		CMTileEncoder encoder;
+		CMTileDecoder decoder;
+		encoder.SetFormat(format);
+		std::vector<uint8_t> out;
+		encoder.Encode(&flip[(size_t)(desk.H - 1) * rowBytes], desk.W, desk.H, -(ptrdiff_t)rowBytes, out);
+		MCHECK(decoder.Decode(out.data(), out.size()) && (memcmp(decoder.Frame(), desk.px.data(), desk.px.size()) == 0));
+	}
+}
+
+//有损：画质(控制端下拉框的几档)越低码流越小，解回去和原图的PSNR不能太差；文字块照样无损
+static void TestLossyQuality()
+{
+	const int W = 1280, H = 720;
+	static const int levels[] = { 80, 60, 40 };
+	size_t lastBytes = 0;
+	for (int q : levels)
+	{
+		CMDesk desk(W, H);
+		CMTileEncoder encoder;
+		CMTileDecoder decoder;
+		encoder.SetFormat(MTF_LOSSY);
+		encoder.SetQuality(q);
+		std::vector<uint8_t> out;
+		size_t bytes = 0;
+		double sum = 0;
+		int bad = 0;
+		for (int t = 0; t < 10; t++)
+		{
+			desk.Step(CMDesk::SCENE_VIDEO, t);
+			encoder.Encode(desk.px.data(), W, H, (ptrdiff_t)W * 4, out);
+			bytes += out.size();
+			if (!decoder.Decode(out.data(), out.size()))
+			{
+				bad++;
+				continue;
+			}
+			const uint8_t* a = decoder.Frame();
+			const uint8_t* b = desk.px.data();
+			for (size_t i = 0; i < desk.px.size(); i += 4)
+			{
+				for (int c = 0; c < 3; c++)
+				{
+					double d = (double)a[i + c] - b[i + c];
+					sum += d * d;
+				}
+			}
+		}
+		double mse = sum / ((double)W * H * 3 * 10);
+		double psnr = (mse > 0) ? 10 * log10(255.0 * 255.0 / mse) : 99;
+		printf("lossy q=%d: %zu bytes, PSNR %.1f dB\n", q, bytes, psnr);
+		MCHECK(bad == 0);
+		MCHECK(psnr > 30);
+		MCHECK((lastBytes == 0) || (bytes < lastBytes));
+		lastBytes = bytes;
+	}
+}
+
+int main()
+{
+	TestLosslessRoundTrip();
+	TestDirtyTiles();
+	TestBottomUp();
+	TestLossyQuality();
+	TestLosslessBadLength();
+	TestFrameCorrupt();
+	return MTestResult("TileCodecTest");
+}
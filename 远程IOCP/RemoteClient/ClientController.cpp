@@ -82,40 +82,31 @@ int CClientController::DownFile(CString strPath)
 void CClientController::StartWatchScreen()
 {
 	m_isClosed = false;
-	m_hThreadWatch = (HANDLE)_beginthread(&CClientController::threadWatchScreen, 0, this);
+	//第一张图在50ms后请求，之后每次至少隔200ms
+	m_nWatchTick = GetTickCount64() + 50 - WATCH_INTERVAL;
+	m_watchTimer = EdoyunTimer::getInstance()->Schedule(50, WATCH_POLL, [this]() {return watchScreenTick(); });
 	m_watchDlg.DoModal();
 	m_isClosed = true;
-	WaitForSingleObject(m_hThreadWatch, 500);
+	EdoyunTimer::getInstance()->Cancel(m_watchTimer);
 }
 
-void CClientController::threadWatchScreen()
+int CClientController::watchScreenTick()
 {
-	Sleep(50);
-	ULONGLONG nTick = GetTickCount64();
-	while (!m_isClosed) {
-		if (m_watchDlg.isFull() == false) {
-			if (GetTickCount64() - nTick < 200) {
-				Sleep(200 - DWORD(GetTickCount64() - nTick));
-			}
-			nTick = GetTickCount64();
-			int ret = SendCommandPacket(m_watchDlg.GetSafeHwnd(), 6, true, NULL, 0);
-			if (ret == 1) {
-				//TRACE("成功发送请求图片命令\r\n");
-			}
-			else {
-				TRACE("获取图片失败！ret = %d\r\n", ret);
-			}
+	if (m_isClosed) {
+		TRACE("watch end %d\r\n", m_isClosed);
+		return -1;
+	}
+	if ((m_watchDlg.isFull() == false) && (GetTickCount64() - m_nWatchTick >= WATCH_INTERVAL)) {
+		m_nWatchTick = GetTickCount64();
+		int ret = SendCommandPacket(m_watchDlg.GetSafeHwnd(), 6, true, NULL, 0);
+		if (ret == 1) {
+			//TRACE("成功发送请求图片命令\r\n");
+		}
+		else {
+			TRACE("获取图片失败！ret = %d\r\n", ret);
 		}
-		Sleep(1);
 	}
-	TRACE("thread end %d\r\n", m_isClosed);
-}
-
-void CClientController::threadWatchScreen(void* arg)
-{
-	CClientController* thiz = (CClientController*)arg;
-	thiz->threadWatchScreen();
-	_endthread();
+	return 0;
 }
 
 void CClientController::threadFunc()
@@ -6,6 +6,7 @@
 #include <map>
 #include "resource.h"
 #include "EdoyunTool.h"
+#include "EdoyunTimer.h"
 
 
 //#define WM_SEND_DATA (WM_USER+2) //发送数据
@@ -65,14 +66,15 @@ public:
 
 	void StartWatchScreen();
 protected:
-	void threadWatchScreen();
-	static void threadWatchScreen(void* arg);
+	//监视画面时定时器每WATCH_POLL毫秒调一次，图片收完了就请求下一张
+	int watchScreenTick();
 	CClientController() :
 		m_statusDlg(&m_remoteDlg),
 		m_watchDlg(&m_remoteDlg)
 	{
 		m_isClosed = true;
-		m_hThreadWatch = INVALID_HANDLE_VALUE;
+		m_watchTimer = 0;
+		m_nWatchTick = 0;
 		m_hThread = INVALID_HANDLE_VALUE;
 		m_nThreadID = -1;
 	}
@@ -118,7 +120,12 @@ private:
 	CRemoteClientDlg m_remoteDlg;
 	CStatusDlg m_statusDlg;
 	HANDLE m_hThread;
-	HANDLE m_hThreadWatch;
+	enum {
+		WATCH_INTERVAL = 200,//两次请求图片的最小间隔(毫秒)
+		WATCH_POLL = 10//检查能否请求下一张的间隔(毫秒)
+	};
+	EdoyunTimer::TIMERID m_watchTimer;
+	ULONGLONG m_nWatchTick;//上次请求图片的时间
 	bool m_isClosed;//监视是否关闭
 	//下载文件的远程路径
 	CString m_strRemote;
@@ -0,0 +1,233 @@
+#pragma once
+#include <vector>
+#include <queue>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <condition_variable>
+
+//定时器服务：近处的定时器放多层时间轮，超出范围的放最小堆，一个线程驱动
+//回调在定时器线程里执行，要短；周期回调返回0继续，返回其他值就停(和ThreadWorker一样)
+class EdoyunTimer
+{
+public:
+	typedef unsigned long long TIMERID;
+	typedef std::function<int()> TIMERFUNC;
+private:
+	enum {
+		WHEEL_BITS = 6,
+		WHEEL_SIZE = 1 << WHEEL_BITS,//每层64个槽
+		WHEEL_MASK = WHEEL_SIZE - 1,
+		WHEEL_LEVELS = 4//一格1毫秒，4层约4.6小时，更远的放堆里
+	};
+	typedef struct TimerEntry {
+		TIMERID id;
+		long long expire;//到期刻度(毫秒)
+		int period;//0表示只执行一次
+		int slack;//允许推迟多少毫秒，差不多同时到期的合并成一批
+		TIMERFUNC func;
+		bool cancelled;
+	}TIMERENTRY;
+	typedef std::shared_ptr<TIMERENTRY> ENTRYPTR;
+	typedef struct HeapItem {
+		long long expire;
+		ENTRYPTR entry;
+		bool operator<(const HeapItem& other) const {
+			return expire > other.expire;//小顶堆
+		}
+	}HEAPITEM;
+public:
+	static EdoyunTimer* getInstance() {
+		static EdoyunTimer timer;
+		return &timer;
+	}
+	//delay毫秒后第一次执行，period大于0时之后每period毫秒执行一次
+	TIMERID Schedule(int delay, int period, const TIMERFUNC& func, int slack = 0) {
+		ENTRYPTR entry = std::make_shared<TIMERENTRY>();
+		entry->period = (std::max)(period, 0);
+		entry->slack = (std::max)(slack, 0);
+		entry->func = func;
+		entry->cancelled = false;
+		std::lock_guard<std::mutex> lock(m_lock);
+		entry->id = ++m_nextId;
+		entry->expire = Coalesce(NowTick() + (std::max)(delay, 0), entry->slack);
+		m_mapTimers[entry->id] = entry;
+		CatchUp();
+		Place(entry, m_current + 1);
+		m_cond.notify_one();
+		return entry->id;
+	}
+	TIMERID After(int ms, const TIMERFUNC& func, int slack = 0) {
+		return Schedule(ms, 0, func, slack);
+	}
+	TIMERID Every(int ms, const TIMERFUNC& func, int slack = 0) {
+		return Schedule(ms, (std::max)(ms, 1), func, slack);
+	}
+	//取消定时器；回调正在别的线程执行时等它执行完再返回，返回后回调不会再被调用
+	bool Cancel(TIMERID id) {
+		std::unique_lock<std::mutex> lock(m_lock);
+		std::map<TIMERID, ENTRYPTR>::iterator it = m_mapTimers.find(id);
+		if (it == m_mapTimers.end())return false;
+		it->second->cancelled = true;
+		m_mapTimers.erase(it);
+		if (std::this_thread::get_id() != m_thread.get_id()) {
+			m_condDone.wait(lock, [this, id]() {return m_running != id; });
+		}
+		return true;
+	}
+private:
+	EdoyunTimer() {
+		m_wheelCount = 0;
+		m_current = 0;
+		m_nextId = 0;
+		m_running = 0;
+		m_bStatus = true;
+		m_base = std::chrono::steady_clock::now();
+		m_thread = std::thread(&EdoyunTimer::threadMain, this);
+	}
+	~EdoyunTimer() {
+		m_lock.lock();
+		m_bStatus = false;
+		m_lock.unlock();
+		m_cond.notify_all();
+		if (m_thread.joinable())m_thread.join();
+	}
+	EdoyunTimer(const EdoyunTimer&) = delete;
+	EdoyunTimer& operator=(const EdoyunTimer&) = delete;
+	static long long Range() {
+		return 1LL << (WHEEL_BITS * WHEEL_LEVELS);
+	}
+	long long NowTick() {
+		return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_base).count();
+	}
+	static long long Coalesce(long long expire, int slack) {
+		if (slack <= 1)return expire;
+		return (expire + slack - 1) / slack * slack;
+	}
+	//以下调用方持锁
+	void Place(const ENTRYPTR& entry, long long minTick) {
+		long long expire = (std::max)(entry->expire, minTick);
+		long long delta = expire - m_current;
+		if (delta >= Range()) {
+			HEAPITEM item = { expire, entry };
+			m_heap.push(item);
+			return;
+		}
+		for (int level = 0; level < WHEEL_LEVELS; level++) {
+			if (delta < (1LL << (WHEEL_BITS * (level + 1)))) {
+				m_wheel[level][(expire >> (WHEEL_BITS * level)) & WHEEL_MASK].push_back(entry);
+				m_wheelCount++;
+				return;
+			}
+		}
+	}
+	void Migrate() {
+		while (!m_heap.empty() && (m_heap.top().expire - m_current < Range())) {
+			ENTRYPTR entry = m_heap.top().entry;
+			m_heap.pop();
+			Place(entry, m_current + 1);
+		}
+	}
+	//时间轮空着时不走刻度，放新定时器之前先追上现在
+	void CatchUp() {
+		if (m_wheelCount == 0) {
+			m_current = (std::max)(m_current, NowTick() - 1);
+			Migrate();
+		}
+	}
+	void Advance(std::vector<ENTRYPTR>& lstDue) {
+		m_current++;
+		//低层转完一圈，把上一层对应槽摊下来
+		for (int level = 1; level < WHEEL_LEVELS; level++) {
+			if (((m_current >> (WHEEL_BITS * (level - 1))) & WHEEL_MASK) != 0)break;
+			std::vector<ENTRYPTR> slot;
+			slot.swap(m_wheel[level][(m_current >> (WHEEL_BITS * level)) & WHEEL_MASK]);
+			m_wheelCount -= slot.size();
+			for (size_t i = 0; i < slot.size(); i++) {
+				Place(slot[i], m_current);
+			}
+		}
+		Migrate();
+		std::vector<ENTRYPTR>& slot = m_wheel[0][m_current & WHEEL_MASK];
+		m_wheelCount -= slot.size();
+		for (size_t i = 0; i < slot.size(); i++) {
+			if (!slot[i]->cancelled)lstDue.push_back(slot[i]);
+		}
+		slot.clear();
+	}
+	long long NextWait() {
+		long long wait = -1;
+		if (m_wheelCount > 0) {
+			long long left = WHEEL_SIZE - (m_current & WHEEL_MASK);
+			wait = left;
+			for (long long i = 1; i < left; i++) {
+				if (!m_wheel[0][(m_current + i) & WHEEL_MASK].empty()) {
+					wait = i;
+					break;
+				}
+			}
+		}
+		if (!m_heap.empty()) {
+			long long heapWait = (std::max)(m_heap.top().expire - Range() + 1 - m_current, 1LL);
+			wait = (wait < 0) ? heapWait : (std::min)(wait, heapWait);
+		}
+		return wait;
+	}
+	void threadMain() {
+		std::unique_lock<std::mutex> lock(m_lock);
+		while (m_bStatus) {
+			std::vector<ENTRYPTR> lstDue;
+			long long now = NowTick();
+			while (m_current < now) {
+				if (m_wheelCount == 0) {
+					m_current = now - 1;
+					Migrate();
+				}
+				Advance(lstDue);
+			}
+			if (lstDue.size() > 0) {
+				for (size_t i = 0; i < lstDue.size(); i++) {
+					ENTRYPTR& entry = lstDue[i];
+					if (entry->cancelled)continue;
+					m_running = entry->id;
+					lock.unlock();
+					int ret = entry->func();
+					lock.lock();
+					m_running = 0;
+					if (entry->cancelled || (entry->period == 0) || (ret != 0)) {
+						m_mapTimers.erase(entry->id);
+					}
+					else {
+						//从上次到期算，不累积漂移；落后太多就从现在算
+						entry->expire = Coalesce((std::max)(entry->expire + entry->period, NowTick()), entry->slack);
+						Place(entry, m_current + 1);
+					}
+				}
+				m_condDone.notify_all();//叫醒等回调结束的Cancel
+				continue;
+			}
+			long long wait = NextWait();
+			if (wait < 0)m_cond.wait(lock);
+			else m_cond.wait_for(lock, std::chrono::milliseconds(wait));
+		}
+	}
+private:
+	std::vector<ENTRYPTR> m_wheel[WHEEL_LEVELS][WHEEL_SIZE];
+	size_t m_wheelCount;//时间轮里的定时器数(含已取消还没扫掉的)
+	std::priority_queue<HEAPITEM> m_heap;
+	std::map<TIMERID, ENTRYPTR> m_mapTimers;//还活着的定时器
+	long long m_current;//时间轮已经走到的刻度
+	TIMERID m_nextId;
+	TIMERID m_running;//正在执行的定时器
+	bool m_bStatus;//false 表示线程将要关闭
+	std::chrono::steady_clock::time_point m_base;
+	std::mutex m_lock;
+	std::condition_variable m_cond;
+	std::condition_variable m_condDone;
+	std::thread m_thread;
+};
@@ -2,6 +2,9 @@
 #include "pch.h"
 #include <atomic>
 #include <list>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
 #include "EdoyunThread.h"
 
 template<class T>
@@ -13,21 +16,38 @@ public:
 		EQPush,
 		EQPop,
 		EQSize,
-		EQClear
+		EQClear,
+		EQPopN,//一次取多个，没有数据时可以挂起等到超时
+		EQCancel//等待超时，撤回挂起的EQPopN
 	};
 	typedef struct IocpParam {
 		size_t nOperator;//操作
 		T Data;//数据
 		HANDLE hEvent;//pop操作需要的
+		std::list<T>* pList;//EQPopN：取到的追加到这里
+		size_t nMax;//EQPopN：最多取几个
+		size_t nCount;//EQPopN：实际取到几个
+		bool bWait;//EQPopN：没有数据时挂起等待
+		IocpParam* pTarget;//EQCancel：要撤回的EQPopN
 		IocpParam(int op, const T& data, HANDLE hEve = NULL) {
 			nOperator = op;
 			Data = data;
 			hEvent = hEve;
+			pList = NULL;
+			nMax = nCount = 0;
+			bWait = false;
+			pTarget = NULL;
 		}
 		IocpParam() {
 			nOperator = EQNone;
+			hEvent = NULL;
+			pList = NULL;
+			nMax = nCount = 0;
+			bWait = false;
+			pTarget = NULL;
 		}
 	}PPARAM;//Post Parameter 用于投递信息的结构体
+	static const ULONGLONG DEADLINE_INFINITE = (ULONGLONG)-1;//一直等
 public:
 	CEdoyunQueue() {
 		m_lock = false;
@@ -80,6 +100,44 @@ public:
 		}
 		return ret;
 	}
+	//取走现有的最多nMax个追加到lstOut；一个都没有时等到deadline(GetTickCount64的时刻，
+	//DEADLINE_INFINITE一直等，0不等)。返回取到的个数，一次投递换回一批，不用每个都同步一次
+	size_t PopN(std::list<T>& lstOut, size_t nMax, ULONGLONG deadline = 0) {
+		if (m_lock || (nMax == 0))return 0;
+		HANDLE hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+		if (hEvent == NULL)return 0;
+		IocpParam Param(EQPopN, T(), hEvent);
+		Param.pList = &lstOut;
+		Param.nMax = nMax;
+		ULONGLONG now = GetTickCount64();
+		Param.bWait = deadline > now;
+		if (PostQueuedCompletionStatus(m_hCompeletionPort, sizeof(PPARAM), (ULONG_PTR)&Param, NULL) == FALSE) {
+			CloseHandle(hEvent);
+			return 0;
+		}
+		DWORD dwWait = INFINITE;
+		if (Param.bWait && (deadline != DEADLINE_INFINITE)) {
+			dwWait = (DWORD)(std::min)(deadline - now, (ULONGLONG)(INFINITE - 1));
+		}
+		if (WaitForSingleObject(hEvent, dwWait) == WAIT_TIMEOUT) {
+			//超时：撤回挂起的请求。队列线程要么撤回、要么已经给了数据，两种情况都会且只会置一次事件
+			IocpParam* pCancel = new IocpParam(EQCancel, T());
+			pCancel->pTarget = &Param;
+			if (PostQueuedCompletionStatus(m_hCompeletionPort, sizeof(PPARAM), (ULONG_PTR)pCancel, NULL) == FALSE) {
+				delete pCancel;//队列线程正在退出，退出前会放开所有挂起的请求
+			}
+			WaitForSingleObject(hEvent, INFINITE);
+		}
+		CloseHandle(hEvent);
+		return Param.nCount;
+	}
+	//取一个，空的时候等到deadline，超时返回false
+	bool WaitPop(T& data, ULONGLONG deadline = DEADLINE_INFINITE) {
+		std::list<T> lstOut;
+		if (PopN(lstOut, 1, deadline) == 0)return false;
+		data = lstOut.front();
+		return true;
+	}
 	size_t Size() {
 		HANDLE hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
 		IocpParam Param(EQSize, T(), hEvent);
@@ -119,6 +177,30 @@ protected:
 			m_lstData.push_back(pParam->Data);
 			delete pParam;
 			//printf("delete %08p\r\n", (void*)pParam);
+			//有挂起的EQPopN就按先来后到给
+			while ((m_lstWaiting.size() > 0) && (m_lstData.size() > 0)) {
+				PPARAM* pWaiter = m_lstWaiting.front();
+				m_lstWaiting.pop_front();
+				TakeN(pWaiter);
+			}
+			break;
+		case EQPopN:
+			if ((m_lstData.size() == 0) && pParam->bWait) {
+				m_lstWaiting.push_back(pParam);
+			}
+			else {
+				TakeN(pParam);
+			}
+			break;
+		case EQCancel:
+			for (typename std::list<PPARAM*>::iterator it = m_lstWaiting.begin(); it != m_lstWaiting.end(); it++) {
+				if (*it == pParam->pTarget) {
+					m_lstWaiting.erase(it);
+					SetEvent(pParam->pTarget->hEvent);
+					break;
+				}
+			}
+			delete pParam;
 			break;
 		case EQPop:
 			if (m_lstData.size() > 0) {
@@ -174,12 +256,27 @@ protected:
 			pParam = (PPARAM*)CompletionKey;
 			DealParam(pParam);
 		}
+		//还挂着的都放开，取到0个
+		while (m_lstWaiting.size() > 0) {
+			SetEvent(m_lstWaiting.front()->hEvent);
+			m_lstWaiting.pop_front();
+		}
 		HANDLE hTemp = m_hCompeletionPort;
 		m_hCompeletionPort = NULL;
 		CloseHandle(hTemp);
 	}
+	//给EQPopN取最多nMax个，然后叫醒它
+	void TakeN(PPARAM* pParam) {
+		while ((pParam->nCount < pParam->nMax) && (m_lstData.size() > 0)) {
+			pParam->pList->push_back(m_lstData.front());
+			m_lstData.pop_front();
+			pParam->nCount++;
+		}
+		SetEvent(pParam->hEvent);
+	}
 protected:
 	std::list<T> m_lstData;
+	std::list<PPARAM*> m_lstWaiting;//挂起等数据的EQPopN，只在队列线程里动
 	HANDLE m_hCompeletionPort;
 	HANDLE m_hThread;
 	std::atomic<bool> m_lock;//队列正在析构
@@ -187,80 +284,160 @@ protected:
 
 
 
+//发送队列：没有发送在进行时，放进来的数据立刻发出去；正在发时先攒着，上一次发完(完成端口通知)
+//再把攒下的一次性聚合发出(一次WSASend带多个缓冲区)。没有数据时不占线程也不占定时器
+//回调拿到这一批数据，返回0表示已经投递，这批数据在OnSendComplete之前不会被动
+//按字节记账：积压(含正在发的)到高水位时PushBack等着，发到低水位以下再放行，每个连接占的内存有上限
+typedef struct SendQueueStats {
+	size_t bytes;//现在积压的字节数
+	size_t peak;//积压的最大值
+	unsigned long long highHits;//碰到高水位停下的次数
+	unsigned long long resumes;//降到低水位放行的次数
+	ULONGLONG pausedMs;//生产者停着的总时间
+	SendQueueStats() :bytes(0), peak(0), highHits(0), resumes(0), pausedMs(0) {}
+}SENDQSTATS;
+
 template<class T>
-class EdoyunSendQueue :public CEdoyunQueue<T>, public ThreadFuncBase
+class EdoyunSendQueue :public ThreadFuncBase
 {
 public:
-	typedef int (ThreadFuncBase::* EDYCALLBACK)(T& data);
-	EdoyunSendQueue(ThreadFuncBase* obj, EDYCALLBACK callback)
-		:CEdoyunQueue<T>(), m_base(obj), m_callback(callback)
+	enum {
+		DEFAULT_HIGH = 1024 * 1024,//默认高水位
+		DEFAULT_LOW = 256 * 1024//默认低水位
+	};
+	typedef int (ThreadFuncBase::* EDYCALLBACK)(std::list<T>& batch);
+	EdoyunSendQueue(ThreadFuncBase* obj, EDYCALLBACK callback, size_t high = DEFAULT_HIGH, size_t low = DEFAULT_LOW)
+		:m_base(obj), m_callback(callback), m_sending(false), m_closed(false), m_high(high), m_low(low)
 	{
-		m_thread.Start();
-		m_thread.UpdateWorker(::ThreadWorker(this, (FUNCTYPE)&EdoyunSendQueue<T>::threadTick));
 	}
 	virtual ~EdoyunSendQueue() {
+		m_lock.lock();
+		m_closed = true;
+		m_lock.unlock();
+		m_cond.notify_all();
 		m_base = NULL;
 		m_callback = NULL;
 	}
-protected:
-	virtual bool PopFront(T& data) {
-		return false;
-	};
-	bool PopFront() {
-		typename CEdoyunQueue<T>::IocpParam* Param = new typename CEdoyunQueue<T>::IocpParam(CEdoyunQueue<T>::EQPop, T());
-		if (CEdoyunQueue<T>::m_lock) {
-			delete Param;
+	//high为0表示不限
+	void SetWatermark(size_t high, size_t low) {
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_high = high;
+		m_low = (high > 0) ? (std::min)(low, high) : low;
+		m_cond.notify_all();
+	}
+	//积压到高水位时等发到低水位(连接断了、队列关了都会放行)；队列关了返回false
+	bool PushBack(const T& data) {
+		std::unique_lock<std::mutex> lock(m_lock);
+		if (m_closed) {
 			return false;
 		}
-		bool ret = PostQueuedCompletionStatus(CEdoyunQueue<T>::m_hCompeletionPort, sizeof(typename CEdoyunQueue<T>::PPARAM), (ULONG_PTR)&Param, NULL);
-		if (ret == false) {
-			delete Param;
+		if (m_sending && (m_high > 0) && (m_stats.bytes >= m_high) && !m_closed) {
+			m_stats.highHits++;
+			ULONGLONG tick = GetTickCount64();
+			m_cond.wait(lock, [this]() {return m_closed || !m_sending || (m_high == 0) || (m_stats.bytes <= m_low); });
+			m_stats.pausedMs += GetTickCount64() - tick;
+			if (!m_closed)m_stats.resumes++;
+		}
+		if (m_closed) {
 			return false;
 		}
-		return ret;
+		m_lstPending.push_back(data);
+		Account((long long)data.size());
+		bool start = !m_sending;
+		if (start) {
+			m_sending = true;
+			m_lstInFlight.swap(m_lstPending);
+		}
+		lock.unlock();
+		if (start)Post();
+		return true;
 	}
-	int threadTick() {
-		if (CEdoyunQueue<T>::m_lstData.size() > 0) {
-			PopFront();
+	//上一批发完了：有攒下的就接着发，没有就停下，等下一次PushBack
+	void OnSendComplete() {
+		m_lock.lock();
+		Release();
+		if (m_closed || m_lstPending.empty()) {
+			m_sending = false;
+			m_lock.unlock();
+			m_cond.notify_all();
+			return;
 		}
-		Sleep(1);
-		return 0;
+		m_lstInFlight.swap(m_lstPending);
+		m_lock.unlock();
+		m_cond.notify_all();
+		Post();
 	}
-	virtual void DealParam(typename CEdoyunQueue<T>::PPARAM* pParam) {
-		switch (pParam->nOperator)
-		{
-		case CEdoyunQueue<T>::EQPush:
-			CEdoyunQueue<T>::m_lstData.push_back(pParam->Data);
-			delete pParam;
-			//printf("delete %08p\r\n", (void*)pParam);
-			break;
-		case CEdoyunQueue<T>::EQPop:
-			if (CEdoyunQueue<T>::m_lstData.size() > 0) {
-				pParam->Data = CEdoyunQueue<T>::m_lstData.front();
-				if ((m_base->*m_callback)(pParam->Data) == 0)
-					CEdoyunQueue<T>::m_lstData.pop_front();
-			}
-			delete pParam;
-			break;
-		case CEdoyunQueue<T>::EQSize:
-			pParam->nOperator = CEdoyunQueue<T>::m_lstData.size();
-			if (pParam->hEvent != NULL)
-				SetEvent(pParam->hEvent);
-			break;
-		case CEdoyunQueue<T>::EQClear:
-			CEdoyunQueue<T>::m_lstData.clear();
-			delete pParam;
-			//printf("delete %08p\r\n", (void*)pParam);
-			break;
-		default:
-			OutputDebugStringA("unknown operator!\r\n");
-			break;
+	//发送失败(连接断了)：丢掉正在发的和攒下的，之后PushBack都直接返回false，等着水位的也放行
+	void Abort() {
+		m_lock.lock();
+		m_closed = true;
+		Release();
+		for (typename std::list<T>::iterator it = m_lstPending.begin(); it != m_lstPending.end(); it++) {
+			Account(-(long long)it->size());
+		}
+		m_lstPending.clear();
+		m_sending = false;
+		m_lock.unlock();
+		m_cond.notify_all();
+	}
+	//还没发完的块数(含正在发的)
+	size_t Size() {
+		std::lock_guard<std::mutex> lock(m_lock);
+		return m_lstPending.size() + m_lstInFlight.size();
+	}
+	//还没发完的字节数(含正在发的)
+	size_t Bytes() {
+		std::lock_guard<std::mutex> lock(m_lock);
+		return m_stats.bytes;
+	}
+	SENDQSTATS GetStats() {
+		std::lock_guard<std::mutex> lock(m_lock);
+		return m_stats;
+	}
+	bool Clear() {
+		std::lock_guard<std::mutex> lock(m_lock);
+		for (typename std::list<T>::iterator it = m_lstPending.begin(); it != m_lstPending.end(); it++) {
+			Account(-(long long)it->size());
 		}
+		m_lstPending.clear();
+		m_cond.notify_all();
+		return true;
+	}
+private:
+	//以下调用方持锁
+	void Account(long long delta) {
+		m_stats.bytes += (size_t)delta;
+		if (m_stats.bytes > m_stats.peak)m_stats.peak = m_stats.bytes;
+	}
+	//正在发的这一批结束了(发完或者丢掉)，从积压里扣掉
+	void Release() {
+		for (typename std::list<T>::iterator it = m_lstInFlight.begin(); it != m_lstInFlight.end(); it++) {
+			Account(-(long long)it->size());
+		}
+		m_lstInFlight.clear();
+	}
+	//只有拿到m_sending的线程调用，m_lstInFlight归它
+	void Post() {
+		if ((m_base != NULL) && (m_callback != NULL) && ((m_base->*m_callback)(m_lstInFlight) == 0))return;
+		//投递失败(连接断了)：这批丢掉，放开发送状态，后面的数据下次PushBack再试
+		m_lock.lock();
+		Release();
+		m_sending = false;
+		m_lock.unlock();
+		m_cond.notify_all();
 	}
 private:
 	ThreadFuncBase* m_base;
 	EDYCALLBACK m_callback;
-	EdoyunThread m_thread;
+	std::mutex m_lock;
+	std::condition_variable m_cond;//叫醒等水位降下来的PushBack
+	std::list<T> m_lstPending;//等着发的
+	std::list<T> m_lstInFlight;//正在发的这一批
+	bool m_sending;//有一批正在发
+	bool m_closed;
+	size_t m_high;//0表示不限
+	size_t m_low;
+	SENDQSTATS m_stats;
 };
 
-typedef EdoyunSendQueue<std::vector<char>>::EDYCALLBACK  SENDCALLBACK;
\ No newline at end of file
+typedef EdoyunSendQueue<std::vector<char>>::EDYCALLBACK  SENDCALLBACK;
@@ -125,20 +125,33 @@ int EdoyunClient::Send(void* buffer, size_t nSize)
 	return -1;
 }
 
-int EdoyunClient::SendData(std::vector<char>& data)
+//发送队列的回调：这一批一次聚合投递，完成时SendOverlapped通知队列
+int EdoyunClient::SendData(std::list<std::vector<char>>& batch)
 {
-	if (m_vecSend.Size() > 0) {
-		int ret = WSASend(m_sock, SendWSABuffer(), 1, &m_received, m_flags, &m_send->m_overlapped, NULL);
-		if (ret != 0 && WSAGetLastError() != WSA_IO_PENDING) {
-			CEdoyunTool::ShowError();
-			return ret;
-		}
+	m_sendBufs.clear();
+	for (std::list<std::vector<char>>::iterator it = batch.begin(); it != batch.end(); it++) {
+		if (it->empty())continue;
+		WSABUF buf = { (ULONG)it->size(), it->data() };
+		m_sendBufs.push_back(buf);
+	}
+	if (m_sendBufs.empty()) {
+		m_vecSend.OnSendComplete();
+		return 0;
+	}
+	memset(&m_send->m_overlapped, 0, sizeof(m_send->m_overlapped));
+	DWORD sent = 0;
+	int ret = WSASend(m_sock, m_sendBufs.data(), (DWORD)m_sendBufs.size(), &sent, 0, &m_send->m_overlapped, NULL);
+	if (ret != 0 && WSAGetLastError() != WSA_IO_PENDING) {
+		CEdoyunTool::ShowError();
+		return ret;
 	}
 	return 0;
 }
 
 EdoyunServer::~EdoyunServer()
 {
+	//Cancel会等正在执行的回调，之后就可以删连接了
+	if (m_traceTimer != 0)EdoyunTimer::getInstance()->Cancel(m_traceTimer);
 	std::map<SOCKET, EdoyunClient*>::iterator it = m_client.begin();
 	for (; it != m_client.end(); it++) {
 		delete it->second;
@@ -170,12 +183,41 @@ bool EdoyunServer::StartService()
 	CreateIoCompletionPort((HANDLE)m_sock, m_hIOCP, (ULONG_PTR)this, 0);
 	m_pool.Invoke();
 	m_pool.DispatchWorker(ThreadWorker(this, (FUNCTYPE)&EdoyunServer::threadIocp));
+	//和SuperControl共用SCONTROL_TRACE：值是trace文件路径
+	char* path = NULL;
+	size_t len = 0;
+	if ((_dupenv_s(&path, &len, "SCONTROL_TRACE") == 0) && (path != NULL)) {
+		if (*path != '\0') {
+			std::string file(path);
+			m_traceTimer = EdoyunTimer::getInstance()->Every(1000, [this, file]() {return DumpTrace(file); });
+		}
+		free(path);
+	}
 	if (!NewAccept())return false;
 	//m_pool.DispatchWorker(ThreadWorker(this, (FUNCTYPE)&EdoyunServer::threadIocp));
 	//m_pool.DispatchWorker(ThreadWorker(this, (FUNCTYPE)&EdoyunServer::threadIocp));
 	return true;
 }
 
+int EdoyunServer::DumpTrace(const std::string& path)
+{
+	m_pool.DumpTrace(path.c_str(), "iocp");
+	FILE* pFile = NULL;
+	if ((fopen_s(&pFile, path.c_str(), "a") != 0) || (pFile == NULL))return 0;
+	long long now = (long long)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	m_lockClient.lock();
+	std::map<SOCKET, EdoyunClient*>::iterator it = m_client.begin();
+	for (; it != m_client.end(); it++) {
+		SENDQSTATS stats = it->second->GetSendStats();
+		fprintf(pFile, "%lld sendq %llu bytes %llu peak %llu high %llu resume %llu paused %llu\n",
+			now, (unsigned long long)it->first, (unsigned long long)stats.bytes, (unsigned long long)stats.peak,
+			stats.highHits, stats.resumes, (unsigned long long)stats.pausedMs);
+	}
+	m_lockClient.unlock();
+	fclose(pFile);
+	return 0;
+}
+
 void EdoyunServer::BindNewSocket(SOCKET s, ULONG_PTR nKey)
 {
 	CreateIoCompletionPort((HANDLE)s, m_hIOCP, nKey, 0);
@@ -197,7 +239,17 @@ int EdoyunServer::threadIocp()
 	DWORD tranferred = 0;
 	ULONG_PTR CompletionKey = 0;
 	OVERLAPPED* lpOverlapped = NULL;
-	if (GetQueuedCompletionStatus(m_hIOCP, &tranferred, &CompletionKey, &lpOverlapped, INFINITE)) {
+	BOOL ok = GetQueuedCompletionStatus(m_hIOCP, &tranferred, &CompletionKey, &lpOverlapped, INFINITE);
+	if (!ok && (lpOverlapped != NULL) && (CompletionKey != 0)) {
+		//投递出去的操作失败了：发送失败时关掉发送队列，不然m_sending一直为真，生产者永远停在水位上
+		EdoyunOverlapped* pOverlapped = CONTAINING_RECORD(lpOverlapped, EdoyunOverlapped, m_overlapped);
+		TRACE("Operator %d failed %d\r\n", pOverlapped->m_operator, GetLastError());
+		if (pOverlapped->m_operator == ESend) {
+			((SENDOVERLAPPED*)pOverlapped)->Failed();
+		}
+		return 0;
+	}
+	if (ok) {
 		if (CompletionKey != 0) {
 			//把系统返回的 OVERLAPPED* 指针转换回 EdoyunOverlapped* 指针的 m_overlapped对象
 			EdoyunOverlapped* pOverlapped = CONTAINING_RECORD(lpOverlapped, EdoyunOverlapped, m_overlapped);
@@ -219,8 +271,9 @@ int EdoyunServer::threadIocp()
 			break;
 			case ESend:
 			{
+				//发完一批只是接着投递攒下的，直接在这里做：线程池里的生产者都停在水位上时也能发
 				SENDOVERLAPPED* pOver = (SENDOVERLAPPED*)pOverlapped;
-				m_pool.DispatchWorker(pOver->m_worker);
+				pOver->SendWorker();
 			}
 			break;
 			case EError:
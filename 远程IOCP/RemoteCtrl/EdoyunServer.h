@@ -2,6 +2,7 @@
 #include <MSWSock.h>
 #include "EdoyunThread.h"
 #include "CEdoyunQueue.h"
+#include "EdoyunTimer.h"
 #include <map>
 #include "EdoyunTool.h"
 
@@ -62,7 +63,11 @@ public:
 	size_t GetBufferSize()const { return m_buffer.size(); }
 	int Recv();
 	int Send(void* buffer, size_t nSize);
-	int SendData(std::vector<char>& data);
+	int SendData(std::list<std::vector<char>>& batch);
+	void SendDone() { m_vecSend.OnSendComplete(); }
+	void SendFailed() { m_vecSend.Abort(); }
+	//发送队列的水位统计(碰到高水位的次数、积压峰值等)
+	SENDQSTATS GetSendStats() { return m_vecSend.GetStats(); }
 private:
 	SOCKET m_sock;
 	DWORD m_received;
@@ -76,6 +81,7 @@ private:
 	sockaddr_in m_raddr;
 	bool m_isbusy;
 	EdoyunSendQueue<std::vector<char>> m_vecSend;//发送数据队列
+	std::vector<WSABUF> m_sendBufs;//正在发的这一批，每块一个缓冲区
 };
 
 template<EdoyunOperator>
@@ -107,9 +113,15 @@ class SendOverlapped :public EdoyunOverlapped
 public:
 	SendOverlapped();
 	virtual ~SendOverlapped() {}
+	//一批数据发完了，让队列接着发攒下的
 	int SendWorker() {
+		if (m_client != NULL)m_client->SendDone();
 		return -1;
 	}
+	//发送失败(控制端断了)：队列关掉，攒下的丢掉，停在水位上的生产者放行
+	void Failed() {
+		if (m_client != NULL)m_client->SendFailed();
+	}
 };
 
 
@@ -138,6 +150,7 @@ public:
 		m_addr.sin_family = AF_INET;
 		m_addr.sin_port = htons(port);
 		m_addr.sin_addr.s_addr = inet_addr(ip.c_str());
+		m_traceTimer = 0;
 	}
 	~EdoyunServer();
 	bool StartService();
@@ -145,7 +158,9 @@ public:
 		//PCLIENT pClient(new EdoyunClient());
 		EdoyunClient* pClient = new EdoyunClient();
 		pClient->SetOverlapped(pClient);
+		m_lockClient.lock();
 		m_client.insert(std::pair<SOCKET, EdoyunClient*>(*pClient, pClient));
+		m_lockClient.unlock();
 		if (!AcceptEx(m_sock,
 			*pClient,
 			*pClient,
@@ -167,11 +182,15 @@ public:
 private:
 	void CreateSocket();
 	int threadIocp();
+	//设置了环境变量SCONTROL_TRACE时每秒调一次：线程池和每个连接发送队列的统计追加到trace文件
+	int DumpTrace(const std::string& path);
 private:
 	EdoyunThreadPool m_pool;
 	HANDLE m_hIOCP;
 	SOCKET m_sock;
 	sockaddr_in m_addr;
 	std::map<SOCKET, EdoyunClient*> m_client;
+	std::mutex m_lockClient;//m_client：接入在线程池里加，trace定时器遍历
+	EdoyunTimer::TIMERID m_traceTimer;
 };
 
@@ -3,8 +3,62 @@
 #include <atomic>
 #include <vector>
 #include <mutex>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
 #include <Windows.h>
 
+//对数分桶的直方图(微秒)：0号桶放0，第i个桶放[2^(i-1), 2^i)，记录不加锁
+class EdoyunHistogram {
+public:
+	enum { BUCKETS = 32 };
+	typedef struct Snapshot {
+		unsigned long long buckets[BUCKETS];
+		unsigned long long count;
+		unsigned long long max;
+		Snapshot() :count(0), max(0) { memset(buckets, 0, sizeof(buckets)); }
+		void Merge(const Snapshot& other) {
+			for (int i = 0; i < BUCKETS; i++)buckets[i] += other.buckets[i];
+			count += other.count;
+			max = (std::max)(max, other.max);
+		}
+		//近似分位数：取所在桶的上界，不超过最大值
+		unsigned long long Percentile(double p) const {
+			if (count == 0)return 0;
+			unsigned long long rank = (unsigned long long)(p * count), seen = 0;
+			for (int i = 0; i < BUCKETS; i++) {
+				seen += buckets[i];
+				if (seen > rank)return (i == 0) ? 0 : (std::min)(1ULL << i, max);
+			}
+			return max;
+		}
+	}SNAPSHOT;
+	EdoyunHistogram() {
+		for (int i = 0; i < BUCKETS; i++)m_buckets[i] = 0;
+		m_max = 0;
+	}
+	void Record(unsigned long long us) {
+		int bucket = 0;
+		while ((bucket < BUCKETS - 1) && (us >= (1ULL << bucket)))bucket++;
+		m_buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+		unsigned long long max = m_max.load(std::memory_order_relaxed);
+		while ((us > max) && !m_max.compare_exchange_weak(max, us, std::memory_order_relaxed)) {}
+	}
+	SNAPSHOT GetSnapshot() const {
+		SNAPSHOT snap;
+		for (int i = 0; i < BUCKETS; i++) {
+			snap.buckets[i] = m_buckets[i].load(std::memory_order_relaxed);
+			snap.count += snap.buckets[i];
+		}
+		snap.max = m_max.load(std::memory_order_relaxed);
+		return snap;
+	}
+private:
+	std::atomic<unsigned long long> m_buckets[BUCKETS];
+	std::atomic<unsigned long long> m_max;
+};
+
 class ThreadFuncBase {};
 typedef int (ThreadFuncBase::* FUNCTYPE)();
 class ThreadWorker {
@@ -34,6 +88,9 @@ public:
 	bool IsValid() const {
 		return (thiz != NULL) && (func != NULL);
 	}
+	bool operator==(const ThreadWorker& worker) const {
+		return (thiz == worker.thiz) && (func == worker.func);
+	}
 	
 private:
 	ThreadFuncBase* thiz;
@@ -47,6 +104,9 @@ public:
 	EdoyunThread() {
 		m_hThread = NULL;
 		m_bStatus = false;
+		m_bHasWorker = false;
+		m_bWaiting = false;
+		m_bBusy = false;
 	}
 
 	~EdoyunThread() {
@@ -76,41 +136,60 @@ public:
 		return ret;
 	}
 
+	//工作直接存在线程对象里，换工作不用new/delete
 	void UpdateWorker(const ::ThreadWorker& worker = ::ThreadWorker()) {
-		if (m_worker.load() != NULL && m_worker.load() != &worker) {
-			::ThreadWorker* pWorker = m_worker.load();
-			m_worker.store(NULL);
-			delete pWorker;
-		}
-		if (!worker.IsValid()) {
-			m_worker.store(NULL);
-			return;
-		}
-		m_worker.store(new ::ThreadWorker(worker));
+		m_workerLock.lock();
+		m_worker = worker;
+		m_bHasWorker = worker.IsValid();
+		m_tDispatch = std::chrono::steady_clock::now();
+		m_bWaiting = m_bHasWorker.load();
+		m_workerLock.unlock();
 	}
 
 	//true表示空闲 false表示已经分配了工作
 	bool IsIdle() {
-		if (m_worker == NULL)return true;
-		return !m_worker.load()->IsValid();
+		return !m_bHasWorker;
+	}
+	//正在执行工作(不算分配了工作还没轮到执行的)
+	bool IsBusy() {
+		return m_bBusy;
 	}
+	//分配到开始执行的时长、每次执行的时长(微秒)
+	const EdoyunHistogram& WaitHistogram() const { return m_waitHist; }
+	const EdoyunHistogram& RunHistogram() const { return m_runHist; }
 private:
 	void ThreadWorker() {
 		while (m_bStatus) {
-			if (m_worker == NULL) {
+			if (!m_bHasWorker) {
 				Sleep(1);
 				continue;
 			}
-			::ThreadWorker worker = *m_worker.load();
+			m_workerLock.lock();
+			::ThreadWorker worker = m_worker;
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			if (m_bWaiting) {
+				m_bWaiting = false;
+				m_waitHist.Record(Micros(start - m_tDispatch));
+			}
+			m_workerLock.unlock();
 			if (worker.IsValid()) {
+				m_bBusy = true;
 				int ret = worker();
+				m_bBusy = false;
+				m_runHist.Record(Micros(std::chrono::steady_clock::now() - start));
 				if (ret != 0&&ret != -1) {
 					CString str;
 					str.Format(_T("thread found warning code %d\r\n"), ret);
 					OutputDebugString(str);
 				}
 				if (ret < 0) {
-					m_worker.store(NULL);
+					//执行期间可能已经换了新工作，只清掉自己这一个
+					m_workerLock.lock();
+					if (m_worker == worker) {
+						m_worker = ::ThreadWorker();
+						m_bHasWorker = false;
+					}
+					m_workerLock.unlock();
 				}
 			}
 			else {
@@ -118,6 +197,9 @@ private:
 			}
 		}
 	}
+	static unsigned long long Micros(std::chrono::steady_clock::duration d) {
+		return (unsigned long long)std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+	}
 	static void ThreadEntry(void* arg) {
 		EdoyunThread* thiz = (EdoyunThread*)arg;
 		if (thiz) {
@@ -128,18 +210,35 @@ private:
 private:
 	HANDLE m_hThread;
 	bool m_bStatus;//false 表示线程将要关闭  true 表示线程正在运行
-	std::atomic<::ThreadWorker*> m_worker;
+	::ThreadWorker m_worker;
+	std::atomic<bool> m_bHasWorker;
+	std::mutex m_workerLock;
+	std::chrono::steady_clock::time_point m_tDispatch;//分配工作的时间
+	bool m_bWaiting;//分配了工作还没开始执行，受m_workerLock保护
+	std::atomic<bool> m_bBusy;
+	EdoyunHistogram m_waitHist;
+	EdoyunHistogram m_runHist;
 };
 
+//线程池的运行统计，GetStats随时可以取
+typedef struct PoolStats {
+	size_t threads;
+	size_t busy;//正在执行工作的线程数
+	size_t assigned;//分配了工作的线程数(含还没轮到执行的)
+	unsigned long long rejected;//所有线程都忙、没分配出去的次数
+	EdoyunHistogram::SNAPSHOT wait;
+	EdoyunHistogram::SNAPSHOT run;
+}POOLSTATS;
+
 class EdoyunThreadPool
 {
 public:
-	EdoyunThreadPool(size_t size) {
+	EdoyunThreadPool(size_t size) :m_rejected(0) {
 		m_threads.resize(size);
 		for (size_t i = 0; i < size; i++)
 			m_threads[i] = new EdoyunThread();
 	}
-	EdoyunThreadPool() {}
+	EdoyunThreadPool() :m_rejected(0) {}
 	~EdoyunThreadPool() {
 		Stop();
 		for (size_t i = 0; i < m_threads.size(); i++)
@@ -184,9 +283,44 @@ public:
 			}
 		}
 		m_lock.unlock();
+		if (index < 0) {
+			//以前这里直接丢，至少要数出来
+			m_rejected++;
+			TRACE("dispatch rejected, all %d threads busy\r\n", (int)m_threads.size());
+		}
 		return index;
 	}
 
+	POOLSTATS GetStats() {
+		POOLSTATS stats;
+		stats.threads = m_threads.size();
+		stats.busy = 0;
+		stats.assigned = 0;
+		stats.rejected = m_rejected;
+		for (size_t i = 0; i < m_threads.size(); i++) {
+			EdoyunThread* pThread = m_threads[i];
+			if (pThread == NULL)continue;
+			if (pThread->IsBusy())stats.busy++;
+			if (!pThread->IsIdle())stats.assigned++;
+			stats.wait.Merge(pThread->WaitHistogram().GetSnapshot());
+			stats.run.Merge(pThread->RunHistogram().GetSnapshot());
+		}
+		return stats;
+	}
+	//统计追加到trace文件，一行一次
+	bool DumpTrace(const char* path, const char* name) {
+		FILE* pFile = NULL;
+		if ((fopen_s(&pFile, path, "a") != 0) || (pFile == NULL))return false;
+		POOLSTATS stats = GetStats();
+		long long now = (long long)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+		fprintf(pFile, "%lld pool %s threads %d busy %d assigned %d rejected %llu wait n %llu p50 %llu p95 %llu p99 %llu max %llu run n %llu p50 %llu p95 %llu p99 %llu max %llu\n",
+			now, name, (int)stats.threads, (int)stats.busy, (int)stats.assigned, stats.rejected,
+			stats.wait.count, stats.wait.Percentile(0.5), stats.wait.Percentile(0.95), stats.wait.Percentile(0.99), stats.wait.max,
+			stats.run.count, stats.run.Percentile(0.5), stats.run.Percentile(0.95), stats.run.Percentile(0.99), stats.run.max);
+		fclose(pFile);
+		return true;
+	}
+
 	bool CheckThreadValid(size_t index) {
 		if (index < m_threads.size()) {
 			return m_threads[index]->IsValid();
@@ -196,4 +330,5 @@ public:
 private:
 	std::mutex m_lock;
 	std::vector<EdoyunThread*> m_threads;
+	std::atomic<unsigned long long> m_rejected;
 };
\ No newline at end of file